@@ -57,6 +57,34 @@
     (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, DIFI_IOCTL_CODE_BASE + 7, \
                 METHOD_BUFFERED, FILE_READ_ACCESS)
 
+#define IOCTL_DIFI_GET_LATENCY_STATS     \
+    (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, DIFI_IOCTL_CODE_BASE + 8, \
+                METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_DIFI_DRAIN_TRACE     \
+    (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, DIFI_IOCTL_CODE_BASE + 9, \
+                METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_DIFI_OPEN_JOURNAL     \
+    (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, DIFI_IOCTL_CODE_BASE + 10, \
+                METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#define IOCTL_DIFI_GET_MERGE_PROGRESS     \
+    (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, DIFI_IOCTL_CODE_BASE + 11, \
+                METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_DIFI_BACKGROUND_MERGE     \
+    (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, DIFI_IOCTL_CODE_BASE + 12, \
+                METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#define IOCTL_DIFI_GET_REMAPS     \
+    (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, DIFI_IOCTL_CODE_BASE + 13, \
+                METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_DIFI_SET_SPLIT_WINDOW     \
+    (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, DIFI_IOCTL_CODE_BASE + 14, \
+                METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
 #ifndef MAX_PATH
 #define MAX_PATH 260
 #endif
@@ -99,6 +127,74 @@ struct ioctl_difi_stats
     unsigned long long  read_hits;
     unsigned long long  per_irql_writes[4];  // Counting 0-2, index 3 will contain all > 2
     unsigned long long  per_irql_reads[4];   // Counting 0-2, index 3 will contain all > 2
+    unsigned long long  bytes_read;
+    unsigned long long  bytes_written;
+    unsigned long long  remapped_bytes;      // Bytes sent to the remap storage
+    unsigned long long  split_irps;          // Requests broken into several transfers
+    unsigned long long  split_transfers;
+    unsigned long long  passed_through;      // Requests sent down unchanged
+};
+
+/* Ways a request goes through the filter, latency is kept for each */
+#define DIFI_LATENCY_PASS_THROUGH   (0)     /* Sent down unchanged */
+#define DIFI_LATENCY_REMAPPED       (1)     /* Sent down as one remapped run */
+#define DIFI_LATENCY_SPLIT          (2)     /* Broken into several transfers */
+#define DIFI_LATENCY_PATHS          (3)
+
+#define DIFI_LATENCY_STATS_VERSION  (1)
+#define DIFI_LATENCY_BUCKETS        (208)
+
+/*
+   Output of IOCTL_DIFI_GET_LATENCY_STATS: counts of requests by microseconds
+   from dispatch to completion. Values below 2^(sub_bucket_bits + 1) have a 
+   bucket each, every power of two range above is split into 
+   2^sub_bucket_bits buckets, the last bucket holds everything bigger
+*/
+struct ioctl_difi_latency_stats
+{
+    unsigned            size;               /* Total size of this structure */
+    unsigned            version;            /* DIFI_LATENCY_STATS_VERSION */
+    unsigned            bucket_count;
+    unsigned            sub_bucket_bits;
+    unsigned long long  reads[DIFI_LATENCY_PATHS][DIFI_LATENCY_BUCKETS];
+    unsigned long long  writes[DIFI_LATENCY_PATHS][DIFI_LATENCY_BUCKETS];
+};
+
+#define DIFI_TRACE_VERSION          (1)
+
+#define DIFI_TRACE_READ             (0)
+#define DIFI_TRACE_WRITE            (1)
+
+#define DIFI_TRACE_PASSED_THROUGH   (0x01)  /* Sent down unchanged */
+#define DIFI_TRACE_FAILED           (0x02)  /* Remap failed, request completed with error */
+
+/* One read or write seen by the filter */
+struct ioctl_difi_trace_record
+{
+    unsigned long long  timestamp;          /* Performance counter at dispatch */
+    unsigned long long  start_block;
+    unsigned long       length_in_blocks;
+    unsigned long       hits;               /* Blocks found in the remap storage */
+    unsigned short      extents;            /* Runs the request was mapped to */
+    unsigned char       op;                 /* DIFI_TRACE_READ or DIFI_TRACE_WRITE */
+    unsigned char       flags;
+    unsigned long       cpu;
+};
+
+/*
+   Output of IOCTL_DIFI_DRAIN_TRACE, takes as many records as the output 
+   buffer holds. Records of one processor are in order, records of different
+   processors are not, sort them by timestamp
+*/
+struct ioctl_difi_trace
+{
+    unsigned            version;            /* DIFI_TRACE_VERSION */
+    unsigned            record_count;
+    unsigned            lost;               /* Dropped since the last drain */
+    unsigned            reserved;
+    unsigned long long  frequency;          /* Timestamp ticks per second */
+
+    struct ioctl_difi_trace_record records[1];
 };
 
 struct ioctl_difi_disk_initialize
@@ -113,6 +209,116 @@ struct ioctl_difi_disk_initialize
     struct  ioctl_difi_storage_info initial_storage;
 };
 
+#define DIFI_JOURNAL_REPLAY         (0x01)  /* Restore remaps saved by the last run */
+
+/*
+   Input of IOCTL_DIFI_OPEN_JOURNAL, sent after IOCTL_DIFI_INITIALIZE and 
+   before tracking starts. The first journal_blocks of the storage keep 
+   every remap, so they survive a reboot. Without DIFI_JOURNAL_REPLAY the 
+   journal starts empty. Storage must be the same as in the last run
+*/
+struct ioctl_difi_open_journal
+{
+    unsigned    size;                           /* Total size of this structure */
+    unsigned    flags;
+    ULONG       journal_blocks;
+};
+
+/*
+   Optional input of IOCTL_DIFI_STOP_TRACKING_MERGE, zero fields take the 
+   defaults. The merge copies remapped blocks back to the disk in the 
+   background, writes wait meanwhile; tracking stops when it succeeds. 
+   Runs continuous on the disk are written with one request of up to 
+   transfer_kb, a window of window_transfers is read in storage order
+*/
+struct ioctl_difi_merge
+{
+    unsigned    size;                           /* Total size of this structure */
+    ULONG       queue_depth;                    /* Requests in flight */
+    ULONG       transfer_kb;
+    ULONG       window_transfers;
+};
+
+#define DIFI_MERGE_IDLE             (0)         /* No merge was started */
+#define DIFI_MERGE_RUNNING          (1)
+#define DIFI_MERGE_DONE             (2)         /* status tells how it ended */
+
+/* Output of IOCTL_DIFI_GET_MERGE_PROGRESS */
+struct ioctl_difi_merge_progress
+{
+    unsigned            size;
+    unsigned            state;                  /* DIFI_MERGE_XXX */
+    LONG                status;                 /* NTSTATUS of a finished merge */
+    unsigned            reserved;
+    unsigned long long  total_blocks;           /* Remapped when the merge started */
+    unsigned long long  blocks_read;
+    unsigned long long  blocks_written;
+    unsigned long long  runs;
+    unsigned long long  requests;
+    unsigned long long  background_blocks;      /* Unmapped by the background merge */
+    unsigned long long  background_runs;
+};
+
+/*
+   Input of IOCTL_DIFI_BACKGROUND_MERGE. While tracking goes on, remapped 
+   runs are copied back to the disk a chunk at a time and unmapped, their
+   storage becomes free. Writes to the chunk being copied wait, at most 
+   budget_kb_per_sec are copied and the copy pauses while the disk is 
+   busy. idle_ms is the pause once everything is merged. Zero fields take 
+   the defaults, enable 0 stops it
+*/
+struct ioctl_difi_background_merge
+{
+    unsigned    size;                           /* Total size of this structure */
+    unsigned    enable;
+    ULONG       budget_kb_per_sec;
+    ULONG       idle_ms;
+};
+
+/*
+   Input and output of IOCTL_DIFI_SET_SPLIT_WINDOW: transfers a remapped 
+   request split in pieces keeps in flight, up to the packet pool size. 
+   Deep queues take more, 1 sends pieces one by one. 0 goes back to the 
+   default picked from the adapter properties. The output holds the 
+   window in effect
+*/
+struct ioctl_difi_split_window
+{
+    unsigned    size;                           /* Total size of this structure */
+    ULONG       window;
+};
+
+/* Input of IOCTL_DIFI_GET_REMAPS */
+struct ioctl_difi_remaps_query
+{
+    unsigned            size;                   /* Total size of this structure */
+    unsigned            reserved;
+    unsigned long long  start_block;            /* 0 for the first page */
+};
+
+struct ioctl_difi_remap_run
+{
+    unsigned long long  source_block;
+    unsigned long long  target_block;
+    unsigned long       length_in_blocks;
+    unsigned long       reserved;
+};
+
+/*
+   Output of IOCTL_DIFI_GET_REMAPS: as many runs from start_block on as the
+   output buffer holds, in source block order. Pass next_block as the 
+   start_block of the next page, the map ends with a page of no runs. 
+   Pages are taken while tracking goes on, each shows the map as it is then
+*/
+struct ioctl_difi_remaps
+{
+    unsigned            run_count;
+    unsigned            reserved;
+    unsigned long long  next_block;
+
+    struct ioctl_difi_remap_run runs[1];
+};
+
 struct ioctl_difi_track_disk
 {
     BOOLEAN simulate;
@@ -34,10 +34,143 @@
 #else
     #include <stdio.h>
     #include <stdlib.h>
+    #include <string.h>
+    #include <assert.h>
     #define difi_dbg_print printf
     #define difi_assert assert
 #endif
 
+/* 
+   Short term lock and atomics for library structures. Spin lock in the 
+   kernel, usable up to DISPATCH_LEVEL. Not recursive
+*/
+#ifndef DIFI_USER_MODE
+    typedef struct 
+    {
+        KSPIN_LOCK lock;
+        KIRQL      irql;    /* Saved by the owner */
+    } difi_lock_t;
+
+    #define difi_lock_init(l)       KeInitializeSpinLock(&(l)->lock)
+    #define difi_lock_destroy(l)
+    #define difi_lock_acquire(l)    KeAcquireSpinLock(&(l)->lock, &(l)->irql)
+    #define difi_lock_release(l)    KeReleaseSpinLock(&(l)->lock, (l)->irql)
+
+    #define difi_atomic_inc(p)      InterlockedIncrement(p)
+    #define difi_atomic_dec(p)      InterlockedDecrement(p)
+    #define difi_memory_barrier()   KeMemoryBarrier()
+    #define difi_compiler_barrier() KeMemoryBarrierWithoutFence()
+    #define difi_cpu_relax()        YieldProcessor()
+#elif defined(_WIN32)
+    #include <windows.h>
+    typedef CRITICAL_SECTION difi_lock_t;
+
+    #define difi_lock_init(l)       InitializeCriticalSection(l)
+    #define difi_lock_destroy(l)    DeleteCriticalSection(l)
+    #define difi_lock_acquire(l)    EnterCriticalSection(l)
+    #define difi_lock_release(l)    LeaveCriticalSection(l)
+
+    #define difi_atomic_inc(p)      InterlockedIncrement(p)
+    #define difi_atomic_dec(p)      InterlockedDecrement(p)
+    #define difi_memory_barrier()   MemoryBarrier()
+    #define difi_compiler_barrier() _ReadWriteBarrier()
+    #define difi_cpu_relax()        SwitchToThread()
+#else
+    #include <pthread.h>
+    typedef pthread_mutex_t difi_lock_t;
+
+    #define difi_lock_init(l)       pthread_mutex_init(l, NULL)
+    #define difi_lock_destroy(l)    pthread_mutex_destroy(l)
+    #define difi_lock_acquire(l)    pthread_mutex_lock(l)
+    #define difi_lock_release(l)    pthread_mutex_unlock(l)
+
+    #include <sched.h>
+    #define difi_atomic_inc(p)      __sync_add_and_fetch(p, 1)
+    #define difi_atomic_dec(p)      __sync_sub_and_fetch(p, 1)
+    #define difi_memory_barrier()   __sync_synchronize()
+    #define difi_compiler_barrier() __asm__ __volatile__("" ::: "memory")
+    #define difi_cpu_relax()        sched_yield()
+#endif
+
+/*
+   Notification event for waits that can last, stays signaled until reset
+   and releases every waiter. Set and reset are usable up to DISPATCH_LEVEL,
+   wait only where difi_event_can_wait() says so, spin elsewhere
+*/
+#ifndef DIFI_USER_MODE
+    typedef KEVENT difi_event_t;
+
+    #define difi_event_init(e)      KeInitializeEvent(e, NotificationEvent, TRUE)
+    #define difi_event_destroy(e)
+    #define difi_event_set(e)       KeSetEvent(e, IO_NO_INCREMENT, FALSE)
+    #define difi_event_reset(e)     KeClearEvent(e)
+    #define difi_event_wait(e) \
+        KeWaitForSingleObject(e, Executive, KernelMode, FALSE, NULL)
+    #define difi_event_can_wait()   (KeGetCurrentIrql() <= APC_LEVEL)
+#elif defined(_WIN32)
+    typedef HANDLE difi_event_t;
+
+    #define difi_event_init(e)      (*(e) = CreateEvent(NULL, TRUE, TRUE, NULL))
+    #define difi_event_destroy(e)   CloseHandle(*(e))
+    #define difi_event_set(e)       SetEvent(*(e))
+    #define difi_event_reset(e)     ResetEvent(*(e))
+    #define difi_event_wait(e)      WaitForSingleObject(*(e), INFINITE)
+    #define difi_event_can_wait()   1
+#else
+    typedef struct
+    {
+        pthread_mutex_t mutex;
+        pthread_cond_t  cond;
+        int             signaled;
+    } difi_event_t;
+
+    static __inline void difi_event_init(difi_event_t* e)
+    {
+        pthread_mutex_init(&e->mutex, NULL);
+        pthread_cond_init(&e->cond, NULL);
+        e->signaled = 1;
+    }
+
+    static __inline void difi_event_destroy(difi_event_t* e)
+    {
+        pthread_cond_destroy(&e->cond);
+        pthread_mutex_destroy(&e->mutex);
+    }
+
+    static __inline void difi_event_set(difi_event_t* e)
+    {
+        pthread_mutex_lock(&e->mutex);
+        e->signaled = 1;
+        pthread_cond_broadcast(&e->cond);
+        pthread_mutex_unlock(&e->mutex);
+    }
+
+    static __inline void difi_event_reset(difi_event_t* e)
+    {
+        pthread_mutex_lock(&e->mutex);
+        e->signaled = 0;
+        pthread_mutex_unlock(&e->mutex);
+    }
+
+    static __inline void difi_event_wait(difi_event_t* e)
+    {
+        pthread_mutex_lock(&e->mutex);
+        while (!e->signaled)
+            pthread_cond_wait(&e->cond, &e->mutex);
+        pthread_mutex_unlock(&e->mutex);
+    }
+
+    #define difi_event_can_wait()   1
+#endif
+
+/* 
+   Readers of structures updated in place only need loads kept in order, 
+   x86 and x64 do not reorder loads with other loads or stores with other
+   stores, so these only stop the compiler
+*/
+#define difi_read_barrier()     difi_compiler_barrier()
+#define difi_write_barrier()    difi_compiler_barrier()
+
 
 #include "libcrt/types.h"
 
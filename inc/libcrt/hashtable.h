@@ -93,6 +93,9 @@ unsigned long good_hash_func(unsigned char* k, unsigned long length, unsigned lo
  *
  * This function will cause the table to expand if the insertion would take
  * the ratio of entries to table size over the maximum load factor.
+ * Expansion is incremental: every insert, search, remove and change moves a
+ * bounded number of buckets to the new table, so no single call pays for
+ * rehashing the whole table.
  *
  * This function does not check for repeated insertions with a duplicate key.
  * The value returned when using a duplicate key is undefined -- when
@@ -0,0 +1,57 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Group-probing hash table for 64-bit keys and values
+*/
+#ifndef SWISS_MAP_H
+#define SWISS_MAP_H
+
+#include "libcrt/types.h"
+
+/* 
+   Open addressing table in the style of Swiss tables. Every slot has a 
+   control byte holding 7 bits of the key hash, slots are probed in groups of
+   16 so one SSE2 compare checks a whole group before any key is touched.
+   Builds without SSE2 (or with SWISS_MAP_NO_SSE2 defined) use a scalar loop
+   over the control bytes instead.
+*/
+#define SWISS_MAP_GROUP_SIZE    (16)
+
+struct swiss_map;
+
+struct swiss_map* swiss_map_create(unsigned min_size,
+                                   void* (*alloc_fn)(unsigned size), 
+                                   void (*free_fn)(void* mem));
+
+void swiss_map_destroy(struct swiss_map* map);
+
+/* Insert or replace the value. Returns non-zero on success */
+int swiss_map_insert(struct swiss_map* map, ulong64_t key, ulong64_t value);
+
+/* Returns non-zero and fills value if the key is found */
+int swiss_map_search(struct swiss_map* map, ulong64_t key, ulong64_t* value);
+
+/* Returns non-zero if the key was found and removed */
+int swiss_map_remove(struct swiss_map* map, ulong64_t key);
+
+unsigned swiss_map_count(struct swiss_map* map);
+
+#endif
@@ -1,11 +1,18 @@
 #ifndef TYPES_H
 #define TYPES_H
 
-#ifndef _SIZE_T_DEFINED
+#ifdef DIFI_USER_MODE
+#include <stddef.h>
+#elif !defined(_SIZE_T_DEFINED)
 typedef unsigned int size_t;
 #define _SIZE_T_DEFINED
 #endif
 
+/* Calling convention of MSVC, means nothing to other compilers */
+#if !defined(_MSC_VER) && !defined(__cdecl)
+#define __cdecl
+#endif
+
 #ifndef NULL
 #define NULL 0
 #endif
@@ -0,0 +1,64 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Hash table mapping 64-bit keys to 64-bit values
+*/
+#ifndef U64_MAP_H
+#define U64_MAP_H
+
+#include "libcrt/types.h"
+
+/* 
+   Entries are stored inline in one array (16 bytes each) with linear 
+   probing, so inserts do not allocate unless the table grows. 
+   U64_MAP_EMPTY_KEY marks free slots and cannot be used as a key.
+*/
+#define U64_MAP_EMPTY_KEY   (0xFFFFFFFFFFFFFFFFULL)
+
+struct u64_map;
+
+struct u64_map* u64_map_create(unsigned min_size,
+                               void* (*alloc_fn)(unsigned size), 
+                               void (*free_fn)(void* mem));
+
+void u64_map_destroy(struct u64_map* map);
+
+/* Insert or replace the value. Returns non-zero on success */
+int u64_map_insert(struct u64_map* map, ulong64_t key, ulong64_t value);
+
+/* Returns non-zero and fills value if the key is found */
+int u64_map_search(struct u64_map* map, ulong64_t key, ulong64_t* value);
+
+/* Returns non-zero if the key was found and removed */
+int u64_map_remove(struct u64_map* map, ulong64_t key);
+
+/* 
+   Searches may run concurrently with one writer if the old table is not 
+   freed on growth while readers may still use it: retire_fn gets it instead
+   of free_fn. A search racing with a removal may miss the key
+*/
+void u64_map_set_retire(struct u64_map* map, 
+                        void (*retire_fn)(void* context, void* mem),
+                        void* context);
+
+unsigned u64_map_count(struct u64_map* map);
+
+#endif
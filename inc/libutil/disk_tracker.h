@@ -30,6 +30,12 @@ typedef void*              disk_remap_t;
 #define DISK_TRACKER_NO_MEMORY    (-1)
 #define DISK_TRACKER_NO_STORAGE   (-2)
 #define DISK_TRACKER_INV_ARGUMENT (-3)
+#define DISK_TRACKER_BUFFER_TOO_SMALL (-4)
+
+/* Storage allocation policies */
+#define DISK_TRACKER_ALLOC_SEQUENTIAL  (0) /* Fill storage extents in order */
+#define DISK_TRACKER_ALLOC_CONTIGUOUS  (1) /* Keep each source extent in one target run 
+                                              if any free extent is big enough */
 
 struct disk_extent
 {
@@ -45,6 +51,28 @@ struct disk_extent_remap
     struct disk_extent remapped_extents[1];
 };
 
+/* Size in bytes of disk_extent_remap holding num_extents extents */
+#define DISK_EXTENT_REMAP_SIZE(num_extents) \
+    (sizeof(struct disk_extent_remap) + \
+     sizeof(struct disk_extent) * ((num_extents) > 0 ? (num_extents) - 1 : 0))
+
+/* Continuous source blocks mapped to continuous target blocks */
+struct disk_remap_run
+{
+    ulong64_t source_block;
+    ulong64_t target_block;
+    ulong32_t length_in_blocks;
+};
+
+/* Position of disk_tracker_export_runs, zero it to start */
+struct disk_tracker_export
+{
+    unsigned  shard;
+    ulong64_t next_block;
+};
+
+typedef void (*disk_tracker_run_hook)(void* context, const struct disk_remap_run* run);
+
 struct remap_storage
 {
     void*                 custom_info;
@@ -59,6 +87,20 @@ disk_remap_t disk_tracker_init(void* (*alloc_fn)(unsigned size),
                                void (*free_fn)(void* mem), 
                                struct remap_storage* initial_storage);
 
+/* 
+   Tracker which splits the source disk into shards with their own locks and
+   free storage, so remaps of different 1Mb chunks run in parallel. All 
+   functions may be called concurrently. disk_tracker_init makes one shard.
+   Lookups (find_remap, range_is_clean, find_remap_for_block) take no locks,
+   they retry if a remap of the same shard ran meanwhile
+*/
+#define DISK_TRACKER_MAX_SHARDS (64)
+
+disk_remap_t disk_tracker_init_sharded(void* (*alloc_fn)(unsigned size), 
+                                       void (*free_fn)(void* mem), 
+                                       struct remap_storage* initial_storage,
+                                       unsigned shard_count);
+
 int disk_tracker_reset(disk_remap_t remap);
 
 int disk_tracker_destroy(disk_remap_t* remap);
@@ -69,10 +111,35 @@ int disk_tracker_reset_storage(disk_remap_t remap, struct remap_storage* storage
 
 int disk_tracker_get_storage(disk_remap_t remap, struct remap_storage** storage);
 
+int disk_tracker_set_alloc_policy(disk_remap_t remap, int policy);
+
+/* 
+   Take blocks of the storage out of use, e.g. for metadata kept there. 
+   Must be called before the first remap, the blocks must be free
+*/
+int disk_tracker_reserve_storage(disk_remap_t remap, struct disk_extent* extent);
+
+/* Give reserved blocks back for remaps, extent as it was reserved */
+int disk_tracker_unreserve_storage(disk_remap_t remap, const struct disk_extent* extent);
+
 int disk_tracker_get_storage_info(disk_remap_t remap, 
                                   unsigned* total_blocks,
                                   unsigned* free_blocks);
 
+/* 
+   Returns non-zero if no block of the source extent was ever remapped, so
+   the request may go to the disk as is. Works with 1Mb granularity: zero 
+   means some block nearby was remapped, not necessarily one of ours
+*/
+int disk_tracker_range_is_clean(disk_remap_t remap, struct disk_extent* source);
+
+/* 
+   Give storage to the source blocks not remapped yet and return the remap
+   of the whole source. Not undone on failure: like a partly done write, 
+   pieces mapped before it keep their new targets, which read the old 
+   storage content until written again. Targets of the failed piece are 
+   free again
+*/
 int disk_tracker_remap(disk_remap_t remap, 
                        struct disk_extent* source,
                        struct disk_extent_remap** result);
@@ -81,17 +148,106 @@ int disk_tracker_find_remap(disk_remap_t remap,
                             struct disk_extent* source, 
                             struct disk_extent_remap** result);
 
+/* 
+   Same as disk_tracker_remap and disk_tracker_find_remap, but the result goes
+   to a caller supplied buffer with room for max_extents extents, nothing is
+   allocated. If the buffer is too small, DISK_TRACKER_BUFFER_TOO_SMALL is 
+   returned and result->number_of_extents tells how many are needed. 
+   Blocks are remapped by disk_tracker_remap_to_buffer even in this case
+*/
+int disk_tracker_remap_to_buffer(disk_remap_t remap, 
+                                 struct disk_extent* source,
+                                 struct disk_extent_remap* result,
+                                 ulong32_t max_extents);
+
+int disk_tracker_find_remap_to_buffer(disk_remap_t remap, 
+                                      struct disk_extent* source,
+                                      struct disk_extent_remap* result,
+                                      ulong32_t max_extents);
+
 int disk_tracker_get_all_remaps(disk_remap_t remap, 
                                 /*OUT*/unsigned* remaps_count, 
                                 /*OUT*/struct disk_extent_remap*** remaps);
 
-/* Get internal hash table size */
+/* Get number of remapped blocks (used to be the size of internal hash table) */
 int disk_tracker_get_hash_size(disk_remap_t remap, unsigned* size);
 
 
 struct disk_extent* disk_tracker_find_remap_for_block(disk_remap_t remap,
                                                       ulong64_t source_block);
 
+/* 
+   hook gets every run remaps create, after it is visible to lookups and 
+   exports. It runs under the shard lock (a spin lock in the kernel) and 
+   must not block. NULL hook stops the calls
+*/
+int disk_tracker_set_run_hook(disk_remap_t remap, 
+                              disk_tracker_run_hook hook, 
+                              void* context);
+
+/* 
+   Map source blocks to the given target blocks, to rebuild the tracker from
+   saved runs before the first remap. Blocks mapped to the same target 
+   already are skipped, the rest must be unmapped and their targets free.
+   The run hook is not called
+*/
+int disk_tracker_restore_run(disk_remap_t remap, const struct disk_remap_run* run);
+
+/* 
+   Forget the mapping of the run's source blocks to its target blocks, once
+   the data is back on the source. Blocks mapped elsewhere or not at all are
+   skipped, *unmapped counts the rest. Their targets become free, or with 
+   keep_targets stay allocated until disk_tracker_release_storage gives 
+   them back, e.g. when no request may still use them
+*/
+int disk_tracker_unmap_run(disk_remap_t remap, 
+                           const struct disk_remap_run* run,
+                           int keep_targets,
+                           ulong32_t* unmapped);
+
+int disk_tracker_release_storage(disk_remap_t remap, const struct disk_extent* extent);
+
+/* 
+   Copy up to max_runs runs from position on and advance it. Returns the 
+   number copied, 0 when all were. Runs come one shard after another, not 
+   in source order; runs made meanwhile may be missed or seen twice
+*/
+unsigned disk_tracker_export_runs(disk_remap_t remap, 
+                                  struct disk_tracker_export* position,
+                                  struct disk_remap_run* runs,
+                                  unsigned max_runs);
+
+/* 
+   Copy up to max_runs runs from *next_block on in source block order and 
+   move *next_block past the last one, start with 0. Returns the number 
+   copied, 0 when all were. Every call takes all shard locks
+*/
+unsigned disk_tracker_export_sorted_runs(disk_remap_t remap, 
+                                         ulong64_t* next_block,
+                                         struct disk_remap_run* runs,
+                                         unsigned max_runs);
+
+/* 
+   Walks all runs in source block order a page at a time, memory used does 
+   not depend on the number of runs. No lock is held between pages: every
+   page shows the runs as they are when it is taken, so runs made or 
+   dropped behind the position are not seen. disk_tracker_cursor_position
+   is the first block of the next page, a later cursor may start there
+*/
+struct disk_tracker_cursor;
+
+struct disk_tracker_cursor* disk_tracker_cursor_open(disk_remap_t remap, 
+                                                     ulong64_t start_block);
+
+/* Copies up to max_runs runs and returns their number, 0 at the end */
+unsigned disk_tracker_cursor_next(struct disk_tracker_cursor* cursor, 
+                                  struct disk_remap_run* runs,
+                                  unsigned max_runs);
+
+ulong64_t disk_tracker_cursor_position(struct disk_tracker_cursor* cursor);
+
+void disk_tracker_cursor_close(struct disk_tracker_cursor* cursor);
+
 void disk_tracker_free_remap(disk_remap_t remap,  struct disk_extent_remap* extent_remap);
 
 void disk_tracker_free_extent(disk_remap_t remap, struct disk_extent* extent);
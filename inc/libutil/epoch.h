@@ -0,0 +1,61 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Epoch based reclamation: memory unlinked from a shared structure is 
+  freed only after all readers which could still see it are gone
+*/
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include "libcrt/types.h"
+
+struct epoch;
+
+/* Destructor of a retired object, free_fn of the domain if NULL */
+typedef void (*epoch_destroy_fn)(void* object);
+
+struct epoch* epoch_create(void* (*alloc_fn)(unsigned size), 
+                           void (*free_fn)(void* mem));
+
+/* No readers may be left. Frees all retired objects */
+void epoch_destroy(struct epoch* epoch);
+
+/* 
+   Readers bracket every access with enter and leave. Nothing is locked,
+   the only write is an interlocked increment of a counter of the current
+   CPU. Returns a token for epoch_leave
+*/
+unsigned epoch_enter(struct epoch* epoch);
+
+void epoch_leave(struct epoch* epoch, unsigned token);
+
+/* 
+   Free the object once readers active now are gone. The object must be 
+   unreachable for new readers already. Never waits for readers: objects
+   beyond what the epoch holds go to allocated chunks. Only if that 
+   allocation fails it waits for the readers of the previous epoch
+*/
+void epoch_retire(struct epoch* epoch, void* object, epoch_destroy_fn destroy_fn);
+
+/* Free what can be freed without waiting. Cheap if nothing is retired */
+void epoch_reclaim(struct epoch* epoch);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Ordered map of remapped block runs (source extent -> target extent)
+*/
+#ifndef EXTENT_MAP_H
+#define EXTENT_MAP_H
+
+#include "libcrt/types.h"
+
+#define EXTENT_MAP_OK           (0)
+#define EXTENT_MAP_NO_MEMORY    (-1)
+
+/* AVL tree height never exceeds 1.44*log2(n), 64 is plenty for any n */
+#define EXTENT_MAP_MAX_HEIGHT   (64)
+
+struct extent_map;
+struct extent_map_node;
+
+/* Continuous run of source blocks mapped to continuous run of target blocks */
+struct extent_map_run
+{
+    ulong64_t source_block;
+    ulong64_t target_block;
+    ulong32_t length_in_blocks;
+};
+
+/* In-order iterator, lives on the caller's stack. Any update of the map 
+   invalidates all iterators */
+struct extent_map_iter
+{
+    struct extent_map_node* stack[EXTENT_MAP_MAX_HEIGHT];
+    int                     depth;
+};
+
+
+struct extent_map* extent_map_create(void* (*alloc_fn)(unsigned size), 
+                                     void (*free_fn)(void* mem));
+
+void extent_map_destroy(struct extent_map* map);
+
+/* 
+   Add a run. Source blocks of the run must not be mapped yet. The run is 
+   merged with its neighbours if both source and target are continuous.
+ */
+int extent_map_insert(struct extent_map* map, const struct extent_map_run* run);
+
+/* 
+   Remove source blocks [source_block, source_block + length) from the map.
+   Runs partly inside are trimmed, a run covering both ends is split in 
+   two. Blocks not mapped are ignored. Fails only if a split needs a node 
+   which can't be allocated, the map is left unchanged then
+*/
+int extent_map_remove(struct extent_map* map, ulong64_t source_block, ulong64_t length);
+
+/* Find the run containing source_block. Returns 0 if the block is not mapped */
+int extent_map_lookup(struct extent_map* map, 
+                      ulong64_t source_block, 
+                      struct extent_map_run* run);
+
+/* 
+   Lookups and iterators may run concurrently with one writer if removed 
+   nodes are not freed while readers may still see them: retire_fn gets 
+   them instead of free_fn. Walks are bounded by EXTENT_MAP_MAX_HEIGHT, so
+   a reader always terminates, but its result must be dropped if the map
+   changed meanwhile
+*/
+void extent_map_set_retire(struct extent_map* map, 
+                           void (*retire_fn)(void* context, void* mem),
+                           void* context);
+
+/* Number of runs in the map */
+unsigned extent_map_count(struct extent_map* map);
+
+/* Position iterator at the first run which ends after source_block */
+void extent_map_iter_seek(struct extent_map* map, 
+                          struct extent_map_iter* iter, 
+                          ulong64_t source_block);
+
+/* Fetch the current run and advance. Returns 0 when there are no more runs */
+int extent_map_iter_next(struct extent_map_iter* iter, struct extent_map_run* run);
+
+#endif
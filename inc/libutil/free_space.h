@@ -0,0 +1,73 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Free space manager for remap storage
+*/
+#ifndef FREE_SPACE_H
+#define FREE_SPACE_H
+
+#include "libcrt/types.h"
+
+#define FREE_SPACE_OK           (0)
+#define FREE_SPACE_NO_MEMORY    (-1)
+#define FREE_SPACE_OVERLAP      (-2)
+#define FREE_SPACE_NOT_FREE     (-3)
+
+/* Allocation policies for free_space_alloc */
+#define FREE_SPACE_LOWEST   (0) /* Lowest address extent, may return less than asked */
+#define FREE_SPACE_FIT      (1) /* Lowest address extent holding the whole request */
+#define FREE_SPACE_LARGEST  (2) /* Largest extent, may return less than asked */
+
+struct free_space;
+
+struct free_space* free_space_create(void* (*alloc_fn)(unsigned size), 
+                                     void (*free_fn)(void* mem));
+
+void free_space_destroy(struct free_space* space);
+
+/* 
+   Return blocks to the free space, merging with neighbouring free extents.
+   Fails with FREE_SPACE_OVERLAP if any of the blocks is free already 
+ */
+int free_space_add(struct free_space* space, ulong64_t start_block, ulong64_t length);
+
+/* 
+   Allocate up to length blocks from a single free extent chosen by the policy.
+   Returns number of blocks allocated, 0 if nothing suitable was found
+ */
+ulong32_t free_space_alloc(struct free_space* space, 
+                           ulong32_t length, 
+                           int policy,
+                           ulong64_t* start_block);
+
+/* 
+   Allocate exactly the given blocks, used to restore saved allocations. 
+   Fails with FREE_SPACE_NOT_FREE unless all of them are in one free extent
+ */
+int free_space_take(struct free_space* space, ulong64_t start_block, ulong64_t length);
+
+/* Total number of free blocks */
+ulong64_t free_space_blocks(struct free_space* space);
+
+/* Number of free extents */
+unsigned free_space_count(struct free_space* space);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Log-bucketed histogram of 64-bit values
+*/
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "libcrt/types.h"
+
+/* 
+   HDR style buckets: values below 2^(HISTOGRAM_SUB_BITS + 1) have a bucket
+   each, every power of two range above is split into 2^HISTOGRAM_SUB_BITS 
+   buckets, so a value is known within 1/8 of it. Values from 2^HISTOGRAM_MAX_BITS on
+   go to the last bucket. Counting is not synchronized, concurrent writers 
+   keep a histogram each and add them up
+*/
+#define HISTOGRAM_SUB_BITS  (3)
+#define HISTOGRAM_MAX_BITS  (28)
+#define HISTOGRAM_BUCKETS   ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << \
+                             HISTOGRAM_SUB_BITS)
+
+struct histogram
+{
+    ulong64_t counts[HISTOGRAM_BUCKETS];
+};
+
+unsigned histogram_bucket(ulong64_t value);
+
+/* Smallest and largest values counted in the bucket */
+ulong64_t histogram_bucket_low(unsigned bucket);
+ulong64_t histogram_bucket_high(unsigned bucket);
+
+void histogram_record(struct histogram* hist, ulong64_t value);
+
+void histogram_add(struct histogram* to, const struct histogram* from);
+
+ulong64_t histogram_count(const struct histogram* hist);
+
+/* 
+   Value not exceeded by the given part of the counted values, in basis 
+   points (9990 is 99.9%). Returns the high end of the bucket, 0 if empty
+*/
+ulong64_t histogram_percentile(const struct histogram* hist, unsigned basis_points);
+
+#endif
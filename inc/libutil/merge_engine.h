@@ -0,0 +1,134 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Merge: copying remapped blocks back to the source disk
+*/
+#ifndef MERGE_ENGINE_H
+#define MERGE_ENGINE_H
+
+#include "libcrt/types.h"
+#include "libutil/disk_tracker.h"
+
+#define MERGE_ENGINE_OK             (0)
+#define MERGE_ENGINE_NO_MEMORY      (-1)
+#define MERGE_ENGINE_IO_ERROR       (-2)
+#define MERGE_ENGINE_INV_ARGUMENT   (-3)
+#define MERGE_ENGINE_CANCELLED      (-4)
+
+#define MERGE_OP_READ               (0)     /* From the remap storage */
+#define MERGE_OP_WRITE              (1)     /* Back to the source disk */
+
+/* 
+   Runs are taken in source order, runs continuous on the source form one 
+   transfer: a buffer written with one request. A window of transfers is 
+   read in target block order, then written in source block order as soon
+   as each transfer is complete, so both disks see mostly ascending blocks.
+   Reads and writes share queue_depth slots
+*/
+struct merge_params
+{
+    unsigned queue_depth;           /* Requests in flight */
+    unsigned transfer_blocks;       /* Longest request */
+    unsigned window_transfers;      /* Buffers of transfer_blocks each */
+};
+
+#define MERGE_DEFAULT_QUEUE_DEPTH       (8)
+#define MERGE_DEFAULT_TRANSFER_BLOCKS   (2048)
+#define MERGE_DEFAULT_WINDOW_TRANSFERS  (16)
+
+struct merge_request
+{
+    int                   op;           /* MERGE_OP_ */
+    ulong64_t             block;
+    ulong32_t             length_in_blocks;
+    void*                 buffer;
+    void*                 io_context;   /* Left to the I/O functions */
+
+    /* Engine only */
+    unsigned              transfer;
+    int                   status;
+    struct merge_request* next;
+};
+
+/* 
+   submit_fn starts the request and returns 0, merge_engine_complete must 
+   follow, from any thread or from submit_fn itself. wait_fn blocks until 
+   a completion arrives, it may be NULL if submit_fn completes every 
+   request before returning. flush_fn makes source writes durable, or NULL
+*/
+struct merge_io
+{
+    void* context;
+    int  (*submit_fn)(void* context, struct merge_request* request);
+    void (*wait_fn)(void* context);
+    int  (*flush_fn)(void* context);
+};
+
+/* Fills up to max runs in source order and returns their number, 0 at the end */
+typedef unsigned (*merge_source_fn)(void* context, struct disk_remap_run* runs, unsigned max);
+
+struct merge_progress
+{
+    ulong64_t total_blocks;         /* Given to merge_engine_create, 0 if unknown */
+    ulong64_t blocks_read;
+    ulong64_t blocks_written;
+    ulong64_t runs;
+    ulong64_t reads;
+    ulong64_t writes;
+    ulong64_t windows;
+    int       status;               /* MERGE_ENGINE_OK while running */
+    int       done;
+};
+
+struct merge_engine;
+
+/* params may be NULL for the defaults, buffers are allocated up front */
+struct merge_engine* merge_engine_create(const struct merge_params* params,
+                                         const struct merge_io* io,
+                                         merge_source_fn source_fn,
+                                         void* source_context,
+                                         ulong64_t total_blocks,
+                                         void* (*alloc_fn)(unsigned size), 
+                                         void (*free_fn)(void* mem));
+
+void merge_engine_destroy(struct merge_engine* engine);
+
+/* Copy everything the source gives. Returns after all requests completed */
+int merge_engine_run(struct merge_engine* engine);
+
+/* Completion of a submitted request, status 0 on success. Never blocks */
+void merge_engine_complete(struct merge_engine* engine, 
+                           struct merge_request* request, 
+                           int status);
+
+/* 
+   Make the engine ready for another merge_engine_run after the last one 
+   returned, e.g. to copy runs in steps. Counters keep adding up
+*/
+void merge_engine_rewind(struct merge_engine* engine);
+
+/* Stop taking runs, merge_engine_run returns MERGE_ENGINE_CANCELLED */
+void merge_engine_cancel(struct merge_engine* engine);
+
+/* May be called from any thread while the merge runs */
+void merge_engine_get_progress(struct merge_engine* engine, struct merge_progress* progress);
+
+#endif
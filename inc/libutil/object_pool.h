@@ -0,0 +1,61 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Pool of preallocated fixed size objects
+*/
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include "libcrt/types.h"
+
+/* 
+   All objects live in one block allocated up front, so getting and putting
+   an object is O(1) and never allocates. The pool is not synchronized, 
+   callers serialize access to it.
+*/
+struct object_pool;
+
+/* 
+   construct_fn is called once for every object when the pool is created and
+   may fail it (return non-zero), destruct_fn is called for every constructed
+   object when the pool is destroyed. Both are optional
+*/
+struct object_pool* object_pool_create(unsigned object_size,
+                                       unsigned capacity,
+                                       int  (*construct_fn)(void* object, void* context),
+                                       void (*destruct_fn)(void* object, void* context),
+                                       void* context,
+                                       void* (*alloc_fn)(unsigned size), 
+                                       void (*free_fn)(void* mem));
+
+void object_pool_destroy(struct object_pool* pool);
+
+/* Returns NULL if all objects are in use */
+void* object_pool_get(struct object_pool* pool);
+
+void object_pool_put(struct object_pool* pool, void* object);
+
+/* Non-zero if the object came from this pool */
+int object_pool_owns(struct object_pool* pool, void* object);
+
+unsigned object_pool_free_count(struct object_pool* pool);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Append-only journal of remap changes, kept on the remap storage
+*/
+#ifndef REMAP_JOURNAL_H
+#define REMAP_JOURNAL_H
+
+#include "libcrt/types.h"
+
+#define REMAP_JOURNAL_OK            (0)
+#define REMAP_JOURNAL_NO_MEMORY     (-1)
+#define REMAP_JOURNAL_IO_ERROR      (-2)
+#define REMAP_JOURNAL_INV_ARGUMENT  (-3)
+#define REMAP_JOURNAL_NO_SPACE      (-4)    /* Checkpoint does not fit into half of the area */
+#define REMAP_JOURNAL_CORRUPT       (-5)    /* No usable checkpoint, or it can't be applied */
+
+#define REMAP_JOURNAL_BLOCK_SIZE    (512)
+
+/* 
+   The area is split in two halves. A half starts with a header block, then
+   a checkpoint (every mapping at the time it was taken), then batches of 
+   changes made since. When the current half fills up a checkpoint goes to
+   the other one, its header is written last, so a crash in the middle 
+   leaves the previous half in charge. Replay reads one half sequentially
+*/
+#define REMAP_JOURNAL_MAX_RECORD    (64 * 1024)
+#define REMAP_JOURNAL_MIN_BLOCKS    (2 * (1 + 2 * REMAP_JOURNAL_MAX_RECORD / REMAP_JOURNAL_BLOCK_SIZE))
+
+/* Operations */
+#define REMAP_JOURNAL_MAP           (1)     /* Source blocks were mapped to the target */
+#define REMAP_JOURNAL_UNMAP         (2)     /* Mapping ended, source holds the data again */
+
+/* On-disk layout, the same for 32 and 64 bit builds */
+struct remap_journal_entry
+{
+    ulong64_t source_block;
+    ulong64_t target_block;
+    uint32_t  length_in_blocks;
+    uint32_t  op;
+};
+
+/* Most entries one batch or checkpoint record holds */
+#define REMAP_JOURNAL_RECORD_ENTRIES \
+    ((REMAP_JOURNAL_MAX_RECORD - 32) / sizeof(struct remap_journal_entry))
+
+/* 
+   Storage access. Offsets are in bytes from the start of the area, offsets 
+   and sizes are multiples of REMAP_JOURNAL_BLOCK_SIZE. Functions return 0 
+   on success. flush_fn may be NULL if writes are durable on completion.
+   barrier_fn may be NULL too. It is called once the entries of a batch or
+   a checkpoint are taken, before they are written where replay finds them,
+   and returns when the data of the changes they describe is written; a 
+   flush follows. Entries may then be appended before that data is written
+*/
+struct remap_journal_io
+{
+    void* context;
+    int (*read_fn)(void* context, ulong64_t offset, void* buffer, unsigned size);
+    int (*write_fn)(void* context, ulong64_t offset, const void* buffer, unsigned size);
+    int (*flush_fn)(void* context);
+    int (*barrier_fn)(void* context);
+};
+
+/* 
+   Source of all current mappings for a checkpoint. Fills up to max entries
+   and returns their number, 0 at the end. restart is non-zero on the first 
+   call of every checkpoint. Entries may repeat, replay skips duplicates
+*/
+typedef unsigned (*remap_journal_export_fn)(void* context, 
+                                            int restart,
+                                            struct remap_journal_entry* entries, 
+                                            unsigned max);
+
+/* Called for every saved entry by replay, returns 0 on success */
+typedef int (*remap_journal_apply_fn)(void* context, 
+                                      const struct remap_journal_entry* entry);
+
+struct remap_journal_info
+{
+    ulong64_t generation;       /* Checkpoints ever taken */
+    ulong64_t half_blocks;
+    ulong64_t used_blocks;      /* Of the current half */
+    ulong64_t batches;          /* Written by this instance */
+    ulong64_t entries;
+    ulong64_t checkpoints;
+    ulong64_t overflows;        /* Appends which found the batch full */
+};
+
+struct remap_journal;
+
+/* 
+   batch_entries appends are kept in memory between commits, at most 
+   REMAP_JOURNAL_RECORD_ENTRIES. Call remap_journal_format or 
+   remap_journal_replay before appending
+*/
+struct remap_journal* remap_journal_create(const struct remap_journal_io* io,
+                                           ulong64_t area_blocks,
+                                           unsigned batch_entries,
+                                           remap_journal_export_fn export_fn,
+                                           void* export_context,
+                                           void* (*alloc_fn)(unsigned size), 
+                                           void (*free_fn)(void* mem));
+
+void remap_journal_destroy(struct remap_journal* journal);
+
+/* Start an empty journal. Whatever the area held before is ignored */
+int remap_journal_format(struct remap_journal* journal);
+
+/* 
+   Read the last checkpoint and the batches after it, passing every entry 
+   to apply_fn in the order they were appended. A torn batch at the end is
+   dropped, appends then continue in its place
+*/
+int remap_journal_replay(struct remap_journal* journal, 
+                         remap_journal_apply_fn apply_fn,
+                         void* apply_context);
+
+/* 
+   Queue an entry for the next batch, never blocks: usable under spin locks.
+   ticket gets the value to pass to remap_journal_commit. If the batch is 
+   full the entry is dropped and the next commit takes a checkpoint instead,
+   so export_fn must already see the change when it is appended
+*/
+void remap_journal_append(struct remap_journal* journal, 
+                          const struct remap_journal_entry* entry,
+                          ulong64_t* ticket);
+
+/* Ticket of the last append */
+ulong64_t remap_journal_last_ticket(struct remap_journal* journal);
+
+/* 
+   Make everything appended up to ticket durable. The first caller writes 
+   all queued entries as one batch, callers arriving meanwhile wait for it
+   and usually find their entries written. Blocks on I/O: PASSIVE_LEVEL 
+*/
+int remap_journal_commit(struct remap_journal* journal, ulong64_t ticket);
+
+/* Write a checkpoint to the other half now, the log starts over after it */
+int remap_journal_checkpoint(struct remap_journal* journal);
+
+void remap_journal_get_info(struct remap_journal* journal, 
+                            struct remap_journal_info* info);
+
+#endif
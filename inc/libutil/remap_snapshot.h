@@ -0,0 +1,141 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Snapshot of all remaps: sorted runs with a fanout index
+*/
+#ifndef REMAP_SNAPSHOT_H
+#define REMAP_SNAPSHOT_H
+
+#include "libcrt/types.h"
+#include "libutil/disk_tracker.h"
+
+#define REMAP_SNAPSHOT_OK           (0)
+#define REMAP_SNAPSHOT_NO_MEMORY    (-1)
+#define REMAP_SNAPSHOT_IO_ERROR     (-2)
+#define REMAP_SNAPSHOT_INV_ARGUMENT (-3)    /* Runs out of order or overlapping */
+#define REMAP_SNAPSHOT_CORRUPT      (-4)    /* Bad magic, version, size or checksum */
+
+#define REMAP_SNAPSHOT_VERSION      (1)
+
+/* Index slots at most, every slot covers the same power of two of source blocks */
+#define REMAP_SNAPSHOT_MAX_FANOUT   (4096)
+
+/*
+   File layout, little endian: header, run_count runs sorted by source 
+   block, then fanout_count + 1 run numbers. Slot s holds the first run 
+   ending past block s << fanout_shift, so a lookup binary searches only 
+   the runs of one slot. Source blocks past the last slot belong to it
+*/
+struct remap_snapshot_header
+{
+    uint32_t  magic;
+    uint32_t  version;
+    uint32_t  header_size;
+    uint32_t  run_size;
+    ulong64_t run_count;
+    ulong64_t remapped_blocks;
+    ulong64_t index_offset;
+    uint32_t  fanout_shift;
+    uint32_t  fanout_count;
+    uint32_t  runs_checksum;        /* CRC-32 of the runs */
+    uint32_t  index_checksum;
+    uint32_t  reserved;
+    uint32_t  checksum;             /* CRC-32 of the header with this field 0 */
+};
+
+struct remap_snapshot_run
+{
+    ulong64_t source_block;
+    ulong64_t target_block;
+    uint32_t  length_in_blocks;
+    uint32_t  reserved;
+};
+
+/* 
+   Output of the writer, offsets are in bytes from the start of the file.
+   Runs and the index are written in order, the header last
+*/
+struct remap_snapshot_io
+{
+    void* context;
+    int (*write_fn)(void* context, ulong64_t offset, const void* buffer, unsigned size);
+};
+
+struct remap_snapshot_writer;
+
+/* 
+   disk_blocks is the size of the source disk, it only picks the index 
+   granularity. Runs are buffered and written in big sequential pieces
+*/
+struct remap_snapshot_writer* remap_snapshot_writer_create(const struct remap_snapshot_io* io,
+                                                           ulong64_t disk_blocks,
+                                                           void* (*alloc_fn)(unsigned size), 
+                                                           void (*free_fn)(void* mem));
+
+/* Runs must come in source block order, adjacent ones are merged */
+int remap_snapshot_writer_add(struct remap_snapshot_writer* writer, 
+                              const struct disk_remap_run* run);
+
+/* Write the index and the header, the snapshot is complete after it */
+int remap_snapshot_writer_finish(struct remap_snapshot_writer* writer);
+
+void remap_snapshot_writer_destroy(struct remap_snapshot_writer* writer);
+
+/* Stream every run of the tracker into a snapshot */
+int remap_snapshot_save(disk_remap_t remap, 
+                        const struct remap_snapshot_io* io,
+                        ulong64_t disk_blocks,
+                        void* (*alloc_fn)(unsigned size), 
+                        void (*free_fn)(void* mem));
+
+/* Snapshot in memory, e.g. a mapped file. Points into the data, copies nothing */
+struct remap_snapshot
+{
+    const struct remap_snapshot_header* header;
+    const struct remap_snapshot_run*    runs;
+    const ulong64_t*                    index;
+    ulong64_t                           run_count;
+};
+
+/* 
+   Check the header and the index. verify_runs also checks the runs 
+   checksum and order, which reads all of them
+*/
+int remap_snapshot_open(struct remap_snapshot* snapshot, 
+                        const void* data, 
+                        ulong64_t size,
+                        int verify_runs);
+
+/* Number of the first run ending past source_block, run_count if none */
+ulong64_t remap_snapshot_find(const struct remap_snapshot* snapshot, ulong64_t source_block);
+
+/* 
+   Returns non-zero if the block is remapped, run then gets the part of its
+   run from source_block on
+*/
+int remap_snapshot_lookup(const struct remap_snapshot* snapshot, 
+                          ulong64_t source_block,
+                          struct disk_remap_run* run);
+
+/* Map every run of the snapshot in the tracker, see disk_tracker_restore_run */
+int remap_snapshot_restore(const struct remap_snapshot* snapshot, disk_remap_t remap);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Per-CPU rings of fixed size trace records
+*/
+#ifndef TRACE_RING_H
+#define TRACE_RING_H
+
+#include "libcrt/types.h"
+
+/* 
+   Every CPU writes records to its own ring, a reader drains all of them.
+   Nothing is locked: a ring has one writer, code running on its CPU which
+   can not be preempted by another writer of the same CPU (DISPATCH_LEVEL
+   in the kernel), and one reader, callers serialize drains. A full ring 
+   drops new records and counts them as lost
+*/
+struct trace_ring;
+
+/* records_per_cpu is rounded up to a power of two */
+struct trace_ring* trace_ring_create(unsigned cpu_count,
+                                     unsigned records_per_cpu,
+                                     unsigned record_size,
+                                     void* (*alloc_fn)(unsigned size), 
+                                     void (*free_fn)(void* mem));
+
+void trace_ring_destroy(struct trace_ring* ring);
+
+void trace_ring_write(struct trace_ring* ring, unsigned cpu, const void* record);
+
+/* 
+   Moves up to max_records records to buffer and returns their number. 
+   Records of one CPU keep their order, CPUs are taken in turns. lost gets
+   the number of records dropped since the previous drain
+*/
+unsigned trace_ring_drain(struct trace_ring* ring, 
+                          void* buffer, 
+                          unsigned max_records,
+                          ulong32_t* lost);
+
+#endif
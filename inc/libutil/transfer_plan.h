@@ -0,0 +1,71 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Transfer plan: how to send a remapped request to the disk
+*/
+#ifndef TRANSFER_PLAN_H
+#define TRANSFER_PLAN_H
+
+#include "libcrt/types.h"
+#include "libutil/disk_tracker.h"
+
+#define TRANSFER_PLAN_OK                (0)
+#define TRANSFER_PLAN_INV_ARGUMENT      (-3)
+#define TRANSFER_PLAN_BUFFER_TOO_SMALL  (-4)
+
+/* Flags for transfer_plan_build */
+#define TRANSFER_PLAN_SORTED  (1)   /* Order transfers by disk block */
+
+/* One request to the lower disk */
+struct transfer
+{
+    ulong64_t disk_block;
+    ulong32_t buffer_block;        /* First block in the original request buffer */
+    ulong32_t length_in_blocks;
+};
+
+/* What the lower disk accepts without splitting the request again */
+struct transfer_limits
+{
+    ulong32_t max_blocks;          /* Longest transfer, 0 - no limit */
+    ulong32_t align_blocks;        /* Power of two or 0. Runs longer than max_blocks
+                                      are cut at disk blocks aligned to it */
+};
+
+/* 
+   Number of transfers needed for the remap result. Runs adjacent on the disk
+   are merged, runs longer than the limit are cut
+*/
+ulong32_t transfer_plan_size(const struct disk_extent_remap* remap, 
+                             const struct transfer_limits* limits);
+
+/* 
+   Fill transfers for the remap result. If max_transfers is not enough, 
+   TRANSFER_PLAN_BUFFER_TOO_SMALL is returned and count tells how many are needed
+*/
+int transfer_plan_build(const struct disk_extent_remap* remap, 
+                        const struct transfer_limits* limits,
+                        int flags,
+                        struct transfer* transfers,
+                        ulong32_t max_transfers,
+                        ulong32_t* count);
+
+#endif
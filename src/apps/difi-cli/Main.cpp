@@ -40,14 +40,24 @@ BOOL restoreState = FALSE;
 BOOL reEnable = FALSE;
 BOOL restoreOnReboot = FALSE;
 BOOL printDiskStats = FALSE;
+BOOL printLatency = FALSE;
+BOOL printTrace = FALSE;
+BOOL printRemaps = FALSE;
+const wchar_t* saveTraceFile = NULL;
 BOOL allocStorage = FALSE;
 BOOL initStorage = FALSE;
 BOOL simulate = FALSE;
 BOOL trackDisk = FALSE;
 BOOL flushStorage = FALSE;
+BOOL replayJournal = FALSE;
+BOOL mergeDisk = FALSE;
+BOOL printMerge = FALSE;
+int backgroundMergeKb = -1;     // -1 leaves it as is, 0 stops it
+int splitWindow = -1;           // -1 leaves it as is, 0 takes the default
 
 DWORD reEnableDelaySec = 10;
 DWORD allocStorageGb = 3;
+DWORD journalMb = 0;
 DeviceMap_t allPciDevices;
 TCHAR programPath[MAX_PATH];
 
@@ -127,9 +137,24 @@ void PrintUsage()
         "  --delay-sec <seconds>  \n"
         "  --alloc-storage <N GB> Allocate N gigabytes of disk storage for tracking\n"
         "  --print-disk-stats     Print Difi driver stats (if tracking)\n"
+        "  --print-latency        Print request latency percentiles\n"
+        "  --print-trace          Drain and print the request trace\n"
+        "  --save-trace <file>    Drain the request trace and append it to a file\n"
+        "  --print-remaps         Print remapped runs in source block order\n"
         "  --init-storage         Init storage for Difi\n"
+        "  --journal-mb <N>       Keep remaps in an N Mb journal at the start of the\n"
+        "                         storage, so they survive a reboot (with --init-storage)\n"
+        "  --replay-journal       Restore remaps from the journal instead of starting\n"
+        "                         it empty (with --init-storage --journal-mb)\n"
         "  --track-disk           Start disk tracking\n"
         "  --simulate             Simulate disk tracking (works only with --track-disk)\n"
+        "  --merge                Copy remapped blocks back to the disk and stop tracking,\n"
+        "                         writes wait until it is done\n"
+        "  --merge-progress       Print progress of the merge\n"
+        "  --background-merge <N> Merge remapped blocks back at N Kb/s while tracking\n"
+        "                         goes on, freeing their storage. 0 stops it\n"
+        "  --split-window <N>     Keep N pieces of a split remapped request in flight,\n"
+        "                         up to 64. 0 picks it from the adapter properties\n"
         "  --flush-storage        Try to flush disk storage using SHADOW VOLUME COPY"
     ;
 
@@ -160,6 +185,19 @@ void ParseCommandLine(int argc, wchar_t* argv[])
             reEnableDelaySec = _wtoi(argv[i]);
         } else if (wcscmp(argv[i], L"--print-disk-stats") == 0) {
             printDiskStats = TRUE;
+        } else if (wcscmp(argv[i], L"--print-latency") == 0) {
+            printLatency = TRUE;
+        } else if (wcscmp(argv[i], L"--print-trace") == 0) {
+            printTrace = TRUE;
+        } else if (wcscmp(argv[i], L"--print-remaps") == 0) {
+            printRemaps = TRUE;
+        } else if (wcscmp(argv[i], L"--save-trace") == 0) {
+            ++i;
+            if (i == argc) {
+                printf("--save-trace expects a file name\n");
+                exit(1);
+            }
+            saveTraceFile = argv[i];
         } else if (wcscmp(argv[i], L"--alloc-storage") == 0) {
             allocStorage = TRUE;
             ++i;
@@ -174,10 +212,37 @@ void ParseCommandLine(int argc, wchar_t* argv[])
             }
         } else if (wcscmp(argv[i], L"--init-storage") == 0) {
             initStorage = TRUE;
+        } else if (wcscmp(argv[i], L"--journal-mb") == 0) {
+            ++i;
+            if (i == argc) {
+                printf("--journal-mb expects size in Mb\n");
+                exit(1);
+            }
+            journalMb = _wtoi(argv[i]);
+        } else if (wcscmp(argv[i], L"--replay-journal") == 0) {
+            replayJournal = TRUE;
         } else if (wcscmp(argv[i], L"--simulate") == 0) {
             simulate = TRUE;
         } else if (wcscmp(argv[i], L"--track-disk") == 0) {
             trackDisk = TRUE;
+        } else if (wcscmp(argv[i], L"--merge") == 0) {
+            mergeDisk = TRUE;
+        } else if (wcscmp(argv[i], L"--merge-progress") == 0) {
+            printMerge = TRUE;
+        } else if (wcscmp(argv[i], L"--background-merge") == 0) {
+            ++i;
+            if (i == argc) {
+                printf("--background-merge expects Kb per second\n");
+                exit(1);
+            }
+            backgroundMergeKb = _wtoi(argv[i]);
+        } else if (wcscmp(argv[i], L"--split-window") == 0) {
+            ++i;
+            if (i == argc) {
+                printf("--split-window expects a number of transfers\n");
+                exit(1);
+            }
+            splitWindow = _wtoi(argv[i]);
         } else if (wcscmp(argv[i], L"--flush-storage") == 0) {
             flushStorage = TRUE;
         }
@@ -201,6 +266,34 @@ int _tmain(int argc, _TCHAR* argv[])
         df.PrintDiskTrackingStats(L"");
         return 0;
     }
+
+    if (printLatency) {
+        DifiInterface df;
+
+        df.PrintLatencyStats(L"");
+        return 0;
+    }
+
+    if (printTrace) {
+        DifiInterface df;
+
+        df.PrintTrace(L"");
+        return 0;
+    }
+
+    if (printRemaps) {
+        DifiInterface df;
+
+        df.PrintRemaps();
+        return 0;
+    }
+
+    if (saveTraceFile != NULL) {
+        DifiInterface df;
+
+        df.SaveTrace(saveTraceFile);
+        return 0;
+    }
     
 
     if (allocStorage) {
@@ -211,7 +304,7 @@ int _tmain(int argc, _TCHAR* argv[])
     if (initStorage) {
         DifiInterface df;
 
-        if (df.InitStorage() < 0)
+        if (df.InitStorage(journalMb, replayJournal != FALSE) < 0)
             printf("Failed to init difi storage\n");
         else
             printf("Successfully initialized difi storage\n");
@@ -226,6 +319,37 @@ int _tmain(int argc, _TCHAR* argv[])
         return 0;
     }
 
+    if (mergeDisk) {
+        DifiInterface difi;
+
+        if (difi.MergeDisk() == DIFI_OK)
+            printf("Started merge, see --merge-progress\n");
+        return 0;
+    }
+
+    if (backgroundMergeKb >= 0) {
+        DifiInterface difi;
+
+        if (difi.BackgroundMerge(backgroundMergeKb != 0, backgroundMergeKb) == DIFI_OK)
+            printf(backgroundMergeKb != 0 ? "Started background merge\n" : 
+                                            "Stopped background merge\n");
+        return 0;
+    }
+
+    if (splitWindow >= 0) {
+        DifiInterface difi;
+
+        difi.SetSplitWindow(splitWindow);
+        return 0;
+    }
+
+    if (printMerge) {
+        DifiInterface difi;
+
+        difi.PrintMergeProgress();
+        return 0;
+    }
+
     if (print) {
         // Enumerate through all devices in Set.
         wprintf(L"PCI devices:\n======================\n");
@@ -23,6 +23,9 @@
 */
 #include "stdafx.h"
 
+#include <algorithm>
+#include <vector>
+
 #include "DifiInterface.h"
 #include "diskfilter/difi_interface.h"
 #include "DriverSupport.h"
@@ -159,7 +162,13 @@ int DifiInterface::PrintDiskTrackingStats(const TCHAR* diskName)
              L"  writes at PASSIVE  : %llu\n"
              L"  writes at APC      : %llu\n"
              L"  writes at DISPATCH : %llu\n"
-             L"  writes at other    : %llu\n",
+             L"  writes at other    : %llu\n"
+             L"  bytes read         : %llu\n"
+             L"  bytes written      : %llu\n"
+             L"  remapped bytes     : %llu\n"
+             L"  split requests     : %llu\n"
+             L"  split transfers    : %llu\n"
+             L"  passed through     : %llu\n",
              stats.hash_size, stats.write_hits, stats.read_hits,
              stats.per_irql_reads[0],
              stats.per_irql_reads[1],
@@ -168,11 +177,235 @@ int DifiInterface::PrintDiskTrackingStats(const TCHAR* diskName)
              stats.per_irql_writes[0],
              stats.per_irql_writes[1],
              stats.per_irql_writes[2],
-             stats.per_irql_writes[3]
+             stats.per_irql_writes[3],
+             stats.bytes_read,
+             stats.bytes_written,
+             stats.remapped_bytes,
+             stats.split_irps,
+             stats.split_transfers,
+             stats.passed_through
              );
     return DIFI_OK;
 }
 
+// Largest value counted in the bucket, see ioctl_difi_latency_stats
+static unsigned long long LatencyBucketHigh(unsigned bucket, unsigned subBits)
+{
+    unsigned group = bucket >> subBits;
+    if (group == 0)
+        return bucket;
+
+    unsigned long long low = (unsigned long long)
+        ((1u << subBits) + (bucket & ((1u << subBits) - 1))) << (group - 1);
+    return low + (1ULL << (group - 1)) - 1;
+}
+
+// Value not exceeded by the given part of requests, in basis points
+static unsigned long long LatencyPercentile(const unsigned long long* counts, 
+                                            unsigned long long total,
+                                            const ioctl_difi_latency_stats& stats,
+                                            unsigned basisPoints)
+{
+    unsigned long long rank = (total * basisPoints + 9999) / 10000;
+    unsigned long long seen = 0;
+
+    for (unsigned i = 0; i < stats.bucket_count; i++) {
+        seen += counts[i];
+        if (seen >= rank && seen > 0)
+            return LatencyBucketHigh(i, stats.sub_bucket_bits);
+    }
+    return 0;
+}
+
+static void PrintLatencyRow(const wchar_t* name, 
+                            const unsigned long long* counts,
+                            const ioctl_difi_latency_stats& stats)
+{
+    unsigned long long total = 0;
+    for (unsigned i = 0; i < stats.bucket_count; i++)
+        total += counts[i];
+
+    if (total == 0) {
+        wprintf(L"  %-20s %12u\n", name, 0);
+        return;
+    }
+    wprintf(L"  %-20s %12llu %8llu %8llu %8llu %8llu %8llu\n", name, total,
+            LatencyPercentile(counts, total, stats, 5000),
+            LatencyPercentile(counts, total, stats, 9000),
+            LatencyPercentile(counts, total, stats, 9900),
+            LatencyPercentile(counts, total, stats, 9990),
+            LatencyPercentile(counts, total, stats, 10000));
+}
+
+int DifiInterface::PrintLatencyStats(const TCHAR* diskName)
+{
+    diskName;   // Ignore for now
+
+    WinHandle difiHandle(OpenControlDevice()); 
+    if ( !difiHandle ) {
+        return DIFI_DISK_FILTER_NOT_FOUND;
+    }
+
+    // Too big for the stack
+    MallocAutoPtr<ioctl_difi_latency_stats> buffer(malloc(sizeof(ioctl_difi_latency_stats)));
+    ioctl_difi_latency_stats* stats = (ioctl_difi_latency_stats*)(void*)buffer;
+    if (stats == NULL) {
+        return DIFI_GENERIC_ERROR;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->size = sizeof(*stats);
+    stats->version = DIFI_LATENCY_STATS_VERSION;
+
+    unsigned long bytes_ret;
+    if ( DeviceIoControl(difiHandle, IOCTL_DIFI_GET_LATENCY_STATS, 
+        (LPVOID)stats, sizeof(*stats),
+        (LPVOID)stats, sizeof(*stats),
+        &bytes_ret, NULL) == 0 )
+    {
+        _tprintf(_T("Unable to get disk filter latency.  Error : %d\n"), GetLastError());
+        return DIFI_IOCTL_FAILED;
+    }
+    if (stats->version != DIFI_LATENCY_STATS_VERSION || 
+        stats->bucket_count > DIFI_LATENCY_BUCKETS) {
+        wprintf(L"Unsupported latency stats version %u\n", stats->version);
+        return DIFI_IOCTL_FAILED;
+    }
+
+    static const wchar_t* const paths[DIFI_LATENCY_PATHS] = {
+        L"pass-through", L"remapped", L"split"
+    };
+
+    wprintf(L"Difi disk filter latency, microseconds\n"
+            L"  %-20s %12s %8s %8s %8s %8s %8s\n",
+            L"", L"requests", L"p50", L"p90", L"p99", L"p99.9", L"max");
+    for (unsigned path = 0; path < DIFI_LATENCY_PATHS; path++) {
+        wchar_t name[32];
+        swprintf_s(name, L"read %s", paths[path]);
+        PrintLatencyRow(name, stats->reads[path], *stats);
+    }
+    for (unsigned path = 0; path < DIFI_LATENCY_PATHS; path++) {
+        wchar_t name[32];
+        swprintf_s(name, L"write %s", paths[path]);
+        PrintLatencyRow(name, stats->writes[path], *stats);
+    }
+    return DIFI_OK;
+}
+
+static bool TraceRecordEarlier(const ioctl_difi_trace_record& a, 
+                               const ioctl_difi_trace_record& b)
+{
+    return a.timestamp < b.timestamp;
+}
+
+// Drains until the rings are empty, processors interleave so sort at the end
+static int DrainTrace(HANDLE difiHandle, 
+                      std::vector<ioctl_difi_trace_record>& records,
+                      unsigned long long& frequency,
+                      unsigned& lost)
+{
+    const unsigned maxRecords = 4096;
+    const unsigned bufferSize = FIELD_OFFSET(ioctl_difi_trace, records) + 
+                                maxRecords * sizeof(ioctl_difi_trace_record);
+    MallocAutoPtr<ioctl_difi_trace> buffer(malloc(bufferSize));
+    ioctl_difi_trace* trace = (ioctl_difi_trace*)(void*)buffer;
+    if (trace == NULL) {
+        return DIFI_GENERIC_ERROR;
+    }
+
+    frequency = 0;
+    lost = 0;
+    for (;;) {
+        unsigned long bytes_ret;
+        if ( DeviceIoControl(difiHandle, IOCTL_DIFI_DRAIN_TRACE, 
+            NULL, 0,
+            (LPVOID)trace, bufferSize,
+            &bytes_ret, NULL) == 0 )
+        {
+            _tprintf(_T("Unable to drain disk filter trace.  Error : %d\n"), GetLastError());
+            return DIFI_IOCTL_FAILED;
+        }
+        if (trace->version != DIFI_TRACE_VERSION) {
+            wprintf(L"Unsupported trace version %u\n", trace->version);
+            return DIFI_IOCTL_FAILED;
+        }
+        frequency = trace->frequency;
+        lost += trace->lost;
+        records.insert(records.end(), trace->records, trace->records + trace->record_count);
+        if (trace->record_count < maxRecords)
+            break;
+    }
+    std::sort(records.begin(), records.end(), TraceRecordEarlier);
+    return DIFI_OK;
+}
+
+int DifiInterface::PrintTrace(const TCHAR* diskName)
+{
+    diskName;   // Ignore for now
+
+    WinHandle difiHandle(OpenControlDevice()); 
+    if ( !difiHandle ) {
+        return DIFI_DISK_FILTER_NOT_FOUND;
+    }
+
+    std::vector<ioctl_difi_trace_record> records;
+    unsigned long long frequency;
+    unsigned lost;
+    int result = DrainTrace(difiHandle, records, frequency, lost);
+    if (result != DIFI_OK) {
+        return result;
+    }
+
+    wprintf(L"%-16s %-3s %-5s %-16s %-8s %-8s %-7s %s\n", 
+            L"time, us", L"cpu", L"op", L"block", L"length", L"hits", L"extents", L"flags");
+    for (size_t i = 0; i < records.size(); i++) {
+        const ioctl_difi_trace_record& r = records[i];
+        unsigned long long usec = frequency == 0 ? 0 : 
+            (r.timestamp - records[0].timestamp) * 1000000 / frequency;
+
+        wprintf(L"%-16llu %-3lu %-5s %-16llu %-8lu %-8lu %-7u %s%s\n", 
+                usec, r.cpu, 
+                r.op == DIFI_TRACE_WRITE ? L"write" : L"read",
+                r.start_block, r.length_in_blocks, r.hits, (unsigned)r.extents,
+                (r.flags & DIFI_TRACE_PASSED_THROUGH) ? L"pass " : L"",
+                (r.flags & DIFI_TRACE_FAILED) ? L"failed" : L"");
+    }
+    if (lost != 0)
+        wprintf(L"%u records lost, rings were full\n", lost);
+    return DIFI_OK;
+}
+
+// Raw records in time order, user_mode_replay reads them
+int DifiInterface::SaveTrace(const TCHAR* fileName)
+{
+    WinHandle difiHandle(OpenControlDevice()); 
+    if ( !difiHandle ) {
+        return DIFI_DISK_FILTER_NOT_FOUND;
+    }
+
+    std::vector<ioctl_difi_trace_record> records;
+    unsigned long long frequency;
+    unsigned lost;
+    int result = DrainTrace(difiHandle, records, frequency, lost);
+    if (result != DIFI_OK) {
+        return result;
+    }
+
+    FILE* f = NULL;
+    if (_tfopen_s(&f, fileName, _T("ab")) != 0 || f == NULL) {
+        _tprintf(_T("Unable to open %s\n"), fileName);
+        return DIFI_GENERIC_ERROR;
+    }
+    if (!records.empty())
+        fwrite(&records[0], sizeof(records[0]), records.size(), f);
+    fclose(f);
+
+    wprintf(L"Saved %u records", (unsigned)records.size());
+    if (lost != 0)
+        wprintf(L", %u lost", lost);
+    wprintf(L"\n");
+    return DIFI_OK;
+}
+
 int DifiInterface::AllocateStorage(unsigned size_in_gb)
 {
     int storage_token = ::AllocateStorage(size_in_gb, 0);
@@ -182,7 +415,7 @@ int DifiInterface::AllocateStorage(unsigned size_in_gb)
     return storage_token;
 }
 
-int DifiInterface::InitStorage()
+int DifiInterface::InitStorage(unsigned journal_mb, bool replay_journal)
 {
     unsigned long long size = 0;
     int storage_token = 0;
@@ -242,25 +475,47 @@ int DifiInterface::InitStorage()
         return DIFI_IOCTL_FAILED;
     }
 
-    if ( DeviceIoControl(difiHandle, IOCTL_DIFI_TEST_STORAGE, 
-                         NULL, 0,
-                         NULL, 0, 
-                         &bytes_ret, NULL) == 0 )
-    {
-        _tprintf(_T("Unable to test storage.  Error : %d\n"), GetLastError());
-        free(disk_init);
-        free(storage_info);
-        return DIFI_IOCTL_FAILED;
+    /* Test sectors would overwrite the saved journal */
+    if (!replay_journal) {
+        if ( DeviceIoControl(difiHandle, IOCTL_DIFI_TEST_STORAGE, 
+                             NULL, 0,
+                             NULL, 0, 
+                             &bytes_ret, NULL) == 0 )
+        {
+            _tprintf(_T("Unable to test storage.  Error : %d\n"), GetLastError());
+            free(disk_init);
+            free(storage_info);
+            return DIFI_IOCTL_FAILED;
+        }
+
+        char sector[512];
+        memset(sector, 0, sizeof(sector));
+        memcpy(sector, "*    Test sector", sizeof("*    Test sector"));
+        sector[511] = '*';
+        if (::VerifyStorage(storage_token, storage_info, sector, sector) < 0) {
+            printf("Storage verification failed!");
+        } else {
+            printf("All storage verification passed\n");
+        }
     }
 
-    char sector[512];
-    memset(sector, 0, sizeof(sector));
-    memcpy(sector, "*    Test sector", sizeof("*    Test sector"));
-    sector[511] = '*';
-    if (::VerifyStorage(storage_token, storage_info, sector, sector) < 0) {
-        printf("Storage verification failed!");
-    } else {
-        printf("All storage verification passed\n");
+    if (journal_mb > 0) {
+        ioctl_difi_open_journal journal;
+        journal.size = sizeof(journal);
+        journal.flags = replay_journal ? DIFI_JOURNAL_REPLAY : 0;
+        journal.journal_blocks = journal_mb * 2048;
+
+        if ( DeviceIoControl(difiHandle, IOCTL_DIFI_OPEN_JOURNAL, 
+                             (LPVOID)&journal, sizeof(journal),
+                             NULL, 0, 
+                             &bytes_ret, NULL) == 0 )
+        {
+            _tprintf(_T("Unable to open remap journal.  Error : %d\n"), GetLastError());
+            free(disk_init);
+            free(storage_info);
+            return DIFI_IOCTL_FAILED;
+        }
+        printf("Remap journal: %uMb%s\n", journal_mb, replay_journal ? ", replayed" : "");
     }
 
     free(disk_init);
@@ -291,3 +546,169 @@ int DifiInterface::TrackDisk(const wchar_t* disk, bool simulate)
     return DIFI_OK;
 }
 
+// Copies remapped blocks back to the disk in the background, tracking stops when done
+int DifiInterface::MergeDisk(unsigned queue_depth, unsigned transfer_kb)
+{
+    WinHandle difiHandle(OpenControlDevice()); 
+    if ( !difiHandle ) {
+        return DIFI_DISK_FILTER_NOT_FOUND;
+    }
+
+    unsigned long bytes_ret;
+    ioctl_difi_merge merge;
+    memset(&merge, 0, sizeof(merge));
+    merge.size = sizeof(merge);
+    merge.queue_depth = queue_depth;
+    merge.transfer_kb = transfer_kb;
+
+    if ( DeviceIoControl(difiHandle, IOCTL_DIFI_STOP_TRACKING_MERGE, 
+                         (LPVOID)&merge, sizeof(merge),
+                         NULL, 0, 
+                         &bytes_ret, NULL) == 0 )
+    {
+        _tprintf(_T("Unable to start merge.  Error : %d\n"), GetLastError());
+        return DIFI_IOCTL_FAILED;
+    }
+
+    return DIFI_OK;
+}
+
+// Merges remapped blocks back while tracking goes on, their storage becomes free
+int DifiInterface::BackgroundMerge(bool enable, unsigned budget_kb_per_sec)
+{
+    WinHandle difiHandle(OpenControlDevice()); 
+    if ( !difiHandle ) {
+        return DIFI_DISK_FILTER_NOT_FOUND;
+    }
+
+    unsigned long bytes_ret;
+    ioctl_difi_background_merge merge;
+    memset(&merge, 0, sizeof(merge));
+    merge.size = sizeof(merge);
+    merge.enable = enable;
+    merge.budget_kb_per_sec = budget_kb_per_sec;
+
+    if ( DeviceIoControl(difiHandle, IOCTL_DIFI_BACKGROUND_MERGE, 
+                         (LPVOID)&merge, sizeof(merge),
+                         NULL, 0, 
+                         &bytes_ret, NULL) == 0 )
+    {
+        _tprintf(_T("Unable to set background merge.  Error : %d\n"), GetLastError());
+        return DIFI_IOCTL_FAILED;
+    }
+
+    return DIFI_OK;
+}
+
+// Transfers a split remapped request keeps in flight, 0 for the adapter default
+int DifiInterface::SetSplitWindow(unsigned window)
+{
+    WinHandle difiHandle(OpenControlDevice()); 
+    if ( !difiHandle ) {
+        return DIFI_DISK_FILTER_NOT_FOUND;
+    }
+
+    unsigned long bytes_ret;
+    ioctl_difi_split_window split;
+    memset(&split, 0, sizeof(split));
+    split.size = sizeof(split);
+    split.window = window;
+
+    if ( DeviceIoControl(difiHandle, IOCTL_DIFI_SET_SPLIT_WINDOW, 
+                         (LPVOID)&split, sizeof(split),
+                         (LPVOID)&split, sizeof(split), 
+                         &bytes_ret, NULL) == 0 )
+    {
+        _tprintf(_T("Unable to set split window.  Error : %d\n"), GetLastError());
+        return DIFI_IOCTL_FAILED;
+    }
+
+    _tprintf(_T("Split window: %u\n"), split.window);
+    return DIFI_OK;
+}
+
+// Remapped runs in source order, pulled a page at a time so the map may be of any size
+int DifiInterface::PrintRemaps()
+{
+    WinHandle difiHandle(OpenControlDevice()); 
+    if ( !difiHandle ) {
+        return DIFI_DISK_FILTER_NOT_FOUND;
+    }
+
+    const unsigned maxRuns = 4096;
+    const unsigned bufferSize = FIELD_OFFSET(ioctl_difi_remaps, runs) + 
+                                maxRuns * sizeof(ioctl_difi_remap_run);
+    MallocAutoPtr<ioctl_difi_remaps> buffer(malloc(bufferSize));
+    ioctl_difi_remaps* remaps = (ioctl_difi_remaps*)(void*)buffer;
+    if (remaps == NULL) {
+        return DIFI_GENERIC_ERROR;
+    }
+
+    ioctl_difi_remaps_query query;
+    memset(&query, 0, sizeof(query));
+    query.size = sizeof(query);
+
+    unsigned long long runs = 0, blocks = 0;
+    wprintf(L"%-16s %-16s %s\n", L"source", L"target", L"length");
+    for (;;) {
+        unsigned long bytes_ret;
+        if ( DeviceIoControl(difiHandle, IOCTL_DIFI_GET_REMAPS, 
+            (LPVOID)&query, sizeof(query),
+            (LPVOID)remaps, bufferSize,
+            &bytes_ret, NULL) == 0 )
+        {
+            _tprintf(_T("Unable to get remaps.  Error : %d\n"), GetLastError());
+            return DIFI_IOCTL_FAILED;
+        }
+        if (remaps->run_count == 0)
+            break;
+        for (unsigned i = 0; i < remaps->run_count; i++) {
+            const ioctl_difi_remap_run& r = remaps->runs[i];
+
+            wprintf(L"%-16llu %-16llu %lu\n", r.source_block, r.target_block, r.length_in_blocks);
+            blocks += r.length_in_blocks;
+        }
+        runs += remaps->run_count;
+        query.start_block = remaps->next_block;
+    }
+    wprintf(L"%llu blocks in %llu runs\n", blocks, runs);
+    return DIFI_OK;
+}
+
+int DifiInterface::PrintMergeProgress()
+{
+    WinHandle difiHandle(OpenControlDevice()); 
+    if ( !difiHandle ) {
+        return DIFI_DISK_FILTER_NOT_FOUND;
+    }
+
+    ioctl_difi_merge_progress progress;
+    memset(&progress, 0, sizeof(progress));
+
+    unsigned long bytes_ret;
+    if ( DeviceIoControl(difiHandle, IOCTL_DIFI_GET_MERGE_PROGRESS, 
+        NULL, 0,
+        (LPVOID)&progress, sizeof(progress),
+        &bytes_ret, NULL) == 0 )
+    {
+        _tprintf(_T("Unable to get merge progress.  Error : %d\n"), GetLastError());
+        return DIFI_IOCTL_FAILED;
+    }
+
+    static const wchar_t* const states[] = {L"idle", L"running", L"done"};
+
+    wprintf(L"Merge %s, status 0x%x\n"
+            L"  blocks read:    %llu of %llu\n"
+            L"  blocks written: %llu of %llu\n"
+            L"  runs:           %llu\n"
+            L"  requests:       %llu\n"
+            L"Background merge: %llu blocks in %llu runs\n",
+            progress.state <= DIFI_MERGE_DONE ? states[progress.state] : L"unknown",
+            progress.status,
+            progress.blocks_read, progress.total_blocks,
+            progress.blocks_written, progress.total_blocks,
+            progress.runs,
+            progress.requests,
+            progress.background_blocks, progress.background_runs);
+    return DIFI_OK;
+}
@@ -45,10 +45,18 @@ public:
     ~DifiInterface();
 
     int PrintDiskTrackingStats(const TCHAR* diskName);
+    int PrintLatencyStats(const TCHAR* diskName);
+    int PrintTrace(const TCHAR* diskName);
+    int SaveTrace(const TCHAR* fileName);
     int CheckStorageStatus();
     int AllocateStorage(unsigned size_in_gb);
-    int InitStorage();
+    int InitStorage(unsigned journal_mb = 0, bool replay_journal = false);
     int TrackDisk(const wchar_t* disk, bool simulate);
+    int MergeDisk(unsigned queue_depth = 0, unsigned transfer_kb = 0);
+    int PrintMergeProgress();
+    int BackgroundMerge(bool enable, unsigned budget_kb_per_sec = 0);
+    int SetSplitWindow(unsigned window);
+    int PrintRemaps();
 
 private:
     int InstallDriver();
@@ -56,6 +56,10 @@ void diskf_free(void* p)
 NTSTATUS difi_start_tracking_device(struct filter_device_extension *dev_ext, BOOLEAN simulate)
 {
     dev_ext->simulate = simulate;
+
+    /* Lower device may not have been started when we attached */
+    if (!dev_ext->limits_known)
+        difi_query_lower_limits(dev_ext);
     
     /* Do it */
     DbgPrint("TRACKING device %u. Simulate: %d\n", dev_ext->dev_index, simulate);
@@ -70,6 +74,7 @@ NTSTATUS difi_stop_tracking_device_discard(struct filter_device_extension *dev_e
     DbgPrint("STOP TRACKING device %u.\n", dev_ext->dev_index);
     dev_ext->track_this = FALSE;
     disk_tracker_reset(dev_ext->remapper);
+    difi_checkpoint_journal(dev_ext);
 
     return STATUS_SUCCESS;
 }
@@ -146,7 +151,19 @@ NTSTATUS difi_driver_create_close(PDEVICE_OBJECT dev_obj, PIRP irp)
 VOID difi_driver_unload(__in PDRIVER_OBJECT drv_obj)
 {
     PDEVICE_OBJECT dev_obj = drv_obj->DeviceObject;        
+    unsigned       i;
     
+    for (i = 0; i < current_dev_ext; i++) {
+        if (filter_device_extensions[i].dev_ext != NULL) {
+            difi_stop_background_merge(filter_device_extensions[i].dev_ext);
+            difi_stop_merge(filter_device_extensions[i].dev_ext);
+            difi_close_journal(filter_device_extensions[i].dev_ext);
+            difi_destroy_packet_pool(filter_device_extensions[i].dev_ext);
+            difi_destroy_cpu_stats(filter_device_extensions[i].dev_ext);
+            difi_destroy_trace(filter_device_extensions[i].dev_ext);
+        }
+    }
+
     if ( dev_obj )
         IoDeleteDevice(dev_obj); 
 }
@@ -226,13 +243,22 @@ difi_add_or_init_storage(struct control_device_extension* control_dev_ext,
              info->sector_size, info->cluster_size);
 
     if(control_dev_ext->dev_ext->remapper == NULL) {
-        DbgPrint("Difi: initializing disk tracker");
+        /* A shard per CPU, writes on different CPUs rarely wait for each other */
+        unsigned shards = (unsigned)KeNumberProcessors;
+
+        if (shards > DISK_TRACKER_MAX_SHARDS)
+            shards = DISK_TRACKER_MAX_SHARDS;
+        DbgPrint("Difi: initializing disk tracker with %u shards", shards);
         control_dev_ext->dev_ext->remapper = 
-            disk_tracker_init(diskf_malloc, diskf_free, remap_stor);
+            disk_tracker_init_sharded(diskf_malloc, diskf_free, remap_stor, shards);
         if (control_dev_ext->dev_ext->remapper == NULL) {
             DbgPrint("difi: failed to allocate mapper");
             return STATUS_NO_MEMORY;
         }
+        /* Keep sequential writes sequential on storage, reads of them 
+           then need a single transfer */
+        disk_tracker_set_alloc_policy(control_dev_ext->dev_ext->remapper,
+                                      DISK_TRACKER_ALLOC_CONTIGUOUS);
     } else {
         if (force_reset) {
             DbgPrint("Resetting storage");
@@ -281,7 +307,7 @@ NTSTATUS difi_driver_ioctl(PDEVICE_OBJECT dev_obj, PIRP irp)
                 break;
             }
             stats = (struct ioctl_difi_stats*)irp->AssociatedIrp.SystemBuffer;
-            RtlCopyMemory(stats, &control_dev_ext->dev_ext->stats, sizeof(*stats));
+            difi_collect_stats(control_dev_ext->dev_ext, stats);
             if(control_dev_ext->dev_ext->remapper != NULL) {
                 disk_tracker_get_hash_size(control_dev_ext->dev_ext->remapper, 
                                            &stats->hash_size);
@@ -298,7 +324,13 @@ NTSTATUS difi_driver_ioctl(PDEVICE_OBJECT dev_obj, PIRP irp)
                      "  writes at PASSIVE  : %llu\n"
                      "  writes at APC      : %llu\n"
                      "  writes at DISPATCH : %llu\n"
-                     "  writes at other    : %llu\n",
+                     "  writes at other    : %llu\n"
+                     "  bytes read         : %llu\n"
+                     "  bytes written      : %llu\n"
+                     "  remapped bytes     : %llu\n"
+                     "  split requests     : %llu\n"
+                     "  split transfers    : %llu\n"
+                     "  passed through     : %llu\n",
                      stats->hash_size, 
                      stats->write_hits, 
                      stats->read_hits,
@@ -309,7 +341,13 @@ NTSTATUS difi_driver_ioctl(PDEVICE_OBJECT dev_obj, PIRP irp)
                      stats->per_irql_writes[0],
                      stats->per_irql_writes[1],
                      stats->per_irql_writes[2],
-                     stats->per_irql_writes[3]
+                     stats->per_irql_writes[3],
+                     stats->bytes_read,
+                     stats->bytes_written,
+                     stats->remapped_bytes,
+                     stats->split_irps,
+                     stats->split_transfers,
+                     stats->passed_through
                      );
             
             irp->IoStatus.Information = sizeof(*stats);
@@ -317,6 +355,38 @@ NTSTATUS difi_driver_ioctl(PDEVICE_OBJECT dev_obj, PIRP irp)
             break;
         }
 
+        case IOCTL_DIFI_GET_LATENCY_STATS:
+        {
+            if (irp_stack->Parameters.DeviceIoControl.OutputBufferLength <
+                sizeof(struct ioctl_difi_latency_stats)) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                DbgPrint("buffer is too small!");
+                break;
+            }
+            difi_collect_latency(control_dev_ext->dev_ext, 
+                                 (struct ioctl_difi_latency_stats*)irp->AssociatedIrp.SystemBuffer);
+            irp->IoStatus.Information = sizeof(struct ioctl_difi_latency_stats);
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        case IOCTL_DIFI_DRAIN_TRACE:
+        {
+            ULONG size = irp_stack->Parameters.DeviceIoControl.OutputBufferLength;
+
+            if (size < sizeof(struct ioctl_difi_trace)) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                DbgPrint("buffer is too small!");
+                break;
+            }
+            irp->IoStatus.Information = 
+                difi_drain_trace(control_dev_ext->dev_ext, 
+                                 (struct ioctl_difi_trace*)irp->AssociatedIrp.SystemBuffer,
+                                 size);
+            status = STATUS_SUCCESS;
+            break;
+        }
+
         case IOCTL_DIFI_INITIALIZE:
         {
             struct ioctl_difi_storage_info* info = NULL;
@@ -406,7 +476,125 @@ NTSTATUS difi_driver_ioctl(PDEVICE_OBJECT dev_obj, PIRP irp)
                 status = STATUS_UNSUCCESSFUL;
                 break;
             }
-            status = difi_stop_tracking_device_discard(control_dev_ext->dev_ext);
+            /* A background merge step in progress finishes first */
+            KeWaitForSingleObject(&control_dev_ext->dev_ext->merge_mutex, Executive, 
+                                  KernelMode, FALSE, NULL);
+            if (control_dev_ext->dev_ext->merge_result.state == DIFI_MERGE_RUNNING) {
+                /* The merge reads the remaps */
+                status = STATUS_DEVICE_BUSY;
+            } else {
+                status = difi_stop_tracking_device_discard(control_dev_ext->dev_ext);
+            }
+            KeReleaseMutex(&control_dev_ext->dev_ext->merge_mutex, FALSE);
+            break;
+        }
+
+        case IOCTL_DIFI_STOP_TRACKING_MERGE:
+        {
+            struct ioctl_difi_merge* params = NULL;
+
+            if (!control_dev_ext->dev_ext->track_this || 
+                control_dev_ext->dev_ext->simulate) {
+                DbgPrint("Not tracking this disk\n");
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+            /* Parameters are optional */
+            if (irp_stack->Parameters.DeviceIoControl.InputBufferLength >= 
+                sizeof(*params))
+                params = (struct ioctl_difi_merge*)irp->AssociatedIrp.SystemBuffer;
+            status = difi_start_merge(control_dev_ext->dev_ext, params);
+            DbgPrint("difi_start_merge: status %x\n", status);
+            break;
+        }
+
+        case IOCTL_DIFI_BACKGROUND_MERGE:
+        {
+            struct ioctl_difi_background_merge* params = NULL;
+
+            if (irp_stack->Parameters.DeviceIoControl.InputBufferLength <
+                sizeof(*params)) {
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+            params = (struct ioctl_difi_background_merge*)irp->AssociatedIrp.SystemBuffer;
+            if (!params->enable) {
+                difi_stop_background_merge(control_dev_ext->dev_ext);
+                status = STATUS_SUCCESS;
+                break;
+            }
+            if (!control_dev_ext->dev_ext->track_this || 
+                control_dev_ext->dev_ext->simulate) {
+                DbgPrint("Not tracking this disk\n");
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+            status = difi_start_background_merge(control_dev_ext->dev_ext, params);
+            DbgPrint("difi_start_background_merge: %u Kb/s status %x\n", 
+                     params->budget_kb_per_sec, status);
+            break;
+        }
+
+        case IOCTL_DIFI_SET_SPLIT_WINDOW:
+        {
+            struct ioctl_difi_split_window* params = NULL;
+            struct filter_device_extension* dev_ext = control_dev_ext->dev_ext;
+
+            if (irp_stack->Parameters.DeviceIoControl.InputBufferLength <
+                sizeof(*params)) {
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+            params = (struct ioctl_difi_split_window*)irp->AssociatedIrp.SystemBuffer;
+            /* Split IRPs in flight keep the window they started with */
+            dev_ext->split_window_set = min(params->window, PACKET_POOL_SIZE);
+            params->window = dev_ext->split_window_set > 0 ? dev_ext->split_window_set : 
+                                                             dev_ext->split_window;
+            DbgPrint("Device %u: split window %u\n", dev_ext->dev_index, params->window);
+            if (irp_stack->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(*params))
+                irp->IoStatus.Information = sizeof(*params);
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        case IOCTL_DIFI_GET_REMAPS:
+        {
+            struct ioctl_difi_remaps_query* query = NULL;
+            ULONG                           size, used = 0;
+            ulong64_t                       start_block;
+
+            size = irp_stack->Parameters.DeviceIoControl.OutputBufferLength;
+            if (irp_stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*query)) {
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+            if (size < sizeof(struct ioctl_difi_remaps)) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+            /* The output overwrites the query in the system buffer */
+            query = (struct ioctl_difi_remaps_query*)irp->AssociatedIrp.SystemBuffer;
+            start_block = query->start_block;
+            status = difi_get_remaps(control_dev_ext->dev_ext, start_block,
+                                     (struct ioctl_difi_remaps*)irp->AssociatedIrp.SystemBuffer,
+                                     size, &used);
+            irp->IoStatus.Information = used;
+            break;
+        }
+
+        case IOCTL_DIFI_GET_MERGE_PROGRESS:
+        {
+            struct ioctl_difi_merge_progress* progress = NULL;
+
+            if (irp_stack->Parameters.DeviceIoControl.OutputBufferLength <
+                sizeof(*progress)) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+            progress = (struct ioctl_difi_merge_progress*)irp->AssociatedIrp.SystemBuffer;
+            difi_get_merge_progress(control_dev_ext->dev_ext, progress);
+            irp->IoStatus.Information = sizeof(*progress);
+            status = STATUS_SUCCESS;
             break;
         }
 
@@ -433,6 +621,13 @@ NTSTATUS difi_driver_ioctl(PDEVICE_OBJECT dev_obj, PIRP irp)
                 break;
             }
 
+            if (control_dev_ext->dev_ext->journal != NULL) {
+                /* Test sector would overwrite the journal header */
+                DbgPrint("Unable to test storage with the journal open!\n");
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+
             disk_tracker_get_storage(control_dev_ext->dev_ext->remapper, &storage);
             if (storage == NULL) {
                 /* Cannot track disk without storage */
@@ -514,6 +709,22 @@ NTSTATUS difi_driver_ioctl(PDEVICE_OBJECT dev_obj, PIRP irp)
             break;
         }
 
+        case IOCTL_DIFI_OPEN_JOURNAL:
+        {
+            struct ioctl_difi_open_journal* params = NULL;
+
+            if (irp_stack->Parameters.DeviceIoControl.InputBufferLength <
+                sizeof(*params)) {
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+            params = (struct ioctl_difi_open_journal*)irp->AssociatedIrp.SystemBuffer;
+            status = difi_open_journal(control_dev_ext->dev_ext, params);
+            DbgPrint("difi_open_journal: %u blocks flags %x status %x\n", 
+                     params->journal_blocks, params->flags, status);
+            break;
+        }
+
         case IOCTL_DIFI_GET_INFO: 
         {
             struct ioctl_difi_diskf_info* info = NULL;
@@ -553,6 +764,31 @@ NTSTATUS difi_driver_ioctl(PDEVICE_OBJECT dev_obj, PIRP irp)
     return status;
 }
 
+/* 
+   Writes completed before a flush must survive a crash, with the remaps 
+   which send them to the storage. Flushes arrive at PASSIVE_LEVEL
+*/
+NTSTATUS difi_driver_flush(PDEVICE_OBJECT dev_obj, PIRP irp)
+{
+    NTSTATUS status;
+    struct common_device_data* dev_data = 
+        (struct common_device_data*)dev_obj->DeviceExtension;
+    struct filter_device_extension* dev_ext = 
+        (struct filter_device_extension*)dev_obj->DeviceExtension;
+
+    status = STATUS_SUCCESS;
+    if (dev_data->dev_type == DEVICE_TYPE_FILTER) {
+        if (dev_ext->journal == NULL || difi_commit_journal(dev_ext) == REMAP_JOURNAL_OK)
+            return difi_driver_send_to_next_driver(dev_obj, irp);
+        status = STATUS_IO_DEVICE_ERROR;
+    }
+
+    irp->IoStatus.Information = 0;
+    irp->IoStatus.Status = status;
+    IoCompleteRequest(irp, IO_NO_INCREMENT);
+    return status;
+}
+
 NTSTATUS difi_driver_shutdown(PDEVICE_OBJECT dev_obj, PIRP irp)
 {
     NTSTATUS status;
@@ -599,6 +835,278 @@ NTSTATUS difi_driver_power(PDEVICE_OBJECT dev_obj, PIRP irp)
 }
 
 
+static NTSTATUS
+query_lower_property(struct filter_device_extension* dev_ext,
+                     STORAGE_PROPERTY_ID property_id,
+                     PVOID buffer,
+                     ULONG size)
+{
+    STORAGE_PROPERTY_QUERY query;
+    IO_STATUS_BLOCK        io_status;
+    KEVENT                 event;
+    PIRP                   irp;
+    NTSTATUS               status;
+
+    RtlZeroMemory(&query, sizeof(query));
+    query.PropertyId = property_id;
+    query.QueryType = PropertyStandardQuery;
+    RtlZeroMemory(buffer, size);
+
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+    irp = IoBuildDeviceIoControlRequest(IOCTL_STORAGE_QUERY_PROPERTY,
+                                        dev_ext->target_device_obj,
+                                        &query, sizeof(query),
+                                        buffer, size,
+                                        FALSE, &event, &io_status);
+    if (irp == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    status = IoCallDriver(dev_ext->target_device_obj, irp);
+    if (status == STATUS_PENDING) {
+        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+        status = io_status.Status;
+    }
+    return status;
+}
+
+/*
+   Read what requests the lower stack takes without splitting them again
+   and set up transfer plan limits. Keeps the defaults (no limits) if the
+   adapter does not answer, the port driver splits requests then
+*/
+void difi_query_lower_limits(struct filter_device_extension* dev_ext)
+{
+    STORAGE_ADAPTER_DESCRIPTOR          adapter;
+    STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR alignment;
+    ULONG                               max_bytes;
+    NTSTATUS                            status;
+
+    status = query_lower_property(dev_ext, StorageAdapterProperty, 
+                                  &adapter, sizeof(adapter));
+    if (!NT_SUCCESS(status) || adapter.Size < sizeof(adapter)) {
+        DbgPrint("Device %u: no adapter properties: %x\n", dev_ext->dev_index, status);
+        return;
+    }
+
+    dev_ext->max_transfer_bytes = adapter.MaximumTransferLength;
+    dev_ext->max_physical_pages = adapter.MaximumPhysicalPages;
+
+    /* A buffer not starting on a page boundary spans one page more */
+    max_bytes = adapter.MaximumTransferLength;
+    if (adapter.MaximumPhysicalPages > 1 && 
+        adapter.MaximumPhysicalPages - 1 < max_bytes / PAGE_SIZE)
+        max_bytes = (adapter.MaximumPhysicalPages - 1) * PAGE_SIZE;
+    dev_ext->transfer_limits.max_blocks = max_bytes / BLOCK_SIZE;
+
+    /* Cut long runs on physical sector boundaries, not there before Windows 7 */
+    status = query_lower_property(dev_ext, StorageAccessAlignmentProperty, 
+                                  &alignment, sizeof(alignment));
+    if (NT_SUCCESS(status) && alignment.BytesPerPhysicalSector > BLOCK_SIZE)
+        dev_ext->transfer_limits.align_blocks = alignment.BytesPerPhysicalSector / BLOCK_SIZE;
+
+    /* Keeping many transfers in flight only helps if the adapter queues them */
+    if (!adapter.CommandQueueing)
+        dev_ext->split_window = 2;
+
+    dev_ext->limits_known = TRUE;
+
+    /* 
+       The alignment mask is only printed. Pieces start BLOCK_SIZE multiples
+       into the original buffer: with the masks adapters report, all below 
+       BLOCK_SIZE, they are as aligned as the request itself
+    */
+    DbgPrint("Device %u: max transfer %u, max pages %u, alignment mask %x, "
+             "split at %u blocks, window %u\n", 
+             dev_ext->dev_index, dev_ext->max_transfer_bytes, 
+             dev_ext->max_physical_pages, adapter.AlignmentMask,
+             dev_ext->transfer_limits.max_blocks, dev_ext->split_window);
+}
+
+
+void difi_create_cpu_stats(struct filter_device_extension* dev_ext)
+{
+    ULONG count = (ULONG)KeNumberProcessors;
+
+    dev_ext->cpu_stats = ExAllocatePoolWithTag(NonPagedPoolCacheAligned, 
+                                               count * sizeof(union difi_cpu_stats_slot),
+                                               'tsPC');
+    if (dev_ext->cpu_stats == NULL) {
+        /* Not fatal, processors share one slot and may lose counts */
+        DbgPrint("Failed to allocate per processor stats.\n");
+        dev_ext->cpu_stats = &dev_ext->fallback_stats;
+        count = 1;
+    }
+    RtlZeroMemory(dev_ext->cpu_stats, count * sizeof(union difi_cpu_stats_slot));
+    dev_ext->cpu_stats_count = count;
+}
+
+void difi_destroy_cpu_stats(struct filter_device_extension* dev_ext)
+{
+    if (dev_ext->cpu_stats != NULL && dev_ext->cpu_stats != &dev_ext->fallback_stats)
+        ExFreePool(dev_ext->cpu_stats);
+    dev_ext->cpu_stats = NULL;
+    dev_ext->cpu_stats_count = 0;
+}
+
+/* 
+   Adds up counters of all processors. Updates running meanwhile may be 
+   seen partially, every counter is still consistent on its own
+*/
+void difi_collect_stats(struct filter_device_extension* dev_ext, 
+                        struct ioctl_difi_stats* stats)
+{
+    ULONG i, j;
+
+    RtlZeroMemory(stats, sizeof(*stats));
+    for (i = 0; i < dev_ext->cpu_stats_count; i++) {
+        struct difi_cpu_stats* cpu_stats = &dev_ext->cpu_stats[i].counters;
+
+        for (j = 0; j < 4; j++) {
+            stats->per_irql_reads[j] += cpu_stats->reads_per_irql[j];
+            stats->per_irql_writes[j] += cpu_stats->writes_per_irql[j];
+        }
+        stats->read_hits += cpu_stats->read_hits;
+        stats->write_hits += cpu_stats->write_hits;
+        stats->bytes_read += cpu_stats->bytes_read;
+        stats->bytes_written += cpu_stats->bytes_written;
+        stats->remapped_bytes += cpu_stats->remapped_bytes;
+        stats->split_irps += cpu_stats->split_irps;
+        stats->split_transfers += cpu_stats->split_transfers;
+        stats->passed_through += cpu_stats->passed_through;
+    }
+}
+
+
+void difi_create_trace(struct filter_device_extension* dev_ext)
+{
+    KeInitializeSpinLock(&dev_ext->trace_drain_lock);
+    dev_ext->trace = trace_ring_create((unsigned)KeNumberProcessors,
+                                       TRACE_RECORDS_PER_CPU,
+                                       sizeof(struct ioctl_difi_trace_record),
+                                       diskf_malloc,
+                                       diskf_free);
+    if (dev_ext->trace == NULL) {
+        /* Not fatal, requests are not traced */
+        DbgPrint("Failed to create trace ring.\n");
+    }
+}
+
+void difi_destroy_trace(struct filter_device_extension* dev_ext)
+{
+    if (dev_ext->trace != NULL) {
+        trace_ring_destroy(dev_ext->trace);
+        dev_ext->trace = NULL;
+    }
+}
+
+/* Records are copied as is to user mode, x86 and x64 readers see one layout */
+C_ASSERT(sizeof(struct ioctl_difi_trace_record) == 32);
+
+/* Fills the buffer with records, returns its used size in bytes */
+ULONG difi_drain_trace(struct filter_device_extension* dev_ext, 
+                       struct ioctl_difi_trace* trace,
+                       ULONG buffer_size)
+{
+    ULONG         max_records;
+    ulong32_t     lost = 0;
+    LARGE_INTEGER frequency;
+    KIRQL         irql;
+
+    max_records = (buffer_size - FIELD_OFFSET(struct ioctl_difi_trace, records)) / 
+                  sizeof(struct ioctl_difi_trace_record);
+    KeQueryPerformanceCounter(&frequency);
+
+    RtlZeroMemory(trace, FIELD_OFFSET(struct ioctl_difi_trace, records));
+    trace->version = DIFI_TRACE_VERSION;
+    trace->frequency = (ULONGLONG)frequency.QuadPart;
+    if (dev_ext->trace != NULL) {
+        /* One reader at a time */
+        KeAcquireSpinLock(&dev_ext->trace_drain_lock, &irql);
+        trace->record_count = trace_ring_drain(dev_ext->trace, trace->records, 
+                                               max_records, &lost);
+        KeReleaseSpinLock(&dev_ext->trace_drain_lock, irql);
+    }
+    trace->lost = lost;
+    return FIELD_OFFSET(struct ioctl_difi_trace, records) + 
+           trace->record_count * sizeof(struct ioctl_difi_trace_record);
+}
+
+/* Runs are copied as is to user mode, x86 and x64 readers see one layout */
+C_ASSERT(sizeof(struct ioctl_difi_remap_run) == 24);
+
+/* 
+   Fills the buffer with runs from start_block on, a small page from the 
+   tracker at a time, so nothing depends on the size of the map
+*/
+NTSTATUS difi_get_remaps(struct filter_device_extension* dev_ext, 
+                         ulong64_t start_block,
+                         struct ioctl_difi_remaps* remaps,
+                         ULONG buffer_size,
+                         ULONG* used_size)
+{
+    struct disk_tracker_cursor* cursor;
+    struct disk_remap_run       runs[REMAPS_PAGE_RUNS];
+    ULONG                       max_runs, count, i;
+
+    max_runs = (buffer_size - FIELD_OFFSET(struct ioctl_difi_remaps, runs)) / 
+               sizeof(struct ioctl_difi_remap_run);
+    RtlZeroMemory(remaps, FIELD_OFFSET(struct ioctl_difi_remaps, runs));
+    remaps->next_block = start_block;
+    *used_size = FIELD_OFFSET(struct ioctl_difi_remaps, runs);
+    if (dev_ext->remapper == NULL)
+        return STATUS_SUCCESS;
+
+    cursor = disk_tracker_cursor_open(dev_ext->remapper, start_block);
+    if (cursor == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    while (remaps->run_count < max_runs) {
+        count = disk_tracker_cursor_next(cursor, runs, 
+                                         min(max_runs - remaps->run_count, REMAPS_PAGE_RUNS));
+        if (count == 0)
+            break;
+        for (i = 0; i < count; i++) {
+            struct ioctl_difi_remap_run* run = &remaps->runs[remaps->run_count++];
+
+            run->source_block = runs[i].source_block;
+            run->target_block = runs[i].target_block;
+            run->length_in_blocks = runs[i].length_in_blocks;
+            run->reserved = 0;
+        }
+    }
+    remaps->next_block = disk_tracker_cursor_position(cursor);
+    disk_tracker_cursor_close(cursor);
+
+    *used_size += remaps->run_count * sizeof(struct ioctl_difi_remap_run);
+    return STATUS_SUCCESS;
+}
+
+/* Rows of ioctl_difi_latency_stats are added up as histograms */
+C_ASSERT(DIFI_LATENCY_BUCKETS == HISTOGRAM_BUCKETS);
+C_ASSERT(sizeof(struct histogram) == DIFI_LATENCY_BUCKETS * sizeof(ULONGLONG));
+
+void difi_collect_latency(struct filter_device_extension* dev_ext, 
+                          struct ioctl_difi_latency_stats* latency)
+{
+    ULONG i, path;
+
+    RtlZeroMemory(latency, sizeof(*latency));
+    latency->size = sizeof(*latency);
+    latency->version = DIFI_LATENCY_STATS_VERSION;
+    latency->bucket_count = DIFI_LATENCY_BUCKETS;
+    latency->sub_bucket_bits = HISTOGRAM_SUB_BITS;
+    for (i = 0; i < dev_ext->cpu_stats_count; i++) {
+        struct difi_cpu_stats* cpu_stats = &dev_ext->cpu_stats[i].counters;
+
+        for (path = 0; path < DIFI_LATENCY_PATHS; path++) {
+            histogram_add((struct histogram*)latency->reads[path], 
+                          &cpu_stats->read_latency[path]);
+            histogram_add((struct histogram*)latency->writes[path], 
+                          &cpu_stats->write_latency[path]);
+        }
+    }
+}
+
+
 NTSTATUS difi_driver_add_device(PDRIVER_OBJECT driver_obj, 
                                    PDEVICE_OBJECT phys_dev_obj)
 {
@@ -641,6 +1149,11 @@ NTSTATUS difi_driver_add_device(PDRIVER_OBJECT driver_obj,
     dev_ext->device_obj = dev_obj;
 
     KeInitializeEvent(&dev_ext->irp_complete_ev, NotificationEvent, FALSE);
+    difi_create_packet_pool(dev_ext);
+    difi_create_cpu_stats(dev_ext);
+    difi_create_trace(dev_ext);
+    difi_init_merge(dev_ext);
+    dev_ext->split_window = DEFAULT_SPLIT_WINDOW;
 
     dev_obj->Flags &= ~DO_DEVICE_INITIALIZING;
     
@@ -652,6 +1165,9 @@ NTSTATUS difi_driver_add_device(PDRIVER_OBJECT driver_obj,
     if (!NT_SUCCESS(status)) 
     {   
         DbgPrint("Unable to create device control object!\n");
+        difi_destroy_packet_pool(dev_ext);
+        difi_destroy_cpu_stats(dev_ext);
+        difi_destroy_trace(dev_ext);
         IoDetachDevice(dev_ext->target_device_obj);
         IoDeleteDevice(dev_obj);
         return status;
@@ -665,6 +1181,7 @@ NTSTATUS difi_driver_add_device(PDRIVER_OBJECT driver_obj,
     /* Save filter device extension in global array for easy access later */
     dev_ext->dev_index = current_dev_ext++;
     filter_device_extensions[dev_ext->dev_index].dev_ext = dev_ext;
+    difi_query_lower_limits(dev_ext);
 
     control_dev_obj->Flags &= ~DO_DEVICE_INITIALIZING;
 
@@ -792,6 +1309,7 @@ NTSTATUS DriverEntry(__in PDRIVER_OBJECT driver_obj, __in PUNICODE_STRING  regis
     driver_obj->MajorFunction[IRP_MJ_CLEANUP]  = difi_driver_create_close;
     driver_obj->MajorFunction[IRP_MJ_READ]     = difi_driver_read;
     driver_obj->MajorFunction[IRP_MJ_WRITE]    = difi_driver_write;
+    driver_obj->MajorFunction[IRP_MJ_FLUSH_BUFFERS] = difi_driver_flush;
     driver_obj->MajorFunction[IRP_MJ_DEVICE_CONTROL] = difi_driver_ioctl;
     driver_obj->MajorFunction[IRP_MJ_SHUTDOWN] = difi_driver_shutdown;
     driver_obj->MajorFunction[IRP_MJ_PNP] = difi_driver_pnp;
@@ -26,9 +26,16 @@
 
 #include <ntddk.h>
 #include <Ntstrsafe.h >
+#include <ntddstor.h>
 
 #include "libcrt/hashtable.h"
 #include "libutil/disk_tracker.h"
+#include "libutil/histogram.h"
+#include "libutil/merge_engine.h"
+#include "libutil/object_pool.h"
+#include "libutil/remap_journal.h"
+#include "libutil/trace_ring.h"
+#include "libutil/transfer_plan.h"
 #include "diskfilter/difi_interface.h"
 
 // FIXME: should be part of the IOCTL!
@@ -53,6 +60,120 @@ struct transfer_packet
     PIRP    irp;
     PIRP    orig_irp;
     PMDL    partial_mdl;
+    struct filter_device_extension* dev_ext;
+    struct split_context*           split;   /* Original IRP state */
+};
+
+/*
+   Original IRP broken into several transfers. At most window transfers
+   are down at a time, completion of one sends the next
+*/
+struct split_context
+{
+    PIRP                            orig_irp;
+    struct filter_device_extension* dev_ext;
+    KSPIN_LOCK                      lock;
+    BOOLEAN                         issuing;        /* Some thread sends transfers */
+    ULONG                           window;
+    ULONG                           in_flight;
+    LARGE_INTEGER                   start;          /* Performance counter at dispatch */
+    ULONG                           io_slot;        /* From difi_io_begin */
+    ULONG                           next_transfer;
+    ULONG                           num_transfers;
+    NTSTATUS                        status;
+    ULONG_PTR                       information;
+    struct transfer                 transfers[1];   /* Must be last */
+};
+
+/* Transfers in flight per split IRP unless IOCTL_DIFI_SET_SPLIT_WINDOW sets it */
+#define DEFAULT_SPLIT_WINDOW        (8)
+
+/* 
+   Every filter device keeps packets with IRP and MDL allocated up front.
+   Pooled MDLs can describe up to PACKET_POOL_MAX_TRANSFER bytes, bigger
+   pieces and pieces arriving while the pool is empty are allocated 
+*/
+#define PACKET_POOL_SIZE            (64)
+#define PACKET_POOL_MAX_TRANSFER    (256 * 1024)
+
+/* Runs IOCTL_DIFI_GET_REMAPS takes from the tracker at a time */
+#define REMAPS_PAGE_RUNS            (16)
+
+/* Trace records kept per processor until drained */
+#define TRACE_RECORDS_PER_CPU       (1024)
+
+/* 
+   Remaps are journaled in the first blocks of the storage. A system thread
+   commits them every JOURNAL_COMMIT_INTERVAL_MS as one batch, a checkpoint
+   every JOURNAL_CHECKPOINT_INTERVAL_S keeps the log short. Flushes commit
+   as well. A batch is written once the writes which made its remaps are
+*/
+#define JOURNAL_BATCH_ENTRIES           (2048)
+#define JOURNAL_COMMIT_INTERVAL_MS      (10)
+#define JOURNAL_CHECKPOINT_INTERVAL_S   (600)
+
+/* 
+   Merge defaults: 256Kb requests, 16 of them buffered, 8 in flight. 
+   Smaller transfers are used if the lower device asks for them
+*/
+#define MERGE_QUEUE_DEPTH           (8)
+#define MERGE_TRANSFER_BLOCKS       (512)
+#define MERGE_WINDOW_TRANSFERS      (16)
+
+/* 
+   Background merge: a step copies the runs of one tracker chunk with small
+   requests, at most BACKGROUND_BUDGET_KB_PER_SEC on average. It waits while
+   more than BACKGROUND_BUSY_REQUESTS foreground requests are in flight
+*/
+#define BACKGROUND_STEP_BLOCKS          (2048)
+#define BACKGROUND_QUEUE_DEPTH          (2)
+#define BACKGROUND_TRANSFER_BLOCKS      (128)
+#define BACKGROUND_WINDOW_TRANSFERS     (16)
+#define BACKGROUND_BUDGET_KB_PER_SEC    (4096)
+#define BACKGROUND_IDLE_MS              (1000)
+#define BACKGROUND_BUSY_REQUESTS        (4)
+#define BACKGROUND_STEP_RUNS            (64)
+
+/* I/O of one merge engine: the merge which stops tracking or the background one */
+struct difi_merge_job
+{
+    struct filter_device_extension* dev_ext;
+    struct merge_engine*            engine;
+    KEVENT                          event;          /* A request completed */
+    ulong64_t                       next_block;     /* Source position */
+    struct disk_remap_run*          runs;           /* Of a background step */
+    unsigned                        run_count;
+    unsigned                        next_run;
+};
+
+/* 
+   Counters of one processor. Every processor updates its own slot at 
+   DISPATCH_LEVEL, IOCTL_DIFI_GET_STATS adds them up
+*/
+struct difi_cpu_stats
+{
+    ULONGLONG reads_per_irql[4];
+    ULONGLONG writes_per_irql[4];
+    ULONGLONG read_hits;            /* Remapped blocks found by reads */
+    ULONGLONG write_hits;           /* Blocks remapped by writes */
+    ULONGLONG bytes_read;
+    ULONGLONG bytes_written;
+    ULONGLONG remapped_bytes;       /* Bytes sent to the remap storage */
+    ULONGLONG split_irps;           /* Requests broken into several transfers */
+    ULONGLONG split_transfers;
+    ULONGLONG passed_through;       /* Requests sent down unchanged */
+    struct histogram read_latency[DIFI_LATENCY_PATHS];   /* Microseconds */
+    struct histogram write_latency[DIFI_LATENCY_PATHS];
+};
+
+#define STATS_CACHE_LINE            (64)
+
+/* Slots never share a cache line */
+union difi_cpu_stats_slot
+{
+    struct difi_cpu_stats counters;
+    UCHAR                 pad[(sizeof(struct difi_cpu_stats) + STATS_CACHE_LINE - 1) & 
+                              ~(STATS_CACHE_LINE - 1)];
 };
 
 enum device_type {
@@ -85,8 +206,46 @@ struct filter_device_extension
     int                 low_storage_percentage;
     KEVENT              need_more_storage_event;
     unsigned            dev_index;          /* Internal index */
+    struct object_pool* packet_pool;        /* Reusable transfer packets */
+    KSPIN_LOCK          packet_pool_lock;
+    ULONG               split_window;       /* Transfers in flight per split IRP */
+    ULONG               split_window_set;   /* From the IOCTL, 0 if not set */
+    struct transfer_limits transfer_limits; /* Lower device request limits */
+    BOOLEAN             limits_known;       /* Adapter properties were read */
+    ULONG               max_transfer_bytes; /* From the storage adapter descriptor */
+    ULONG               max_physical_pages;
     
-    struct ioctl_difi_stats stats;
+    union difi_cpu_stats_slot* cpu_stats;   /* One slot per processor */
+    ULONG               cpu_stats_count;
+    union difi_cpu_stats_slot  fallback_stats; /* Shared if slots were not allocated */
+    struct trace_ring*  trace;              /* Record per request, NULL if disabled */
+    KSPIN_LOCK          trace_drain_lock;
+
+    struct remap_journal* journal;          /* NULL if remaps are not saved */
+    struct remap_storage* journal_area;     /* Storage extents holding it */
+    struct disk_tracker_export journal_export; /* Checkpoint position */
+    PKTHREAD            journal_thread;
+    KEVENT              journal_stop_event;
+
+    /* Merge of remapped blocks back to the disk, see disk_filter_merge.c */
+    KSPIN_LOCK          merge_lock;
+    BOOLEAN             hold_writes;        /* Writes to hold_start..hold_end wait */
+    ulong64_t           hold_start;         /* Blocks */
+    ulong64_t           hold_end;
+    LIST_ENTRY          held_writes;
+    volatile LONG       io_slot;            /* Where new requests are counted */
+    volatile LONG       io_in_flight[2];    /* Dispatched and not completed */
+    KMUTEX              merge_mutex;        /* Holds and drains one at a time */
+    struct difi_merge_job merge;            /* Engine is non-NULL while a merge runs */
+    PKTHREAD            merge_thread;
+    struct ioctl_difi_merge_progress merge_result; /* Of the last finished merge */
+    struct difi_merge_job background;       /* Background merge, one step at a time */
+    PKTHREAD            background_thread;  /* Non-NULL while it is on */
+    KEVENT              background_stop_event;
+    ULONG               background_budget;  /* Kb per second */
+    ULONG               background_idle_ms;
+    ulong64_t           background_blocks;  /* Merged and unmapped */
+    ulong64_t           background_runs;
 };
 
 struct control_device_extension
@@ -114,6 +273,90 @@ void diskf_free(void* p);
 
 NTSTATUS difi_driver_read(PDEVICE_OBJECT dev_obj, PIRP irp);
 NTSTATUS difi_driver_write(PDEVICE_OBJECT dev_obj, PIRP irp);
+NTSTATUS difi_driver_flush(PDEVICE_OBJECT dev_obj, PIRP irp);
+
+void difi_query_lower_limits(struct filter_device_extension* dev_ext);
+void difi_create_cpu_stats(struct filter_device_extension* dev_ext);
+void difi_destroy_cpu_stats(struct filter_device_extension* dev_ext);
+void difi_create_trace(struct filter_device_extension* dev_ext);
+void difi_destroy_trace(struct filter_device_extension* dev_ext);
+ULONG difi_drain_trace(struct filter_device_extension* dev_ext, 
+                       struct ioctl_difi_trace* trace,
+                       ULONG buffer_size);
+void difi_collect_stats(struct filter_device_extension* dev_ext, 
+                        struct ioctl_difi_stats* stats);
+void difi_collect_latency(struct filter_device_extension* dev_ext, 
+                          struct ioctl_difi_latency_stats* latency);
+NTSTATUS difi_get_remaps(struct filter_device_extension* dev_ext, 
+                         ulong64_t start_block,
+                         struct ioctl_difi_remaps* remaps,
+                         ULONG buffer_size,
+                         ULONG* used_size);
+NTSTATUS difi_open_journal(struct filter_device_extension* dev_ext, 
+                           const struct ioctl_difi_open_journal* params);
+int difi_commit_journal(struct filter_device_extension* dev_ext);
+void difi_checkpoint_journal(struct filter_device_extension* dev_ext);
+void difi_close_journal(struct filter_device_extension* dev_ext);
+void difi_init_merge(struct filter_device_extension* dev_ext);
+NTSTATUS difi_start_merge(struct filter_device_extension* dev_ext, 
+                          const struct ioctl_difi_merge* params);
+void difi_get_merge_progress(struct filter_device_extension* dev_ext,
+                             struct ioctl_difi_merge_progress* progress);
+void difi_stop_merge(struct filter_device_extension* dev_ext);
+NTSTATUS difi_start_background_merge(struct filter_device_extension* dev_ext,
+                                     const struct ioctl_difi_background_merge* params);
+void difi_stop_background_merge(struct filter_device_extension* dev_ext);
+BOOLEAN difi_hold_write(struct filter_device_extension* dev_ext, PIRP irp);
+void difi_drain_io(struct filter_device_extension* dev_ext);
+NTSTATUS difi_stop_tracking_device_discard(struct filter_device_extension *dev_ext);
+void difi_create_packet_pool(struct filter_device_extension* dev_ext);
+void difi_destroy_packet_pool(struct filter_device_extension* dev_ext);
+
+/* 
+   Counters of the current processor, raises IRQL to DISPATCH_LEVEL so the 
+   thread is not moved to another processor while updating them. Returns 
+   the IRQL the caller runs at
+*/
+static __inline struct difi_cpu_stats*
+difi_stats_begin(struct filter_device_extension* dev_ext, KIRQL* irql)
+{
+    ULONG cpu;
+
+    *irql = KeGetCurrentIrql();
+    if (*irql < DISPATCH_LEVEL)
+        KeRaiseIrql(DISPATCH_LEVEL, irql);
+    cpu = KeGetCurrentProcessorNumber();
+    return &dev_ext->cpu_stats[cpu % dev_ext->cpu_stats_count].counters;
+}
+
+static __inline void
+difi_stats_end(KIRQL irql)
+{
+    if (irql < DISPATCH_LEVEL)
+        KeLowerIrql(irql);
+}
+
+#define STATS_IRQL_INDEX(irql) ((irql) < 3 ? (irql) : 3)
+
+/* 
+   Every request sent down is counted in the current slot until it 
+   completes. difi_drain_io switches the slot and waits for the old one
+   to empty, so requests which could see a remap are done afterwards
+*/
+static __inline ULONG
+difi_io_begin(struct filter_device_extension* dev_ext)
+{
+    ULONG slot = (ULONG)dev_ext->io_slot & 1;
+
+    InterlockedIncrement(&dev_ext->io_in_flight[slot]);
+    return slot;
+}
+
+static __inline void
+difi_io_end(struct filter_device_extension* dev_ext, ULONG slot)
+{
+    InterlockedDecrement(&dev_ext->io_in_flight[slot]);
+}
 
 
 #define DEEFEE_DISKF_DEVIOTYPE 0xA001
@@ -0,0 +1,409 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+  
+  Disk filter driver - remap journal on the storage
+*/
+#include "disk_filter.h"
+
+
+/* 
+   Offsets of the journal are relative to its area, which is the beginning 
+   of the storage. Transfers are split where storage extents end
+*/
+static int
+journal_transfer(struct filter_device_extension* dev_ext, 
+                 UCHAR          major,
+                 ulong64_t      offset,
+                 void*          buffer,
+                 unsigned       size)
+{
+    struct remap_storage* area = dev_ext->journal_area;
+    ulong64_t             block = offset / BLOCK_SIZE;
+    ulong32_t             i = 0;
+
+    while (size > 0) {
+        KEVENT          event;
+        IO_STATUS_BLOCK iosb;
+        LARGE_INTEGER   disk_offset;
+        PIRP            irp;
+        NTSTATUS        status;
+        ulong32_t       length;
+
+        /* Extent holding the block */
+        while (i < area->number_of_extents && block >= area->extents[i].length_in_blocks) {
+            block -= area->extents[i].length_in_blocks;
+            i++;
+        }
+        if (i == area->number_of_extents)
+            return -1;
+
+        length = area->extents[i].length_in_blocks - (ulong32_t)block;
+        if (length > size / BLOCK_SIZE)
+            length = size / BLOCK_SIZE;
+        disk_offset.QuadPart = (LONGLONG)((area->extents[i].start_block + block) * BLOCK_SIZE);
+
+        KeInitializeEvent(&event, NotificationEvent, FALSE);
+        irp = IoBuildSynchronousFsdRequest(major, dev_ext->target_device_obj, buffer,
+                                           length * BLOCK_SIZE, &disk_offset, 
+                                           &event, &iosb);
+        if (irp == NULL)
+            return -1;
+        status = IoCallDriver(dev_ext->target_device_obj, irp);
+        if (status == STATUS_PENDING) {
+            KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+            status = iosb.Status;
+        }
+        if (!NT_SUCCESS(status)) {
+            DbgPrint("difi: journal %s at block %llu failed: %x\n", 
+                     major == IRP_MJ_READ ? "read" : "write",
+                     area->extents[i].start_block + block, status);
+            return -1;
+        }
+
+        block += length;
+        buffer = (UCHAR*)buffer + length * BLOCK_SIZE;
+        size -= length * BLOCK_SIZE;
+    }
+    return 0;
+}
+
+static int
+journal_read(void* context, ulong64_t offset, void* buffer, unsigned size)
+{
+    return journal_transfer((struct filter_device_extension*)context, 
+                            IRP_MJ_READ, offset, buffer, size);
+}
+
+static int
+journal_write(void* context, ulong64_t offset, const void* buffer, unsigned size)
+{
+    return journal_transfer((struct filter_device_extension*)context, 
+                            IRP_MJ_WRITE, offset, (void*)buffer, size);
+}
+
+/* Push the disk write cache, a batch is durable only after it */
+static int
+journal_flush(void* context)
+{
+    struct filter_device_extension* dev_ext = (struct filter_device_extension*)context;
+    KEVENT                          event;
+    IO_STATUS_BLOCK                 iosb;
+    PIRP                            irp;
+    NTSTATUS                        status;
+
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+    irp = IoBuildSynchronousFsdRequest(IRP_MJ_FLUSH_BUFFERS, dev_ext->target_device_obj,
+                                       NULL, 0, NULL, &event, &iosb);
+    if (irp == NULL)
+        return -1;
+    status = IoCallDriver(dev_ext->target_device_obj, irp);
+    if (status == STATUS_PENDING) {
+        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+        status = iosb.Status;
+    }
+    return NT_SUCCESS(status) ? 0 : -1;
+}
+
+/* 
+   Requests which made the remaps being logged were counted before they 
+   were appended, the drain waits for their data. The journal is written
+   under merge_mutex, see difi_commit_journal
+*/
+static int
+journal_barrier(void* context)
+{
+    difi_drain_io((struct filter_device_extension*)context);
+    return 0;
+}
+
+/* Every current remap, for checkpoints */
+static unsigned
+journal_export(void* context, int restart, struct remap_journal_entry* entries, unsigned max)
+{
+    struct filter_device_extension* dev_ext = (struct filter_device_extension*)context;
+    struct disk_remap_run           runs[32];
+    unsigned                        count, i;
+
+    if (restart)
+        RtlZeroMemory(&dev_ext->journal_export, sizeof(dev_ext->journal_export));
+    count = disk_tracker_export_runs(dev_ext->remapper, &dev_ext->journal_export, 
+                                     runs, max < 32 ? max : 32);
+    for (i = 0; i < count; i++) {
+        entries[i].source_block = runs[i].source_block;
+        entries[i].target_block = runs[i].target_block;
+        entries[i].length_in_blocks = runs[i].length_in_blocks;
+        entries[i].op = REMAP_JOURNAL_MAP;
+    }
+    return count;
+}
+
+/* 
+   Runs under a shard spin lock, appending never blocks. The write is not
+   sent yet, journal_barrier keeps the entry off the disk until it is done
+*/
+static void
+journal_run_hook(void* context, const struct disk_remap_run* run)
+{
+    struct filter_device_extension* dev_ext = (struct filter_device_extension*)context;
+    struct remap_journal_entry      entry;
+    ulong64_t                       ticket;
+
+    entry.source_block = run->source_block;
+    entry.target_block = run->target_block;
+    entry.length_in_blocks = (uint32_t)run->length_in_blocks;
+    entry.op = REMAP_JOURNAL_MAP;
+    remap_journal_append(dev_ext->journal, &entry, &ticket);
+}
+
+static int
+journal_apply(void* context, const struct remap_journal_entry* entry)
+{
+    struct filter_device_extension* dev_ext = (struct filter_device_extension*)context;
+    struct disk_remap_run           run;
+    ulong32_t                       unmapped;
+
+    run.source_block = entry->source_block;
+    run.target_block = entry->target_block;
+    run.length_in_blocks = entry->length_in_blocks;
+    switch (entry->op) {
+        case REMAP_JOURNAL_MAP:
+            return disk_tracker_restore_run(dev_ext->remapper, &run);
+        case REMAP_JOURNAL_UNMAP:
+            /* Merged back by the background merge, the target is free again */
+            return disk_tracker_unmap_run(dev_ext->remapper, &run, 0, &unmapped);
+        default:
+            return -1;
+    }
+}
+
+/* 
+   Remaps made so far become durable after their data. The writer drains,
+   so it takes merge_mutex first: a merge step holding it may commit too.
+   PASSIVE_LEVEL
+*/
+int difi_commit_journal(struct filter_device_extension* dev_ext)
+{
+    int res = REMAP_JOURNAL_OK;
+
+    KeWaitForSingleObject(&dev_ext->merge_mutex, Executive, KernelMode, FALSE, NULL);
+    if (dev_ext->journal != NULL)
+        res = remap_journal_commit(dev_ext->journal, 
+                                   remap_journal_last_ticket(dev_ext->journal));
+    KeReleaseMutex(&dev_ext->merge_mutex, FALSE);
+    if (res != REMAP_JOURNAL_OK)
+        DbgPrint("difi: journal commit failed: %d\n", res);
+    return res;
+}
+
+/* 
+   Writes everything appended since the last pass as one batch, so all 
+   remaps made meanwhile share the write and the flush
+*/
+static VOID
+journal_thread(PVOID context)
+{
+    struct filter_device_extension* dev_ext = (struct filter_device_extension*)context;
+    LARGE_INTEGER                   timeout;
+    ULONGLONG                       last_checkpoint = KeQueryInterruptTime();
+    NTSTATUS                        status;
+
+    timeout.QuadPart = -(LONGLONG)JOURNAL_COMMIT_INTERVAL_MS * 10000;
+    do {
+        status = KeWaitForSingleObject(&dev_ext->journal_stop_event, Executive, 
+                                       KernelMode, FALSE, &timeout);
+        difi_commit_journal(dev_ext);
+
+        /* Bounds the replay time */
+        if (KeQueryInterruptTime() - last_checkpoint >= 
+            (ULONGLONG)JOURNAL_CHECKPOINT_INTERVAL_S * 10000000) {
+            difi_checkpoint_journal(dev_ext);
+            last_checkpoint = KeQueryInterruptTime();
+        }
+    } while (status == STATUS_TIMEOUT);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/* The first count extents of the area go back to remaps */
+static void
+unreserve_journal_area(struct filter_device_extension* dev_ext, 
+                       struct remap_storage* area,
+                       ulong32_t count)
+{
+    ulong32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (disk_tracker_unreserve_storage(dev_ext->remapper, 
+                                           &area->extents[i]) != DISK_TRACKER_OK)
+            DbgPrint("difi: journal blocks %I64u:%u stay reserved\n", 
+                     area->extents[i].start_block, area->extents[i].length_in_blocks);
+    }
+    disk_tracker_free_remap_storage(dev_ext->remapper, area);
+}
+
+/* The first blocks of the storage, taken out of use */
+static NTSTATUS
+reserve_journal_area(struct filter_device_extension* dev_ext, ULONG blocks)
+{
+    struct remap_storage* storage = NULL;
+    struct remap_storage* area;
+    ulong32_t             i, left = blocks;
+
+    disk_tracker_get_storage(dev_ext->remapper, &storage);
+    if (storage == NULL || storage->number_of_blocks < blocks)
+        return STATUS_INVALID_PARAMETER;
+
+    area = disk_tracker_alloc_remap_storage(dev_ext->remapper, storage->number_of_extents);
+    if (area == NULL)
+        return STATUS_NO_MEMORY;
+    area->number_of_blocks = blocks;
+    for (i = 0; i < storage->number_of_extents && left > 0; i++) {
+        area->extents[i] = storage->extents[i];
+        if (area->extents[i].length_in_blocks > left)
+            area->extents[i].length_in_blocks = left;
+        left -= area->extents[i].length_in_blocks;
+        if (disk_tracker_reserve_storage(dev_ext->remapper, 
+                                         &area->extents[i]) != DISK_TRACKER_OK) {
+            unreserve_journal_area(dev_ext, area, i);
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+    area->number_of_extents = i;
+    if (left > 0) {
+        unreserve_journal_area(dev_ext, area, i);
+        return STATUS_INVALID_PARAMETER;
+    }
+    dev_ext->journal_area = area;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS difi_open_journal(struct filter_device_extension* dev_ext, 
+                           const struct ioctl_difi_open_journal* params)
+{
+    struct remap_journal_io io;
+    HANDLE                  thread;
+    NTSTATUS                status;
+    int                     res;
+
+    if (dev_ext->remapper == NULL || dev_ext->journal != NULL || dev_ext->track_this ||
+        params->journal_blocks < REMAP_JOURNAL_MIN_BLOCKS)
+        return STATUS_INVALID_PARAMETER;
+
+    status = reserve_journal_area(dev_ext, params->journal_blocks);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("difi: unable to reserve %u journal blocks\n", params->journal_blocks);
+        return status;
+    }
+
+    io.context = dev_ext;
+    io.read_fn = journal_read;
+    io.write_fn = journal_write;
+    io.flush_fn = journal_flush;
+    io.barrier_fn = journal_barrier;
+    dev_ext->journal = remap_journal_create(&io, params->journal_blocks, 
+                                            JOURNAL_BATCH_ENTRIES,
+                                            journal_export, dev_ext,
+                                            diskf_malloc, diskf_free);
+    if (dev_ext->journal == NULL) {
+        status = STATUS_NO_MEMORY;
+        goto failed;
+    }
+
+    KeWaitForSingleObject(&dev_ext->merge_mutex, Executive, KernelMode, FALSE, NULL);
+    if (params->flags & DIFI_JOURNAL_REPLAY) {
+        res = remap_journal_replay(dev_ext->journal, journal_apply, dev_ext);
+        DbgPrint("difi: journal replay: %d\n", res);
+        /* Replayed remaps go to a fresh log */
+        if (res == REMAP_JOURNAL_OK)
+            res = remap_journal_checkpoint(dev_ext->journal);
+    } else {
+        res = remap_journal_format(dev_ext->journal);
+    }
+    KeReleaseMutex(&dev_ext->merge_mutex, FALSE);
+    if (res != REMAP_JOURNAL_OK) {
+        status = res == REMAP_JOURNAL_NO_MEMORY ? STATUS_NO_MEMORY : STATUS_DISK_CORRUPT_ERROR;
+        goto failed;
+    }
+
+    KeInitializeEvent(&dev_ext->journal_stop_event, NotificationEvent, FALSE);
+    status = PsCreateSystemThread(&thread, THREAD_ALL_ACCESS, NULL, NULL, NULL, 
+                                  journal_thread, dev_ext);
+    if (!NT_SUCCESS(status))
+        goto failed;
+    ObReferenceObjectByHandle(thread, THREAD_ALL_ACCESS, NULL, KernelMode, 
+                              (PVOID*)&dev_ext->journal_thread, NULL);
+    ZwClose(thread);
+
+    disk_tracker_set_run_hook(dev_ext->remapper, journal_run_hook, dev_ext);
+    return STATUS_SUCCESS;
+
+failed:
+    if (dev_ext->journal != NULL)
+        remap_journal_destroy(dev_ext->journal);
+    dev_ext->journal = NULL;
+    /* Remaps of a replay cut short are not all there, none stay */
+    if (params->flags & DIFI_JOURNAL_REPLAY)
+        disk_tracker_reset(dev_ext->remapper);
+    /* The journal may be opened again, it reserves the blocks anew */
+    unreserve_journal_area(dev_ext, dev_ext->journal_area, 
+                           dev_ext->journal_area->number_of_extents);
+    dev_ext->journal_area = NULL;
+    return status;
+}
+
+/* After a reset nothing is mapped, the log starts over empty. PASSIVE_LEVEL */
+void difi_checkpoint_journal(struct filter_device_extension* dev_ext)
+{
+    int res = REMAP_JOURNAL_OK;
+
+    KeWaitForSingleObject(&dev_ext->merge_mutex, Executive, KernelMode, FALSE, NULL);
+    if (dev_ext->journal != NULL)
+        res = remap_journal_checkpoint(dev_ext->journal);
+    KeReleaseMutex(&dev_ext->merge_mutex, FALSE);
+    if (res != REMAP_JOURNAL_OK)
+        DbgPrint("difi: journal checkpoint failed: %d\n", res);
+}
+
+void difi_close_journal(struct filter_device_extension* dev_ext)
+{
+    struct remap_journal* journal;
+
+    if (dev_ext->journal == NULL)
+        return;
+
+    disk_tracker_set_run_hook(dev_ext->remapper, NULL, NULL);
+    if (dev_ext->journal_thread != NULL) {
+        /* The thread commits what is left on the way out */
+        KeSetEvent(&dev_ext->journal_stop_event, IO_NO_INCREMENT, FALSE);
+        KeWaitForSingleObject(dev_ext->journal_thread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(dev_ext->journal_thread);
+        dev_ext->journal_thread = NULL;
+    }
+    /* Flushes commit under the mutex */
+    KeWaitForSingleObject(&dev_ext->merge_mutex, Executive, KernelMode, FALSE, NULL);
+    journal = dev_ext->journal;
+    dev_ext->journal = NULL;
+    KeReleaseMutex(&dev_ext->merge_mutex, FALSE);
+    remap_journal_destroy(journal);
+    unreserve_journal_area(dev_ext, dev_ext->journal_area, 
+                           dev_ext->journal_area->number_of_extents);
+    dev_ext->journal_area = NULL;
+}
@@ -0,0 +1,644 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+  
+  Disk filter driver - merge of remapped blocks back to the disk
+*/
+#include "disk_filter.h"
+
+
+void difi_init_merge(struct filter_device_extension* dev_ext)
+{
+    KeInitializeSpinLock(&dev_ext->merge_lock);
+    InitializeListHead(&dev_ext->held_writes);
+    KeInitializeMutex(&dev_ext->merge_mutex, 0);
+    dev_ext->merge.dev_ext = dev_ext;
+    KeInitializeEvent(&dev_ext->merge.event, SynchronizationEvent, FALSE);
+    dev_ext->background.dev_ext = dev_ext;
+    KeInitializeEvent(&dev_ext->background.event, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&dev_ext->background_stop_event, NotificationEvent, FALSE);
+}
+
+/* 
+   Queue the write while a merge copies the blocks it goes to. Returns 
+   FALSE if it goes elsewhere or the merge has finished meanwhile, the 
+   write then goes on as usual
+*/
+BOOLEAN difi_hold_write(struct filter_device_extension* dev_ext, PIRP irp)
+{
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+    ulong64_t          start, end;
+    BOOLEAN            held = FALSE;
+    KIRQL              irql;
+
+    start = (ulong64_t)stack->Parameters.Write.ByteOffset.QuadPart / BLOCK_SIZE;
+    end = start + (stack->Parameters.Write.Length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    KeAcquireSpinLock(&dev_ext->merge_lock, &irql);
+    if (dev_ext->hold_writes && start < dev_ext->hold_end && end > dev_ext->hold_start) {
+        IoMarkIrpPending(irp);
+        InsertTailList(&dev_ext->held_writes, &irp->Tail.Overlay.ListEntry);
+        held = TRUE;
+    }
+    KeReleaseSpinLock(&dev_ext->merge_lock, irql);
+    return held;
+}
+
+/* Writes to start..end wait from now on, difi_drain_io waits for those already sent */
+static void
+hold_range(struct filter_device_extension* dev_ext, ulong64_t start, ulong64_t end)
+{
+    KIRQL irql;
+
+    KeAcquireSpinLock(&dev_ext->merge_lock, &irql);
+    dev_ext->hold_start = start;
+    dev_ext->hold_end = end;
+    dev_ext->hold_writes = TRUE;
+    KeReleaseSpinLock(&dev_ext->merge_lock, irql);
+}
+
+/* 
+   Requests dispatched before the call are complete on return. New ones go
+   to the other slot meanwhile. Callers hold merge_mutex: PASSIVE_LEVEL
+*/
+void difi_drain_io(struct filter_device_extension* dev_ext)
+{
+    LARGE_INTEGER delay;
+    LONG          old_slot;
+
+    old_slot = InterlockedExchange(&dev_ext->io_slot, (dev_ext->io_slot & 1) ^ 1);
+    delay.QuadPart = -10000;    /* 1 ms */
+    while (dev_ext->io_in_flight[old_slot & 1] > 0)
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+}
+
+/* Held writes are dispatched again, after the merge is done with their blocks */
+static void
+release_writes(struct filter_device_extension* dev_ext)
+{
+    LIST_ENTRY held;
+    KIRQL      irql;
+
+    InitializeListHead(&held);
+    KeAcquireSpinLock(&dev_ext->merge_lock, &irql);
+    dev_ext->hold_writes = FALSE;
+    if (!IsListEmpty(&dev_ext->held_writes)) {
+        /* Move the whole list */
+        held = dev_ext->held_writes;
+        held.Flink->Blink = &held;
+        held.Blink->Flink = &held;
+        InitializeListHead(&dev_ext->held_writes);
+    }
+    KeReleaseSpinLock(&dev_ext->merge_lock, irql);
+
+    while (!IsListEmpty(&held)) {
+        PLIST_ENTRY entry = RemoveHeadList(&held);
+        PIRP        irp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+
+        difi_driver_write(dev_ext->device_obj, irp);
+    }
+}
+
+static NTSTATUS
+merge_completion(IN PDEVICE_OBJECT dev_obj, IN PIRP irp, IN PVOID context)
+{
+    struct merge_request*  request = (struct merge_request*)context;
+    struct difi_merge_job* job = (struct difi_merge_job*)request->io_context;
+    int                    status = NT_SUCCESS(irp->IoStatus.Status) ? 0 : -1;
+
+    dev_obj;
+    IoFreeMdl(irp->MdlAddress);
+    irp->MdlAddress = NULL;
+    IoFreeIrp(irp);
+
+    merge_engine_complete(job->engine, request, status);
+    KeSetEvent(&job->event, IO_NO_INCREMENT, FALSE);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+/* Reads and writes both go to the lower device: the storage is a file on the disk */
+static int
+merge_submit(void* context, struct merge_request* request)
+{
+    struct difi_merge_job*          job = (struct difi_merge_job*)context;
+    PDEVICE_OBJECT                  target = job->dev_ext->target_device_obj;
+    ULONG                           length = request->length_in_blocks * BLOCK_SIZE;
+    PIO_STACK_LOCATION              next_stack;
+    PIRP                            irp;
+    PMDL                            mdl;
+
+    irp = IoAllocateIrp(target->StackSize, FALSE);
+    if (irp == NULL)
+        return -1;
+    mdl = IoAllocateMdl(request->buffer, length, FALSE, FALSE, NULL);
+    if (mdl == NULL) {
+        IoFreeIrp(irp);
+        return -1;
+    }
+    MmBuildMdlForNonPagedPool(mdl);
+
+    irp->MdlAddress = mdl;
+    irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    next_stack = IoGetNextIrpStackLocation(irp);
+    next_stack->MajorFunction = request->op == MERGE_OP_READ ? IRP_MJ_READ : IRP_MJ_WRITE;
+    next_stack->DeviceObject = target;
+    /* Read and Write parameters share the layout */
+    next_stack->Parameters.Write.Length = length;
+    next_stack->Parameters.Write.ByteOffset.QuadPart = (LONGLONG)(request->block * BLOCK_SIZE);
+
+    request->io_context = job;
+    IoSetCompletionRoutine(irp, merge_completion, request, TRUE, TRUE, TRUE);
+    IoCallDriver(target, irp);
+    return 0;
+}
+
+static void
+merge_wait(void* context)
+{
+    struct difi_merge_job* job = (struct difi_merge_job*)context;
+
+    KeWaitForSingleObject(&job->event, Executive, KernelMode, FALSE, NULL);
+}
+
+static int
+merge_flush(void* context)
+{
+    struct filter_device_extension* dev_ext = ((struct difi_merge_job*)context)->dev_ext;
+    KEVENT                          event;
+    IO_STATUS_BLOCK                 iosb;
+    PIRP                            irp;
+    NTSTATUS                        status;
+
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+    irp = IoBuildSynchronousFsdRequest(IRP_MJ_FLUSH_BUFFERS, dev_ext->target_device_obj,
+                                       NULL, 0, NULL, &event, &iosb);
+    if (irp == NULL)
+        return -1;
+    status = IoCallDriver(dev_ext->target_device_obj, irp);
+    if (status == STATUS_PENDING) {
+        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+        status = iosb.Status;
+    }
+    return NT_SUCCESS(status) ? 0 : -1;
+}
+
+/* Runs in source order, a page at a time */
+static unsigned
+merge_source(void* context, struct disk_remap_run* runs, unsigned max)
+{
+    struct difi_merge_job* job = (struct difi_merge_job*)context;
+
+    return disk_tracker_export_sorted_runs(job->dev_ext->remapper, &job->next_block,
+                                           runs, max);
+}
+
+/* Runs of the current background step */
+static unsigned
+step_source(void* context, struct disk_remap_run* runs, unsigned max)
+{
+    struct difi_merge_job* job = (struct difi_merge_job*)context;
+    unsigned               count = job->run_count - job->next_run;
+
+    if (count > max)
+        count = max;
+    RtlCopyMemory(runs, &job->runs[job->next_run], count * sizeof(*runs));
+    job->next_run += count;
+    return count;
+}
+
+static void
+init_merge_io(struct difi_merge_job* job, struct merge_io* io)
+{
+    io->context = job;
+    io->submit_fn = merge_submit;
+    io->wait_fn = merge_wait;
+    io->flush_fn = merge_flush;
+}
+
+static void
+save_progress(struct filter_device_extension* dev_ext, 
+              struct ioctl_difi_merge_progress* out)
+{
+    struct merge_progress progress;
+
+    merge_engine_get_progress(dev_ext->merge.engine, &progress);
+    RtlZeroMemory(out, sizeof(*out));
+    out->size = sizeof(*out);
+    out->state = progress.done ? DIFI_MERGE_DONE : DIFI_MERGE_RUNNING;
+    out->total_blocks = progress.total_blocks;
+    out->blocks_read = progress.blocks_read;
+    out->blocks_written = progress.blocks_written;
+    out->runs = progress.runs;
+    out->requests = progress.reads + progress.writes;
+    out->background_blocks = dev_ext->background_blocks;
+    out->background_runs = dev_ext->background_runs;
+    switch (progress.status) {
+        case MERGE_ENGINE_OK:        out->status = STATUS_SUCCESS;       break;
+        case MERGE_ENGINE_CANCELLED: out->status = STATUS_CANCELLED;     break;
+        default:                     out->status = STATUS_IO_DEVICE_ERROR; break;
+    }
+}
+
+static VOID
+merge_thread(PVOID context)
+{
+    struct filter_device_extension* dev_ext = (struct filter_device_extension*)context;
+    struct ioctl_difi_merge_progress result;
+    KIRQL                           irql;
+    int                             status;
+
+    /* Remaps of writes sent before the hold must reach the storage first */
+    KeWaitForSingleObject(&dev_ext->merge_mutex, Executive, KernelMode, FALSE, NULL);
+    difi_drain_io(dev_ext);
+    KeReleaseMutex(&dev_ext->merge_mutex, FALSE);
+
+    status = merge_engine_run(dev_ext->merge.engine);
+    DbgPrint("difi: merge of device %u finished: %d\n", dev_ext->dev_index, status);
+
+    /* Every remapped block is on the disk now. Otherwise the remaps stay valid */
+    if (status == MERGE_ENGINE_OK)
+        difi_stop_tracking_device_discard(dev_ext);
+    release_writes(dev_ext);
+
+    save_progress(dev_ext, &result);
+    KeAcquireSpinLock(&dev_ext->merge_lock, &irql);
+    dev_ext->merge_result = result;
+    KeReleaseSpinLock(&dev_ext->merge_lock, irql);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/* Thread of a finished merge is waited for, its engine destroyed */
+static void
+reap_merge(struct filter_device_extension* dev_ext)
+{
+    if (dev_ext->merge_thread == NULL)
+        return;
+    KeWaitForSingleObject(dev_ext->merge_thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(dev_ext->merge_thread);
+    dev_ext->merge_thread = NULL;
+    merge_engine_destroy(dev_ext->merge.engine);
+    dev_ext->merge.engine = NULL;
+}
+
+static NTSTATUS
+start_merge(struct filter_device_extension* dev_ext, const struct ioctl_difi_merge* params)
+{
+    struct merge_params merge_params;
+    struct merge_io     io;
+    unsigned            remapped = 0;
+    HANDLE              thread;
+    NTSTATUS            status;
+
+    if (dev_ext->merge.engine != NULL && dev_ext->merge_result.state != DIFI_MERGE_DONE)
+        return STATUS_DEVICE_BUSY;
+    reap_merge(dev_ext);
+
+    merge_params.queue_depth = MERGE_QUEUE_DEPTH;
+    merge_params.transfer_blocks = MERGE_TRANSFER_BLOCKS;
+    merge_params.window_transfers = MERGE_WINDOW_TRANSFERS;
+    if (params != NULL) {
+        if (params->queue_depth != 0)
+            merge_params.queue_depth = params->queue_depth;
+        if (params->transfer_kb != 0)
+            merge_params.transfer_blocks = params->transfer_kb * 1024 / BLOCK_SIZE;
+        if (params->window_transfers != 0)
+            merge_params.window_transfers = params->window_transfers;
+    }
+    if (dev_ext->transfer_limits.max_blocks != 0 && 
+        merge_params.transfer_blocks > dev_ext->transfer_limits.max_blocks)
+        merge_params.transfer_blocks = dev_ext->transfer_limits.max_blocks;
+    if (merge_params.transfer_blocks == 0 || merge_params.queue_depth > 256 ||
+        (ulong64_t)merge_params.transfer_blocks * merge_params.window_transfers > 
+        64 * 1024 * 1024 / BLOCK_SIZE)
+        return STATUS_INVALID_PARAMETER;
+
+    init_merge_io(&dev_ext->merge, &io);
+    disk_tracker_get_hash_size(dev_ext->remapper, &remapped);
+    dev_ext->merge.next_block = 0;
+    dev_ext->merge.engine = merge_engine_create(&merge_params, &io, merge_source, 
+                                                &dev_ext->merge, remapped, 
+                                                diskf_malloc, diskf_free);
+    if (dev_ext->merge.engine == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    KeClearEvent(&dev_ext->merge.event);
+    dev_ext->merge_result.state = DIFI_MERGE_RUNNING;
+
+    /* From now on all writes wait, the thread waits for those already sent */
+    hold_range(dev_ext, 0, ~(ulong64_t)0);
+
+    status = PsCreateSystemThread(&thread, THREAD_ALL_ACCESS, NULL, NULL, NULL, 
+                                  merge_thread, dev_ext);
+    if (!NT_SUCCESS(status)) {
+        release_writes(dev_ext);
+        merge_engine_destroy(dev_ext->merge.engine);
+        dev_ext->merge.engine = NULL;
+        dev_ext->merge_result.state = DIFI_MERGE_IDLE;
+        return status;
+    }
+    ObReferenceObjectByHandle(thread, THREAD_ALL_ACCESS, NULL, KernelMode, 
+                              (PVOID*)&dev_ext->merge_thread, NULL);
+    ZwClose(thread);
+    return STATUS_SUCCESS;
+}
+
+/* A background step in progress finishes first */
+NTSTATUS difi_start_merge(struct filter_device_extension* dev_ext, 
+                          const struct ioctl_difi_merge* params)
+{
+    NTSTATUS status;
+
+    KeWaitForSingleObject(&dev_ext->merge_mutex, Executive, KernelMode, FALSE, NULL);
+    status = start_merge(dev_ext, params);
+    KeReleaseMutex(&dev_ext->merge_mutex, FALSE);
+    return status;
+}
+
+void difi_get_merge_progress(struct filter_device_extension* dev_ext,
+                             struct ioctl_difi_merge_progress* progress)
+{
+    KIRQL irql;
+
+    KeAcquireSpinLock(&dev_ext->merge_lock, &irql);
+    *progress = dev_ext->merge_result;
+    KeReleaseSpinLock(&dev_ext->merge_lock, irql);
+    progress->size = sizeof(*progress);
+    progress->background_blocks = dev_ext->background_blocks;
+    progress->background_runs = dev_ext->background_runs;
+
+    /* The engine counts while it runs */
+    if (progress->state == DIFI_MERGE_RUNNING && dev_ext->merge.engine != NULL)
+        save_progress(dev_ext, progress);
+}
+
+/* On unload: a running merge stops after the requests in flight */
+void difi_stop_merge(struct filter_device_extension* dev_ext)
+{
+    if (dev_ext->merge.engine != NULL)
+        merge_engine_cancel(dev_ext->merge.engine);
+    reap_merge(dev_ext);
+}
+
+
+/* 
+   Remaps of the step are on the disk: forget them. Their targets are given
+   back once the unmaps are durable and no request sent before may read 
+   them, so neither a crash nor a late read finds them reused
+*/
+static ulong32_t
+unmap_step(struct filter_device_extension* dev_ext)
+{
+    struct difi_merge_job* job = &dev_ext->background;
+    struct remap_journal_entry entry;
+    struct disk_extent     target;
+    ulong64_t              ticket = 0;
+    ulong32_t              merged = 0, unmapped;
+    unsigned               i, count = 0;
+    int                    res;
+
+    for (i = 0; i < job->run_count; i++) {
+        res = disk_tracker_unmap_run(dev_ext->remapper, &job->runs[i], 1, &unmapped);
+        if (res != DISK_TRACKER_OK || unmapped == 0)
+            continue;
+        merged += unmapped;
+
+        /* 
+           Writes to the step are held, those sent before were drained and 
+           merge_mutex keeps resets and full merges out: the map there is 
+           still as exported and the whole run goes. Targets of a run gone 
+           in part are not told from the ones in use and can't be given back
+        */
+        if (unmapped != job->runs[i].length_in_blocks) {
+            DbgPrint("difi: run %I64u:%u unmapped in part, %u blocks of storage lost\n",
+                     job->runs[i].source_block, job->runs[i].length_in_blocks, unmapped);
+            ASSERT(unmapped == job->runs[i].length_in_blocks);
+        }
+
+        /* 
+           Replay skips blocks not mapped to the run's target, as the unmap
+           did, and frees the targets the release below gives back
+        */
+        if (dev_ext->journal != NULL) {
+            entry.source_block = job->runs[i].source_block;
+            entry.target_block = job->runs[i].target_block;
+            entry.length_in_blocks = (uint32_t)job->runs[i].length_in_blocks;
+            entry.op = REMAP_JOURNAL_UNMAP;
+            remap_journal_append(dev_ext->journal, &entry, &ticket);
+        }
+        if (unmapped == job->runs[i].length_in_blocks)
+            job->runs[count++] = job->runs[i];
+    }
+
+    if (dev_ext->journal != NULL && ticket != 0) {
+        res = remap_journal_commit(dev_ext->journal, ticket);
+        if (res != REMAP_JOURNAL_OK) {
+            /* Replay may still map the blocks there, the targets stay in use */
+            DbgPrint("difi: journal commit of unmaps failed: %d\n", res);
+            return merged;
+        }
+    }
+
+    difi_drain_io(dev_ext);
+    for (i = 0; i < count; i++) {
+        target.start_block = job->runs[i].target_block;
+        target.length_in_blocks = job->runs[i].length_in_blocks;
+        disk_tracker_release_storage(dev_ext->remapper, &target);
+    }
+    dev_ext->background_runs += count;
+    return merged;
+}
+
+/* 
+   Copy the runs from the position on, up to BACKGROUND_STEP_BLOCKS of the
+   source, back to the disk and unmap them. Writes there wait meanwhile. 
+   Returns FALSE if there was nothing to copy
+*/
+static BOOLEAN
+background_step(struct filter_device_extension* dev_ext, ulong32_t* merged)
+{
+    struct difi_merge_job* job = &dev_ext->background;
+    ulong64_t              start, end;
+    unsigned               count, i;
+    int                    res;
+
+    *merged = 0;
+    if (!dev_ext->track_this || dev_ext->simulate || dev_ext->remapper == NULL ||
+        dev_ext->merge_result.state == DIFI_MERGE_RUNNING)
+        return FALSE;
+
+    /* The first run from the position on, from the start after the last one */
+    start = job->next_block;
+    if (disk_tracker_export_sorted_runs(dev_ext->remapper, &start, job->runs, 1) == 0) {
+        start = 0;
+        if (disk_tracker_export_sorted_runs(dev_ext->remapper, &start, job->runs, 1) == 0)
+            return FALSE;
+    }
+    start = job->runs[0].source_block;
+    end = start + BACKGROUND_STEP_BLOCKS;
+
+    /* Writes which missed the hold are done after the drain, the runs stay put */
+    hold_range(dev_ext, start, end);
+    difi_drain_io(dev_ext);
+
+    job->next_block = start;
+    count = disk_tracker_export_sorted_runs(dev_ext->remapper, &job->next_block, 
+                                            job->runs, BACKGROUND_STEP_RUNS);
+    for (i = 0; i < count && job->runs[i].source_block < end; i++) {
+        if (job->runs[i].source_block + job->runs[i].length_in_blocks > end)
+            job->runs[i].length_in_blocks = (ulong32_t)(end - job->runs[i].source_block);
+    }
+    job->run_count = i;
+    job->next_run = 0;
+    /* The rest of a crowded range is left to the next step */
+    if (i == BACKGROUND_STEP_RUNS)
+        end = job->runs[i - 1].source_block + job->runs[i - 1].length_in_blocks;
+    job->next_block = end;
+
+    merge_engine_rewind(job->engine);
+    res = merge_engine_run(job->engine);
+    if (res == MERGE_ENGINE_OK)
+        *merged = unmap_step(dev_ext);
+    else
+        DbgPrint("difi: background merge of %I64u:%u failed: %d\n", 
+                 start, (ULONG)(end - start), res);
+    release_writes(dev_ext);
+
+    dev_ext->background_blocks += *merged;
+    return TRUE;
+}
+
+/* 
+   Copies a step whenever the budget allows and the disk is not busy. The
+   budget is a token bucket holding at most one second worth of Kb. Tokens
+   are Kb times the 100ns units of the interrupt time, so none get lost
+*/
+#define TOKENS_PER_KB   (10000000)
+
+static VOID
+background_thread(PVOID context)
+{
+    struct filter_device_extension* dev_ext = (struct filter_device_extension*)context;
+    LARGE_INTEGER                   timeout;
+    ULONGLONG                       last = KeQueryInterruptTime(), now;
+    LONGLONG                        tokens = 0;
+    LONGLONG                        budget = dev_ext->background_budget;
+    ULONG                           pause_ms;
+    ulong32_t                       merged;
+    BOOLEAN                         worked;
+
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_PRIORITY + 1);
+    for (;;) {
+        now = KeQueryInterruptTime();
+        tokens += (LONGLONG)(now - last) * budget;
+        if (tokens > budget * TOKENS_PER_KB)
+            tokens = budget * TOKENS_PER_KB;
+        last = now;
+
+        if (tokens <= 0) {
+            /* Until the debt is paid */
+            pause_ms = (ULONG)(-tokens / (budget * (TOKENS_PER_KB / 1000)) + 1);
+        } else if (dev_ext->io_in_flight[0] + dev_ext->io_in_flight[1] > 
+                   BACKGROUND_BUSY_REQUESTS) {
+            pause_ms = 10;
+        } else {
+            KeWaitForSingleObject(&dev_ext->merge_mutex, Executive, KernelMode, FALSE, NULL);
+            worked = background_step(dev_ext, &merged);
+            KeReleaseMutex(&dev_ext->merge_mutex, FALSE);
+            /* The budget counts the data copied back */
+            tokens -= (LONGLONG)merged * BLOCK_SIZE / 1024 * TOKENS_PER_KB;
+            pause_ms = worked ? 0 : dev_ext->background_idle_ms;
+        }
+
+        timeout.QuadPart = -(LONGLONG)pause_ms * 10000;
+        if (KeWaitForSingleObject(&dev_ext->background_stop_event, Executive, KernelMode, 
+                                  FALSE, &timeout) != STATUS_TIMEOUT)
+            break;
+    }
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS difi_start_background_merge(struct filter_device_extension* dev_ext,
+                                     const struct ioctl_difi_background_merge* params)
+{
+    struct difi_merge_job* job = &dev_ext->background;
+    struct merge_params    merge_params;
+    struct merge_io        io;
+    HANDLE                 thread;
+    NTSTATUS               status;
+
+    if (dev_ext->background_thread != NULL)
+        return STATUS_DEVICE_BUSY;
+
+    dev_ext->background_budget = params->budget_kb_per_sec != 0 ? 
+                                 params->budget_kb_per_sec : BACKGROUND_BUDGET_KB_PER_SEC;
+    dev_ext->background_idle_ms = params->idle_ms != 0 ? params->idle_ms : BACKGROUND_IDLE_MS;
+
+    merge_params.queue_depth = BACKGROUND_QUEUE_DEPTH;
+    merge_params.transfer_blocks = BACKGROUND_TRANSFER_BLOCKS;
+    merge_params.window_transfers = BACKGROUND_WINDOW_TRANSFERS;
+    if (dev_ext->transfer_limits.max_blocks != 0 && 
+        merge_params.transfer_blocks > dev_ext->transfer_limits.max_blocks)
+        merge_params.transfer_blocks = dev_ext->transfer_limits.max_blocks;
+
+    job->runs = (struct disk_remap_run*)diskf_malloc(BACKGROUND_STEP_RUNS * sizeof(*job->runs));
+    if (job->runs == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    init_merge_io(job, &io);
+    job->engine = merge_engine_create(&merge_params, &io, step_source, job, 0, 
+                                      diskf_malloc, diskf_free);
+    if (job->engine == NULL) {
+        diskf_free(job->runs);
+        job->runs = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    job->next_block = 0;
+    KeClearEvent(&job->event);
+    KeClearEvent(&dev_ext->background_stop_event);
+
+    status = PsCreateSystemThread(&thread, THREAD_ALL_ACCESS, NULL, NULL, NULL, 
+                                  background_thread, dev_ext);
+    if (!NT_SUCCESS(status)) {
+        merge_engine_destroy(job->engine);
+        job->engine = NULL;
+        diskf_free(job->runs);
+        job->runs = NULL;
+        return status;
+    }
+    ObReferenceObjectByHandle(thread, THREAD_ALL_ACCESS, NULL, KernelMode, 
+                              (PVOID*)&dev_ext->background_thread, NULL);
+    ZwClose(thread);
+    return STATUS_SUCCESS;
+}
+
+/* A step in progress is finished first, the remaps left stay valid */
+void difi_stop_background_merge(struct filter_device_extension* dev_ext)
+{
+    struct difi_merge_job* job = &dev_ext->background;
+
+    if (dev_ext->background_thread == NULL)
+        return;
+    KeSetEvent(&dev_ext->background_stop_event, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(dev_ext->background_thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(dev_ext->background_thread);
+    dev_ext->background_thread = NULL;
+    merge_engine_destroy(job->engine);
+    job->engine = NULL;
+    diskf_free(job->runs);
+    job->runs = NULL;
+}
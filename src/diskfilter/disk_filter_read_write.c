@@ -24,12 +24,12 @@
 #include "disk_filter.h"
 
 
-NTSTATUS split_irp(PDEVICE_OBJECT dev_obj, PIRP irp);
-NTSTATUS split_irp_for_remap(PDEVICE_OBJECT dev_obj, PIRP irp, 
-                             struct disk_extent_remap* remap);
+NTSTATUS split_irp_for_remap(struct filter_device_extension* dev_ext, PIRP irp, 
+                             struct disk_extent_remap* remap, ULONG slot,
+                             LARGE_INTEGER start);
 
 NTSTATUS
-create_transfer_packet(PDEVICE_OBJECT     dev_obj,
+create_transfer_packet(struct filter_device_extension* dev_ext,
                        PIRP               orig_irp,
                        PIO_STACK_LOCATION orig_stack,
                        UCHAR              operation, 
@@ -40,10 +40,218 @@ create_transfer_packet(PDEVICE_OBJECT     dev_obj,
 NTSTATUS
 difi_transfer_completion(IN PDEVICE_OBJECT dev_obj, IN PIRP irp, IN PVOID context);
 
+/* 
+   Remap results for most requests fit into this on-stack buffer, so reads 
+   and writes do not touch the pool. A buffer in the device extension would
+   need a lock, requests for the same disk run in parallel
+*/
+#define STACK_REMAP_EXTENTS (16)
+
+struct stack_remap
+{
+    struct disk_extent_remap remap;
+    struct disk_extent       more_extents[STACK_REMAP_EXTENTS - 1];
+};
+
+static int
+get_remap(struct filter_device_extension* dev_ext, 
+          struct disk_extent* extent,
+          BOOLEAN write,
+          struct stack_remap* buffer,
+          struct disk_extent_remap** remap_res)
+{
+    int status;
+
+    *remap_res = &buffer->remap;
+    if (write) {
+        status = disk_tracker_remap_to_buffer(dev_ext->remapper, extent, 
+                                              &buffer->remap, STACK_REMAP_EXTENTS);
+    } else {
+        status = disk_tracker_find_remap_to_buffer(dev_ext->remapper, extent, 
+                                                   &buffer->remap, STACK_REMAP_EXTENTS);
+    }
+    if (status == DISK_TRACKER_BUFFER_TOO_SMALL) {
+        /* Heavily fragmented request, blocks are remapped already */
+        status = disk_tracker_find_remap(dev_ext->remapper, extent, remap_res);
+    }
+    return status;
+}
+
 static void
-dump_remap(const char* op, struct disk_extent* extent, 
-            struct disk_extent_remap* remap_res);
+put_remap(struct stack_remap* buffer, struct disk_extent_remap* remap_res)
+{
+    if (remap_res != &buffer->remap)
+        diskf_free(remap_res);
+}
 
+static NTSTATUS
+fail_remap(PIRP irp, int tracker_status)
+{
+    NTSTATUS status = tracker_status == DISK_TRACKER_NO_STORAGE ? 
+                      STATUS_DISK_FULL : STATUS_INSUFFICIENT_RESOURCES;
+
+    DbgPrint("Remap failed: %d\n", tracker_status);
+    irp->IoStatus.Status = status;
+    irp->IoStatus.Information = 0;
+    IoCompleteRequest(irp, IO_NO_INCREMENT);
+    return status;
+}
+
+/* Binary record of the request for the trace ring of this processor */
+static void
+trace_request(struct filter_device_extension* dev_ext, 
+              PIO_STACK_LOCATION stack,
+              struct disk_extent_remap* remap_res,
+              UCHAR flags,
+              LARGE_INTEGER start)
+{
+    struct ioctl_difi_trace_record record;
+
+    record.timestamp = (ULONGLONG)start.QuadPart;
+    /* Read and Write parameters share the layout */
+    record.start_block = (ULONGLONG)stack->Parameters.Write.ByteOffset.QuadPart / BLOCK_SIZE;
+    record.length_in_blocks = stack->Parameters.Write.Length / BLOCK_SIZE;
+    record.hits = remap_res != NULL ? remap_res->num_remapped : 0;
+    record.extents = 0;
+    if (remap_res != NULL) {
+        record.extents = remap_res->number_of_extents > 0xFFFF ? 
+                         0xFFFF : (USHORT)remap_res->number_of_extents;
+    }
+    record.op = stack->MajorFunction == IRP_MJ_WRITE ? DIFI_TRACE_WRITE : DIFI_TRACE_READ;
+    record.flags = flags;
+    record.cpu = KeGetCurrentProcessorNumber();
+    trace_ring_write(dev_ext->trace, record.cpu, &record);
+}
+
+/* 
+   One update of the processor's counters and trace per request. remap_res 
+   is NULL if the tracker was not asked, flags are DIFI_TRACE_XXX
+*/
+static void
+account_request(struct filter_device_extension* dev_ext, 
+                PIO_STACK_LOCATION stack,
+                struct disk_extent_remap* remap_res,
+                UCHAR flags,
+                LARGE_INTEGER start)
+{
+    struct difi_cpu_stats* cpu_stats;
+    ulong32_t              remapped_blocks = remap_res != NULL ? remap_res->num_remapped : 0;
+    KIRQL                  irql;
+
+    cpu_stats = difi_stats_begin(dev_ext, &irql);
+    /* Read and Write parameters share the layout */
+    if (stack->MajorFunction == IRP_MJ_WRITE) {
+        cpu_stats->writes_per_irql[STATS_IRQL_INDEX(irql)]++;
+        cpu_stats->bytes_written += stack->Parameters.Write.Length;
+        cpu_stats->write_hits += remapped_blocks;
+    } else {
+        cpu_stats->reads_per_irql[STATS_IRQL_INDEX(irql)]++;
+        cpu_stats->bytes_read += stack->Parameters.Read.Length;
+        cpu_stats->read_hits += remapped_blocks;
+    }
+    if (flags & DIFI_TRACE_PASSED_THROUGH)
+        cpu_stats->passed_through++;
+    else
+        cpu_stats->remapped_bytes += (ULONGLONG)remapped_blocks * BLOCK_SIZE;
+
+    /* Still at DISPATCH_LEVEL, nothing else writes to this processor's ring */
+    if (dev_ext->trace != NULL)
+        trace_request(dev_ext, stack, remap_res, flags, start);
+    difi_stats_end(irql);
+}
+
+/* Microseconds since start go to the histogram of this processor */
+static void
+record_latency(struct filter_device_extension* dev_ext, 
+               UCHAR operation,
+               ULONG path,
+               ULONG slot,
+               LARGE_INTEGER start)
+{
+    struct difi_cpu_stats* cpu_stats;
+    LARGE_INTEGER          now, frequency;
+    ulong64_t              usec;
+    KIRQL                  irql;
+
+    now = KeQueryPerformanceCounter(&frequency);
+    usec = (ulong64_t)(now.QuadPart - start.QuadPart) * 1000000 / 
+           (ulong64_t)frequency.QuadPart;
+
+    cpu_stats = difi_stats_begin(dev_ext, &irql);
+    if (operation == IRP_MJ_WRITE)
+        histogram_record(&cpu_stats->write_latency[path], usec);
+    else
+        histogram_record(&cpu_stats->read_latency[path], usec);
+    difi_stats_end(irql);
+
+    /* Every request that went down ends here, a merge waits for them */
+    difi_io_end(dev_ext, slot);
+}
+
+static NTSTATUS
+latency_completion(IN PDEVICE_OBJECT dev_obj, IN PIRP irp, IN PVOID context)
+{
+    struct filter_device_extension* dev_ext = (struct filter_device_extension*)context;
+    PIO_STACK_LOCATION              stack = IoGetCurrentIrpStackLocation(irp);
+
+    dev_obj;
+    if (irp->PendingReturned)
+        IoMarkIrpPending(irp);
+    record_latency(dev_ext, stack->MajorFunction, stack->Parameters.Read.Key & 0xFFFF,
+                   stack->Parameters.Read.Key >> 16, stack->Parameters.Read.ByteOffset);
+    return STATUS_CONTINUE_COMPLETION;
+}
+
+/* 
+   Sends the IRP down once the next stack location is set up. Drivers below
+   do not look at our stack location, like the DDK diskperf sample it keeps
+   the dispatch time in ByteOffset, the path and the slot in Key for the 
+   completion
+*/
+static NTSTATUS
+send_timed(struct filter_device_extension* dev_ext, 
+           PIRP irp, 
+           ULONG path,
+           ULONG slot,
+           LARGE_INTEGER start)
+{
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+
+    stack->Parameters.Read.ByteOffset = start;
+    stack->Parameters.Read.Key = path | (slot << 16);
+    IoSetCompletionRoutine(irp, latency_completion, dev_ext, TRUE, TRUE, TRUE);
+    return IoCallDriver(dev_ext->target_device_obj, irp);
+}
+
+static NTSTATUS
+pass_through(struct filter_device_extension* dev_ext, 
+             PIRP irp, 
+             ULONG slot,
+             LARGE_INTEGER start)
+{
+    IoCopyCurrentIrpStackLocationToNext(irp);
+    return send_timed(dev_ext, irp, DIFI_LATENCY_PASS_THROUGH, slot, start);
+}
+
+/* 
+   Whole request maps to one continuous run: send the original IRP down with
+   the new offset, no packets needed
+*/
+static NTSTATUS
+forward_remapped(struct filter_device_extension* dev_ext, 
+                 PIRP irp, 
+                 ulong64_t target_block,
+                 ULONG slot,
+                 LARGE_INTEGER start)
+{
+    PIO_STACK_LOCATION next_stack;
+
+    IoCopyCurrentIrpStackLocationToNext(irp);
+    next_stack = IoGetNextIrpStackLocation(irp);
+    /* Read and Write parameters share the layout */
+    next_stack->Parameters.Write.ByteOffset.QuadPart = target_block * BLOCK_SIZE;
+    return send_timed(dev_ext, irp, DIFI_LATENCY_REMAPPED, slot, start);
+}
 
 NTSTATUS difi_driver_read(PDEVICE_OBJECT dev_obj, PIRP irp)
 {
@@ -53,35 +261,52 @@ NTSTATUS difi_driver_read(PDEVICE_OBJECT dev_obj, PIRP irp)
     PIO_STACK_LOCATION        stack = IoGetCurrentIrpStackLocation(irp);
     struct disk_extent        extent;
     struct disk_extent_remap* remap_res;
+    struct stack_remap        buffer;
+    int                       tracker_status;
+    LARGE_INTEGER             start = KeQueryPerformanceCounter(NULL);
+    ULONG                     slot = difi_io_begin(dev_ext);
     
-    dev_ext->stats.per_irql_reads[KeGetCurrentIrql() < 3 ? KeGetCurrentIrql() : 3]++;
-
     /* Always forward zero-length requests to the lower driver */
     if(stack->Parameters.Read.Length == 0 ||
        !dev_ext->track_this || dev_ext->remapper == NULL) {
-        IoCopyCurrentIrpStackLocationToNext(irp);
-        return IoCallDriver(dev_ext->target_device_obj, irp);
+        account_request(dev_ext, stack, NULL, DIFI_TRACE_PASSED_THROUGH, start);
+        return pass_through(dev_ext, irp, slot, start);
     }
     
     extent.start_block = stack->Parameters.Read.ByteOffset.QuadPart / BLOCK_SIZE;
     extent.length_in_blocks = stack->Parameters.Read.Length / BLOCK_SIZE;
 
-    disk_tracker_find_remap(dev_ext->remapper, &extent, &remap_res);
+    /* Most reads hit blocks never written since tracking started */
+    if (disk_tracker_range_is_clean(dev_ext->remapper, &extent)) {
+        account_request(dev_ext, stack, NULL, DIFI_TRACE_PASSED_THROUGH, start);
+        return pass_through(dev_ext, irp, slot, start);
+    }
 
-    dump_remap("Read", &extent, remap_res);
+    tracker_status = get_remap(dev_ext, &extent, FALSE, &buffer, &remap_res);
+    if (tracker_status != DISK_TRACKER_OK) {
+        account_request(dev_ext, stack, NULL, DIFI_TRACE_FAILED, start);
+        difi_io_end(dev_ext, slot);
+        return fail_remap(irp, tracker_status);
+    }
 
-    dev_ext->stats.read_hits += remap_res->num_remapped;
+    account_request(dev_ext, stack, remap_res, 
+                    dev_ext->simulate ? DIFI_TRACE_PASSED_THROUGH : 0, start);
 
     if(dev_ext->simulate) {
         /* In simulation mode, just pass to the next driver */
-        diskf_free(remap_res);
-        IoCopyCurrentIrpStackLocationToNext(irp);
-        return IoCallDriver(dev_ext->target_device_obj, irp);
+        put_remap(&buffer, remap_res);
+        return pass_through(dev_ext, irp, slot, start);
     }
     
 
-    status = split_irp_for_remap(dev_ext->target_device_obj, irp, remap_res);
-    diskf_free(remap_res);
+    if (remap_res->number_of_extents == 1) {
+        ulong64_t target_block = remap_res->remapped_extents[0].start_block;
+        put_remap(&buffer, remap_res);
+        return forward_remapped(dev_ext, irp, target_block, slot, start);
+    }
+
+    status = split_irp_for_remap(dev_ext, irp, remap_res, slot, start);
+    put_remap(&buffer, remap_res);
     return status;
 }
 
@@ -93,10 +318,25 @@ NTSTATUS difi_driver_write(PDEVICE_OBJECT dev_obj, PIRP irp)
     PIO_STACK_LOCATION        stack = IoGetCurrentIrpStackLocation(irp);
     struct disk_extent        extent;
     struct disk_extent_remap* remap_res;
+    struct stack_remap        buffer;
+    int                       tracker_status;
+    LARGE_INTEGER             start = KeQueryPerformanceCounter(NULL);
+    ULONG                     slot;
     
     dev_ext = (struct filter_device_extension *)dev_obj->DeviceExtension;
 
-    dev_ext->stats.per_irql_writes[KeGetCurrentIrql() < 3 ? KeGetCurrentIrql() : 3]++;
+    /* 
+       While a merge copies remapped blocks back, their part of the disk must
+       not change, writes there wait for it. Counted first, so the merge sees
+       every write that missed the hold
+    */
+    slot = difi_io_begin(dev_ext);
+    if (dev_ext->hold_writes) {
+        difi_io_end(dev_ext, slot);
+        if (difi_hold_write(dev_ext, irp))
+            return STATUS_PENDING;
+        slot = difi_io_begin(dev_ext);
+    }
 
     /* Determine the buffering mode */
     if (dev_ext->target_device_obj->Flags & DO_DIRECT_IO) {
@@ -107,146 +347,293 @@ NTSTATUS difi_driver_write(PDEVICE_OBJECT dev_obj, PIRP irp)
         data = irp->AssociatedIrp.SystemBuffer;
     }
 
-    dev_ext->stats.per_irql_writes[KeGetCurrentIrql() < 3 ? KeGetCurrentIrql() : 3]++;
-
     /* Always forward zero-length requests to the lower driver */
     if(stack->Parameters.Write.Length == 0 ||
        !dev_ext->track_this || dev_ext->remapper == NULL) {
-        IoCopyCurrentIrpStackLocationToNext(irp);
-        return IoCallDriver(dev_ext->target_device_obj, irp);
+        account_request(dev_ext, stack, NULL, DIFI_TRACE_PASSED_THROUGH, start);
+        return pass_through(dev_ext, irp, slot, start);
     }
 
     extent.start_block = stack->Parameters.Write.ByteOffset.QuadPart / BLOCK_SIZE;
     extent.length_in_blocks = stack->Parameters.Write.Length / BLOCK_SIZE;
 
-    disk_tracker_remap(dev_ext->remapper, &extent, &remap_res);
-
-    dump_remap("Write", &extent, remap_res);
+    tracker_status = get_remap(dev_ext, &extent, TRUE, &buffer, &remap_res);
+    if (tracker_status != DISK_TRACKER_OK) {
+        account_request(dev_ext, stack, NULL, DIFI_TRACE_FAILED, start);
+        difi_io_end(dev_ext, slot);
+        return fail_remap(irp, tracker_status);
+    }
 
-    dev_ext->stats.write_hits += remap_res->num_remapped;
+    account_request(dev_ext, stack, remap_res, 
+                    dev_ext->simulate ? DIFI_TRACE_PASSED_THROUGH : 0, start);
     
     if(dev_ext->simulate) {
         /* In simulation mode, just pass to the next driver */
-        diskf_free(remap_res);
-        IoCopyCurrentIrpStackLocationToNext(irp);
-        return IoCallDriver(dev_ext->target_device_obj, irp);
+        put_remap(&buffer, remap_res);
+        return pass_through(dev_ext, irp, slot, start);
+    }
+
+    if (remap_res->number_of_extents == 1) {
+        ulong64_t target_block = remap_res->remapped_extents[0].start_block;
+        put_remap(&buffer, remap_res);
+        return forward_remapped(dev_ext, irp, target_block, slot, start);
     }
 
-    status = split_irp_for_remap(dev_ext->target_device_obj, irp, remap_res);
-    diskf_free(remap_res);
+    status = split_irp_for_remap(dev_ext, irp, remap_res, slot, start);
+    put_remap(&buffer, remap_res);
     return status;
 }
 
 
 
-#define MIN(a, b) ((a) > (b) ? (b) : (a))
-
-NTSTATUS split_irp(PDEVICE_OBJECT dev_obj, PIRP irp)
+static void
+complete_split(struct split_context* ctx)
 {
-    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
-    unsigned long i;
-    NTSTATUS status;
+    PIRP orig_irp = ctx->orig_irp;
+
+    orig_irp->IoStatus.Status = ctx->status;
+    orig_irp->IoStatus.Information = ctx->information;
+    ASSERT(!NT_SUCCESS(ctx->status) ||
+           (ULONG)ctx->information == 
+           IoGetCurrentIrpStackLocation(orig_irp)->Parameters.Write.Length);
+
+    record_latency(ctx->dev_ext, IoGetCurrentIrpStackLocation(orig_irp)->MajorFunction,
+                   DIFI_LATENCY_SPLIT, ctx->io_slot, ctx->start);
+    ExFreePool(ctx);
+    IoCompleteRequest(orig_irp, IO_DISK_INCREMENT);
+}
 
-    irp->IoStatus.Status = STATUS_SUCCESS;
-    irp->IoStatus.Information = 0;
-    IoMarkIrpPending(irp);
+/*
+   Send transfers while the window allows. One thread at a time does it: 
+   transfers completed from inside IoCallDriver only free the window for 
+   the loop below instead of recursing into it. The thread that issues also
+   completes the original IRP if the last transfer finishes meanwhile, so 
+   the context is not freed under its feet
+*/
+static void
+issue_transfers(struct split_context* ctx)
+{
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(ctx->orig_irp);
+    BOOLEAN            done;
+    KIRQL              irql;
+
+    KeAcquireSpinLock(&ctx->lock, &irql);
+    if (ctx->issuing) {
+        KeReleaseSpinLock(&ctx->lock, irql);
+        return;
+    }
+    ctx->issuing = TRUE;
 
-    /* DriverContext[0] will hold total number of transfer packets */
-    irp->Tail.Overlay.DriverContext[0] = ULongToPtr (0);
-    
-    for (i = 0; i < stack->Parameters.Write.Length; i += BLOCK_SIZE)
-    {
+    while (ctx->next_transfer < ctx->num_transfers && 
+           ctx->in_flight < ctx->window) {
+        struct transfer*        transfer = &ctx->transfers[ctx->next_transfer];
         struct transfer_packet* packet = NULL;
-        ULONG transfer_len = MIN(BLOCK_SIZE, stack->Parameters.Write.Length - i);
-        
-        status = create_transfer_packet(dev_obj, irp, stack, stack->MajorFunction,
-                                        i, transfer_len, 
-                                        stack->Parameters.Write.ByteOffset.QuadPart + i,
-                                        &packet);
-        InterlockedIncrement((volatile LONG*)&(irp->Tail.Overlay.DriverContext[0]));    
-        
-        IoSetCompletionRoutine(packet->irp, difi_transfer_completion, packet, TRUE, TRUE, TRUE);
-        status = IoCallDriver(dev_obj, packet->irp);
+        ULONG                   offset = transfer->buffer_block * BLOCK_SIZE;
+        ULONG                   transfer_len = transfer->length_in_blocks * BLOCK_SIZE;
+        ulong64_t               disk_loc = transfer->disk_block * BLOCK_SIZE;
+        NTSTATUS                status;
+
+        ctx->next_transfer++;
+        ctx->in_flight++;
+        KeReleaseSpinLock(&ctx->lock, irql);
+
+        status = create_transfer_packet(ctx->dev_ext, ctx->orig_irp, stack, 
+                                        stack->MajorFunction, offset, 
+                                        transfer_len, disk_loc, &packet);
+        if (NT_SUCCESS(status)) {
+            packet->split = ctx;
+            IoSetCompletionRoutine(packet->irp, difi_transfer_completion, packet, 
+                                   TRUE, TRUE, TRUE);
+            IoCallDriver(ctx->dev_ext->target_device_obj, packet->irp);
+            KeAcquireSpinLock(&ctx->lock, &irql);
+            continue;
+        }
+
+        /* Do not send the rest, complete when transfers in flight are done */
+        DbgPrint("Failed to create transfer packet: 0x%x\n", status);
+        KeAcquireSpinLock(&ctx->lock, &irql);
+        ctx->status = status;
+        ctx->next_transfer = ctx->num_transfers;
+        ctx->in_flight--;
     }
-    DbgPrint("Split IRP into %d packets\n", (ULONG)(irp->Tail.Overlay.DriverContext[0]));
 
-    return status = STATUS_PENDING;
+    /* Completions seen issuing set and left the original IRP to us */
+    done = ctx->next_transfer == ctx->num_transfers && ctx->in_flight == 0;
+    ctx->issuing = FALSE;
+    KeReleaseSpinLock(&ctx->lock, irql);
+
+    if (done)
+        complete_split(ctx);
 }
 
-NTSTATUS split_irp_for_remap(PDEVICE_OBJECT dev_obj, PIRP irp, struct disk_extent_remap* remap)
+NTSTATUS split_irp_for_remap(struct filter_device_extension* dev_ext, PIRP irp, 
+                             struct disk_extent_remap* remap, ULONG slot,
+                             LARGE_INTEGER start)
 {
-    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
-    unsigned long i, offset;
-    NTSTATUS status;
+    struct split_context*  ctx;
+    struct difi_cpu_stats* cpu_stats;
+    ULONG                  num_transfers, size;
+    KIRQL                  irql;
+
+    /* The plan is all we need from the remap, it may be on the caller's stack */
+    num_transfers = transfer_plan_size(remap, &dev_ext->transfer_limits);
+    size = FIELD_OFFSET(struct split_context, transfers) + 
+           num_transfers * sizeof(struct transfer);
+    ctx = ExAllocatePoolWithTag(NonPagedPool, size, 'lpSD');
+    if (ctx == NULL) {
+        DbgPrint("Failed to allocate split context.\n");
+        difi_io_end(dev_ext, slot);
+        irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+        irp->IoStatus.Information = 0;
+        IoCompleteRequest(irp, IO_NO_INCREMENT);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(ctx, FIELD_OFFSET(struct split_context, transfers));
+    transfer_plan_build(remap, &dev_ext->transfer_limits, TRANSFER_PLAN_SORTED,
+                        ctx->transfers, num_transfers, &ctx->num_transfers);
+    KeInitializeSpinLock(&ctx->lock);
+    ctx->orig_irp = irp;
+    ctx->dev_ext = dev_ext;
+    ctx->window = dev_ext->split_window_set > 0 ? dev_ext->split_window_set : 
+                  dev_ext->split_window > 0 ? dev_ext->split_window : DEFAULT_SPLIT_WINDOW;
+    ctx->status = STATUS_SUCCESS;
+    ctx->start = start;
+    ctx->io_slot = slot;
+
+    cpu_stats = difi_stats_begin(dev_ext, &irql);
+    cpu_stats->split_irps++;
+    cpu_stats->split_transfers += ctx->num_transfers;
+    difi_stats_end(irql);
 
-    irp->IoStatus.Status = STATUS_SUCCESS;
-    irp->IoStatus.Information = 0;
     IoMarkIrpPending(irp);
+    issue_transfers(ctx);
 
-    /* DriverContext[0] will hold total number of transfer packets */
-    irp->Tail.Overlay.DriverContext[0] = ULongToPtr (0);
-    
-    for (i = 0, offset = 0; i < remap->number_of_extents; i++) {
-        struct transfer_packet* packet = NULL;
-        ULONG transfer_len = remap->remapped_extents[i].length_in_blocks * BLOCK_SIZE;
-
-        status = create_transfer_packet(dev_obj, irp, stack, stack->MajorFunction,
-                                        offset, transfer_len, 
-                                        remap->remapped_extents[i].start_block * BLOCK_SIZE,
-                                        &packet);
-        InterlockedIncrement((volatile LONG*)&(irp->Tail.Overlay.DriverContext[0]));    
-        offset += transfer_len;
-                
-        IoSetCompletionRoutine(packet->irp, difi_transfer_completion, packet, TRUE, TRUE, TRUE);
-        status = IoCallDriver(dev_obj, packet->irp);
+    return STATUS_PENDING;
+}
+
+
+
+static int
+construct_packet(void* object, void* context)
+{
+    struct transfer_packet*         pkt = (struct transfer_packet*)object;
+    struct filter_device_extension* dev_ext = (struct filter_device_extension*)context;
+
+    pkt->dev_ext = dev_ext;
+    pkt->irp = IoAllocateIrp(dev_ext->target_device_obj->StackSize, FALSE);
+    if (pkt->irp == NULL)
+        return -1;
+
+    /* 
+       No buffer yet, IoBuildPartialMdl fills it for every transfer. One page
+       more than the maximum covers pieces not starting at a page boundary
+    */
+    pkt->partial_mdl = IoAllocateMdl(NULL, PACKET_POOL_MAX_TRANSFER + PAGE_SIZE, 
+                                     FALSE, FALSE, NULL);
+    if (pkt->partial_mdl == NULL) {
+        IoFreeIrp(pkt->irp);
+        return -1;
     }
-    
-    DbgPrint("Split IRP into %d packets\n", (ULONG)(irp->Tail.Overlay.DriverContext[0]));
+    return 0;
+}
 
-    return status = STATUS_PENDING;
+static void
+destruct_packet(void* object, void* context)
+{
+    struct transfer_packet* pkt = (struct transfer_packet*)object;
+
+    context;
+    IoFreeMdl(pkt->partial_mdl);
+    IoFreeIrp(pkt->irp);
 }
 
+void difi_create_packet_pool(struct filter_device_extension* dev_ext)
+{
+    KeInitializeSpinLock(&dev_ext->packet_pool_lock);
+    dev_ext->packet_pool = object_pool_create(sizeof(struct transfer_packet),
+                                              PACKET_POOL_SIZE,
+                                              construct_packet,
+                                              destruct_packet,
+                                              dev_ext,
+                                              diskf_malloc,
+                                              diskf_free);
+    if (dev_ext->packet_pool == NULL) {
+        /* Not fatal, every packet will be allocated */
+        DbgPrint("Failed to create transfer packet pool.\n");
+    }
+}
 
+void difi_destroy_packet_pool(struct filter_device_extension* dev_ext)
+{
+    if (dev_ext->packet_pool != NULL) {
+        object_pool_destroy(dev_ext->packet_pool);
+        dev_ext->packet_pool = NULL;
+    }
+}
 
-NTSTATUS
-create_transfer_packet(PDEVICE_OBJECT     dev_obj,
-                       PIRP               orig_irp,
-                       PIO_STACK_LOCATION orig_stack,
-                       UCHAR              operation, 
-                       ULONG              offset,
-                       ULONG              transfer_len,
-                       ulong64_t          disk_loc, 
-                       struct transfer_packet** result_out)
+static struct transfer_packet*
+get_pooled_packet(struct filter_device_extension* dev_ext)
 {
-    struct transfer_packet* result = NULL;
-    NTSTATUS                status = STATUS_SUCCESS;
-    PIO_STACK_LOCATION      stack = NULL;
-    PUCHAR                  orig_buffer = MmGetMdlVirtualAddress(orig_irp->MdlAddress);
+    struct transfer_packet* pkt;
+    KIRQL                   irql;
+
+    if (dev_ext->packet_pool == NULL)
+        return NULL;
+    KeAcquireSpinLock(&dev_ext->packet_pool_lock, &irql);
+    pkt = (struct transfer_packet*)object_pool_get(dev_ext->packet_pool);
+    KeReleaseSpinLock(&dev_ext->packet_pool_lock, irql);
+    return pkt;
+}
+
+static void
+free_transfer_packet(struct transfer_packet* pkt)
+{
+    struct filter_device_extension* dev_ext = pkt->dev_ext;
+    KIRQL                           irql;
+
+    MmPrepareMdlForReuse(pkt->partial_mdl);
+
+    if (dev_ext->packet_pool != NULL && 
+        object_pool_owns(dev_ext->packet_pool, pkt)) {
+        IoReuseIrp(pkt->irp, STATUS_SUCCESS);
+        KeAcquireSpinLock(&dev_ext->packet_pool_lock, &irql);
+        object_pool_put(dev_ext->packet_pool, pkt);
+        KeReleaseSpinLock(&dev_ext->packet_pool_lock, irql);
+        return;
+    }
+
+    IoFreeMdl(pkt->partial_mdl);
+    IoFreeIrp(pkt->irp);
+    ExFreePool(pkt);
+}
+
+/* Packet for the pool is full or the piece is too big for pooled MDLs */
+static NTSTATUS
+alloc_transfer_packet(struct filter_device_extension* dev_ext,
+                      PUCHAR                          buffer,
+                      ULONG                           transfer_len,
+                      struct transfer_packet**        result_out)
+{
+    struct transfer_packet* result;
 
-    // It can be null, don't assert here
-    // ASSERT(orig_buffer != NULL);
-    
-    *result_out = NULL;
     result = ExAllocatePoolWithTag(NonPagedPool, sizeof(*result), 'pnPC');
     if (result == NULL) {
         DbgPrint("Failed to allocate transfer packet.");
-        return status = STATUS_INSUFFICIENT_RESOURCES;
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
     RtlZeroMemory(result, sizeof(*result));
-    result->orig_irp = orig_irp;
+    result->dev_ext = dev_ext;
 
-    /*
-     *  Allocate an Irp for the packet.
-     */
-    result->irp = IoAllocateIrp(dev_obj->StackSize, FALSE);
+    result->irp = IoAllocateIrp(dev_ext->target_device_obj->StackSize, FALSE);
     if (result->irp == NULL) {
         DbgPrint("Failed to allocate IRP for transfer packet.");
         ExFreePool(result);
-        return status = STATUS_INSUFFICIENT_RESOURCES;
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    result->partial_mdl = IoAllocateMdl(orig_buffer,
+    result->partial_mdl = IoAllocateMdl(buffer,
                                         transfer_len,
                                         FALSE,
                                         FALSE,
@@ -255,9 +642,41 @@ create_transfer_packet(PDEVICE_OBJECT     dev_obj,
         DbgPrint("Failed to allocate MDL for transfer packet.");
         IoFreeIrp(result->irp);
         ExFreePool(result);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *result_out = result;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+create_transfer_packet(struct filter_device_extension* dev_ext,
+                       PIRP               orig_irp,
+                       PIO_STACK_LOCATION orig_stack,
+                       UCHAR              operation, 
+                       ULONG              offset,
+                       ULONG              transfer_len,
+                       ulong64_t          disk_loc, 
+                       struct transfer_packet** result_out)
+{
+    struct transfer_packet* result = NULL;
+    NTSTATUS                status = STATUS_SUCCESS;
+    PIO_STACK_LOCATION      stack = NULL;
+    PUCHAR                  orig_buffer = MmGetMdlVirtualAddress(orig_irp->MdlAddress);
 
-        return status = STATUS_INSUFFICIENT_RESOURCES;
+    // It can be null, don't assert here
+    // ASSERT(orig_buffer != NULL);
+    
+    *result_out = NULL;
+    if (transfer_len <= PACKET_POOL_MAX_TRANSFER)
+        result = get_pooled_packet(dev_ext);
+    if (result == NULL) {
+        status = alloc_transfer_packet(dev_ext, orig_buffer + offset, 
+                                       transfer_len, &result);
+        if (!NT_SUCCESS(status))
+            return status;
     }
+    result->orig_irp = orig_irp;
 
     /*
        Build partial mdl: source mdl, new mdl, buffer and length
@@ -285,59 +704,31 @@ create_transfer_packet(PDEVICE_OBJECT     dev_obj,
 NTSTATUS difi_transfer_completion(IN PDEVICE_OBJECT dev_obj, IN PIRP irp, IN PVOID context)
 {
     struct transfer_packet* pkt = (struct transfer_packet*)context;
+    struct split_context*   ctx = pkt->split;
+    BOOLEAN                 more, done;
+    KIRQL                   irql;
 
     dev_obj;
 
-    ASSERT (PtrToUlong (pkt->orig_irp->Tail.Overlay.DriverContext[0]) > 0);
-    
-    if (!NT_SUCCESS (irp->IoStatus.Status)) {
-      InterlockedExchange ((PLONG)&pkt->orig_irp->IoStatus.Status,
-                           irp->IoStatus.Status);
-    }
-    
-    /* Update total number of bytes tranferred */
-    InterlockedExchangeAdd ((PLONG)&pkt->orig_irp->IoStatus.Information,
-                            irp->IoStatus.Information);
-    MmPrepareMdlForReuse(pkt->partial_mdl);
-    
-    if (InterlockedDecrement((volatile LONG*)&pkt->orig_irp->Tail.Overlay.DriverContext[0]) == 0) {
-        /* Done with all packets, assert and complete the original irp */
-        PIO_STACK_LOCATION prev_stack = IoGetCurrentIrpStackLocation(pkt->orig_irp);
-        ASSERT((ULONG)pkt->orig_irp->IoStatus.Information == 
-               prev_stack->Parameters.Write.Length);
-
-        /* DDK doc says to propagate pending state */
-        if (pkt->irp->PendingReturned){
-            IoMarkIrpPending(pkt->orig_irp);
-        }
-
-        //IoFreeMdl(pkt->partial_mdl); /*Again, not sure - keep it here? */
-        IoCompleteRequest(pkt->orig_irp, IO_DISK_INCREMENT);
-    }
+    KeAcquireSpinLock(&ctx->lock, &irql);
+    ASSERT(ctx->in_flight > 0);
+    if (!NT_SUCCESS(irp->IoStatus.Status))
+        ctx->status = irp->IoStatus.Status;
 
-    /* Not sure about this: free MDL or not? */
-    //IoFreeMdl(pkt->partial_mdl);
-    IoFreeIrp(irp);
-    ExFreePool(pkt);
+    /* Update total number of bytes tranferred */
+    ctx->information += irp->IoStatus.Information;
+    ctx->in_flight--;
+    more = ctx->next_transfer < ctx->num_transfers;
+    done = !more && ctx->in_flight == 0 && !ctx->issuing;
+    KeReleaseSpinLock(&ctx->lock, irql);
+
+    /* Back to the pool, or free IRP, MDL and the packet */
+    free_transfer_packet(pkt);
+
+    if (done)
+        complete_split(ctx);
+    else if (more)
+        issue_transfers(ctx);
     
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
-
-static void
-dump_remap(const char* op, struct disk_extent* extent, 
-            struct disk_extent_remap* remap_res)
-{
-    unsigned idx;
-    DbgPrint("%s: Source extent: %llu len: %lu remaped to %d extents, hits %u",
-             op, 
-             extent->start_block,
-             extent->length_in_blocks,
-             remap_res->number_of_extents,
-             remap_res->num_remapped);
-    
-    for(idx = 0; idx < remap_res->number_of_extents; idx++) {
-        DbgPrint("  start: %llu length: %u", 
-                 remap_res->remapped_extents[idx].start_block,
-                 remap_res->remapped_extents[idx].length_in_blocks);
-    }
-}
@@ -49,6 +49,9 @@ create_hashtable(unsigned int minsize,
     if (NULL == h->table) { hash_free(h); return NULL; } /*oom*/
     memset(h->table, 0, size * sizeof(struct entry *));
     h->tablelength  = size;
+    h->nexttable    = NULL;
+    h->oldtable     = NULL;
+    h->resizeindex  = 0;
     h->primeindex   = pindex;
     h->entrycount   = 0;
     h->hashfn       = hashf;
@@ -74,68 +77,120 @@ hash(struct hashtable *h, void *k)
 }
 
 /*****************************************************************************/
-static int
-hashtable_expand(struct hashtable *h)
+/* Bounded amount of resize work done by every table operation. Zeroing is
+ * cheap, so it goes in bigger steps than moving entries */
+#define RESIZE_CLEAR_BUCKETS    1024
+#define RESIZE_MOVE_BUCKETS     64
+
+static void
+hashtable_resize_step(struct hashtable *h)
 {
-    /* Double the size of the table to accomodate more entries */
-    struct entry **newtable;
     struct entry *e;
-    unsigned int newsize, i, index;
-    /* Check we're not hitting max capacity */
-    if (h->primeindex == (prime_table_length - 1)) return 0;
-    newsize = primes[++(h->primeindex)];
+    unsigned int i, end, index;
 
-    newtable = (struct entry **)h->hash_alloc(sizeof(struct entry*) * newsize);
-    if (NULL != newtable)
+    if (NULL != h->nexttable)
     {
-        memset(newtable, 0, newsize * sizeof(struct entry *));
-        /* This algorithm is not 'stable'. ie. it reverses the list
-         * when it transfers entries between the tables */
-        for (i = 0; i < h->tablelength; i++) {
-            while (NULL != (e = h->table[i])) {
-                h->table[i] = e->next;
-                index = indexFor(newsize,e->h);
-                e->next = newtable[index];
-                newtable[index] = e;
-            }
+        end = h->resizeindex + RESIZE_CLEAR_BUCKETS;
+        if (end > h->nexttablelength) end = h->nexttablelength;
+        memset(&h->nexttable[h->resizeindex], 0, 
+               (end - h->resizeindex) * sizeof(struct entry *));
+        h->resizeindex = end;
+        if (end == h->nexttablelength)
+        {
+            /* New table is ready, new entries go there from now on */
+            h->oldtable = h->table;
+            h->oldtablelength = h->tablelength;
+            h->table = h->nexttable;
+            h->tablelength = h->nexttablelength;
+            h->loadlimit = get_load_factor(h->tablelength);
+            h->nexttable = NULL;
+            h->resizeindex = 0;
         }
-        h->hash_free(h->table);
-        h->table = newtable;
     }
-    /* Plan B: realloc instead */
-    else 
+    else if (NULL != h->oldtable)
     {
-#if 0
-        struct entry **pE;
-
-        /* No realloc in kernel mode, thus disabled */
-        newtable = (struct entry **)
-                   realloc(h->table, newsize * sizeof(struct entry *));
-        if (NULL == newtable) { (h->primeindex)--; return 0; }
-        h->table = newtable;
-        memset(newtable[h->tablelength], 0, newsize - h->tablelength);
-        for (i = 0; i < h->tablelength; i++) {
-            for (pE = &(newtable[i]), e = *pE; e != NULL; e = *pE) {
-                index = indexFor(newsize,e->h);
-                if (index == i)
-                {
-                    pE = &(e->next);
-                }
-                else
-                {
-                    *pE = e->next;
-                    e->next = newtable[index];
-                    newtable[index] = e;
-                }
+        end = h->resizeindex + RESIZE_MOVE_BUCKETS;
+        if (end > h->oldtablelength) end = h->oldtablelength;
+        for (i = h->resizeindex; i < end; i++) {
+            while (NULL != (e = h->oldtable[i])) {
+                h->oldtable[i] = e->next;
+                index = indexFor(h->tablelength,e->h);
+                e->next = h->table[index];
+                h->table[index] = e;
             }
         }
-#endif
+        h->resizeindex = end;
+        if (end == h->oldtablelength)
+        {
+            h->hash_free(h->oldtable);
+            h->oldtable = NULL;
+            h->resizeindex = 0;
+        }
     }
-    h->tablelength = newsize;
-    h->loadlimit   = get_load_factor(newsize);
+}
+
+/* Whole table walks need all entries in one place */
+static void
+hashtable_finish_resize(struct hashtable *h)
+{
+    while (NULL != h->nexttable || NULL != h->oldtable)
+        hashtable_resize_step(h);
+}
+
+/*****************************************************************************/
+static int
+hashtable_expand(struct hashtable *h)
+{
+    /* Start growing to the next prime size. The work itself is spread over
+     * following operations by hashtable_resize_step, so a single insert never
+     * rehashes the whole table */
+    unsigned int newsize;
+
+    /* Previous resize is still in progress */
+    if (NULL != h->nexttable || NULL != h->oldtable) return 0;
+    /* Check we're not hitting max capacity */
+    if (h->primeindex == (prime_table_length - 1)) return 0;
+    newsize = primes[h->primeindex + 1];
+
+    h->nexttable = (struct entry **)h->hash_alloc(sizeof(struct entry*) * newsize);
+    if (NULL == h->nexttable) return 0;
+    h->primeindex++;
+    h->nexttablelength = newsize;
+    h->resizeindex = 0;
     return -1;
 }
 
+/*****************************************************************************/
+static struct entry **
+hashtable_find_in_chain(struct hashtable *h, struct entry **pE,
+                        void *k, unsigned int hashvalue)
+{
+    for (; NULL != *pE; pE = &((*pE)->next))
+    {
+        /* Check hash value to short circuit heavier comparison */
+        if ((hashvalue == (*pE)->h) && (h->eqfn(k, (*pE)->k))) return pE;
+    }
+    return NULL;
+}
+
+/* Link pointing to the entry with the key, or NULL. Entries not yet moved by
+ * the resize are still in the old table */
+static struct entry **
+hashtable_find(struct hashtable *h, void *k, unsigned int hashvalue)
+{
+    struct entry **pE;
+
+    pE = hashtable_find_in_chain(h, &(h->table[indexFor(h->tablelength,hashvalue)]),
+                                 k, hashvalue);
+    if (NULL == pE && NULL != h->oldtable)
+    {
+        pE = hashtable_find_in_chain(h, 
+                 &(h->oldtable[indexFor(h->oldtablelength,hashvalue)]),
+                 k, hashvalue);
+    }
+    return pE;
+}
+
 /*****************************************************************************/
 unsigned int
 hashtable_count(struct hashtable *h)
@@ -150,6 +205,7 @@ hashtable_insert(struct hashtable *h, void *k, void *v)
     /* This method allows duplicate keys - but they shouldn't be used */
     unsigned int index;
     struct entry *e;
+    hashtable_resize_step(h);
     if (++(h->entrycount) > h->loadlimit)
     {
         /* Ignore the return value. If expand fails, we should
@@ -173,18 +229,10 @@ hashtable_insert(struct hashtable *h, void *k, void *v)
 void * /* returns value associated with key */
 hashtable_search(struct hashtable *h, void *k)
 {
-    struct entry *e;
-    unsigned int hashvalue, index;
-    hashvalue = hash(h,k);
-    index = indexFor(h->tablelength,hashvalue);
-    e = h->table[index];
-    while (NULL != e)
-    {
-        /* Check hash value to short circuit heavier comparison */
-        if ((hashvalue == e->h) && (h->eqfn(k, e->k))) return e->v;
-        e = e->next;
-    }
-    return NULL;
+    struct entry **pE;
+    hashtable_resize_step(h);
+    pE = hashtable_find(h, k, hash(h,k));
+    return (NULL != pE) ? (*pE)->v : NULL;
 }
 
 /*****************************************************************************/
@@ -197,28 +245,17 @@ hashtable_remove(struct hashtable *h, void *k)
     struct entry *e;
     struct entry **pE;
     void *v;
-    unsigned int hashvalue, index;
 
-    hashvalue = hash(h,k);
-    index = indexFor(h->tablelength,hash(h,k));
-    pE = &(h->table[index]);
+    hashtable_resize_step(h);
+    pE = hashtable_find(h, k, hash(h,k));
+    if (NULL == pE) return NULL;
     e = *pE;
-    while (NULL != e)
-    {
-        /* Check hash value to short circuit heavier comparison */
-        if ((hashvalue == e->h) && (h->eqfn(k, e->k)))
-        {
-            *pE = e->next;
-            h->entrycount--;
-            v = e->v;
-            h->hash_free(e->k);
-            h->hash_free(e);
-            return v;
-        }
-        pE = &(e->next);
-        e = e->next;
-    }
-    return NULL;
+    *pE = e->next;
+    h->entrycount--;
+    v = e->v;
+    h->hash_free(e->k);
+    h->hash_free(e);
+    return v;
 }
 
 void
@@ -226,7 +263,10 @@ hashtable_get_all_keys(struct hashtable *h, void** keys)
 {
     unsigned int i, j;
     struct entry *e;
-    struct entry **table = h->table;
+    struct entry **table;
+
+    hashtable_finish_resize(h);
+    table = h->table;
 
     for (i = 0, j = 0; i < h->tablelength; i++)
     {
@@ -242,12 +282,15 @@ hashtable_get_all_keys(struct hashtable *h, void** keys)
 void
 hashtable_print(struct hashtable *h)
 {
-    unsigned int i, j;
+    unsigned int i;
     struct entry *e;
-    struct entry **table = h->table;
+    struct entry **table;
+
+    hashtable_finish_resize(h);
+    table = h->table;
 
     difi_dbg_print("========\n");
-    for (i = 0, j = 0; i < h->tablelength; i++)
+    for (i = 0; i < h->tablelength; i++)
     {
         e = table[i];
         while (NULL != e)
@@ -264,7 +307,10 @@ hashtable_get_all_values(struct hashtable *h, void** values)
 {
     unsigned int i, j;
     struct entry *e;
-    struct entry **table = h->table;
+    struct entry **table;
+
+    hashtable_finish_resize(h);
+    table = h->table;
 
     for (i = 0, j = 0; i < h->tablelength; i++)
     {
@@ -278,34 +324,38 @@ hashtable_get_all_values(struct hashtable *h, void** values)
 
 /*****************************************************************************/
 /* destroy */
-void
-hashtable_destroy(struct hashtable *h, int free_values)
+static void
+hashtable_free_chains(struct hashtable *h, struct entry **table,
+                      unsigned int tablelength, int free_values)
 {
     unsigned int i;
     struct entry *e, *f;
-    struct entry **table = h->table;
-    void (*hash_free)(void* p) = h->hash_free;
 
-    if (free_values)
+    for (i = 0; i < tablelength; i++)
     {
-        for (i = 0; i < h->tablelength; i++)
-        {
-            e = table[i];
-            while (NULL != e)
-            { f = e; e = e->next; hash_free(f->k); hash_free(f->v); hash_free(f); }
-        }
-    }
-    else
-    {
-        for (i = 0; i < h->tablelength; i++)
-        {
-            e = table[i];
-            while (NULL != e)
-            { f = e; e = e->next; hash_free(f->k); hash_free(f); }
+        e = table[i];
+        while (NULL != e)
+        { 
+            f = e; e = e->next; 
+            h->hash_free(f->k); 
+            if (free_values) h->hash_free(f->v); 
+            h->hash_free(f); 
         }
     }
-    hash_free(h->table);
-    hash_free(h);
+    h->hash_free(table);
+}
+
+void
+hashtable_destroy(struct hashtable *h, int free_values)
+{
+    hashtable_free_chains(h, h->table, h->tablelength, free_values);
+    /* Old table is drained from the start, moved buckets are empty */
+    if (NULL != h->oldtable)
+        hashtable_free_chains(h, h->oldtable, h->oldtablelength, free_values);
+    /* Table being zeroed holds no entries yet */
+    if (NULL != h->nexttable)
+        h->hash_free(h->nexttable);
+    h->hash_free(h);
 }
 
 /*****************************************************************************/
@@ -319,23 +369,13 @@ hashtable_destroy(struct hashtable *h, int free_values)
 int
 hashtable_change(struct hashtable *h, void *k, void *v)
 {
-    struct entry *e;
-    unsigned int hashvalue, index;
-    hashvalue = hash(h,k);
-    index = indexFor(h->tablelength,hashvalue);
-    e = h->table[index];
-    while (NULL != e)
-    {
-        /* Check hash value to short circuit heavier comparison */
-        if ((hashvalue == e->h) && (h->eqfn(k, e->k)))
-        {
-            h->hash_free(e->v);
-            e->v = v;
-            return -1;
-        }
-        e = e->next;
-    }
-    return 0;
+    struct entry **pE;
+    hashtable_resize_step(h);
+    pE = hashtable_find(h, k, hash(h,k));
+    if (NULL == pE) return 0;
+    h->hash_free((*pE)->v);
+    (*pE)->v = v;
+    return -1;
 }
 
 
@@ -14,6 +14,13 @@ struct entry
 struct hashtable {
     unsigned int tablelength;
     struct entry **table;
+    /* Incremental resize: nexttable is being zeroed, then becomes table while
+     * the previous table is drained from oldtable bucket by bucket */
+    unsigned int nexttablelength;
+    struct entry **nexttable;
+    unsigned int oldtablelength;
+    struct entry **oldtable;
+    unsigned int resizeindex;
     unsigned int entrycount;
     unsigned int loadlimit;
     unsigned int primeindex;
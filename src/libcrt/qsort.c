@@ -24,8 +24,10 @@ void quick_sort_ulong64(ulong64_t *arr, unsigned elements) {
     if (L < R) {
       piv=arr[L];
       while (L < R) {
-        while (arr[R]>=piv && L<R) R--; if (L<R) arr[L++]=arr[R];
-        while (arr[L]<=piv && L<R) L++; if (L<R) arr[R--]=arr[L]; 
+        while (arr[R]>=piv && L<R) R--;
+        if (L<R) arr[L++]=arr[R];
+        while (arr[L]<=piv && L<R) L++;
+        if (L<R) arr[R--]=arr[L];
       }
       arr[L]=piv; beg[i+1]=L+1; end[i+1]=end[i]; end[i++]=L;
       if (end[i]-beg[i] > end[i-1] - beg[i-1]) {
@@ -49,8 +51,10 @@ void quick_sort_ulong64_ptr(ulong64_t** arr, unsigned elements) {
     if (L < R) {
       piv=arr[L];
       while (L < R) {
-        while (*arr[R]>=*piv && L<R) R--; if (L<R) arr[L++]=arr[R];
-        while (*arr[L]<=*piv && L<R) L++; if (L<R) arr[R--]=arr[L]; 
+        while (*arr[R]>=*piv && L<R) R--;
+        if (L<R) arr[L++]=arr[R];
+        while (*arr[L]<=*piv && L<R) L++;
+        if (L<R) arr[R--]=arr[L];
       }
       arr[L]=piv; beg[i+1]=L+1; end[i+1]=end[i]; end[i++]=L;
       if (end[i]-beg[i] > end[i-1] - beg[i-1]) {
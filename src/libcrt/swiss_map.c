@@ -0,0 +1,328 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Group-probing hash table for 64-bit keys and values
+*/
+#include "libcrt/baselib.h"
+#include "libcrt/swiss_map.h"
+
+/* 
+   SSE2 is always there on x64. 32-bit kernel code may not touch XMM 
+   registers without saving the FPU state, so only user mode builds use it
+*/
+#if !defined(SWISS_MAP_NO_SSE2)
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__x86_64__) || \
+    (defined(DIFI_USER_MODE) && \
+     ((defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)))
+#define SWISS_MAP_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define CTRL_EMPTY      (0x80)
+#define CTRL_DELETED    (0xFE)
+/* Full slots have the high bit clear and keep 7 bits of the hash */
+
+#define SWISS_MAP_MAX_SIZE  (1u << 27)    /* Keeps size of the slot array in 32 bits */
+
+struct swiss_map_slot
+{
+    ulong64_t key;
+    ulong64_t value;
+};
+
+struct swiss_map
+{
+    unsigned char*          ctrl;
+    struct swiss_map_slot*  slots;
+    unsigned                size;           /* Power of two, at least one group */
+    unsigned                count;
+    unsigned                growth_left;    /* Empty slots we may still fill */
+
+    void* (*alloc_fn)(unsigned size); 
+    void  (*free_fn) (void* mem);
+};
+
+static __inline ulong64_t hash_key(ulong64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static __inline unsigned lowest_bit(unsigned mask)
+{
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (unsigned)i;
+#elif defined(__GNUC__)
+    return (unsigned)__builtin_ctz(mask);
+#else
+    unsigned i = 0;
+
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+#ifdef SWISS_MAP_SSE2
+
+/* Bit i is set if control byte i of the group equals b */
+static __inline unsigned group_match(const unsigned char* group, unsigned char b)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+}
+
+/* Bit i is set if slot i of the group is empty or deleted */
+static __inline unsigned group_match_free(const unsigned char* group)
+{
+    return (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+#else
+
+static __inline unsigned group_match(const unsigned char* group, unsigned char b)
+{
+    unsigned mask = 0;
+    unsigned i;
+
+    for (i = 0; i < SWISS_MAP_GROUP_SIZE; i++) {
+        if (group[i] == b)
+            mask |= 1u << i;
+    }
+    return mask;
+}
+
+static __inline unsigned group_match_free(const unsigned char* group)
+{
+    unsigned mask = 0;
+    unsigned i;
+
+    for (i = 0; i < SWISS_MAP_GROUP_SIZE; i++) {
+        if (group[i] & 0x80)
+            mask |= 1u << i;
+    }
+    return mask;
+}
+
+#endif
+
+/* Index of the slot holding the key, or map->size if there is none */
+static unsigned find_index(struct swiss_map* map, ulong64_t key, ulong64_t hash)
+{
+    unsigned      group_mask = map->size / SWISS_MAP_GROUP_SIZE - 1;
+    unsigned      group = (unsigned)(hash >> 32) & group_mask;
+    unsigned char h2 = (unsigned char)(hash & 0x7F);
+    unsigned      step = 0;
+
+    for (;;) {
+        const unsigned char* ctrl = &map->ctrl[group * SWISS_MAP_GROUP_SIZE];
+        unsigned             mask = group_match(ctrl, h2);
+
+        while (mask != 0) {
+            unsigned i = group * SWISS_MAP_GROUP_SIZE + lowest_bit(mask);
+            if (map->slots[i].key == key)
+                return i;
+            mask &= mask - 1;
+        }
+        /* A group with an empty slot ends the probe sequence */
+        if (group_match(ctrl, CTRL_EMPTY) != 0)
+            return map->size;
+
+        /* Triangular steps visit every group of a power of two table */
+        step++;
+        group = (group + step) & group_mask;
+    }
+}
+
+/* First empty or deleted slot on the probe sequence of the hash */
+static unsigned find_free_index(struct swiss_map* map, ulong64_t hash)
+{
+    unsigned group_mask = map->size / SWISS_MAP_GROUP_SIZE - 1;
+    unsigned group = (unsigned)(hash >> 32) & group_mask;
+    unsigned step = 0;
+
+    for (;;) {
+        unsigned mask = group_match_free(&map->ctrl[group * SWISS_MAP_GROUP_SIZE]);
+        if (mask != 0)
+            return group * SWISS_MAP_GROUP_SIZE + lowest_bit(mask);
+        step++;
+        group = (group + step) & group_mask;
+    }
+}
+
+static int alloc_table(struct swiss_map* map, unsigned size)
+{
+    map->ctrl = (unsigned char*)map->alloc_fn(size);
+    if (map->ctrl == NULL)
+        return 0;
+    map->slots = (struct swiss_map_slot*)map->alloc_fn(size * sizeof(*map->slots));
+    if (map->slots == NULL) {
+        map->free_fn(map->ctrl);
+        map->ctrl = NULL;
+        return 0;
+    }
+    memset(map->ctrl, CTRL_EMPTY, size);
+    map->size = size;
+    map->growth_left = size / 8 * 7 - map->count;
+    return 1;
+}
+
+/* Move all entries to a new table, dropping deleted markers on the way */
+static int rehash(struct swiss_map* map, unsigned size)
+{
+    unsigned char*         old_ctrl = map->ctrl;
+    struct swiss_map_slot* old_slots = map->slots;
+    unsigned               old_size = map->size;
+    unsigned               i;
+
+    if (!alloc_table(map, size)) {
+        map->ctrl = old_ctrl;
+        map->slots = old_slots;
+        return 0;
+    }
+    for (i = 0; i < old_size; i++) {
+        if ((old_ctrl[i] & 0x80) == 0) {
+            unsigned j = find_free_index(map, hash_key(old_slots[i].key));
+            map->ctrl[j] = old_ctrl[i];
+            map->slots[j] = old_slots[i];
+        }
+    }
+    map->free_fn(old_ctrl);
+    map->free_fn(old_slots);
+    return 1;
+}
+
+struct swiss_map* swiss_map_create(unsigned min_size,
+                                   void* (*alloc_fn)(unsigned size), 
+                                   void (*free_fn)(void* mem))
+{
+    struct swiss_map* map;
+    unsigned          size = SWISS_MAP_GROUP_SIZE;
+
+    if (min_size > SWISS_MAP_MAX_SIZE / 8 * 7)
+        return NULL;
+    while (size / 8 * 7 < min_size)
+        size *= 2;
+
+    map = (struct swiss_map*)alloc_fn(sizeof(*map));
+    if (map == NULL)
+        return NULL;
+    memset(map, 0, sizeof(*map));
+    map->alloc_fn = alloc_fn;
+    map->free_fn = free_fn;
+
+    if (!alloc_table(map, size)) {
+        free_fn(map);
+        return NULL;
+    }
+    return map;
+}
+
+void swiss_map_destroy(struct swiss_map* map)
+{
+    map->free_fn(map->ctrl);
+    map->free_fn(map->slots);
+    map->free_fn(map);
+}
+
+int swiss_map_insert(struct swiss_map* map, ulong64_t key, ulong64_t value)
+{
+    ulong64_t hash = hash_key(key);
+    unsigned  i = find_index(map, key, hash);
+
+    if (i < map->size) {
+        map->slots[i].value = value;
+        return 1;
+    }
+
+    if (map->growth_left == 0) {
+        /* Grow if the table is really full, otherwise just sweep deleted slots */
+        unsigned size = map->size;
+        if (map->count >= size / 16 * 7) {
+            if (size >= SWISS_MAP_MAX_SIZE)
+                return 0;
+            size *= 2;
+        }
+        if (!rehash(map, size))
+            return 0;
+    }
+
+    i = find_free_index(map, hash);
+    if (map->ctrl[i] == CTRL_EMPTY)
+        map->growth_left--;
+    map->ctrl[i] = (unsigned char)(hash & 0x7F);
+    map->slots[i].key = key;
+    map->slots[i].value = value;
+    map->count++;
+    return 1;
+}
+
+int swiss_map_search(struct swiss_map* map, ulong64_t key, ulong64_t* value)
+{
+    unsigned i = find_index(map, key, hash_key(key));
+
+    if (i == map->size)
+        return 0;
+    *value = map->slots[i].value;
+    return 1;
+}
+
+int swiss_map_remove(struct swiss_map* map, ulong64_t key)
+{
+    unsigned i = find_index(map, key, hash_key(key));
+    unsigned group;
+
+    if (i == map->size)
+        return 0;
+
+    /* 
+       Probes stop at a group with an empty slot. If our group has one
+       already, the slot can become empty again, otherwise probes for 
+       other keys must still walk through it
+    */
+    group = i & ~(SWISS_MAP_GROUP_SIZE - 1);
+    if (group_match(&map->ctrl[group], CTRL_EMPTY) != 0) {
+        map->ctrl[i] = CTRL_EMPTY;
+        map->growth_left++;
+    } else {
+        map->ctrl[i] = CTRL_DELETED;
+    }
+    map->count--;
+    return 1;
+}
+
+unsigned swiss_map_count(struct swiss_map* map)
+{
+    return map->count;
+}
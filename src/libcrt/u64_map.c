@@ -0,0 +1,240 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Open addressing hash table for 64-bit keys and values
+*/
+#include "libcrt/baselib.h"
+#include "libcrt/u64_map.h"
+
+#define U64_MAP_MIN_SIZE    (16)
+#define U64_MAP_MAX_SIZE    (1u << 27)    /* Keeps size of the slot array in 32 bits */
+
+struct u64_map_slot
+{
+    ulong64_t key;
+    ulong64_t value;
+};
+
+/* Size and slots are replaced together, so a reader never mixes them */
+struct u64_map_table
+{
+    unsigned            size;       /* Power of two */
+    struct u64_map_slot slots[1];
+};
+
+struct u64_map
+{
+    struct u64_map_table* table;
+    unsigned              count;
+    unsigned              load_limit;
+
+    void* (*alloc_fn)(unsigned size); 
+    void  (*free_fn) (void* mem);
+
+    void  (*retire_fn)(void* context, void* mem);
+    void* retire_context;
+};
+
+/* Finalizer of MurmurHash3, spreads sequential block numbers over the table */
+static __inline unsigned slot_index(struct u64_map_table* table, ulong64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ULL;
+    key ^= key >> 33;
+    return (unsigned)key & (table->size - 1);
+}
+
+static struct u64_map_table* alloc_table(struct u64_map* map, unsigned size)
+{
+    struct u64_map_table* table;
+    unsigned              i;
+
+    table = (struct u64_map_table*)map->alloc_fn(sizeof(*table) + 
+                                                 (size - 1) * sizeof(table->slots[0]));
+    if (table == NULL)
+        return NULL;
+    table->size = size;
+    for (i = 0; i < size; i++)
+        table->slots[i].key = U64_MAP_EMPTY_KEY;
+    return table;
+}
+
+/* Returns the slot holding the key or the empty slot where it belongs */
+static struct u64_map_slot* find_slot(struct u64_map_table* table, ulong64_t key)
+{
+    unsigned i = slot_index(table, key);
+
+    while (table->slots[i].key != key && table->slots[i].key != U64_MAP_EMPTY_KEY)
+        i = (i + 1) & (table->size - 1);
+    return &table->slots[i];
+}
+
+static int grow(struct u64_map* map)
+{
+    struct u64_map_table* old_table = map->table;
+    struct u64_map_table* table;
+    unsigned              i;
+
+    if (old_table->size >= U64_MAP_MAX_SIZE)
+        return 0;
+    table = alloc_table(map, old_table->size * 2);
+    if (table == NULL)
+        return 0;
+
+    for (i = 0; i < old_table->size; i++) {
+        if (old_table->slots[i].key != U64_MAP_EMPTY_KEY)
+            *find_slot(table, old_table->slots[i].key) = old_table->slots[i];
+    }
+    map->load_limit = table->size / 4 * 3;
+
+    /* Publish the table filled */
+    difi_write_barrier();
+    map->table = table;
+    if (map->retire_fn != NULL)
+        map->retire_fn(map->retire_context, old_table);
+    else
+        map->free_fn(old_table);
+    return 1;
+}
+
+struct u64_map* u64_map_create(unsigned min_size,
+                               void* (*alloc_fn)(unsigned size), 
+                               void (*free_fn)(void* mem))
+{
+    struct u64_map* map;
+    unsigned        size = U64_MAP_MIN_SIZE;
+
+    if (min_size > U64_MAP_MAX_SIZE / 4 * 3)
+        return NULL;
+    while (size / 4 * 3 < min_size)
+        size *= 2;
+
+    map = (struct u64_map*)alloc_fn(sizeof(*map));
+    if (map == NULL)
+        return NULL;
+    memset(map, 0, sizeof(*map));
+    map->alloc_fn = alloc_fn;
+    map->free_fn = free_fn;
+
+    map->table = alloc_table(map, size);
+    if (map->table == NULL) {
+        free_fn(map);
+        return NULL;
+    }
+    map->load_limit = size / 4 * 3;
+    return map;
+}
+
+void u64_map_destroy(struct u64_map* map)
+{
+    map->free_fn(map->table);
+    map->free_fn(map);
+}
+
+int u64_map_insert(struct u64_map* map, ulong64_t key, ulong64_t value)
+{
+    struct u64_map_slot* slot;
+
+    if (key == U64_MAP_EMPTY_KEY)
+        return 0;
+
+    slot = find_slot(map->table, key);
+    if (slot->key == U64_MAP_EMPTY_KEY) {
+        if (map->count + 1 > map->load_limit) {
+            if (!grow(map))
+                return 0;
+            slot = find_slot(map->table, key);
+        }
+        /* Value first, a reader finding the key finds it with the value */
+        slot->value = value;
+        difi_write_barrier();
+        slot->key = key;
+        map->count++;
+        return 1;
+    }
+    slot->value = value;
+    return 1;
+}
+
+int u64_map_search(struct u64_map* map, ulong64_t key, ulong64_t* value)
+{
+    struct u64_map_slot* slot;
+
+    if (key == U64_MAP_EMPTY_KEY)
+        return 0;
+
+    slot = find_slot(map->table, key);
+    if (slot->key == U64_MAP_EMPTY_KEY)
+        return 0;
+    *value = slot->value;
+    return 1;
+}
+
+int u64_map_remove(struct u64_map* map, ulong64_t key)
+{
+    struct u64_map_slot* slots = map->table->slots;
+    unsigned             mask = map->table->size - 1;
+    unsigned             hole, i;
+
+    if (key == U64_MAP_EMPTY_KEY)
+        return 0;
+
+    hole = (unsigned)(find_slot(map->table, key) - slots);
+    if (slots[hole].key == U64_MAP_EMPTY_KEY)
+        return 0;
+
+    /* 
+       Backward shift deletion: pull following entries of the cluster into 
+       the hole unless they are already at or past their home slot.
+       No tombstones, so probe lengths do not degrade over time
+    */
+    i = hole;
+    for (;;) {
+        unsigned home;
+
+        i = (i + 1) & mask;
+        if (slots[i].key == U64_MAP_EMPTY_KEY)
+            break;
+        home = slot_index(map->table, slots[i].key);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            slots[hole] = slots[i];
+            hole = i;
+        }
+    }
+    slots[hole].key = U64_MAP_EMPTY_KEY;
+    map->count--;
+    return 1;
+}
+
+void u64_map_set_retire(struct u64_map* map, 
+                        void (*retire_fn)(void* context, void* mem),
+                        void* context)
+{
+    map->retire_fn = retire_fn;
+    map->retire_context = context;
+}
+
+unsigned u64_map_count(struct u64_map* map)
+{
+    return map->count;
+}
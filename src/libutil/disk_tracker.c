@@ -20,61 +20,396 @@
   THE SOFTWARE.
 */
 #include "libcrt/baselib.h"
-#include "libcrt/hashtable.h"
+#include "libcrt/u64_map.h"
+#include "libutil/extent_map.h"
+#include "libutil/free_space.h"
+#include "libutil/epoch.h"
 #include "libutil/disk_tracker.h"
 
+/* 
+   Source disk is split into chunks of 2048 blocks (1Mb of 512 byte sectors).
+   Chunk index lets to skip the remap tree for ranges which were never written
+*/
+#define CHUNK_SHIFT         (11)
+#define CHUNK_INDEX_SIZE    (1024)
+
+/* 
+   With several shards source chunks go to shards round robin, so writes to
+   different chunks usually take different locks
+*/
+#define SHARD_SHIFT         CHUNK_SHIFT
+
+/* Shard out of free blocks takes at least this many from unallocated storage */
+#define REFILL_BLOCKS       (1 << 16)
+#define REFILL_EXTENTS      (16)
+
+/* 
+   Remapped part of the source chunks which belong to the shard. Writers 
+   take the lock, readers take nothing: sequence is odd while the indexes 
+   change and readers retry if it moved. Memory they may still look at is
+   freed through the tracker epoch
+*/
+struct tracker_shard
+{
+    difi_lock_t        lock;
+    volatile long      sequence;
+    struct extent_map* remap_index;     /* source runs -> target runs */
+    struct u64_map*    chunk_index;     /* chunk -> number of remapped blocks in it */
+    int                chunk_index_valid;
+    struct free_space* free_space;      /* Blocks this shard allocates from */
+    unsigned           remapped_blocks;
+};
+
 struct disk_tracker
 {
     struct remap_storage* head;
-    struct remap_storage* current;
-    struct disk_extent*   current_extent;
+    struct remap_storage* reserved;     /* One extent each, kept out of use */
+    difi_lock_t           storage_lock;
+    struct free_space*    free_space;   /* Storage not handed to shards yet */
+    struct epoch*         epoch;        /* Frees what readers may still see */
+    int                   alloc_policy;
+    unsigned              total_blocks;
+    disk_tracker_run_hook run_hook;     /* Told about new runs */
+    void*                 run_hook_context;
 
     void* (*alloc_fn)(unsigned size); 
     void  (*free_fn) (void* mem);
 
-    struct hashtable* blocks_map;
-    unsigned          current_block;
-    unsigned          free_blocks;
-    unsigned          total_blocks;
+    unsigned              shard_count;
+    struct tracker_shard  shards[1];    /* Must be last */
+};
+
+/* Accumulates remapped pieces into extents, merging continuous ones */
+struct remap_builder
+{
+    struct disk_extent_remap* result;   /* NULL when only counting */
+    unsigned                  capacity; /* Extents result can hold */
+    unsigned                  count;
+    struct disk_extent        last;
+};
+
+/* Position in the runs of one shard, for walking all shards in order */
+struct shard_cursor
+{
+    struct extent_map_iter iter;
+    struct extent_map_run  run;
+    int                    have_run;
+};
+
+struct disk_tracker_cursor
+{
+    struct disk_tracker* tracker;
+    ulong64_t            next_block;
+    struct shard_cursor  shards[1];     /* One per shard, must be last */
 };
 
-static unsigned int diskf_hash(void* k)
+
+static struct tracker_shard* shard_of(struct disk_tracker* tracker, ulong64_t block)
+{
+    return &tracker->shards[(block >> SHARD_SHIFT) % tracker->shard_count];
+}
+
+/* End of the part of [b, end) which belongs to the shard of block b */
+static ulong64_t piece_end(struct disk_tracker* tracker, ulong64_t b, ulong64_t end)
+{
+    ulong64_t next_chunk = ((b >> SHARD_SHIFT) + 1) << SHARD_SHIFT;
+
+    if (tracker->shard_count == 1 || end < next_chunk)
+        return end;
+    return next_chunk;
+}
+
+static void write_begin(struct tracker_shard* shard)
+{
+    shard->sequence++;
+    difi_write_barrier();
+}
+
+static void write_end(struct tracker_shard* shard)
+{
+    difi_write_barrier();
+    shard->sequence++;
+}
+
+/* Wait while a writer is inside, outside of the epoch so it may wait for us */
+static long read_begin(struct tracker_shard* shard)
+{
+    long sequence;
+
+    while ((sequence = shard->sequence) & 1)
+        difi_cpu_relax();
+    difi_read_barrier();
+    return sequence;
+}
+
+/* Non-zero if what was read since read_begin may be torn */
+static int read_retry(struct tracker_shard* shard, long sequence)
+{
+    difi_read_barrier();
+    return shard->sequence != sequence;
+}
+
+static void retire_memory(void* context, void* mem)
+{
+    epoch_retire(((struct disk_tracker*)context)->epoch, mem, NULL);
+}
+
+static void destroy_remap_index(void* map)
+{
+    extent_map_destroy((struct extent_map*)map);
+}
+
+static void destroy_chunk_index(void* map)
+{
+    u64_map_destroy((struct u64_map*)map);
+}
+
+/* 
+   Whole tracker operations take all shards in order, then the storage lock.
+   Remaps never hold more than one lock at a time
+*/
+static void lock_all(struct disk_tracker* tracker)
+{
+    unsigned i;
+
+    for (i = 0; i < tracker->shard_count; i++)
+        difi_lock_acquire(&tracker->shards[i].lock);
+    difi_lock_acquire(&tracker->storage_lock);
+}
+
+static void unlock_all(struct disk_tracker* tracker)
+{
+    unsigned i;
+
+    difi_lock_release(&tracker->storage_lock);
+    for (i = tracker->shard_count; i > 0; i--)
+        difi_lock_release(&tracker->shards[i - 1].lock);
+}
+
+/* Single shard allocates from the storage directly, several get it in portions */
+static struct free_space* unallocated_space(struct disk_tracker* tracker)
+{
+    return tracker->shard_count == 1 ? tracker->shards[0].free_space 
+                                     : tracker->free_space;
+}
+
+/* Hand all extents of the storage over to the free space manager */
+static int add_free_storage(struct disk_tracker* tracker, 
+                            struct remap_storage* storage)
+{
+    unsigned i;
+
+    for (i = 0; i < storage->number_of_extents; i++) {
+        struct disk_extent* extent = &storage->extents[i];
+        int status = free_space_add(unallocated_space(tracker), 
+                                    extent->start_block, 
+                                    extent->length_in_blocks);
+        if (status == FREE_SPACE_OVERLAP) {
+            difi_dbg_print("storage extent %llu:%lu is already in use\n",
+                           extent->start_block, extent->length_in_blocks);
+            return DISK_TRACKER_INV_ARGUMENT;
+        }
+        if (status != FREE_SPACE_OK) {
+            difi_dbg_print("failed to add free extent\n");
+            return DISK_TRACKER_NO_MEMORY;
+        }
+    }
+    tracker->total_blocks += storage->number_of_blocks;
+    return DISK_TRACKER_OK;
+}
+
+static int take_reserved(struct disk_tracker* tracker, struct disk_extent* extent)
+{
+    int status = free_space_take(unallocated_space(tracker), extent->start_block, 
+                                 extent->length_in_blocks);
+
+    if (status == FREE_SPACE_NOT_FREE) {
+        difi_dbg_print("storage extent %llu:%lu is not free\n", 
+                       extent->start_block, extent->length_in_blocks);
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+    if (status != FREE_SPACE_OK)
+        return DISK_TRACKER_NO_MEMORY;
+    tracker->total_blocks -= extent->length_in_blocks;
+    return DISK_TRACKER_OK;
+}
+
+static void free_reserved(struct disk_tracker* tracker)
+{
+    while (tracker->reserved != NULL) {
+        struct remap_storage* next = tracker->reserved->next;
+
+        tracker->free_fn(tracker->reserved);
+        tracker->reserved = next;
+    }
+}
+
+static void destroy_free_space(struct disk_tracker* tracker)
+{
+    unsigned i;
+
+    if (tracker->free_space != NULL) {
+        free_space_destroy(tracker->free_space);
+        tracker->free_space = NULL;
+    }
+    for (i = 0; i < tracker->shard_count; i++) {
+        if (tracker->shards[i].free_space != NULL) {
+            free_space_destroy(tracker->shards[i].free_space);
+            tracker->shards[i].free_space = NULL;
+        }
+    }
+}
+
+/* Start over with all storage free */
+static int load_free_space(struct disk_tracker* tracker)
+{
+    struct remap_storage* storage;
+    int                   status = DISK_TRACKER_OK;
+    unsigned              i;
+
+    destroy_free_space(tracker);
+    tracker->total_blocks = 0;
+    tracker->free_space = free_space_create(tracker->alloc_fn, tracker->free_fn);
+    for (i = 0; i < tracker->shard_count && tracker->free_space != NULL; i++) {
+        tracker->shards[i].free_space = free_space_create(tracker->alloc_fn, 
+                                                          tracker->free_fn);
+        if (tracker->shards[i].free_space == NULL)
+            break;
+    }
+    if (i < tracker->shard_count) {
+        difi_dbg_print("failed to allocate free space\n");
+        return DISK_TRACKER_NO_MEMORY;
+    }
+
+    for (storage = tracker->head; 
+         storage != NULL && status == DISK_TRACKER_OK; 
+         storage = storage->next) {
+        status = add_free_storage(tracker, storage);
+    }
+    for (storage = tracker->reserved; 
+         storage != NULL && status == DISK_TRACKER_OK; 
+         storage = storage->next) {
+        status = take_reserved(tracker, &storage->extents[0]);
+    }
+    return status;
+}
+
+/* Drop indexes of all shards. Readers may be using them unless it is the end */
+static void destroy_indexes(struct disk_tracker* tracker, int readers)
 {
-    return good_hash_func(k, sizeof(unsigned long long), 0);
+    unsigned i;
+
+    for (i = 0; i < tracker->shard_count; i++) {
+        struct tracker_shard* shard = &tracker->shards[i];
+
+        if (shard->remap_index != NULL) {
+            if (readers)
+                epoch_retire(tracker->epoch, shard->remap_index, destroy_remap_index);
+            else
+                extent_map_destroy(shard->remap_index);
+            shard->remap_index = NULL;
+        }
+        if (shard->chunk_index != NULL) {
+            if (readers)
+                epoch_retire(tracker->epoch, shard->chunk_index, destroy_chunk_index);
+            else
+                u64_map_destroy(shard->chunk_index);
+            shard->chunk_index = NULL;
+        }
+        shard->remapped_blocks = 0;
+    }
 }
 
-static int diskf_key_equal(void* a, void* b)
+/* (Re)create empty remap and chunk indexes, all shards are locked */
+static int create_indexes(struct disk_tracker* tracker)
 {
-    return (int)!(*(unsigned long long*)a - *(unsigned long long*)b);
+    int      status = DISK_TRACKER_OK;
+    unsigned i;
+
+    for (i = 0; i < tracker->shard_count; i++)
+        write_begin(&tracker->shards[i]);
+
+    destroy_indexes(tracker, 1);
+
+    for (i = 0; i < tracker->shard_count && status == DISK_TRACKER_OK; i++) {
+        struct tracker_shard* shard = &tracker->shards[i];
+
+        shard->remap_index = extent_map_create(tracker->alloc_fn, tracker->free_fn);
+        shard->chunk_index = u64_map_create(CHUNK_INDEX_SIZE / tracker->shard_count, 
+                                            tracker->alloc_fn, tracker->free_fn);
+        if (shard->remap_index == NULL || shard->chunk_index == NULL) {
+            difi_dbg_print("failed to allocate remap indexes\n");
+            status = DISK_TRACKER_NO_MEMORY;
+            break;
+        }
+        extent_map_set_retire(shard->remap_index, retire_memory, tracker);
+        u64_map_set_retire(shard->chunk_index, retire_memory, tracker);
+        shard->chunk_index_valid = 1;
+    }
+
+    for (i = 0; i < tracker->shard_count; i++)
+        write_end(&tracker->shards[i]);
+    return status;
 }
 
+static void free_tracker(struct disk_tracker* tracker)
+{
+    unsigned i;
 
+    destroy_indexes(tracker, 0);
+    destroy_free_space(tracker);
+    free_reserved(tracker);
+    if (tracker->epoch != NULL)
+        epoch_destroy(tracker->epoch);
+    for (i = 0; i < tracker->shard_count; i++)
+        difi_lock_destroy(&tracker->shards[i].lock);
+    difi_lock_destroy(&tracker->storage_lock);
+    tracker->free_fn(tracker);
+}
 
 disk_remap_t disk_tracker_init(void* (*alloc_fn)(unsigned size), 
                                void (*free_fn)(void* mem), 
                                struct remap_storage* initial_storage)
 {
-    struct disk_tracker* tracker = (struct disk_tracker*)alloc_fn(sizeof(*tracker));
+    return disk_tracker_init_sharded(alloc_fn, free_fn, initial_storage, 1);
+}
+
+disk_remap_t disk_tracker_init_sharded(void* (*alloc_fn)(unsigned size), 
+                                       void (*free_fn)(void* mem), 
+                                       struct remap_storage* initial_storage,
+                                       unsigned shard_count)
+{
+    struct disk_tracker* tracker;
+    unsigned             sz, i;
+
+    if (shard_count == 0 || shard_count > DISK_TRACKER_MAX_SHARDS) {
+        difi_dbg_print("invalid number of shards %u\n", shard_count);
+        return NULL;
+    }
+
+    sz = sizeof(*tracker) + sizeof(struct tracker_shard) * (shard_count - 1);
+    tracker = (struct disk_tracker*)alloc_fn(sz);
     if (tracker == NULL) {
         difi_dbg_print("failed to allocate new disk tracker\n");
         return NULL;
     }
 
-    memset(tracker, 0, sizeof(*tracker));
+    memset(tracker, 0, sz);
     tracker->alloc_fn = alloc_fn;
     tracker->free_fn = free_fn;
+    tracker->shard_count = shard_count;
+    difi_lock_init(&tracker->storage_lock);
+    for (i = 0; i < shard_count; i++)
+        difi_lock_init(&tracker->shards[i].lock);
     
-    tracker->blocks_map = create_hashtable(1000, diskf_hash, diskf_key_equal, 
-                                           alloc_fn, free_fn);
-    if (tracker->blocks_map == NULL) {
-        difi_dbg_print("failed to allocate hashtable\n");
-        free_fn(tracker);
+    tracker->head = initial_storage;
+    tracker->epoch = epoch_create(alloc_fn, free_fn);
+    if (tracker->epoch == NULL ||
+        create_indexes(tracker) != DISK_TRACKER_OK || 
+        load_free_space(tracker) != DISK_TRACKER_OK) {
+        free_tracker(tracker);
         return NULL;
     }
-    
-    tracker->head = tracker->current = initial_storage;
-    tracker->free_blocks = tracker->total_blocks = initial_storage->number_of_blocks;
-    tracker->current_extent = &initial_storage->extents[0];
 
     return tracker;
 }
@@ -82,48 +417,32 @@ disk_remap_t disk_tracker_init(void* (*alloc_fn)(unsigned size),
 int disk_tracker_reset(disk_remap_t remap)
 {
     struct disk_tracker* tracker = (struct disk_tracker*)remap;
+    int                  status;
+
     if (tracker == NULL) {
         difi_dbg_print("invalid argument\n");
         return DISK_TRACKER_INV_ARGUMENT;
     }
 
-    if (tracker->blocks_map) {
-        /* Destroy hashtable, free all values */
-        hashtable_destroy(tracker->blocks_map, 1);
-        tracker->blocks_map = NULL;
-    }
-
-    tracker->blocks_map = create_hashtable(1000, diskf_hash, diskf_key_equal, 
-                                           tracker->alloc_fn, tracker->free_fn);
-    if (tracker->blocks_map == NULL) {
-        difi_dbg_print("failed to allocate hashtable\n");
-        return DISK_TRACKER_NO_MEMORY;
-    }
-
-    tracker->current = tracker->head;
-    tracker->free_blocks = tracker->total_blocks;
-    tracker->current_extent = &tracker->current->extents[0];
-
-    return DISK_TRACKER_OK;
+    lock_all(tracker);
+    status = create_indexes(tracker);
+    if (status == DISK_TRACKER_OK)
+        status = load_free_space(tracker);
+    unlock_all(tracker);
+    epoch_reclaim(tracker->epoch);
+    return status;
 }
 
 int disk_tracker_destroy(disk_remap_t* remap)
 {
     struct disk_tracker* tracker = (struct disk_tracker*)*remap;
-    void  (*free_fn) (void* mem);
 
     if (tracker == NULL) {
         difi_dbg_print("invalid argument\n");
         return DISK_TRACKER_INV_ARGUMENT;
     }
 
-    if (tracker->blocks_map) {
-        /* Destroy hashtable, free all values */
-        hashtable_destroy(tracker->blocks_map, 1);
-        tracker->blocks_map = NULL;
-    }
-    free_fn = tracker->free_fn;
-    free_fn(tracker);
+    free_tracker(tracker);
     *remap = NULL;
     return DISK_TRACKER_OK;
 }
@@ -133,19 +452,22 @@ int disk_tracker_add_storage(disk_remap_t remap, struct remap_storage* storage)
 {
     struct disk_tracker* tracker = (struct disk_tracker*)remap;
     struct remap_storage* cur = NULL;
+    int                   status;
 
     if (tracker == NULL) {
         difi_dbg_print("invalid argument\n");
         return DISK_TRACKER_INV_ARGUMENT;
     }
+
+    lock_all(tracker);
     cur = tracker->head;
     while(cur->next)
         cur = cur->next;
     cur->next = storage;
-    tracker->free_blocks  += storage->number_of_blocks;
-    tracker->total_blocks += storage->number_of_blocks;
 
-    return DISK_TRACKER_OK;
+    status = add_free_storage(tracker, storage);
+    unlock_all(tracker);
+    return status;
 }
 
 int disk_tracker_get_storage(disk_remap_t remap, struct remap_storage** storage)
@@ -163,11 +485,15 @@ int disk_tracker_reset_storage(disk_remap_t remap, struct remap_storage* storage
 {
     struct disk_tracker* tracker = (struct disk_tracker*)remap;
     struct remap_storage* old_storage, *p;
+    int                   status;
+
     if (tracker == NULL) {
         difi_dbg_print("invalid argument\n");
         return DISK_TRACKER_INV_ARGUMENT;
     }
 
+    lock_all(tracker);
+
     /* Free old storage first */
     old_storage = tracker->head;
     while(old_storage != NULL)
@@ -177,10 +503,85 @@ int disk_tracker_reset_storage(disk_remap_t remap, struct remap_storage* storage
         old_storage = p;
     }
 
-    tracker->head = tracker->current = storage;
-    tracker->free_blocks = tracker->total_blocks = storage->number_of_blocks;
-    tracker->current_extent = &storage->extents[0];
-    return 0;
+    /* Reservations were made in the old storage */
+    free_reserved(tracker);
+    tracker->head = storage;
+    status = load_free_space(tracker);
+    unlock_all(tracker);
+    return status;
+}
+
+int disk_tracker_reserve_storage(disk_remap_t remap, struct disk_extent* extent)
+{
+    struct disk_tracker*  tracker = (struct disk_tracker*)remap;
+    struct remap_storage* reserved;
+    int                   status;
+
+    if (tracker == NULL || extent == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+
+    /* Remembered, so a reset keeps the blocks out of use */
+    reserved = disk_tracker_alloc_remap_storage(remap, 1);
+    if (reserved == NULL) {
+        difi_dbg_print("out of memory\n");
+        return DISK_TRACKER_NO_MEMORY;
+    }
+    reserved->number_of_extents = 1;
+    reserved->number_of_blocks = extent->length_in_blocks;
+    reserved->extents[0] = *extent;
+
+    lock_all(tracker);
+    status = take_reserved(tracker, extent);
+    if (status == DISK_TRACKER_OK) {
+        reserved->next = tracker->reserved;
+        tracker->reserved = reserved;
+    } else {
+        tracker->free_fn(reserved);
+    }
+    unlock_all(tracker);
+    return status;
+}
+
+int disk_tracker_unreserve_storage(disk_remap_t remap, const struct disk_extent* extent)
+{
+    struct disk_tracker*   tracker = (struct disk_tracker*)remap;
+    struct remap_storage** link;
+    struct remap_storage*  reserved = NULL;
+    int                    status = FREE_SPACE_OK;
+
+    if (tracker == NULL || extent == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+
+    lock_all(tracker);
+    for (link = &tracker->reserved; *link != NULL; link = &(*link)->next) {
+        if ((*link)->extents[0].start_block == extent->start_block &&
+            (*link)->extents[0].length_in_blocks == extent->length_in_blocks)
+            break;
+    }
+    if (*link != NULL) {
+        status = free_space_add(unallocated_space(tracker), extent->start_block, 
+                                extent->length_in_blocks);
+        if (status == FREE_SPACE_OK) {
+            reserved = *link;
+            *link = reserved->next;
+            tracker->total_blocks += extent->length_in_blocks;
+        }
+    }
+    unlock_all(tracker);
+
+    if (reserved == NULL) {
+        if (status != FREE_SPACE_OK)
+            return DISK_TRACKER_NO_MEMORY;
+        difi_dbg_print("storage extent %llu:%lu is not reserved\n", 
+                       extent->start_block, extent->length_in_blocks);
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+    tracker->free_fn(reserved);
+    return DISK_TRACKER_OK;
 }
 
 int disk_tracker_get_storage_info(disk_remap_t remap, 
@@ -188,12 +589,21 @@ int disk_tracker_get_storage_info(disk_remap_t remap,
                                   unsigned* free_blocks)
 {
     struct disk_tracker* tracker = (struct disk_tracker*)remap;
+    ulong64_t            free_total;
+    unsigned             i;
+
     if (tracker == NULL) {
         difi_dbg_print("invalid argument\n");
         return DISK_TRACKER_INV_ARGUMENT;
     }
+
+    lock_all(tracker);
+    free_total = free_space_blocks(tracker->free_space);
+    for (i = 0; i < tracker->shard_count; i++)
+        free_total += free_space_blocks(tracker->shards[i].free_space);
     *total_blocks = tracker->total_blocks;
-    *free_blocks = tracker->free_blocks;
+    *free_blocks = (unsigned)free_total;
+    unlock_all(tracker);
     return 0;
 }
 
@@ -201,21 +611,67 @@ int disk_tracker_get_storage_info(disk_remap_t remap,
 int disk_tracker_get_hash_size(disk_remap_t remap, unsigned* size)
 {
     struct disk_tracker* tracker = (struct disk_tracker*)remap;
+    unsigned             i;
+
     if (tracker == NULL) {
         difi_dbg_print("invalid argument\n");
         return DISK_TRACKER_INV_ARGUMENT;
     }
-    *size = hashtable_count(tracker->blocks_map);
+
+    /* Counters are read without locks, the sum is approximate under load */
+    *size = 0;
+    for (i = 0; i < tracker->shard_count; i++)
+        *size += tracker->shards[i].remapped_blocks;
 
     return DISK_TRACKER_OK;
 }
 
+static void cursors_seek(struct disk_tracker* tracker, 
+                         struct shard_cursor* cursors, 
+                         ulong64_t source_block)
+{
+    unsigned i;
+
+    for (i = 0; i < tracker->shard_count; i++) {
+        extent_map_iter_seek(tracker->shards[i].remap_index, &cursors[i].iter, 
+                             source_block);
+        cursors[i].have_run = extent_map_iter_next(&cursors[i].iter, &cursors[i].run);
+    }
+}
+
+/* Next run of all shards in source block order. Returns 0 when there are no more */
+static int cursors_next(struct disk_tracker* tracker, 
+                        struct shard_cursor* cursors, 
+                        struct extent_map_run* run)
+{
+    struct shard_cursor* lowest = NULL;
+    unsigned             i;
+
+    for (i = 0; i < tracker->shard_count; i++) {
+        if (cursors[i].have_run && 
+            (lowest == NULL || cursors[i].run.source_block < lowest->run.source_block))
+            lowest = &cursors[i];
+    }
+    if (lowest == NULL)
+        return 0;
+    *run = lowest->run;
+    lowest->have_run = extent_map_iter_next(&lowest->iter, &lowest->run);
+    return 1;
+}
+
+static int find_remap(struct disk_tracker* tracker, 
+                      struct disk_extent* source,
+                      struct disk_extent_remap** result_out);
+
 int disk_tracker_get_all_remaps(disk_remap_t remap, 
                                 /*OUT*/unsigned* remaps_count, 
                                 /*OUT*/struct disk_extent_remap*** remaps)
 {
-    ulong64_t** keys, b;
-    unsigned i, j, num_keys, source_extents_count;
+    struct shard_cursor*   cursors;
+    struct extent_map_run  run;
+    struct disk_extent     extent;
+    unsigned i, source_extents_count;
+    int      status = DISK_TRACKER_OK;
     struct disk_tracker* tracker = (struct disk_tracker*)remap;
     if (tracker == NULL) {
         difi_dbg_print("invalid argument\n");
@@ -227,166 +683,1059 @@ int disk_tracker_get_all_remaps(disk_remap_t remap,
         return DISK_TRACKER_INV_ARGUMENT;
     }
 
-    num_keys = hashtable_count(tracker->blocks_map);
-    keys = (ulong64_t**)tracker->alloc_fn(num_keys * sizeof(ulong64_t));
+    *remaps_count = 0;
+    *remaps = NULL;
+    cursors = (struct shard_cursor*)tracker->alloc_fn(tracker->shard_count * 
+                                                      sizeof(*cursors));
+    if (cursors == NULL) {
+        difi_dbg_print("out of memory\n");
+        return DISK_TRACKER_NO_MEMORY;
+    }
 
-    hashtable_get_all_keys(tracker->blocks_map, (void**)keys);
+    lock_all(tracker);
 
-    quick_sort_ulong64_ptr(keys, num_keys);
-    
-    /* First find how many source extents do we have */
-    b = *keys[0];
-    source_extents_count = 1;
-    for (i = 1; i < num_keys; i++) {
-        if (*keys[i] != b + 1) {
+    /* First find how many source extents do we have. Runs come sorted, 
+       adjacent source runs form one source extent */
+    source_extents_count = 0;
+    extent.start_block = 0;
+    extent.length_in_blocks = 0;
+    cursors_seek(tracker, cursors, 0);
+    while (cursors_next(tracker, cursors, &run)) {
+        if (source_extents_count == 0 || 
+            run.source_block != extent.start_block + extent.length_in_blocks) {
             source_extents_count++;
+            extent.start_block = run.source_block;
+            extent.length_in_blocks = 0;
         }
-        b = *keys[i];
+        extent.length_in_blocks += run.length_in_blocks;
     }
 
+    if (source_extents_count == 0)
+        goto out;
+
     *remaps = (struct disk_extent_remap**)tracker->alloc_fn(source_extents_count * sizeof(void*));
+    if (*remaps == NULL) {
+        difi_dbg_print("out of memory\n");
+        status = DISK_TRACKER_NO_MEMORY;
+        goto out;
+    }
 
-    for (i = 0, j = 0; i < source_extents_count; i++) {
-        struct disk_extent extent;
-        extent.start_block = *keys[j++];
-        extent.length_in_blocks = 1;
-        while (j < num_keys && *keys[j] == *keys[j - 1] + 1) {
-            extent.length_in_blocks++;
-            j++;
+    i = 0;
+    cursors_seek(tracker, cursors, 0);
+    cursors_next(tracker, cursors, &run);
+    extent.start_block = run.source_block;
+    extent.length_in_blocks = run.length_in_blocks;
+    while (i < source_extents_count) {
+        int more = cursors_next(tracker, cursors, &run);
+        if (more && run.source_block == extent.start_block + extent.length_in_blocks) {
+            extent.length_in_blocks += run.length_in_blocks;
+            continue;
         }
-        disk_tracker_find_remap(remap, &extent, &(*remaps)[i]);
+        find_remap(tracker, &extent, &(*remaps)[i++]);
+        extent.start_block = run.source_block;
+        extent.length_in_blocks = run.length_in_blocks;
     }
 
     *remaps_count = source_extents_count;
-    return DISK_TRACKER_OK;
+out:
+    unlock_all(tracker);
+    tracker->free_fn(cursors);
+    return status;
 }
 
-static struct remap_storage* advance_storage(struct disk_tracker* tracker)
+/* 
+   Find the next unmapped range in [*b, end) and move *b past it.
+   Returns 0 if the rest of the range is fully mapped
+*/
+static int next_unmapped_range(struct tracker_shard* shard,
+                               ulong64_t* b,
+                               ulong64_t end,
+                               ulong64_t* range_start,
+                               ulong64_t* range_end)
 {
-    return tracker->current->next;
+    while (*b < end) {
+        struct extent_map_iter iter;
+        struct extent_map_run  run;
+
+        *range_end = end;
+        extent_map_iter_seek(shard->remap_index, &iter, *b);
+        if (extent_map_iter_next(&iter, &run) && run.source_block < end) {
+            if (run.source_block <= *b) {
+                /* Already remapped */
+                *b = run.source_block + run.length_in_blocks;
+                continue;
+            }
+            *range_end = run.source_block;
+        }
+        *range_start = *b;
+        *b = *range_end;
+        return 1;
+    }
+    return 0;
 }
 
-int disk_tracker_remap(disk_remap_t remap, 
-                       struct disk_extent* source,
-                       struct disk_extent_remap** result)
+/* Add newly remapped blocks to the counters of the chunks they belong to */
+static void count_chunk_blocks(struct tracker_shard* shard,
+                               ulong64_t source_block,
+                               ulong32_t length)
 {
-    struct disk_tracker* tracker = (struct disk_tracker*)remap;
-    ulong64_t    b; 
+    while (length > 0 && shard->chunk_index_valid) {
+        ulong64_t chunk = source_block >> CHUNK_SHIFT;
+        ulong64_t chunk_end = (chunk + 1) << CHUNK_SHIFT;
+        ulong32_t piece = length;
+        ulong64_t count = 0;
 
-    if (tracker == NULL) {
-        difi_dbg_print("remap is NULL\n");
-        return DISK_TRACKER_INV_ARGUMENT;
+        if (source_block + piece > chunk_end)
+            piece = (ulong32_t)(chunk_end - source_block);
+        u64_map_search(shard->chunk_index, chunk, &count);
+        if (!u64_map_insert(shard->chunk_index, chunk, count + piece)) {
+            /* Index can't be trusted anymore, always go to the remap tree */
+            difi_dbg_print("failed to update chunk index\n");
+            shard->chunk_index_valid = 0;
+        }
+        source_block += piece;
+        length -= piece;
+    }
+}
+
+/* Returns non-zero if no block in [start, end) has ever been remapped */
+static int chunks_are_clean(struct tracker_shard* shard,
+                            ulong64_t start,
+                            ulong64_t end)
+{
+    ulong64_t chunk, count;
+
+    if (!shard->chunk_index_valid)
+        return 0;
+    for (chunk = start >> CHUNK_SHIFT; chunk <= (end - 1) >> CHUNK_SHIFT; chunk++) {
+        if (u64_map_search(shard->chunk_index, chunk, &count) && count > 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int insert_run(struct tracker_shard* shard, 
+                      const struct extent_map_run* run)
+{
+    int status = DISK_TRACKER_OK;
+
+    write_begin(shard);
+    if (extent_map_insert(shard->remap_index, run) == EXTENT_MAP_OK) {
+        shard->remapped_blocks += run->length_in_blocks;
+        count_chunk_blocks(shard, run->source_block, run->length_in_blocks);
+    } else {
+        /* The caller gives the target blocks back */
+        status = DISK_TRACKER_NO_MEMORY;
     }
-    if (tracker->current == NULL) {
-        difi_dbg_print("no current storage\n");
-        return DISK_TRACKER_NO_STORAGE;
+    write_end(shard);
+    return status;
+}
+
+/* Targets of runs which could not be inserted are free again */
+static void return_targets(struct tracker_shard* shard, ulong64_t start, ulong32_t length)
+{
+    if (free_space_add(shard->free_space, start, length) != FREE_SPACE_OK)
+        difi_dbg_print("lost %lu free blocks\n", length);
+}
+
+/* Insert a run made by a remap and tell the hook about it */
+static int insert_new_run(struct disk_tracker* tracker,
+                          struct tracker_shard* shard, 
+                          const struct extent_map_run* run)
+{
+    int status = insert_run(shard, run);
+
+    if (status == DISK_TRACKER_OK && tracker->run_hook != NULL) {
+        struct disk_remap_run new_run;
+
+        new_run.source_block = run->source_block;
+        new_run.target_block = run->target_block;
+        new_run.length_in_blocks = run->length_in_blocks;
+        tracker->run_hook(tracker->run_hook_context, &new_run);
     }
+    return status;
+}
+
+/* 
+   Map a source range which has no mappings yet, piece by piece from the 
+   free space. Contiguous policy takes the largest extents to keep the number
+   of pieces low
+*/
+static int remap_unmapped_range(struct disk_tracker* tracker,
+                                struct tracker_shard* shard,
+                                ulong64_t source_block,
+                                ulong32_t length)
+{
+    int policy = tracker->alloc_policy == DISK_TRACKER_ALLOC_CONTIGUOUS ? 
+                 FREE_SPACE_LARGEST : FREE_SPACE_LOWEST;
 
-    if (tracker->free_blocks < source->length_in_blocks) {
-        /* TODO: Dumb algo, wasting storage, need to use leftover from the current block */
-        if (tracker->current->next == NULL) {
+    while (length > 0) {
+        struct extent_map_run run;
+        int                   status;
+        
+        run.source_block = source_block;
+        run.length_in_blocks = free_space_alloc(shard->free_space, length, 
+                                                policy, &run.target_block);
+        if (run.length_in_blocks == 0) {
             difi_dbg_print("no more storage\n");
-            
             return DISK_TRACKER_NO_STORAGE;
         }
-        tracker->current = tracker->current->next;
-    }
-    for (b = source->start_block; b < source->start_block + source->length_in_blocks; b++)
-    {
-        ulong64_t* block = (ulong64_t*)hashtable_search(tracker->blocks_map, &b);
-        if (block == NULL) {
-            ulong64_t* key;
-            block = (ulong64_t*)tracker->alloc_fn(sizeof(ulong64_t));
-            *block = tracker->current_extent->start_block + tracker->current_block++;
-            tracker->free_blocks--;
-            if (tracker->current_block == tracker->current_extent->length_in_blocks) {
-                tracker->current_extent++;
-                tracker->current_block = 0;
-            }
 
-            key = (ulong64_t*)tracker->alloc_fn(sizeof(*key));
-            *key = b;
-            hashtable_insert(tracker->blocks_map, key, block);
+        status = insert_new_run(tracker, shard, &run);
+        if (status != DISK_TRACKER_OK) {
+            return_targets(shard, run.target_block, run.length_in_blocks);
+            return status;
         }
+        source_block += run.length_in_blocks;
+        length -= run.length_in_blocks;
     }
-    return disk_tracker_find_remap(remap, source, result);
+    return DISK_TRACKER_OK;
 }
 
-int disk_tracker_find_remap(disk_remap_t remap, 
-                            struct disk_extent* source,
-                            struct disk_extent_remap** result_out)
+int disk_tracker_range_is_clean(disk_remap_t remap, struct disk_extent* source)
 {
     struct disk_tracker* tracker = (struct disk_tracker*)remap;
-    ulong64_t*   blocks = NULL;
-    ulong64_t    b; 
-    unsigned     i = 0;
-    unsigned     num_remapped = 0;
-    unsigned     num_intervals = 0;
-    struct disk_extent_remap* result = NULL;
-    struct disk_extent*       cur_extent = NULL;
+    ulong64_t            b, end;
+    int                  clean = 1;
+
+    if (tracker == NULL || source->length_in_blocks == 0)
+        return 0;
+
+    end = source->start_block + source->length_in_blocks;
+    for (b = source->start_block; b < end && clean; ) {
+        struct tracker_shard* shard = shard_of(tracker, b);
+        ulong64_t             e = piece_end(tracker, b, end);
 
+        long                  sequence;
+        unsigned              token;
+
+        do {
+            sequence = read_begin(shard);
+            token = epoch_enter(tracker->epoch);
+            clean = chunks_are_clean(shard, b, e);
+            epoch_leave(tracker->epoch, token);
+        } while (read_retry(shard, sequence));
+        b = e;
+    }
+    return clean;
+}
+
+int disk_tracker_set_alloc_policy(disk_remap_t remap, int policy)
+{
+    struct disk_tracker* tracker = (struct disk_tracker*)remap;
     if (tracker == NULL) {
-        difi_dbg_print("remap is NULL\n");
+        difi_dbg_print("invalid argument\n");
         return DISK_TRACKER_INV_ARGUMENT;
     }
-    
-    blocks = (ulong64_t*)tracker->alloc_fn(source->length_in_blocks * sizeof(ulong64_t));
-    if (blocks == NULL) {
-        difi_dbg_print("out of memory\n");
-        return DISK_TRACKER_NO_MEMORY;
+    if (policy != DISK_TRACKER_ALLOC_SEQUENTIAL && 
+        policy != DISK_TRACKER_ALLOC_CONTIGUOUS) {
+        difi_dbg_print("invalid allocation policy %d\n", policy);
+        return DISK_TRACKER_INV_ARGUMENT;
     }
-    
-    for (b = source->start_block; b < source->start_block + source->length_in_blocks; b++, i++)
-    {
-        ulong64_t* block = (ulong64_t*)hashtable_search(tracker->blocks_map, &b);
-        /* If not found,use the original block */
-        if (block == NULL) {
-            blocks[i] = b;
-        } else {
-            blocks[i] = *block;
-            num_remapped++;
-        }
+    tracker->alloc_policy = policy;
+    return DISK_TRACKER_OK;
+}
+
+/* Take up to wanted blocks from the free space, largest extents first */
+static ulong32_t take_free_blocks(struct free_space* space, 
+                                  ulong32_t wanted,
+                                  struct disk_extent* taken,
+                                  unsigned* count)
+{
+    ulong32_t got = 0;
+
+    while (got < wanted && *count < REFILL_EXTENTS) {
+        struct disk_extent* extent = &taken[*count];
+
+        extent->length_in_blocks = free_space_alloc(space, wanted - got, 
+                                                    FREE_SPACE_LARGEST, 
+                                                    &extent->start_block);
+        if (extent->length_in_blocks == 0)
+            break;
+        got += extent->length_in_blocks;
+        (*count)++;
     }
-    
-    /* Convert array of blocks to array of intervals */
+    return got;
+}
 
-    /* First find how many intervals do we have */
-    b = blocks[0];
-    num_intervals = 1;
-    for (i = 1; i < source->length_in_blocks; i++) {
-        if (blocks[i] != b + 1) {
-            num_intervals++;
+/* 
+   Get at least wanted more free blocks for the shard: from unallocated 
+   storage and, when it runs out, from other shards. Called and returns with
+   the shard locked, but drops the lock meanwhile, so only one lock is held 
+   at a time. Returns number of blocks added
+*/
+static ulong32_t refill_shard(struct disk_tracker* tracker, 
+                              struct tracker_shard* shard, 
+                              ulong32_t wanted)
+{
+    struct disk_extent taken[REFILL_EXTENTS];
+    unsigned           count = 0, i;
+    ulong32_t          got;
+
+    difi_lock_release(&shard->lock);
+
+    difi_lock_acquire(&tracker->storage_lock);
+    got = take_free_blocks(tracker->free_space, 
+                           wanted > REFILL_BLOCKS ? wanted : REFILL_BLOCKS, 
+                           taken, &count);
+    difi_lock_release(&tracker->storage_lock);
+
+    for (i = 0; i < tracker->shard_count && got < wanted; i++) {
+        struct tracker_shard* other = &tracker->shards[i];
+
+        if (other == shard)
+            continue;
+        difi_lock_acquire(&other->lock);
+        got += take_free_blocks(other->free_space, wanted - got, taken, &count);
+        difi_lock_release(&other->lock);
+    }
+
+    difi_lock_acquire(&shard->lock);
+    for (i = 0; i < count; i++) {
+        if (free_space_add(shard->free_space, taken[i].start_block, 
+                           taken[i].length_in_blocks) != FREE_SPACE_OK) {
+            difi_dbg_print("lost %lu free blocks\n", taken[i].length_in_blocks);
+            got -= taken[i].length_in_blocks;
+        }
+    }
+    return got;
+}
+
+/* Give storage to all blocks of [start, end) not remapped yet, shard is locked */
+static int map_piece(struct disk_tracker* tracker, 
+                     struct tracker_shard* shard,
+                     ulong64_t start,
+                     ulong64_t end)
+{
+    ulong64_t    b, range_start, range_end; 
+    ulong64_t    reserved = 0, first;
+    ulong64_t    free_blocks;
+    ulong32_t    unmapped;
+    ulong32_t    contiguous = 0;
+    int          status;
+
+    /* First count blocks which need new storage */
+    for (;;) {
+        unmapped = 0;
+        b = start;
+        while (next_unmapped_range(shard, &b, end, &range_start, &range_end))
+            unmapped += (ulong32_t)(range_end - range_start);
+
+        free_blocks = free_space_blocks(shard->free_space);
+        if (free_blocks >= unmapped)
+            break;
+        /* Mappings may change while refill drops the lock, count again */
+        if (tracker->shard_count == 1 || 
+            refill_shard(tracker, shard, (ulong32_t)(unmapped - free_blocks)) == 0) {
+            difi_dbg_print("no more storage\n");
+            return DISK_TRACKER_NO_STORAGE;
+        }
+    }
+
+    /* Try to reserve a single run for the whole source extent */
+    if (unmapped > 0 && tracker->alloc_policy == DISK_TRACKER_ALLOC_CONTIGUOUS)
+        contiguous = free_space_alloc(shard->free_space, unmapped, 
+                                      FREE_SPACE_FIT, &reserved);
+    first = reserved;
+
+    b = start;
+    while (next_unmapped_range(shard, &b, end, &range_start, &range_end)) {
+        ulong32_t length = (ulong32_t)(range_end - range_start);
+
+        if (contiguous) {
+            struct extent_map_run run;
+
+            run.source_block = range_start;
+            run.target_block = reserved;
+            run.length_in_blocks = length;
+            reserved += length;
+            status = insert_new_run(tracker, shard, &run);
+            if (status != DISK_TRACKER_OK) {
+                /* The rest of the single run was not used either */
+                return_targets(shard, run.target_block, 
+                               contiguous - (ulong32_t)(run.target_block - first));
+                return status;
+            }
+        } else {
+            status = remap_unmapped_range(tracker, shard, range_start, length);
+        }
+        if (status != DISK_TRACKER_OK)
+            return status;
+    }
+    return DISK_TRACKER_OK;
+}
+
+/* Give storage to all blocks of the source which are not remapped yet */
+static int map_source(struct disk_tracker* tracker, struct disk_extent* source)
+{
+    ulong64_t b, end;
+    int       status = DISK_TRACKER_OK;
+
+    end = source->start_block + source->length_in_blocks;
+    for (b = source->start_block; b < end && status == DISK_TRACKER_OK; ) {
+        struct tracker_shard* shard = shard_of(tracker, b);
+        ulong64_t             e = piece_end(tracker, b, end);
+
+        difi_lock_acquire(&shard->lock);
+        status = map_piece(tracker, shard, b, e);
+        difi_lock_release(&shard->lock);
+        b = e;
+    }
+    epoch_reclaim(tracker->epoch);
+    return status;
+}
+
+int disk_tracker_remap(disk_remap_t remap, 
+                       struct disk_extent* source,
+                       struct disk_extent_remap** result)
+{
+    struct disk_tracker* tracker = (struct disk_tracker*)remap;
+    int                  status;
+
+    if (tracker == NULL) {
+        difi_dbg_print("remap is NULL\n");
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+
+    status = map_source(tracker, source);
+    if (status != DISK_TRACKER_OK)
+        return status;
+    return disk_tracker_find_remap(remap, source, result);
+}
+
+int disk_tracker_remap_to_buffer(disk_remap_t remap, 
+                                 struct disk_extent* source,
+                                 struct disk_extent_remap* result,
+                                 ulong32_t max_extents)
+{
+    struct disk_tracker* tracker = (struct disk_tracker*)remap;
+    int                  status;
+
+    if (tracker == NULL) {
+        difi_dbg_print("remap is NULL\n");
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+
+    status = map_source(tracker, source);
+    if (status != DISK_TRACKER_OK)
+        return status;
+    return disk_tracker_find_remap_to_buffer(remap, source, result, max_extents);
+}
+
+static void builder_add(struct remap_builder* builder, 
+                        ulong64_t target_block, 
+                        ulong32_t length)
+{
+    struct disk_extent* last = &builder->last;
+
+    if (builder->count > 0 && 
+        last->start_block + last->length_in_blocks == target_block) {
+        last->length_in_blocks += length;
+    } else {
+        builder->count++;
+        last->start_block = target_block;
+        last->length_in_blocks = length;
+    }
+    if (builder->result != NULL && builder->count <= builder->capacity)
+        builder->result->remapped_extents[builder->count - 1] = *last;
+}
+
+/* Translate [b, end) of one shard. Returns number of remapped blocks */
+static ulong32_t build_piece(struct tracker_shard* shard,
+                             ulong64_t b,
+                             ulong64_t end,
+                             struct remap_builder* builder)
+{
+    struct extent_map_iter iter;
+    struct extent_map_run  run;
+    ulong32_t              num_remapped = 0;
+    int                    have_run;
+
+    if (chunks_are_clean(shard, b, end)) {
+        builder_add(builder, b, (ulong32_t)(end - b));
+        return 0;
+    }
+
+    extent_map_iter_seek(shard->remap_index, &iter, b);
+    have_run = extent_map_iter_next(&iter, &run);
+
+    while (b < end) {
+        ulong64_t piece_end;
+
+        if (have_run && run.source_block <= b) {
+            /* Inside the run */
+            piece_end = run.source_block + run.length_in_blocks;
+            if (piece_end > end)
+                piece_end = end;
+            builder_add(builder, run.target_block + (b - run.source_block), 
+                        (ulong32_t)(piece_end - b));
+            num_remapped += (ulong32_t)(piece_end - b);
+            have_run = extent_map_iter_next(&iter, &run);
+        } else {
+            /* Not remapped, use the original blocks */
+            piece_end = (have_run && run.source_block < end) ? run.source_block : end;
+            builder_add(builder, b, (ulong32_t)(piece_end - b));
         }
-        b = blocks[i];
+        b = piece_end;
     }
+    return num_remapped;
+}
+
+/* 
+   Translate source extent into target extents. Returns number of remapped
+   blocks, number of extents is left in builder->count. Takes no locks, a 
+   piece which raced with a writer is translated again
+*/
+static ulong32_t build_remap(struct disk_tracker* tracker,
+                             struct disk_extent* source,
+                             struct remap_builder* builder)
+{
+    ulong64_t b = source->start_block;
+    ulong64_t end = source->start_block + source->length_in_blocks;
+    ulong32_t num_remapped = 0;
+
+    builder->count = 0;
+    while (b < end) {
+        struct tracker_shard* shard = shard_of(tracker, b);
+        ulong64_t             e = piece_end(tracker, b, end);
+        struct remap_builder  saved = *builder;
+        ulong32_t             piece_remapped;
+        long                  sequence;
+        unsigned              token;
+
+        for (;;) {
+            sequence = read_begin(shard);
+            token = epoch_enter(tracker->epoch);
+            piece_remapped = build_piece(shard, b, e, builder);
+            epoch_leave(tracker->epoch, token);
+            if (!read_retry(shard, sequence))
+                break;
+            *builder = saved;
+        }
+        num_remapped += piece_remapped;
+        b = e;
+    }
+    return num_remapped;
+}
+
+static int find_remap(struct disk_tracker* tracker, 
+                      struct disk_extent* source,
+                      struct disk_extent_remap** result_out)
+{
+    struct remap_builder      builder;
+    unsigned                  sz;
+    struct disk_extent_remap* result = NULL;
+
+    /* First find how many intervals do we have */
+    builder.result = NULL;
+    builder.capacity = 0;
+    build_remap(tracker, source, &builder);
     
-    /* Allocate return struct */
-    i = sizeof(struct disk_extent_remap) + sizeof(struct disk_extent)*(num_intervals - 1);
-    result = (struct disk_extent_remap*)tracker->alloc_fn(i);
-    memset(result, 0, i);
-    result->number_of_extents = num_intervals;
-    result->num_remapped = num_remapped;
+    for (;;) {
+        /* Allocate return struct */
+        sz = DISK_EXTENT_REMAP_SIZE(builder.count);
+        result = (struct disk_extent_remap*)tracker->alloc_fn(sz);
+        if (result == NULL) {
+            difi_dbg_print("out of memory\n");
+            return DISK_TRACKER_NO_MEMORY;
+        }
+        memset(result, 0, sz);
+
+        builder.result = result;
+        builder.capacity = builder.count;
+        result->num_remapped = build_remap(tracker, source, &builder);
+        if (builder.count <= builder.capacity)
+            break;
+
+        /* Remapped by a concurrent write in between, try again */
+        tracker->free_fn(result);
+    }
+    result->number_of_extents = builder.count;
+    result->source_extent = *source;
+
+    *result_out = result;
+    return DISK_TRACKER_OK;
+}
+
+int disk_tracker_find_remap(disk_remap_t remap, 
+                            struct disk_extent* source,
+                            struct disk_extent_remap** result_out)
+{
+    struct disk_tracker* tracker = (struct disk_tracker*)remap;
+
+    if (tracker == NULL) {
+        difi_dbg_print("remap is NULL\n");
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+    return find_remap(tracker, source, result_out);
+}
+
+int disk_tracker_find_remap_to_buffer(disk_remap_t remap, 
+                                      struct disk_extent* source,
+                                      struct disk_extent_remap* result,
+                                      ulong32_t max_extents)
+{
+    struct disk_tracker* tracker = (struct disk_tracker*)remap;
+    struct remap_builder builder;
+
+    if (tracker == NULL || result == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+
+    builder.result = result;
+    builder.capacity = max_extents;
+    result->num_remapped = build_remap(tracker, source, &builder);
+    result->number_of_extents = builder.count;
     result->source_extent = *source;
 
-    cur_extent = &result->remapped_extents[0];
-    cur_extent->length_in_blocks = 1;
-    cur_extent->start_block = blocks[0];
-    for (i = 1; i < source->length_in_blocks; i++) {
-        while(blocks[i] == blocks[i - 1] + 1 && i < source->length_in_blocks) {
-            cur_extent->length_in_blocks++;
-            i++;
+    if (builder.count > max_extents)
+        return DISK_TRACKER_BUFFER_TOO_SMALL;
+    return DISK_TRACKER_OK;
+}
+
+int disk_tracker_set_run_hook(disk_remap_t remap, 
+                              disk_tracker_run_hook hook, 
+                              void* context)
+{
+    struct disk_tracker* tracker = (struct disk_tracker*)remap;
+
+    if (tracker == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+
+    /* No remap may see the hook without its context */
+    lock_all(tracker);
+    tracker->run_hook = hook;
+    tracker->run_hook_context = context;
+    unlock_all(tracker);
+    return DISK_TRACKER_OK;
+}
+
+/* 
+   Take exact target blocks for a restored run: from the shard, then from 
+   storage not handed out yet. Shard is locked, storage lock comes after it
+   as in lock_all
+*/
+static int take_target(struct disk_tracker* tracker,
+                       struct tracker_shard* shard,
+                       ulong64_t target_block,
+                       ulong32_t length)
+{
+    int status = free_space_take(shard->free_space, target_block, length);
+
+    if (status == FREE_SPACE_NOT_FREE && tracker->shard_count > 1) {
+        difi_lock_acquire(&tracker->storage_lock);
+        status = free_space_take(tracker->free_space, target_block, length);
+        difi_lock_release(&tracker->storage_lock);
+    }
+    if (status == FREE_SPACE_NOT_FREE) {
+        difi_dbg_print("restored target %llu:%lu is not free\n", target_block, length);
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+    return status == FREE_SPACE_OK ? DISK_TRACKER_OK : DISK_TRACKER_NO_MEMORY;
+}
+
+/* Restore [start, end) of one shard mapped to target on, shard is locked */
+static int restore_piece(struct disk_tracker* tracker,
+                         struct tracker_shard* shard,
+                         ulong64_t start,
+                         ulong64_t end,
+                         ulong64_t target)
+{
+    ulong64_t b = start;
+    int       status;
+
+    while (b < end) {
+        struct extent_map_iter iter;
+        struct extent_map_run  run;
+        ulong64_t              unmapped_end = end;
+
+        extent_map_iter_seek(shard->remap_index, &iter, b);
+        if (extent_map_iter_next(&iter, &run) && run.source_block < end) {
+            if (run.source_block <= b) {
+                /* Mapped already, fine if to the same blocks */
+                if (run.target_block + (b - run.source_block) != target + (b - start)) {
+                    difi_dbg_print("block %llu is mapped elsewhere\n", b);
+                    return DISK_TRACKER_INV_ARGUMENT;
+                }
+                b = run.source_block + run.length_in_blocks;
+                continue;
+            }
+            unmapped_end = run.source_block;
         }
-        if (i == source->length_in_blocks)
+
+        run.source_block = b;
+        run.target_block = target + (b - start);
+        run.length_in_blocks = (ulong32_t)(unmapped_end - b);
+        status = take_target(tracker, shard, run.target_block, run.length_in_blocks);
+        if (status == DISK_TRACKER_OK)
+            status = insert_run(shard, &run);
+        if (status != DISK_TRACKER_OK)
+            return status;
+        b = unmapped_end;
+    }
+    return DISK_TRACKER_OK;
+}
+
+int disk_tracker_restore_run(disk_remap_t remap, const struct disk_remap_run* run)
+{
+    struct disk_tracker* tracker = (struct disk_tracker*)remap;
+    ulong64_t            b, end;
+    int                  status = DISK_TRACKER_OK;
+
+    if (tracker == NULL || run == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+
+    end = run->source_block + run->length_in_blocks;
+    for (b = run->source_block; b < end && status == DISK_TRACKER_OK; ) {
+        struct tracker_shard* shard = shard_of(tracker, b);
+        ulong64_t             e = piece_end(tracker, b, end);
+
+        difi_lock_acquire(&shard->lock);
+        status = restore_piece(tracker, shard, b, e, 
+                               run->target_block + (b - run->source_block));
+        difi_lock_release(&shard->lock);
+        b = e;
+    }
+    epoch_reclaim(tracker->epoch);
+    return status;
+}
+
+/* Take unmapped blocks off the counters of their chunks */
+static void uncount_chunk_blocks(struct tracker_shard* shard,
+                                 ulong64_t source_block,
+                                 ulong32_t length)
+{
+    while (length > 0 && shard->chunk_index_valid) {
+        ulong64_t chunk = source_block >> CHUNK_SHIFT;
+        ulong64_t chunk_end = (chunk + 1) << CHUNK_SHIFT;
+        ulong32_t piece = length;
+        ulong64_t count = 0;
+
+        if (source_block + piece > chunk_end)
+            piece = (ulong32_t)(chunk_end - source_block);
+        u64_map_search(shard->chunk_index, chunk, &count);
+        /* Clean chunks are skipped by lookups again */
+        if (count <= piece)
+            u64_map_remove(shard->chunk_index, chunk);
+        else if (!u64_map_insert(shard->chunk_index, chunk, count - piece))
+            shard->chunk_index_valid = 0;
+        source_block += piece;
+        length -= piece;
+    }
+}
+
+/* 
+   Freed targets go to the storage not handed out, where restore_run looks 
+   for them too. Shard is locked, storage lock comes after it as in lock_all
+*/
+static void free_target(struct disk_tracker* tracker,
+                        struct tracker_shard* shard,
+                        ulong64_t target_block,
+                        ulong32_t length)
+{
+    int status;
+
+    if (tracker->shard_count == 1) {
+        status = free_space_add(shard->free_space, target_block, length);
+    } else {
+        difi_lock_acquire(&tracker->storage_lock);
+        status = free_space_add(tracker->free_space, target_block, length);
+        difi_lock_release(&tracker->storage_lock);
+    }
+    if (status != FREE_SPACE_OK)
+        difi_dbg_print("lost %lu free blocks\n", length);
+}
+
+/* Unmap blocks of [start, end) of one shard mapped to target on, shard is locked */
+static int unmap_piece(struct disk_tracker* tracker,
+                       struct tracker_shard* shard,
+                       ulong64_t start,
+                       ulong64_t end,
+                       ulong64_t target,
+                       int keep_targets,
+                       ulong32_t* unmapped)
+{
+    ulong64_t b = start;
+
+    while (b < end) {
+        struct extent_map_iter iter;
+        struct extent_map_run  run;
+        ulong64_t              mapped_end;
+        ulong32_t              length;
+        int                    status;
+
+        extent_map_iter_seek(shard->remap_index, &iter, b);
+        if (!extent_map_iter_next(&iter, &run) || run.source_block >= end)
             break;
-        cur_extent++;
-        cur_extent->length_in_blocks = 1;
-        cur_extent->start_block = blocks[i];
+        if (run.source_block > b)
+            b = run.source_block;
+        mapped_end = run.source_block + run.length_in_blocks;
+        if (mapped_end > end)
+            mapped_end = end;
+        length = (ulong32_t)(mapped_end - b);
+
+        /* Mapped elsewhere: remapped again since, skipped */
+        if (run.target_block + (b - run.source_block) != target + (b - start)) {
+            b = mapped_end;
+            continue;
+        }
+
+        write_begin(shard);
+        status = extent_map_remove(shard->remap_index, b, length);
+        if (status == EXTENT_MAP_OK) {
+            shard->remapped_blocks -= length;
+            uncount_chunk_blocks(shard, b, length);
+        }
+        write_end(shard);
+        if (status != EXTENT_MAP_OK)
+            return DISK_TRACKER_NO_MEMORY;
+
+        if (!keep_targets)
+            free_target(tracker, shard, target + (b - start), length);
+        *unmapped += length;
+        b = mapped_end;
     }
-    tracker->free_fn(blocks);
-    *result_out = result;
     return DISK_TRACKER_OK;
 }
 
+int disk_tracker_unmap_run(disk_remap_t remap, 
+                           const struct disk_remap_run* run,
+                           int keep_targets,
+                           ulong32_t* unmapped)
+{
+    struct disk_tracker* tracker = (struct disk_tracker*)remap;
+    ulong64_t            b, end;
+    int                  status = DISK_TRACKER_OK;
+
+    if (tracker == NULL || run == NULL || unmapped == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+
+    *unmapped = 0;
+    end = run->source_block + run->length_in_blocks;
+    for (b = run->source_block; b < end && status == DISK_TRACKER_OK; ) {
+        struct tracker_shard* shard = shard_of(tracker, b);
+        ulong64_t             e = piece_end(tracker, b, end);
+
+        difi_lock_acquire(&shard->lock);
+        status = unmap_piece(tracker, shard, b, e, run->target_block + (b - run->source_block),
+                             keep_targets, unmapped);
+        difi_lock_release(&shard->lock);
+        b = e;
+    }
+    epoch_reclaim(tracker->epoch);
+    return status;
+}
+
+int disk_tracker_release_storage(disk_remap_t remap, const struct disk_extent* extent)
+{
+    struct disk_tracker* tracker = (struct disk_tracker*)remap;
+    difi_lock_t*         lock;
+    int                  status;
+
+    if (tracker == NULL || extent == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+
+    /* Where free_target puts them */
+    lock = tracker->shard_count == 1 ? &tracker->shards[0].lock : &tracker->storage_lock;
+    difi_lock_acquire(lock);
+    status = free_space_add(unallocated_space(tracker), extent->start_block, 
+                            extent->length_in_blocks);
+    difi_lock_release(lock);
+    if (status == FREE_SPACE_OVERLAP) {
+        difi_dbg_print("released extent %llu:%lu is free already\n", 
+                       extent->start_block, extent->length_in_blocks);
+        return DISK_TRACKER_INV_ARGUMENT;
+    }
+    return status == FREE_SPACE_OK ? DISK_TRACKER_OK : DISK_TRACKER_NO_MEMORY;
+}
+
+unsigned disk_tracker_export_runs(disk_remap_t remap, 
+                                  struct disk_tracker_export* position,
+                                  struct disk_remap_run* runs,
+                                  unsigned max_runs)
+{
+    struct disk_tracker* tracker = (struct disk_tracker*)remap;
+    unsigned             count = 0;
+
+    if (tracker == NULL || position == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return 0;
+    }
+
+    while (count < max_runs && position->shard < tracker->shard_count) {
+        struct tracker_shard*  shard = &tracker->shards[position->shard];
+        struct extent_map_iter iter;
+        struct extent_map_run  run;
+
+        /* Copying is short, the lock keeps the tree still meanwhile */
+        difi_lock_acquire(&shard->lock);
+        extent_map_iter_seek(shard->remap_index, &iter, position->next_block);
+        while (count < max_runs && extent_map_iter_next(&iter, &run)) {
+            runs[count].source_block = run.source_block;
+            runs[count].target_block = run.target_block;
+            runs[count].length_in_blocks = run.length_in_blocks;
+            count++;
+            position->next_block = run.source_block + run.length_in_blocks;
+        }
+        if (count < max_runs) {
+            position->shard++;
+            position->next_block = 0;
+        }
+        difi_lock_release(&shard->lock);
+    }
+    return count;
+}
+
+/* Page of runs in source order from *next_block on, cursors has one entry per shard */
+static unsigned copy_sorted_runs(struct disk_tracker* tracker,
+                                 struct shard_cursor* cursors,
+                                 ulong64_t* next_block,
+                                 struct disk_remap_run* runs,
+                                 unsigned max_runs)
+{
+    struct extent_map_run run;
+    unsigned              count = 0;
+
+    lock_all(tracker);
+    cursors_seek(tracker, cursors, *next_block);
+    while (count < max_runs && cursors_next(tracker, cursors, &run)) {
+        /* Run holding next_block starts before it */
+        if (run.source_block < *next_block) {
+            ulong32_t skip = (ulong32_t)(*next_block - run.source_block);
+            run.source_block += skip;
+            run.target_block += skip;
+            run.length_in_blocks -= skip;
+        }
+        runs[count].source_block = run.source_block;
+        runs[count].target_block = run.target_block;
+        runs[count].length_in_blocks = run.length_in_blocks;
+        count++;
+        *next_block = run.source_block + run.length_in_blocks;
+    }
+    unlock_all(tracker);
+    return count;
+}
+
+unsigned disk_tracker_export_sorted_runs(disk_remap_t remap, 
+                                         ulong64_t* next_block,
+                                         struct disk_remap_run* runs,
+                                         unsigned max_runs)
+{
+    struct disk_tracker*  tracker = (struct disk_tracker*)remap;
+    struct shard_cursor*  cursors;
+    unsigned              count;
+
+    if (tracker == NULL || next_block == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return 0;
+    }
+
+    cursors = (struct shard_cursor*)tracker->alloc_fn(tracker->shard_count * 
+                                                      sizeof(*cursors));
+    if (cursors == NULL) {
+        difi_dbg_print("out of memory\n");
+        return 0;
+    }
+
+    count = copy_sorted_runs(tracker, cursors, next_block, runs, max_runs);
+    tracker->free_fn(cursors);
+    return count;
+}
+
+struct disk_tracker_cursor* disk_tracker_cursor_open(disk_remap_t remap, 
+                                                     ulong64_t start_block)
+{
+    struct disk_tracker*        tracker = (struct disk_tracker*)remap;
+    struct disk_tracker_cursor* cursor;
+
+    if (tracker == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return NULL;
+    }
+
+    cursor = (struct disk_tracker_cursor*)tracker->alloc_fn(
+        sizeof(*cursor) + (tracker->shard_count - 1) * sizeof(cursor->shards[0]));
+    if (cursor == NULL) {
+        difi_dbg_print("out of memory\n");
+        return NULL;
+    }
+    cursor->tracker = tracker;
+    cursor->next_block = start_block;
+    return cursor;
+}
+
+unsigned disk_tracker_cursor_next(struct disk_tracker_cursor* cursor, 
+                                  struct disk_remap_run* runs,
+                                  unsigned max_runs)
+{
+    if (cursor == NULL || runs == NULL) {
+        difi_dbg_print("invalid argument\n");
+        return 0;
+    }
+    return copy_sorted_runs(cursor->tracker, cursor->shards, &cursor->next_block, 
+                            runs, max_runs);
+}
+
+ulong64_t disk_tracker_cursor_position(struct disk_tracker_cursor* cursor)
+{
+    return cursor->next_block;
+}
+
+void disk_tracker_cursor_close(struct disk_tracker_cursor* cursor)
+{
+    if (cursor != NULL)
+        cursor->tracker->free_fn(cursor);
+}
+
+struct disk_extent* disk_tracker_find_remap_for_block(disk_remap_t remap,
+                                                      ulong64_t source_block)
+{
+    struct disk_tracker*  tracker = (struct disk_tracker*)remap;
+    struct tracker_shard* shard;
+    struct extent_map_run run;
+    struct disk_extent*   extent;
+    ulong32_t             offset;
+    long                  sequence;
+    unsigned              token;
+    int                   found;
+
+    if (tracker == NULL) {
+        difi_dbg_print("remap is NULL\n");
+        return NULL;
+    }
+
+    shard = shard_of(tracker, source_block);
+    do {
+        sequence = read_begin(shard);
+        token = epoch_enter(tracker->epoch);
+        found = extent_map_lookup(shard->remap_index, source_block, &run);
+        epoch_leave(tracker->epoch, token);
+    } while (read_retry(shard, sequence));
+    if (!found)
+        return NULL;
+
+    extent = (struct disk_extent*)tracker->alloc_fn(sizeof(*extent));
+    if (extent == NULL) {
+        difi_dbg_print("out of memory\n");
+        return NULL;
+    }
+
+    /* Remapped blocks from source_block till the end of its run */
+    offset = (ulong32_t)(source_block - run.source_block);
+    extent->start_block = run.target_block + offset;
+    extent->length_in_blocks = run.length_in_blocks - offset;
+    return extent;
+}
+
 void disk_tracker_free_remap(disk_remap_t remap,  struct disk_extent_remap* extent_remap)
 {
     struct disk_tracker* tracker = (struct disk_tracker*)remap;
@@ -0,0 +1,282 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Epoch based reclamation. Readers count themselves in per CPU slots of the
+  current epoch parity. Retired objects wait in the pending list, then the
+  epoch is advanced and they move to the draining list, which is freed when
+  no reader is left in the old parity. The epoch is not advanced again 
+  before that, so readers of the old parity are exactly the ones which
+  could have seen draining objects. When the pending list is full while 
+  the draining one still waits, more objects go to allocated chunks which 
+  drain with the list, retire never waits for readers
+*/
+#include "libcrt/baselib.h"
+#include "libutil/epoch.h"
+
+#define EPOCH_SLOTS         (64)
+#define EPOCH_RETIRE_MAX    (256)
+#define CACHE_LINE          (64)
+
+/* Readers of both parities, one cache line per slot */
+struct epoch_slot
+{
+    volatile long active[2];
+    char          padding[CACHE_LINE - 2 * sizeof(long)];
+};
+
+struct retired_object
+{
+    void*            object;
+    epoch_destroy_fn destroy_fn;
+};
+
+/* Overflow of the pending list */
+struct retired_chunk
+{
+    struct retired_chunk* next;
+    unsigned              count;
+    struct retired_object objects[EPOCH_RETIRE_MAX];
+};
+
+struct epoch
+{
+    struct epoch_slot     slots[EPOCH_SLOTS];
+    volatile long         current;
+    difi_lock_t           lock;             /* Writers only */
+    int                   waiting;          /* Draining list waits for old parity */
+    unsigned              pending_count;
+    unsigned              draining_count;
+    struct retired_object pending[EPOCH_RETIRE_MAX];
+    struct retired_object draining[EPOCH_RETIRE_MAX];
+    struct retired_chunk* pending_more;     /* Newest first */
+    struct retired_chunk* draining_more;
+    struct retired_chunk* spare;            /* Used if a chunk cannot be allocated */
+
+    void* (*alloc_fn)(unsigned size); 
+    void  (*free_fn) (void* mem);
+};
+
+static unsigned current_slot(void)
+{
+#ifndef DIFI_USER_MODE
+    return KeGetCurrentProcessorNumber() % EPOCH_SLOTS;
+#elif defined(_WIN32)
+    return GetCurrentProcessorNumber() % EPOCH_SLOTS;
+#else
+    /* 
+       No portable processor number: threads take slots round robin on 
+       first use and keep them. Stack addresses of glibc threads are 8Mb
+       apart and do not spread
+    */
+    static volatile long next_slot;
+    static __thread long slot;          /* Slot + 1, 0 until taken */
+
+    if (slot == 0)
+        slot = difi_atomic_inc(&next_slot);
+    return (unsigned)(slot - 1) % EPOCH_SLOTS;
+#endif
+}
+
+static void free_objects(struct epoch* epoch, struct retired_object* objects, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        if (objects[i].destroy_fn != NULL)
+            objects[i].destroy_fn(objects[i].object);
+        else
+            epoch->free_fn(objects[i].object);
+    }
+}
+
+/* Objects of the chunks are freed, one chunk is kept as the spare */
+static void free_chunks(struct epoch* epoch, struct retired_chunk* chunk)
+{
+    while (chunk != NULL) {
+        struct retired_chunk* next = chunk->next;
+
+        free_objects(epoch, chunk->objects, chunk->count);
+        if (epoch->spare == NULL) {
+            epoch->spare = chunk;
+        } else {
+            epoch->free_fn(chunk);
+        }
+        chunk = next;
+    }
+}
+
+static int parity_drained(struct epoch* epoch, unsigned parity)
+{
+    unsigned i;
+
+    for (i = 0; i < EPOCH_SLOTS; i++) {
+        if (epoch->slots[i].active[parity] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Free the draining list if its readers are gone. Called under the lock */
+static int try_drain(struct epoch* epoch)
+{
+    if (!epoch->waiting)
+        return 1;
+    difi_memory_barrier();
+    if (!parity_drained(epoch, (unsigned)(epoch->current - 1) & 1))
+        return 0;
+    free_objects(epoch, epoch->draining, epoch->draining_count);
+    epoch->draining_count = 0;
+    free_chunks(epoch, epoch->draining_more);
+    epoch->draining_more = NULL;
+    epoch->waiting = 0;
+    return 1;
+}
+
+/* Move pending objects to draining and advance the epoch. Called under the lock */
+static void advance(struct epoch* epoch)
+{
+    memcpy(epoch->draining, epoch->pending, 
+           epoch->pending_count * sizeof(epoch->pending[0]));
+    epoch->draining_count = epoch->pending_count;
+    epoch->pending_count = 0;
+    epoch->draining_more = epoch->pending_more;
+    epoch->pending_more = NULL;
+    epoch->waiting = 1;
+    difi_atomic_inc(&epoch->current);
+}
+
+struct epoch* epoch_create(void* (*alloc_fn)(unsigned size), 
+                           void (*free_fn)(void* mem))
+{
+    struct epoch* epoch = (struct epoch*)alloc_fn(sizeof(*epoch));
+
+    if (epoch == NULL)
+        return NULL;
+    memset(epoch, 0, sizeof(*epoch));
+    difi_lock_init(&epoch->lock);
+    epoch->alloc_fn = alloc_fn;
+    epoch->free_fn = free_fn;
+    epoch->spare = (struct retired_chunk*)alloc_fn(sizeof(*epoch->spare));
+    return epoch;
+}
+
+void epoch_destroy(struct epoch* epoch)
+{
+    free_objects(epoch, epoch->draining, epoch->draining_count);
+    free_chunks(epoch, epoch->draining_more);
+    free_objects(epoch, epoch->pending, epoch->pending_count);
+    free_chunks(epoch, epoch->pending_more);
+    if (epoch->spare != NULL)
+        epoch->free_fn(epoch->spare);
+    difi_lock_destroy(&epoch->lock);
+    epoch->free_fn(epoch);
+}
+
+unsigned epoch_enter(struct epoch* epoch)
+{
+    unsigned slot = current_slot();
+
+    for (;;) {
+        unsigned parity = (unsigned)epoch->current & 1;
+
+        difi_atomic_inc(&epoch->slots[slot].active[parity]);
+        /* A writer which advanced meanwhile may not have seen us, retry */
+        if (((unsigned)epoch->current & 1) == parity)
+            return slot * 2 + parity;
+        difi_atomic_dec(&epoch->slots[slot].active[parity]);
+    }
+}
+
+void epoch_leave(struct epoch* epoch, unsigned token)
+{
+    difi_atomic_dec(&epoch->slots[token / 2].active[token & 1]);
+}
+
+/* 
+   Room for one more pending object, NULL only if no chunk can be had. 
+   Called under the lock
+*/
+static struct retired_object* pending_slot(struct epoch* epoch)
+{
+    struct retired_chunk* chunk = epoch->pending_more;
+
+    if (epoch->pending_count == EPOCH_RETIRE_MAX && try_drain(epoch))
+        advance(epoch);
+    if (epoch->pending_count < EPOCH_RETIRE_MAX)
+        return &epoch->pending[epoch->pending_count++];
+
+    /* Readers of the old parity are still there: no waiting, chain a chunk */
+    if (chunk == NULL || chunk->count == EPOCH_RETIRE_MAX) {
+        chunk = (struct retired_chunk*)epoch->alloc_fn(sizeof(*chunk));
+        if (chunk == NULL) {
+            chunk = epoch->spare;
+            epoch->spare = NULL;
+        }
+        if (chunk == NULL)
+            return NULL;
+        chunk->count = 0;
+        chunk->next = epoch->pending_more;
+        epoch->pending_more = chunk;
+    }
+    return &chunk->objects[chunk->count++];
+}
+
+void epoch_retire(struct epoch* epoch, void* object, epoch_destroy_fn destroy_fn)
+{
+    struct retired_object* slot;
+
+    difi_lock_acquire(&epoch->lock);
+    slot = pending_slot(epoch);
+    while (slot == NULL) {
+        /* Out of memory as well: the only way left is to wait for the readers */
+        difi_cpu_relax();
+        slot = pending_slot(epoch);
+    }
+    slot->object = object;
+    slot->destroy_fn = destroy_fn;
+    difi_lock_release(&epoch->lock);
+}
+
+void epoch_reclaim(struct epoch* epoch)
+{
+    struct retired_chunk* spare = NULL;
+
+    /* Unlocked peek, writers call it after every update */
+    if (!epoch->waiting && epoch->pending_count == 0 && epoch->spare != NULL)
+        return;
+
+    /* The spare used up by a retire is replaced outside of the lock */
+    if (epoch->spare == NULL)
+        spare = (struct retired_chunk*)epoch->alloc_fn(sizeof(*spare));
+
+    difi_lock_acquire(&epoch->lock);
+    if (epoch->spare == NULL) {
+        epoch->spare = spare;
+        spare = NULL;
+    }
+    if (try_drain(epoch) && epoch->pending_count > 0) {
+        advance(epoch);
+        try_drain(epoch);
+    }
+    difi_lock_release(&epoch->lock);
+    if (spare != NULL)
+        epoch->free_fn(spare);
+}
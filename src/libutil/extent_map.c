@@ -0,0 +1,354 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Ordered map of remapped block runs, implemented as AVL tree keyed by the 
+  first source block of the run. Runs never overlap, so ordering by start 
+  also orders them by end, which makes range lookups a simple in-order walk.
+*/
+#include "libcrt/baselib.h"
+#include "libutil/extent_map.h"
+
+#define MAX_RUN_LENGTH (0xFFFFFFFFUL)
+
+struct extent_map_node
+{
+    struct extent_map_node* child[2];   /* 0 - left, 1 - right */
+    struct extent_map_run   run;
+    int                     height;
+};
+
+struct extent_map
+{
+    struct extent_map_node* root;
+    unsigned                count;
+
+    void* (*alloc_fn)(unsigned size); 
+    void  (*free_fn) (void* mem);
+
+    void  (*retire_fn)(void* context, void* mem);
+    void* retire_context;
+};
+
+/* Path from the root to the node being updated */
+struct node_path
+{
+    struct extent_map_node** links[EXTENT_MAP_MAX_HEIGHT];
+    int                      depth;
+};
+
+static int node_height(struct extent_map_node* node)
+{
+    return node ? node->height : 0;
+}
+
+static void update_height(struct extent_map_node* node)
+{
+    int l = node_height(node->child[0]);
+    int r = node_height(node->child[1]);
+    node->height = (l > r ? l : r) + 1;
+}
+
+/* dir == 0 rotates left, dir == 1 rotates right */
+static struct extent_map_node* rotate(struct extent_map_node* node, int dir)
+{
+    struct extent_map_node* pivot = node->child[!dir];
+
+    node->child[!dir] = pivot->child[dir];
+    pivot->child[dir] = node;
+    update_height(node);
+    update_height(pivot);
+    return pivot;
+}
+
+static struct extent_map_node* rebalance(struct extent_map_node* node)
+{
+    int balance = node_height(node->child[0]) - node_height(node->child[1]);
+
+    if (balance > 1) {
+        if (node_height(node->child[0]->child[0]) < node_height(node->child[0]->child[1]))
+            node->child[0] = rotate(node->child[0], 0);
+        return rotate(node, 1);
+    }
+    if (balance < -1) {
+        if (node_height(node->child[1]->child[1]) < node_height(node->child[1]->child[0]))
+            node->child[1] = rotate(node->child[1], 1);
+        return rotate(node, 0);
+    }
+    update_height(node);
+    return node;
+}
+
+/* Walk the recorded path bottom-up restoring AVL invariant */
+static void rebalance_path(struct node_path* path)
+{
+    while (path->depth > 0) {
+        struct extent_map_node** link = path->links[--path->depth];
+        *link = rebalance(*link);
+    }
+}
+
+static ulong64_t run_end(const struct extent_map_run* run)
+{
+    return run->source_block + run->length_in_blocks;
+}
+
+/* Both source and target of b continue a */
+static int runs_adjacent(const struct extent_map_run* a, const struct extent_map_run* b)
+{
+    return run_end(a) == b->source_block &&
+           a->target_block + a->length_in_blocks == b->target_block &&
+           (ulong64_t)a->length_in_blocks + b->length_in_blocks <= MAX_RUN_LENGTH;
+}
+
+static void remove_node(struct extent_map* map, ulong64_t source_block)
+{
+    struct node_path         path;
+    struct extent_map_node** link = &map->root;
+    struct extent_map_node*  node;
+
+    path.depth = 0;
+    while ((node = *link) != NULL && node->run.source_block != source_block) {
+        path.links[path.depth++] = link;
+        link = &node->child[source_block > node->run.source_block];
+    }
+    if (node == NULL)
+        return;
+
+    if (node->child[0] != NULL && node->child[1] != NULL) {
+        /* Replace with in-order successor, then unlink the successor */
+        struct extent_map_node* target = node;
+
+        path.links[path.depth++] = link;
+        link = &node->child[1];
+        while ((*link)->child[0] != NULL) {
+            path.links[path.depth++] = link;
+            link = &(*link)->child[0];
+        }
+        node = *link;
+        target->run = node->run;
+    }
+    *link = node->child[node->child[0] == NULL];
+    if (map->retire_fn != NULL)
+        map->retire_fn(map->retire_context, node);
+    else
+        map->free_fn(node);
+    map->count--;
+
+    rebalance_path(&path);
+}
+
+struct extent_map* extent_map_create(void* (*alloc_fn)(unsigned size), 
+                                     void (*free_fn)(void* mem))
+{
+    struct extent_map* map = (struct extent_map*)alloc_fn(sizeof(*map));
+    if (map == NULL)
+        return NULL;
+
+    memset(map, 0, sizeof(*map));
+    map->alloc_fn = alloc_fn;
+    map->free_fn = free_fn;
+    return map;
+}
+
+void extent_map_destroy(struct extent_map* map)
+{
+    struct extent_map_node* node = map->root;
+
+    /* Flatten the tree with right rotations, no recursion or stack needed */
+    while (node != NULL) {
+        struct extent_map_node* next;
+        if (node->child[0] != NULL) {
+            next = node->child[0];
+            node->child[0] = next->child[1];
+            next->child[1] = node;
+        } else {
+            next = node->child[1];
+            map->free_fn(node);
+        }
+        node = next;
+    }
+    map->free_fn(map);
+}
+
+int extent_map_insert(struct extent_map* map, const struct extent_map_run* run)
+{
+    struct node_path         path;
+    struct extent_map_node** link = &map->root;
+    struct extent_map_node*  node;
+    struct extent_map_node*  prev = NULL;
+    struct extent_map_node*  next = NULL;
+
+    path.depth = 0;
+    while ((node = *link) != NULL) {
+        int dir = run->source_block > node->run.source_block;
+        if (dir)
+            prev = node;
+        else
+            next = node;
+        path.links[path.depth++] = link;
+        link = &node->child[dir];
+    }
+
+    if (prev != NULL && runs_adjacent(&prev->run, run)) {
+        prev->run.length_in_blocks += run->length_in_blocks;
+        if (next != NULL && runs_adjacent(&prev->run, &next->run)) {
+            prev->run.length_in_blocks += next->run.length_in_blocks;
+            remove_node(map, next->run.source_block);
+        }
+        return EXTENT_MAP_OK;
+    }
+    if (next != NULL && runs_adjacent(run, &next->run)) {
+        /* Extending the run backwards keeps the tree order intact */
+        next->run.source_block = run->source_block;
+        next->run.target_block = run->target_block;
+        next->run.length_in_blocks += run->length_in_blocks;
+        return EXTENT_MAP_OK;
+    }
+
+    node = (struct extent_map_node*)map->alloc_fn(sizeof(*node));
+    if (node == NULL) {
+        difi_dbg_print("failed to allocate extent map node\n");
+        return EXTENT_MAP_NO_MEMORY;
+    }
+    node->child[0] = node->child[1] = NULL;
+    node->run = *run;
+    node->height = 1;
+    /* Readers following the link must see the node initialized */
+    difi_write_barrier();
+    *link = node;
+    map->count++;
+
+    rebalance_path(&path);
+    return EXTENT_MAP_OK;
+}
+
+int extent_map_remove(struct extent_map* map, ulong64_t source_block, ulong64_t length)
+{
+    ulong64_t end = source_block + length;
+
+    for (;;) {
+        struct extent_map_iter  iter;
+        struct extent_map_node* node;
+        ulong64_t               last;
+
+        /* Lowest run ending after source_block, nodes change on every pass */
+        extent_map_iter_seek(map, &iter, source_block);
+        if (iter.depth == 0)
+            break;
+        node = iter.stack[iter.depth - 1];
+        if (node->run.source_block >= end)
+            break;
+        last = run_end(&node->run);
+
+        if (node->run.source_block < source_block) {
+            if (last > end) {
+                /* Tail goes first: if it can't be added nothing changes */
+                struct extent_map_run tail;
+
+                tail.source_block = end;
+                tail.target_block = node->run.target_block + (end - node->run.source_block);
+                tail.length_in_blocks = (ulong32_t)(last - end);
+                if (extent_map_insert(map, &tail) != EXTENT_MAP_OK)
+                    return EXTENT_MAP_NO_MEMORY;
+            }
+            node->run.length_in_blocks = (ulong32_t)(source_block - node->run.source_block);
+        } else if (last > end) {
+            /* Moving the start forward keeps the tree order intact */
+            node->run.target_block += end - node->run.source_block;
+            node->run.length_in_blocks = (ulong32_t)(last - end);
+            node->run.source_block = end;
+            break;
+        } else {
+            remove_node(map, node->run.source_block);
+        }
+    }
+    return EXTENT_MAP_OK;
+}
+
+int extent_map_lookup(struct extent_map* map, 
+                      ulong64_t source_block, 
+                      struct extent_map_run* run)
+{
+    struct extent_map_node* node = map->root;
+    int                     steps;
+
+    for (steps = 0; node != NULL && steps < EXTENT_MAP_MAX_HEIGHT; steps++) {
+        if (source_block < node->run.source_block) {
+            node = node->child[0];
+        } else if (source_block >= run_end(&node->run)) {
+            node = node->child[1];
+        } else {
+            *run = node->run;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void extent_map_set_retire(struct extent_map* map, 
+                           void (*retire_fn)(void* context, void* mem),
+                           void* context)
+{
+    map->retire_fn = retire_fn;
+    map->retire_context = context;
+}
+
+unsigned extent_map_count(struct extent_map* map)
+{
+    return map->count;
+}
+
+void extent_map_iter_seek(struct extent_map* map, 
+                          struct extent_map_iter* iter, 
+                          ulong64_t source_block)
+{
+    struct extent_map_node* node = map->root;
+    int                     steps;
+
+    /* Stack holds all nodes we went left from, top is the lower bound */
+    iter->depth = 0;
+    for (steps = 0; node != NULL && steps < EXTENT_MAP_MAX_HEIGHT; steps++) {
+        if (run_end(&node->run) <= source_block) {
+            node = node->child[1];
+        } else {
+            iter->stack[iter->depth++] = node;
+            node = node->child[0];
+        }
+    }
+}
+
+int extent_map_iter_next(struct extent_map_iter* iter, struct extent_map_run* run)
+{
+    struct extent_map_node* node;
+
+    if (iter->depth == 0)
+        return 0;
+
+    node = iter->stack[--iter->depth];
+    *run = node->run;
+
+    for (node = node->child[1]; 
+         node != NULL && iter->depth < EXTENT_MAP_MAX_HEIGHT; 
+         node = node->child[0])
+        iter->stack[iter->depth++] = node;
+
+    return 1;
+}
@@ -0,0 +1,416 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Free space manager for remap storage. Free extents are kept in AVL tree 
+  ordered by start block, every node also knows the largest free extent in
+  its subtree. This allows to find the lowest extent big enough for a 
+  request, or the largest one, in O(log n) and to merge released blocks 
+  with their free neighbours.
+*/
+#include "libcrt/baselib.h"
+#include "libutil/free_space.h"
+
+#define MAX_TREE_HEIGHT (64)
+
+struct free_node
+{
+    struct free_node* child[2];     /* 0 - left, 1 - right */
+    ulong64_t         start_block;
+    ulong64_t         length;
+    ulong64_t         max_length;   /* Largest extent in this subtree */
+    int               height;
+};
+
+struct free_space
+{
+    struct free_node* root;
+    unsigned          count;
+    ulong64_t         blocks;
+
+    void* (*alloc_fn)(unsigned size); 
+    void  (*free_fn) (void* mem);
+};
+
+/* Path from the root to the node being updated */
+struct node_path
+{
+    struct free_node** links[MAX_TREE_HEIGHT];
+    int                depth;
+};
+
+static int node_height(struct free_node* node)
+{
+    return node ? node->height : 0;
+}
+
+static ulong64_t node_max(struct free_node* node)
+{
+    return node ? node->max_length : 0;
+}
+
+static void update_node(struct free_node* node)
+{
+    int       l = node_height(node->child[0]);
+    int       r = node_height(node->child[1]);
+    ulong64_t max = node->length;
+
+    node->height = (l > r ? l : r) + 1;
+    if (node_max(node->child[0]) > max)
+        max = node_max(node->child[0]);
+    if (node_max(node->child[1]) > max)
+        max = node_max(node->child[1]);
+    node->max_length = max;
+}
+
+/* dir == 0 rotates left, dir == 1 rotates right */
+static struct free_node* rotate(struct free_node* node, int dir)
+{
+    struct free_node* pivot = node->child[!dir];
+
+    node->child[!dir] = pivot->child[dir];
+    pivot->child[dir] = node;
+    update_node(node);
+    update_node(pivot);
+    return pivot;
+}
+
+static struct free_node* rebalance(struct free_node* node)
+{
+    int balance = node_height(node->child[0]) - node_height(node->child[1]);
+
+    if (balance > 1) {
+        if (node_height(node->child[0]->child[0]) < node_height(node->child[0]->child[1]))
+            node->child[0] = rotate(node->child[0], 0);
+        return rotate(node, 1);
+    }
+    if (balance < -1) {
+        if (node_height(node->child[1]->child[1]) < node_height(node->child[1]->child[0]))
+            node->child[1] = rotate(node->child[1], 1);
+        return rotate(node, 0);
+    }
+    update_node(node);
+    return node;
+}
+
+/* Walk the recorded path bottom-up restoring balance and subtree maximums */
+static void rebalance_path(struct node_path* path)
+{
+    while (path->depth > 0) {
+        struct free_node** link = path->links[--path->depth];
+        *link = rebalance(*link);
+    }
+}
+
+/* Find the node starting at start_block, path receives all links above it */
+static struct free_node** find_link(struct free_space* space, 
+                                    ulong64_t start_block,
+                                    struct node_path* path)
+{
+    struct free_node** link = &space->root;
+
+    path->depth = 0;
+    while (*link != NULL && (*link)->start_block != start_block) {
+        path->links[path->depth++] = link;
+        link = &(*link)->child[start_block > (*link)->start_block];
+    }
+    return link;
+}
+
+/* Find the last node starting at or before block, path receives all links above it */
+static struct free_node** find_containing_link(struct free_space* space, 
+                                               ulong64_t block,
+                                               struct node_path* path)
+{
+    struct free_node** link = &space->root;
+    struct free_node** found = NULL;
+    int                found_depth = 0;
+
+    path->depth = 0;
+    while (*link != NULL) {
+        if ((*link)->start_block <= block) {
+            found = link;
+            found_depth = path->depth;
+            if ((*link)->start_block == block)
+                break;
+        }
+        path->links[path->depth++] = link;
+        link = &(*link)->child[block > (*link)->start_block];
+    }
+    path->depth = found_depth;
+    return found;
+}
+
+/* Node at *link was changed in place, fix the maximums up to the root */
+static void update_path(struct node_path* path, struct free_node** link)
+{
+    path->links[path->depth++] = link;
+    rebalance_path(path);
+}
+
+static void remove_link(struct free_space* space, 
+                        struct free_node** link, 
+                        struct node_path* path)
+{
+    struct free_node* node = *link;
+
+    if (node->child[0] != NULL && node->child[1] != NULL) {
+        /* Replace with in-order successor, then unlink the successor */
+        struct free_node* target = node;
+
+        path->links[path->depth++] = link;
+        link = &node->child[1];
+        while ((*link)->child[0] != NULL) {
+            path->links[path->depth++] = link;
+            link = &(*link)->child[0];
+        }
+        node = *link;
+        target->start_block = node->start_block;
+        target->length = node->length;
+    }
+    *link = node->child[node->child[0] == NULL];
+    space->free_fn(node);
+    space->count--;
+
+    rebalance_path(path);
+}
+
+struct free_space* free_space_create(void* (*alloc_fn)(unsigned size), 
+                                     void (*free_fn)(void* mem))
+{
+    struct free_space* space = (struct free_space*)alloc_fn(sizeof(*space));
+    if (space == NULL)
+        return NULL;
+
+    memset(space, 0, sizeof(*space));
+    space->alloc_fn = alloc_fn;
+    space->free_fn = free_fn;
+    return space;
+}
+
+void free_space_destroy(struct free_space* space)
+{
+    struct free_node* node = space->root;
+
+    /* Flatten the tree with right rotations, no recursion or stack needed */
+    while (node != NULL) {
+        struct free_node* next;
+        if (node->child[0] != NULL) {
+            next = node->child[0];
+            node->child[0] = next->child[1];
+            next->child[1] = node;
+        } else {
+            next = node->child[1];
+            space->free_fn(node);
+        }
+        node = next;
+    }
+    space->free_fn(space);
+}
+
+int free_space_add(struct free_space* space, ulong64_t start_block, ulong64_t length)
+{
+    struct node_path   path;
+    struct free_node** link = &space->root;
+    struct free_node*  node;
+    struct free_node*  prev = NULL;
+    struct free_node*  next = NULL;
+    ulong64_t          end = start_block + length;
+
+    if (length == 0)
+        return FREE_SPACE_OK;
+
+    path.depth = 0;
+    while ((node = *link) != NULL) {
+        int dir;
+        if (start_block < node->start_block + node->length && node->start_block < end) {
+            difi_dbg_print("free extent %llu:%llu overlaps %llu:%llu\n", 
+                           start_block, length, node->start_block, node->length);
+            return FREE_SPACE_OVERLAP;
+        }
+        dir = start_block > node->start_block;
+        if (dir)
+            prev = node;
+        else
+            next = node;
+        path.links[path.depth++] = link;
+        link = &node->child[dir];
+    }
+
+    if (next != NULL && next->start_block != end)
+        next = NULL;
+    if (prev != NULL && prev->start_block + prev->length == start_block) {
+        /* Absorb the new blocks and possibly the next extent into the previous one */
+        ulong64_t prev_start = prev->start_block;
+
+        prev->length += length;
+        if (next != NULL) {
+            prev->length += next->length;
+            link = find_link(space, next->start_block, &path);
+            remove_link(space, link, &path);
+        }
+        link = find_link(space, prev_start, &path);
+        update_path(&path, link);
+    } else if (next != NULL) {
+        /* Extending the next extent backwards keeps the tree order intact */
+        next->start_block = start_block;
+        next->length += length;
+        link = find_link(space, start_block, &path);
+        update_path(&path, link);
+    } else {
+        node = (struct free_node*)space->alloc_fn(sizeof(*node));
+        if (node == NULL) {
+            difi_dbg_print("failed to allocate free space node\n");
+            return FREE_SPACE_NO_MEMORY;
+        }
+        node->child[0] = node->child[1] = NULL;
+        node->start_block = start_block;
+        node->length = length;
+        node->max_length = length;
+        node->height = 1;
+        *link = node;
+        space->count++;
+        rebalance_path(&path);
+    }
+    space->blocks += length;
+    return FREE_SPACE_OK;
+}
+
+ulong32_t free_space_alloc(struct free_space* space, 
+                           ulong32_t length, 
+                           int policy,
+                           ulong64_t* start_block)
+{
+    struct node_path   path;
+    struct free_node** link = &space->root;
+    struct free_node*  node;
+    ulong64_t          max = node_max(space->root);
+
+    if (length == 0 || space->root == NULL)
+        return 0;
+    if (policy == FREE_SPACE_FIT && max < length)
+        return 0;
+
+    path.depth = 0;
+    for (;;) {
+        struct free_node* left;
+        int               dir;
+
+        node = *link;
+        left = node->child[0];
+        if (policy == FREE_SPACE_LOWEST) {
+            if (left == NULL)
+                break;
+            dir = 0;
+        } else if (policy == FREE_SPACE_FIT) {
+            if (node_max(left) >= length)
+                dir = 0;
+            else if (node->length >= length)
+                break;
+            else
+                dir = 1;
+        } else {
+            /* Largest, the lowest one of them if there are several */
+            if (node_max(left) == max)
+                dir = 0;
+            else if (node->length == max)
+                break;
+            else
+                dir = 1;
+        }
+        path.links[path.depth++] = link;
+        link = &node->child[dir];
+    }
+
+    /* Carve from the front, the node keeps its place in the tree */
+    if (length > node->length)
+        length = (ulong32_t)node->length;
+    *start_block = node->start_block;
+    node->start_block += length;
+    node->length -= length;
+    space->blocks -= length;
+
+    if (node->length == 0)
+        remove_link(space, link, &path);
+    else
+        update_path(&path, link);
+
+    return length;
+}
+
+int free_space_take(struct free_space* space, ulong64_t start_block, ulong64_t length)
+{
+    struct node_path   path;
+    struct free_node** link;
+    struct free_node*  node;
+    ulong64_t          end = start_block + length;
+    ulong64_t          node_start, tail;
+    int                status;
+
+    if (length == 0)
+        return FREE_SPACE_OK;
+
+    link = find_containing_link(space, start_block, &path);
+    if (link == NULL || (*link)->start_block + (*link)->length < end)
+        return FREE_SPACE_NOT_FREE;
+
+    node = *link;
+    node_start = node->start_block;
+    tail = node_start + node->length - end;
+    space->blocks -= length;
+
+    if (node_start == start_block) {
+        /* Carve from the front, the node keeps its place in the tree */
+        node->start_block += length;
+        node->length -= length;
+        if (node->length == 0)
+            remove_link(space, link, &path);
+        else
+            update_path(&path, link);
+        return FREE_SPACE_OK;
+    }
+
+    /* Keep the head in the node, the tail becomes a new extent */
+    node->length = start_block - node_start;
+    update_path(&path, link);
+    if (tail == 0)
+        return FREE_SPACE_OK;
+
+    space->blocks -= tail;
+    status = free_space_add(space, end, tail);
+    if (status != FREE_SPACE_OK) {
+        /* Give the blocks back to the node */
+        link = find_link(space, node_start, &path);
+        (*link)->length += length + tail;
+        update_path(&path, link);
+        space->blocks += length + tail;
+    }
+    return status;
+}
+
+ulong64_t free_space_blocks(struct free_space* space)
+{
+    return space->blocks;
+}
+
+unsigned free_space_count(struct free_space* space)
+{
+    return space->count;
+}
@@ -0,0 +1,117 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Log-bucketed histogram of 64-bit values
+*/
+#include "libcrt/baselib.h"
+#include "libutil/histogram.h"
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/* Index of the highest set bit, value is not zero */
+static unsigned top_bit(ulong64_t value)
+{
+    unsigned bit = 0;
+
+    while (value >>= 1)
+        bit++;
+    return bit;
+}
+
+unsigned histogram_bucket(ulong64_t value)
+{
+    unsigned top;
+
+    if (value < SUB_BUCKETS)
+        return (unsigned)value;
+    if (value >> HISTOGRAM_MAX_BITS)
+        return HISTOGRAM_BUCKETS - 1;
+
+    /* Group 1 holds [8, 16), group 2 [16, 32) and so on */
+    top = top_bit(value);
+    return ((top - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + 
+           (unsigned)((value >> (top - HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+ulong64_t histogram_bucket_low(unsigned bucket)
+{
+    unsigned group = bucket >> HISTOGRAM_SUB_BITS;
+    unsigned sub = bucket & (SUB_BUCKETS - 1);
+
+    if (group == 0)
+        return sub;
+    return (ulong64_t)(SUB_BUCKETS + sub) << (group - 1);
+}
+
+ulong64_t histogram_bucket_high(unsigned bucket)
+{
+    unsigned group = bucket >> HISTOGRAM_SUB_BITS;
+
+    if (group == 0)
+        return bucket;
+    return histogram_bucket_low(bucket) + ((ulong64_t)1 << (group - 1)) - 1;
+}
+
+void histogram_record(struct histogram* hist, ulong64_t value)
+{
+    hist->counts[histogram_bucket(value)]++;
+}
+
+void histogram_add(struct histogram* to, const struct histogram* from)
+{
+    unsigned i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        to->counts[i] += from->counts[i];
+}
+
+ulong64_t histogram_count(const struct histogram* hist)
+{
+    ulong64_t total = 0;
+    unsigned  i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += hist->counts[i];
+    return total;
+}
+
+ulong64_t histogram_percentile(const struct histogram* hist, unsigned basis_points)
+{
+    ulong64_t total = histogram_count(hist);
+    ulong64_t rank, seen = 0;
+    unsigned  i;
+
+    if (total == 0)
+        return 0;
+    if (basis_points > 10000)
+        basis_points = 10000;
+
+    /* Smallest count covering the part, at least one value */
+    rank = (total * basis_points + 9999) / 10000;
+    if (rank == 0)
+        rank = 1;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank)
+            return histogram_bucket_high(i);
+    }
+    return histogram_bucket_high(HISTOGRAM_BUCKETS - 1);
+}
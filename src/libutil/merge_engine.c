@@ -0,0 +1,451 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Merge: copying remapped blocks back to the source disk
+*/
+#include "libcrt/baselib.h"
+#include "libutil/merge_engine.h"
+
+#define BLOCK_SIZE          (512)
+
+/* Runs asked from the source at a time */
+#define SOURCE_RUNS         (256)
+
+/* Reads a window may take, scattered runs end it early */
+#define PIECES_PER_TRANSFER (64)
+
+/* Continuous target blocks read into one transfer buffer. Target first, for sorting */
+struct merge_piece
+{
+    ulong64_t target_block;
+    ulong32_t buffer_block;
+    ulong32_t length_in_blocks;
+    unsigned  transfer;
+};
+
+struct merge_transfer
+{
+    ulong64_t      source_block;
+    ulong32_t      length_in_blocks;
+    unsigned       reads_left;
+    unsigned char* buffer;
+};
+
+struct merge_engine
+{
+    struct merge_params    params;
+    struct merge_io        io;
+    merge_source_fn        source_fn;
+    void*                  source_context;
+
+    /* Runs taken from the source, the current one may be used in part */
+    struct disk_remap_run* runs;
+    unsigned               run_count;
+    unsigned               next_run;
+    int                    source_done;
+
+    /* Current window */
+    struct merge_transfer* transfers;
+    unsigned               transfer_count;
+    struct merge_piece*    pieces;
+    struct merge_piece**   read_order;
+    unsigned               piece_count;
+    unsigned               max_pieces;
+    unsigned               next_read;       /* In read_order */
+    unsigned               next_write;      /* Transfer */
+    unsigned               writes_done;
+    unsigned char*         buffers;
+
+    struct merge_request*  requests;
+    struct merge_request*  free_requests;
+    unsigned               in_flight;
+
+    /* Shared with completions and progress readers */
+    difi_lock_t            lock;
+    struct merge_request*  completed;
+    volatile int           cancelled;
+    struct merge_progress  progress;
+
+    void* (*alloc_fn)(unsigned size); 
+    void  (*free_fn) (void* mem);
+};
+
+struct merge_engine* merge_engine_create(const struct merge_params* params,
+                                         const struct merge_io* io,
+                                         merge_source_fn source_fn,
+                                         void* source_context,
+                                         ulong64_t total_blocks,
+                                         void* (*alloc_fn)(unsigned size), 
+                                         void (*free_fn)(void* mem))
+{
+    struct merge_engine* engine;
+    unsigned             i;
+
+    if (io == NULL || io->submit_fn == NULL || source_fn == NULL)
+        return NULL;
+    if (params != NULL && (params->queue_depth == 0 || params->transfer_blocks == 0 ||
+                           params->window_transfers == 0))
+        return NULL;
+    /* All buffers are one allocation */
+    if (params != NULL && 
+        (ulong64_t)params->window_transfers * params->transfer_blocks * BLOCK_SIZE > 0xFFFFFFFFUL)
+        return NULL;
+
+    engine = (struct merge_engine*)alloc_fn(sizeof(*engine));
+    if (engine == NULL)
+        return NULL;
+    memset(engine, 0, sizeof(*engine));
+    if (params != NULL) {
+        engine->params = *params;
+    } else {
+        engine->params.queue_depth = MERGE_DEFAULT_QUEUE_DEPTH;
+        engine->params.transfer_blocks = MERGE_DEFAULT_TRANSFER_BLOCKS;
+        engine->params.window_transfers = MERGE_DEFAULT_WINDOW_TRANSFERS;
+    }
+    engine->io = *io;
+    engine->source_fn = source_fn;
+    engine->source_context = source_context;
+    engine->progress.total_blocks = total_blocks;
+    engine->alloc_fn = alloc_fn;
+    engine->free_fn = free_fn;
+    difi_lock_init(&engine->lock);
+
+    engine->max_pieces = engine->params.window_transfers * PIECES_PER_TRANSFER;
+    engine->runs = (struct disk_remap_run*)alloc_fn(SOURCE_RUNS * sizeof(struct disk_remap_run));
+    engine->transfers = (struct merge_transfer*)alloc_fn(engine->params.window_transfers * 
+                                                         sizeof(struct merge_transfer));
+    engine->pieces = (struct merge_piece*)alloc_fn(engine->max_pieces * 
+                                                   sizeof(struct merge_piece));
+    engine->read_order = (struct merge_piece**)alloc_fn(engine->max_pieces * 
+                                                        sizeof(struct merge_piece*));
+    engine->requests = (struct merge_request*)alloc_fn(engine->params.queue_depth * 
+                                                       sizeof(struct merge_request));
+    engine->buffers = (unsigned char*)alloc_fn(engine->params.window_transfers * 
+                                               engine->params.transfer_blocks * BLOCK_SIZE);
+    if (engine->runs == NULL || engine->transfers == NULL || engine->pieces == NULL ||
+        engine->read_order == NULL || engine->requests == NULL || engine->buffers == NULL) {
+        merge_engine_destroy(engine);
+        return NULL;
+    }
+
+    for (i = 0; i < engine->params.queue_depth; i++) {
+        engine->requests[i].next = engine->free_requests;
+        engine->free_requests = &engine->requests[i];
+    }
+    return engine;
+}
+
+void merge_engine_destroy(struct merge_engine* engine)
+{
+    if (engine == NULL)
+        return;
+    if (engine->runs != NULL)
+        engine->free_fn(engine->runs);
+    if (engine->transfers != NULL)
+        engine->free_fn(engine->transfers);
+    if (engine->pieces != NULL)
+        engine->free_fn(engine->pieces);
+    if (engine->read_order != NULL)
+        engine->free_fn(engine->read_order);
+    if (engine->requests != NULL)
+        engine->free_fn(engine->requests);
+    if (engine->buffers != NULL)
+        engine->free_fn(engine->buffers);
+    difi_lock_destroy(&engine->lock);
+    engine->free_fn(engine);
+}
+
+/* Current source run, NULL at the end */
+static struct disk_remap_run* current_run(struct merge_engine* engine)
+{
+    if (engine->next_run == engine->run_count && !engine->source_done) {
+        engine->run_count = engine->source_fn(engine->source_context, engine->runs, SOURCE_RUNS);
+        engine->next_run = 0;
+        if (engine->run_count == 0)
+            engine->source_done = 1;
+    }
+    return engine->next_run < engine->run_count ? &engine->runs[engine->next_run] : NULL;
+}
+
+/* Take blocks of the current run into the window, returns 0 if the window is full */
+static int take_run_blocks(struct merge_engine* engine, struct disk_remap_run* run)
+{
+    struct merge_transfer* transfer = NULL;
+    struct merge_piece*    piece = NULL;
+    ulong32_t              take;
+
+    if (engine->transfer_count > 0) {
+        transfer = &engine->transfers[engine->transfer_count - 1];
+        if (run->source_block != transfer->source_block + transfer->length_in_blocks ||
+            transfer->length_in_blocks == engine->params.transfer_blocks)
+            transfer = NULL;
+    }
+    if (transfer == NULL) {
+        if (engine->transfer_count == engine->params.window_transfers)
+            return 0;
+        transfer = &engine->transfers[engine->transfer_count];
+        transfer->source_block = run->source_block;
+        transfer->length_in_blocks = 0;
+        transfer->reads_left = 0;
+        transfer->buffer = engine->buffers + (size_t)engine->transfer_count * 
+                           engine->params.transfer_blocks * BLOCK_SIZE;
+        engine->transfer_count++;
+    }
+
+    take = engine->params.transfer_blocks - transfer->length_in_blocks;
+    if (take > run->length_in_blocks)
+        take = (ulong32_t)run->length_in_blocks;
+
+    /* Continues the last read? */
+    if (engine->piece_count > 0) {
+        piece = &engine->pieces[engine->piece_count - 1];
+        if (piece->transfer != engine->transfer_count - 1 ||
+            piece->target_block + piece->length_in_blocks != run->target_block)
+            piece = NULL;
+    }
+    if (piece == NULL) {
+        if (engine->piece_count == engine->max_pieces) {
+            /* Transfer opened for nothing is dropped */
+            if (transfer->length_in_blocks == 0)
+                engine->transfer_count--;
+            return 0;
+        }
+        piece = &engine->pieces[engine->piece_count++];
+        piece->target_block = run->target_block;
+        piece->buffer_block = transfer->length_in_blocks;
+        piece->length_in_blocks = 0;
+        piece->transfer = engine->transfer_count - 1;
+        transfer->reads_left++;
+    }
+    piece->length_in_blocks += take;
+    transfer->length_in_blocks += take;
+
+    run->source_block += take;
+    run->target_block += take;
+    run->length_in_blocks -= take;
+    return 1;
+}
+
+/* Fill the window from the source, returns 0 if there is nothing left */
+static int build_window(struct merge_engine* engine)
+{
+    struct disk_remap_run* run;
+    unsigned               i;
+    int                    sorted = 1;
+
+    engine->transfer_count = 0;
+    engine->piece_count = 0;
+    engine->next_read = 0;
+    engine->next_write = 0;
+    engine->writes_done = 0;
+
+    while ((run = current_run(engine)) != NULL && take_run_blocks(engine, run)) {
+        if (run->length_in_blocks == 0) {
+            engine->next_run++;
+            difi_lock_acquire(&engine->lock);
+            engine->progress.runs++;
+            difi_lock_release(&engine->lock);
+        }
+    }
+    if (engine->transfer_count == 0)
+        return 0;
+
+    /* Targets are often allocated in source order already */
+    for (i = 0; i < engine->piece_count; i++) {
+        engine->read_order[i] = &engine->pieces[i];
+        if (i > 0 && engine->pieces[i].target_block < engine->pieces[i - 1].target_block)
+            sorted = 0;
+    }
+    if (!sorted)
+        quick_sort_ulong64_ptr((ulong64_t**)engine->read_order, engine->piece_count);
+    return 1;
+}
+
+static void submit(struct merge_engine* engine, 
+                   int op, 
+                   ulong64_t block, 
+                   ulong32_t length, 
+                   void* buffer,
+                   unsigned transfer)
+{
+    struct merge_request* request = engine->free_requests;
+
+    engine->free_requests = request->next;
+    request->op = op;
+    request->block = block;
+    request->length_in_blocks = length;
+    request->buffer = buffer;
+    request->io_context = NULL;
+    request->transfer = transfer;
+    request->status = 0;
+    request->next = NULL;
+    engine->in_flight++;
+    if (engine->io.submit_fn(engine->io.context, request) != 0)
+        merge_engine_complete(engine, request, -1);
+}
+
+/* Start what the free slots allow: ready writes first, they free buffers */
+static void issue(struct merge_engine* engine)
+{
+    while (engine->free_requests != NULL) {
+        if (engine->next_write < engine->transfer_count &&
+            engine->transfers[engine->next_write].reads_left == 0) {
+            struct merge_transfer* transfer = &engine->transfers[engine->next_write];
+
+            submit(engine, MERGE_OP_WRITE, transfer->source_block, 
+                   transfer->length_in_blocks, transfer->buffer, engine->next_write);
+            engine->next_write++;
+        } else if (engine->next_read < engine->piece_count) {
+            struct merge_piece* piece = engine->read_order[engine->next_read++];
+
+            submit(engine, MERGE_OP_READ, piece->target_block, piece->length_in_blocks,
+                   engine->transfers[piece->transfer].buffer + 
+                   (size_t)piece->buffer_block * BLOCK_SIZE, 
+                   piece->transfer);
+        } else {
+            break;
+        }
+    }
+}
+
+/* Handle completed requests, waits for one if none came yet */
+static int reap(struct merge_engine* engine)
+{
+    struct merge_request* done;
+    int                   status = MERGE_ENGINE_OK;
+
+    for (;;) {
+        difi_lock_acquire(&engine->lock);
+        done = engine->completed;
+        engine->completed = NULL;
+        difi_lock_release(&engine->lock);
+        if (done != NULL)
+            break;
+        if (engine->io.wait_fn != NULL)
+            engine->io.wait_fn(engine->io.context);
+        else
+            difi_cpu_relax();
+    }
+
+    while (done != NULL) {
+        struct merge_request* next = done->next;
+
+        engine->in_flight--;
+        if (done->status != 0) {
+            status = MERGE_ENGINE_IO_ERROR;
+        } else if (done->op == MERGE_OP_READ) {
+            engine->transfers[done->transfer].reads_left--;
+        } else {
+            engine->writes_done++;
+        }
+
+        difi_lock_acquire(&engine->lock);
+        if (done->status == 0 && done->op == MERGE_OP_READ) {
+            engine->progress.reads++;
+            engine->progress.blocks_read += done->length_in_blocks;
+        } else if (done->status == 0) {
+            engine->progress.writes++;
+            engine->progress.blocks_written += done->length_in_blocks;
+        }
+        difi_lock_release(&engine->lock);
+
+        done->next = engine->free_requests;
+        engine->free_requests = done;
+        done = next;
+    }
+    return status;
+}
+
+int merge_engine_run(struct merge_engine* engine)
+{
+    int status = MERGE_ENGINE_OK;
+
+    while (status == MERGE_ENGINE_OK) {
+        if (engine->cancelled) {
+            status = MERGE_ENGINE_CANCELLED;
+            break;
+        }
+        if (!build_window(engine))
+            break;
+        difi_lock_acquire(&engine->lock);
+        engine->progress.windows++;
+        difi_lock_release(&engine->lock);
+
+        while (engine->writes_done < engine->transfer_count) {
+            if (engine->cancelled) {
+                status = MERGE_ENGINE_CANCELLED;
+                break;
+            }
+            issue(engine);
+            status = reap(engine);
+            if (status != MERGE_ENGINE_OK)
+                break;
+        }
+    }
+
+    /* Buffers stay in use until everything sent is back */
+    while (engine->in_flight > 0)
+        reap(engine);
+
+    if (status == MERGE_ENGINE_OK && engine->io.flush_fn != NULL &&
+        engine->io.flush_fn(engine->io.context) != 0)
+        status = MERGE_ENGINE_IO_ERROR;
+
+    difi_lock_acquire(&engine->lock);
+    engine->progress.status = status;
+    engine->progress.done = 1;
+    difi_lock_release(&engine->lock);
+    return status;
+}
+
+void merge_engine_complete(struct merge_engine* engine, 
+                           struct merge_request* request, 
+                           int status)
+{
+    request->status = status;
+    difi_lock_acquire(&engine->lock);
+    request->next = engine->completed;
+    engine->completed = request;
+    difi_lock_release(&engine->lock);
+}
+
+void merge_engine_rewind(struct merge_engine* engine)
+{
+    engine->run_count = 0;
+    engine->next_run = 0;
+    engine->source_done = 0;
+    difi_lock_acquire(&engine->lock);
+    engine->progress.status = MERGE_ENGINE_OK;
+    engine->progress.done = 0;
+    difi_lock_release(&engine->lock);
+}
+
+void merge_engine_cancel(struct merge_engine* engine)
+{
+    engine->cancelled = 1;
+}
+
+void merge_engine_get_progress(struct merge_engine* engine, struct merge_progress* progress)
+{
+    difi_lock_acquire(&engine->lock);
+    *progress = engine->progress;
+    difi_lock_release(&engine->lock);
+}
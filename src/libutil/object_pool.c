@@ -0,0 +1,147 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Pool of preallocated fixed size objects
+*/
+#include "libcrt/baselib.h"
+#include "libutil/object_pool.h"
+
+struct object_pool
+{
+    unsigned char* objects;     /* capacity * object_size bytes */
+    unsigned*      free_stack;  /* Indexes of free objects */
+    unsigned       free_count;
+    unsigned       capacity;
+    unsigned       object_size;
+
+    void  (*destruct_fn)(void* object, void* context);
+    void* context;
+
+    void* (*alloc_fn)(unsigned size); 
+    void  (*free_fn) (void* mem);
+};
+
+static void* object_at(struct object_pool* pool, unsigned index)
+{
+    return pool->objects + (size_t)index * pool->object_size;
+}
+
+/* Destruct first count objects and free the pool */
+static void release_pool(struct object_pool* pool, unsigned count)
+{
+    unsigned i;
+
+    if (pool->destruct_fn != NULL) {
+        for (i = 0; i < count; i++)
+            pool->destruct_fn(object_at(pool, i), pool->context);
+    }
+    if (pool->objects != NULL)
+        pool->free_fn(pool->objects);
+    if (pool->free_stack != NULL)
+        pool->free_fn(pool->free_stack);
+    pool->free_fn(pool);
+}
+
+struct object_pool* object_pool_create(unsigned object_size,
+                                       unsigned capacity,
+                                       int  (*construct_fn)(void* object, void* context),
+                                       void (*destruct_fn)(void* object, void* context),
+                                       void* context,
+                                       void* (*alloc_fn)(unsigned size), 
+                                       void (*free_fn)(void* mem))
+{
+    struct object_pool* pool;
+    unsigned            i;
+
+    /* Keep objects pointer aligned */
+    object_size = (object_size + sizeof(void*) - 1) & ~(unsigned)(sizeof(void*) - 1);
+    if (object_size == 0 || capacity == 0 || capacity > 0xFFFFFFFFu / object_size)
+        return NULL;
+
+    pool = (struct object_pool*)alloc_fn(sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    memset(pool, 0, sizeof(*pool));
+    pool->capacity = capacity;
+    pool->object_size = object_size;
+    pool->destruct_fn = destruct_fn;
+    pool->context = context;
+    pool->alloc_fn = alloc_fn;
+    pool->free_fn = free_fn;
+
+    pool->objects = (unsigned char*)alloc_fn(object_size * capacity);
+    pool->free_stack = (unsigned*)alloc_fn(sizeof(unsigned) * capacity);
+    if (pool->objects == NULL || pool->free_stack == NULL) {
+        difi_dbg_print("failed to allocate object pool\n");
+        pool->destruct_fn = NULL;
+        release_pool(pool, 0);
+        return NULL;
+    }
+    memset(pool->objects, 0, object_size * capacity);
+
+    for (i = 0; i < capacity; i++) {
+        if (construct_fn != NULL && construct_fn(object_at(pool, i), context) != 0) {
+            difi_dbg_print("failed to construct pooled object %u\n", i);
+            release_pool(pool, i);
+            return NULL;
+        }
+        /* Lowest addresses are handed out first */
+        pool->free_stack[i] = capacity - 1 - i;
+    }
+    pool->free_count = capacity;
+    return pool;
+}
+
+void object_pool_destroy(struct object_pool* pool)
+{
+    difi_assert(pool->free_count == pool->capacity);
+    release_pool(pool, pool->capacity);
+}
+
+void* object_pool_get(struct object_pool* pool)
+{
+    if (pool->free_count == 0)
+        return NULL;
+    return object_at(pool, pool->free_stack[--pool->free_count]);
+}
+
+void object_pool_put(struct object_pool* pool, void* object)
+{
+    size_t offset = (unsigned char*)object - pool->objects;
+
+    difi_assert(object_pool_owns(pool, object));
+    difi_assert(pool->free_count < pool->capacity);
+    pool->free_stack[pool->free_count++] = (unsigned)(offset / pool->object_size);
+}
+
+int object_pool_owns(struct object_pool* pool, void* object)
+{
+    unsigned char* p = (unsigned char*)object;
+
+    return p >= pool->objects && 
+           p < pool->objects + (size_t)pool->capacity * pool->object_size &&
+           (size_t)(p - pool->objects) % pool->object_size == 0;
+}
+
+unsigned object_pool_free_count(struct object_pool* pool)
+{
+    return pool->free_count;
+}
@@ -0,0 +1,634 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Append-only journal of remap changes with group commit and checkpoints
+*/
+#include "libcrt/baselib.h"
+#include "libcrt/crc32.h"
+#include "libutil/remap_journal.h"
+
+#define HEADER_MAGIC        (0x484A4644)    /* "DFJH" */
+#define RECORD_MAGIC        (0x524A4644)    /* "DFJR" */
+#define JOURNAL_VERSION     (1)
+
+#define RECORD_CHECKPOINT   (1)
+#define RECORD_BATCH        (2)
+
+/* Replay reads this much at a time, at least one record */
+#define REPLAY_CHUNK        (2 * REMAP_JOURNAL_MAX_RECORD)
+
+#define BLOCK_SIZE          REMAP_JOURNAL_BLOCK_SIZE
+#define RECORD_ENTRIES      ((unsigned)REMAP_JOURNAL_RECORD_ENTRIES)
+
+/* First block of a half */
+struct half_header
+{
+    uint32_t  magic;
+    uint32_t  version;
+    ulong64_t generation;
+    ulong64_t checkpoint_records;   /* Records following the header */
+    ulong64_t checkpoint_blocks;
+    ulong64_t area_blocks;
+    uint32_t  reserved;
+    uint32_t  checksum;             /* CRC-32 of the header with this field 0 */
+};
+
+/* Checkpoint part or batch, entries follow, padded to whole blocks */
+struct record_header
+{
+    uint32_t  magic;
+    uint32_t  type;
+    ulong64_t generation;           /* Of the half, stale records don't match */
+    ulong64_t sequence;             /* Record number in the half */
+    uint32_t  entry_count;
+    uint32_t  checksum;             /* CRC-32 of the header with this field 0 and entries */
+};
+
+struct remap_journal
+{
+    struct remap_journal_io io;
+    ulong64_t               half_blocks;
+
+    /* Appends, under the lock */
+    difi_lock_t                 lock;
+    struct remap_journal_entry* pending;
+    unsigned                    pending_count;
+    unsigned                    capacity;
+    int                         overflow;       /* Entries were dropped */
+    ulong64_t                   appended;       /* Last ticket */
+    ulong64_t                   durable;        /* Tickets written */
+    int                         writing;        /* Somebody commits */
+    difi_event_t                idle;           /* Signaled while nobody writes */
+
+    /* Writer only */
+    struct remap_journal_entry* batch;          /* Swapped with pending by commit */
+    unsigned char*              record;         /* REMAP_JOURNAL_MAX_RECORD bytes */
+    unsigned                    half;
+    ulong64_t                   generation;
+    ulong64_t                   sequence;       /* Of the next record */
+    ulong64_t                   next_block;     /* Free block of the half */
+    struct remap_journal_info   info;
+
+    remap_journal_export_fn     export_fn;
+    void*                       export_context;
+
+    void* (*alloc_fn)(unsigned size); 
+    void  (*free_fn) (void* mem);
+};
+
+/* Position of the reader in the half being replayed */
+struct replay_window
+{
+    unsigned char* buffer;
+    ulong64_t      start;           /* Area offset of buffer[0] */
+    unsigned       length;          /* Valid bytes */
+    ulong64_t      end;             /* End of the half */
+};
+
+static unsigned record_blocks(unsigned entry_count)
+{
+    unsigned size = sizeof(struct record_header) + 
+                    entry_count * sizeof(struct remap_journal_entry);
+
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static ulong64_t half_offset(struct remap_journal* journal, unsigned half)
+{
+    return (ulong64_t)half * journal->half_blocks * BLOCK_SIZE;
+}
+
+static uint32_t header_checksum(struct half_header* header)
+{
+    uint32_t saved = header->checksum;
+    uint32_t crc;
+
+    header->checksum = 0;
+    crc = crc32_update(0, header, sizeof(*header));
+    header->checksum = saved;
+    return crc;
+}
+
+static uint32_t record_checksum(struct record_header* header)
+{
+    uint32_t saved = header->checksum;
+    uint32_t crc;
+
+    header->checksum = 0;
+    crc = crc32_update(0, header, sizeof(*header) + 
+                       header->entry_count * sizeof(struct remap_journal_entry));
+    header->checksum = saved;
+    return crc;
+}
+
+/* Reads the header of a half, returns 0 if it is not valid */
+static int read_half_header(struct remap_journal* journal, 
+                            unsigned half, 
+                            struct half_header* header)
+{
+    unsigned char* block = journal->record;
+
+    if (journal->io.read_fn(journal->io.context, half_offset(journal, half), 
+                            block, BLOCK_SIZE) != 0)
+        return 0;
+    memcpy(header, block, sizeof(*header));
+    return header->magic == HEADER_MAGIC && 
+           header->version == JOURNAL_VERSION &&
+           header->area_blocks == 2 * journal->half_blocks &&
+           header->checksum == header_checksum(header) &&
+           1 + header->checkpoint_blocks <= journal->half_blocks;
+}
+
+static int flush(struct remap_journal* journal)
+{
+    if (journal->io.flush_fn == NULL)
+        return REMAP_JOURNAL_OK;
+    return journal->io.flush_fn(journal->io.context) == 0 ? REMAP_JOURNAL_OK 
+                                                          : REMAP_JOURNAL_IO_ERROR;
+}
+
+/* Data of the changes about to be logged reaches the disk first */
+static int barrier(struct remap_journal* journal)
+{
+    if (journal->io.barrier_fn != NULL && 
+        journal->io.barrier_fn(journal->io.context) != 0)
+        return REMAP_JOURNAL_IO_ERROR;
+    return flush(journal);
+}
+
+/* Write a record at block of the half, entries are already in place */
+static int write_record(struct remap_journal* journal, 
+                        unsigned half,
+                        ulong64_t block,
+                        ulong64_t generation,
+                        ulong64_t sequence,
+                        uint32_t type,
+                        unsigned entry_count)
+{
+    struct record_header* header = (struct record_header*)journal->record;
+    unsigned              size = record_blocks(entry_count) * BLOCK_SIZE;
+    unsigned              used = sizeof(*header) + 
+                                 entry_count * sizeof(struct remap_journal_entry);
+
+    header->magic = RECORD_MAGIC;
+    header->type = type;
+    header->generation = generation;
+    header->sequence = sequence;
+    header->entry_count = entry_count;
+    header->checksum = 0;
+    memset(journal->record + used, 0, size - used);
+    header->checksum = record_checksum(header);
+
+    if (journal->io.write_fn(journal->io.context, 
+                             half_offset(journal, half) + block * BLOCK_SIZE,
+                             journal->record, size) != 0)
+        return REMAP_JOURNAL_IO_ERROR;
+    return REMAP_JOURNAL_OK;
+}
+
+/* 
+   Write every mapping export_fn gives (none if empty) to the other half 
+   and make it current. Batches of the old half are all covered by it
+*/
+static int write_checkpoint(struct remap_journal* journal, int empty)
+{
+    struct remap_journal_entry* entries = (struct remap_journal_entry*)
+        (journal->record + sizeof(struct record_header));
+    struct half_header          header;
+    unsigned                    half = journal->half ^ 1;
+    ulong64_t                   generation = journal->generation + 1;
+    ulong64_t                   block = 1, records = 0;
+    int                         restart = 1;
+    int                         status;
+
+    for (;;) {
+        unsigned count = 0, n;
+
+        /* Fill the record, the exporter may return less than asked */
+        while (!empty && count < RECORD_ENTRIES) {
+            n = journal->export_fn(journal->export_context, restart, 
+                                   entries + count, RECORD_ENTRIES - count);
+            restart = 0;
+            if (n == 0)
+                break;
+            count += n;
+        }
+        if (count == 0)
+            break;
+        if (block + record_blocks(count) > journal->half_blocks) {
+            difi_dbg_print("journal checkpoint does not fit into %llu blocks\n", 
+                           journal->half_blocks);
+            return REMAP_JOURNAL_NO_SPACE;
+        }
+        status = write_record(journal, half, block, generation, records, 
+                              RECORD_CHECKPOINT, count);
+        if (status != REMAP_JOURNAL_OK)
+            return status;
+        block += record_blocks(count);
+        records++;
+        if (count < RECORD_ENTRIES)
+            break;
+    }
+
+    /* Header goes last, until it is durable the old half is in charge */
+    status = barrier(journal);
+    if (status != REMAP_JOURNAL_OK)
+        return status;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = HEADER_MAGIC;
+    header.version = JOURNAL_VERSION;
+    header.generation = generation;
+    header.checkpoint_records = records;
+    header.checkpoint_blocks = block - 1;
+    header.area_blocks = 2 * journal->half_blocks;
+    header.checksum = header_checksum(&header);
+    memset(journal->record, 0, BLOCK_SIZE);
+    memcpy(journal->record, &header, sizeof(header));
+    if (journal->io.write_fn(journal->io.context, half_offset(journal, half), 
+                             journal->record, BLOCK_SIZE) != 0)
+        return REMAP_JOURNAL_IO_ERROR;
+    status = flush(journal);
+    if (status != REMAP_JOURNAL_OK)
+        return status;
+
+    journal->half = half;
+    journal->generation = generation;
+    journal->sequence = records;
+    journal->next_block = block;
+    journal->info.checkpoints++;
+    return REMAP_JOURNAL_OK;
+}
+
+/* Append the batch to the log, a full half is replaced by a checkpoint */
+static int write_batch(struct remap_journal* journal, unsigned count)
+{
+    struct remap_journal_entry* entries = (struct remap_journal_entry*)
+        (journal->record + sizeof(struct record_header));
+    unsigned                    blocks = record_blocks(count);
+    int                         status;
+
+    if (count == 0)
+        return REMAP_JOURNAL_OK;
+    if (journal->next_block + blocks > journal->half_blocks) {
+        /* Entries were applied before they were appended, it has them */
+        return write_checkpoint(journal, 0);
+    }
+
+    /* A batch is valid once written, nothing may precede its data */
+    if (journal->io.barrier_fn != NULL) {
+        status = barrier(journal);
+        if (status != REMAP_JOURNAL_OK)
+            return status;
+    }
+
+    memcpy(entries, journal->batch, count * sizeof(*entries));
+    status = write_record(journal, journal->half, journal->next_block, 
+                          journal->generation, journal->sequence, 
+                          RECORD_BATCH, count);
+    if (status == REMAP_JOURNAL_OK)
+        status = flush(journal);
+    if (status != REMAP_JOURNAL_OK)
+        return status;
+
+    journal->next_block += blocks;
+    journal->sequence++;
+    journal->info.batches++;
+    journal->info.entries += count;
+    return REMAP_JOURNAL_OK;
+}
+
+struct remap_journal* remap_journal_create(const struct remap_journal_io* io,
+                                           ulong64_t area_blocks,
+                                           unsigned batch_entries,
+                                           remap_journal_export_fn export_fn,
+                                           void* export_context,
+                                           void* (*alloc_fn)(unsigned size), 
+                                           void (*free_fn)(void* mem))
+{
+    struct remap_journal* journal;
+    unsigned              batch_size;
+
+    if (io == NULL || io->read_fn == NULL || io->write_fn == NULL || 
+        export_fn == NULL || area_blocks < REMAP_JOURNAL_MIN_BLOCKS ||
+        batch_entries == 0 || batch_entries > RECORD_ENTRIES) {
+        difi_dbg_print("invalid journal parameters\n");
+        return NULL;
+    }
+
+    journal = (struct remap_journal*)alloc_fn(sizeof(*journal));
+    if (journal == NULL)
+        return NULL;
+    memset(journal, 0, sizeof(*journal));
+    journal->io = *io;
+    journal->half_blocks = area_blocks / 2;
+    journal->capacity = batch_entries;
+    journal->export_fn = export_fn;
+    journal->export_context = export_context;
+    journal->alloc_fn = alloc_fn;
+    journal->free_fn = free_fn;
+    difi_lock_init(&journal->lock);
+    difi_event_init(&journal->idle);
+
+    batch_size = batch_entries * sizeof(struct remap_journal_entry);
+    journal->pending = (struct remap_journal_entry*)alloc_fn(batch_size);
+    journal->batch = (struct remap_journal_entry*)alloc_fn(batch_size);
+    journal->record = (unsigned char*)alloc_fn(REPLAY_CHUNK);
+    if (journal->pending == NULL || journal->batch == NULL || 
+        journal->record == NULL) {
+        remap_journal_destroy(journal);
+        return NULL;
+    }
+    return journal;
+}
+
+void remap_journal_destroy(struct remap_journal* journal)
+{
+    if (journal->pending != NULL)
+        journal->free_fn(journal->pending);
+    if (journal->batch != NULL)
+        journal->free_fn(journal->batch);
+    if (journal->record != NULL)
+        journal->free_fn(journal->record);
+    difi_event_destroy(&journal->idle);
+    difi_lock_destroy(&journal->lock);
+    journal->free_fn(journal);
+}
+
+int remap_journal_format(struct remap_journal* journal)
+{
+    struct half_header header;
+    unsigned           half;
+
+    /* Start above any generation left in the area, so none of it replays */
+    journal->generation = 0;
+    for (half = 0; half < 2; half++) {
+        if (read_half_header(journal, half, &header) && 
+            header.generation > journal->generation)
+            journal->generation = header.generation;
+    }
+    journal->half = 1;
+    return write_checkpoint(journal, 1);
+}
+
+/* Make [offset, offset + size) of the area available in the window */
+static const unsigned char* window_get(struct remap_journal* journal,
+                                       struct replay_window* window,
+                                       ulong64_t offset,
+                                       unsigned size)
+{
+    unsigned keep = 0, want;
+
+    if (offset + size > window->end)
+        return NULL;
+    if (offset >= window->start && 
+        offset + size <= window->start + window->length)
+        return window->buffer + (unsigned)(offset - window->start);
+
+    /* Keep the unread tail, read what follows it */
+    if (offset >= window->start && offset < window->start + window->length) {
+        keep = (unsigned)(window->start + window->length - offset);
+        memmove(window->buffer, window->buffer + (window->length - keep), keep);
+    }
+    want = REPLAY_CHUNK - keep;
+    if (offset + keep + want > window->end)
+        want = (unsigned)(window->end - offset - keep);
+    if (want > 0 && 
+        journal->io.read_fn(journal->io.context, offset + keep, 
+                            window->buffer + keep, want) != 0)
+        return NULL;
+    window->start = offset;
+    window->length = keep + want;
+    return window->buffer;
+}
+
+/* 
+   Validate the record at block of the half being replayed. Returns its 
+   header, NULL if it is torn, stale or unreadable
+*/
+static struct record_header* read_record(struct remap_journal* journal,
+                                         struct replay_window* window,
+                                         ulong64_t block,
+                                         ulong64_t generation,
+                                         ulong64_t sequence)
+{
+    ulong64_t             offset = half_offset(journal, journal->half) + block * BLOCK_SIZE;
+    struct record_header* header;
+
+    header = (struct record_header*)window_get(journal, window, offset, BLOCK_SIZE);
+    if (header == NULL || 
+        header->magic != RECORD_MAGIC ||
+        header->generation != generation || 
+        header->sequence != sequence ||
+        header->entry_count > RECORD_ENTRIES)
+        return NULL;
+    header = (struct record_header*)window_get(journal, window, offset, 
+                                               record_blocks(header->entry_count) * 
+                                               BLOCK_SIZE);
+    if (header == NULL || header->checksum != record_checksum(header))
+        return NULL;
+    return header;
+}
+
+int remap_journal_replay(struct remap_journal* journal, 
+                         remap_journal_apply_fn apply_fn,
+                         void* apply_context)
+{
+    struct half_header   headers[2];
+    struct replay_window window;
+    int                  valid[2];
+    ulong64_t            block;
+    unsigned             half;
+
+    for (half = 0; half < 2; half++)
+        valid[half] = read_half_header(journal, half, &headers[half]);
+    if (!valid[0] && !valid[1]) {
+        difi_dbg_print("no valid journal checkpoint\n");
+        return REMAP_JOURNAL_CORRUPT;
+    }
+    half = !valid[0] || (valid[1] && headers[1].generation > headers[0].generation);
+
+    journal->half = half;
+    journal->generation = headers[half].generation;
+    journal->sequence = 0;
+    window.buffer = journal->record;
+    window.start = 0;
+    window.length = 0;
+    window.end = half_offset(journal, half) + journal->half_blocks * BLOCK_SIZE;
+
+    /* Checkpoint records must all be there, batches run till the first bad one */
+    for (block = 1; ; ) {
+        struct record_header*             header;
+        const struct remap_journal_entry* entries;
+        unsigned                          i;
+        int                               in_checkpoint;
+
+        in_checkpoint = journal->sequence < headers[half].checkpoint_records;
+        header = read_record(journal, &window, block, journal->generation, 
+                             journal->sequence);
+        if (header == NULL || 
+            header->type != (in_checkpoint ? RECORD_CHECKPOINT : RECORD_BATCH)) {
+            if (in_checkpoint) {
+                difi_dbg_print("journal checkpoint record %llu is damaged\n", 
+                               journal->sequence);
+                return REMAP_JOURNAL_CORRUPT;
+            }
+            break;
+        }
+
+        entries = (const struct remap_journal_entry*)(header + 1);
+        for (i = 0; i < header->entry_count; i++) {
+            if (apply_fn(apply_context, &entries[i]) != 0) {
+                difi_dbg_print("journal entry %llu:%lu -> %llu can't be applied\n",
+                               entries[i].source_block, 
+                               (unsigned long)entries[i].length_in_blocks,
+                               entries[i].target_block);
+                return REMAP_JOURNAL_CORRUPT;
+            }
+        }
+        block += record_blocks(header->entry_count);
+        journal->sequence++;
+    }
+
+    journal->next_block = block;
+    return REMAP_JOURNAL_OK;
+}
+
+void remap_journal_append(struct remap_journal* journal, 
+                          const struct remap_journal_entry* entry,
+                          ulong64_t* ticket)
+{
+    difi_lock_acquire(&journal->lock);
+    if (journal->pending_count < journal->capacity) {
+        journal->pending[journal->pending_count++] = *entry;
+    } else {
+        journal->overflow = 1;
+        journal->info.overflows++;
+    }
+    *ticket = ++journal->appended;
+    difi_lock_release(&journal->lock);
+}
+
+ulong64_t remap_journal_last_ticket(struct remap_journal* journal)
+{
+    ulong64_t ticket;
+
+    difi_lock_acquire(&journal->lock);
+    ticket = journal->appended;
+    difi_lock_release(&journal->lock);
+    return ticket;
+}
+
+/* 
+   Become the writer and take the queued entries. Returns 0 if ticket is 
+   durable already and nothing has to be done. The current writer does disk
+   I/O, so wait for it on the event unless the IRQL forbids that
+*/
+static int begin_write(struct remap_journal* journal, 
+                       ulong64_t ticket,
+                       int force,
+                       unsigned* count,
+                       int* overflow,
+                       ulong64_t* last)
+{
+    struct remap_journal_entry* swap;
+
+    for (;;) {
+        difi_lock_acquire(&journal->lock);
+        if (!force && !journal->overflow && journal->durable >= ticket) {
+            difi_lock_release(&journal->lock);
+            return 0;
+        }
+        if (!journal->writing)
+            break;
+        difi_lock_release(&journal->lock);
+        if (difi_event_can_wait())
+            difi_event_wait(&journal->idle);
+        else
+            difi_cpu_relax();
+    }
+
+    journal->writing = 1;
+    difi_event_reset(&journal->idle);
+    swap = journal->batch;
+    journal->batch = journal->pending;
+    journal->pending = swap;
+    *count = journal->pending_count;
+    *overflow = journal->overflow;
+    *last = journal->appended;
+    journal->pending_count = 0;
+    journal->overflow = 0;
+    difi_lock_release(&journal->lock);
+    return 1;
+}
+
+static void end_write(struct remap_journal* journal, int status, ulong64_t last)
+{
+    difi_lock_acquire(&journal->lock);
+    if (status == REMAP_JOURNAL_OK)
+        journal->durable = last;
+    else
+        journal->overflow = 1;  /* Taken entries are lost, checkpoint next time */
+    journal->writing = 0;
+    difi_event_set(&journal->idle);     /* Under the lock, so it can't undo the next reset */
+    difi_lock_release(&journal->lock);
+}
+
+int remap_journal_commit(struct remap_journal* journal, ulong64_t ticket)
+{
+    ulong64_t last;
+    unsigned  count;
+    int       overflow, status;
+
+    if (!begin_write(journal, ticket, 0, &count, &overflow, &last))
+        return REMAP_JOURNAL_OK;
+
+    if (overflow)
+        status = write_checkpoint(journal, 0);
+    else
+        status = write_batch(journal, count);
+
+    end_write(journal, status, last);
+    return status;
+}
+
+int remap_journal_checkpoint(struct remap_journal* journal)
+{
+    ulong64_t last;
+    unsigned  count;
+    int       overflow, status;
+
+    begin_write(journal, 0, 1, &count, &overflow, &last);
+    status = write_checkpoint(journal, 0);
+    end_write(journal, status, last);
+    return status;
+}
+
+void remap_journal_get_info(struct remap_journal* journal, 
+                            struct remap_journal_info* info)
+{
+    difi_lock_acquire(&journal->lock);
+    *info = journal->info;
+    info->generation = journal->generation;
+    info->half_blocks = journal->half_blocks;
+    info->used_blocks = journal->next_block;
+    difi_lock_release(&journal->lock);
+}
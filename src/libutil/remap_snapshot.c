@@ -0,0 +1,381 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Snapshot of all remaps: sorted runs with a fanout index
+*/
+#include "libcrt/baselib.h"
+#include "libcrt/crc32.h"
+#include "libutil/remap_snapshot.h"
+
+#define SNAPSHOT_MAGIC      (0x53534644)    /* "DFSS" */
+
+/* Runs are written this many at a time */
+#define WRITE_RUNS          (16384)
+
+/* Runs pulled from the tracker at a time, each pull takes all its locks */
+#define SAVE_RUNS           (1024)
+
+struct remap_snapshot_writer
+{
+    struct remap_snapshot_io  io;
+    struct remap_snapshot_run* buffer;      /* WRITE_RUNS runs */
+    unsigned                  buffered;
+    struct remap_snapshot_run last;         /* Not in the buffer yet, may grow */
+    int                       have_last;
+    ulong64_t*                index;        /* fanout_count + 1 slots */
+    uint32_t                  next_slot;    /* First slot not filled */
+    ulong64_t                 offset;       /* Of the next buffer write */
+    struct remap_snapshot_header header;
+    int                       status;       /* First failure, sticks */
+
+    void* (*alloc_fn)(unsigned size); 
+    void  (*free_fn) (void* mem);
+};
+
+static ulong64_t run_end(const struct remap_snapshot_run* run)
+{
+    return run->source_block + run->length_in_blocks;
+}
+
+static uint32_t header_checksum(struct remap_snapshot_header* header)
+{
+    uint32_t saved = header->checksum;
+    uint32_t crc;
+
+    header->checksum = 0;
+    crc = crc32_update(0, header, sizeof(*header));
+    header->checksum = saved;
+    return crc;
+}
+
+struct remap_snapshot_writer* remap_snapshot_writer_create(const struct remap_snapshot_io* io,
+                                                           ulong64_t disk_blocks,
+                                                           void* (*alloc_fn)(unsigned size), 
+                                                           void (*free_fn)(void* mem))
+{
+    struct remap_snapshot_writer* writer;
+    uint32_t                      shift = 0;
+
+    if (io == NULL || io->write_fn == NULL)
+        return NULL;
+
+    writer = (struct remap_snapshot_writer*)alloc_fn(sizeof(*writer));
+    if (writer == NULL)
+        return NULL;
+    memset(writer, 0, sizeof(*writer));
+    writer->io = *io;
+    writer->alloc_fn = alloc_fn;
+    writer->free_fn = free_fn;
+
+    /* Smallest slots that cover the disk */
+    while (shift < 63 && (disk_blocks >> shift) > REMAP_SNAPSHOT_MAX_FANOUT)
+        shift++;
+    writer->header.magic = SNAPSHOT_MAGIC;
+    writer->header.version = REMAP_SNAPSHOT_VERSION;
+    writer->header.header_size = sizeof(struct remap_snapshot_header);
+    writer->header.run_size = sizeof(struct remap_snapshot_run);
+    writer->header.fanout_shift = shift;
+    writer->header.fanout_count = disk_blocks == 0 ? 1 : 
+                                  (uint32_t)((disk_blocks - 1) >> shift) + 1;
+    writer->offset = sizeof(struct remap_snapshot_header);
+
+    writer->buffer = (struct remap_snapshot_run*)alloc_fn(WRITE_RUNS * 
+                                                          sizeof(struct remap_snapshot_run));
+    writer->index = (ulong64_t*)alloc_fn((writer->header.fanout_count + 1) * sizeof(ulong64_t));
+    if (writer->buffer == NULL || writer->index == NULL) {
+        remap_snapshot_writer_destroy(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+void remap_snapshot_writer_destroy(struct remap_snapshot_writer* writer)
+{
+    if (writer == NULL)
+        return;
+    if (writer->buffer != NULL)
+        writer->free_fn(writer->buffer);
+    if (writer->index != NULL)
+        writer->free_fn(writer->index);
+    writer->free_fn(writer);
+}
+
+static void write_buffer(struct remap_snapshot_writer* writer)
+{
+    unsigned size = writer->buffered * sizeof(struct remap_snapshot_run);
+
+    if (writer->buffered == 0 || writer->status != REMAP_SNAPSHOT_OK)
+        return;
+    writer->header.runs_checksum = crc32_update(writer->header.runs_checksum, 
+                                                writer->buffer, size);
+    if (writer->io.write_fn(writer->io.context, writer->offset, writer->buffer, size) != 0)
+        writer->status = REMAP_SNAPSHOT_IO_ERROR;
+    writer->offset += size;
+    writer->buffered = 0;
+}
+
+/* The last run is final, slots up to its end point at it */
+static void emit_last(struct remap_snapshot_writer* writer)
+{
+    ulong64_t number = writer->header.run_count;
+    ulong64_t end = run_end(&writer->last);
+
+    while (writer->next_slot < writer->header.fanout_count &&
+           ((ulong64_t)writer->next_slot << writer->header.fanout_shift) < end)
+        writer->index[writer->next_slot++] = number;
+
+    writer->buffer[writer->buffered++] = writer->last;
+    writer->header.run_count++;
+    writer->header.remapped_blocks += writer->last.length_in_blocks;
+    writer->have_last = 0;
+    if (writer->buffered == WRITE_RUNS)
+        write_buffer(writer);
+}
+
+int remap_snapshot_writer_add(struct remap_snapshot_writer* writer, 
+                              const struct disk_remap_run* run)
+{
+    if (writer->status != REMAP_SNAPSHOT_OK)
+        return writer->status;
+    if (run->length_in_blocks == 0)
+        return REMAP_SNAPSHOT_OK;
+
+    if (writer->have_last) {
+        if (run->source_block < run_end(&writer->last))
+            return REMAP_SNAPSHOT_INV_ARGUMENT;
+        /* Shards split runs at chunk boundaries, they join here again */
+        if (run->source_block == run_end(&writer->last) &&
+            run->target_block == writer->last.target_block + writer->last.length_in_blocks &&
+            (uint32_t)(writer->last.length_in_blocks + run->length_in_blocks) > 
+            writer->last.length_in_blocks) {
+            writer->last.length_in_blocks += run->length_in_blocks;
+            return REMAP_SNAPSHOT_OK;
+        }
+        emit_last(writer);
+    }
+    writer->last.source_block = run->source_block;
+    writer->last.target_block = run->target_block;
+    writer->last.length_in_blocks = (uint32_t)run->length_in_blocks;
+    writer->last.reserved = 0;
+    writer->have_last = 1;
+    return writer->status;
+}
+
+int remap_snapshot_writer_finish(struct remap_snapshot_writer* writer)
+{
+    struct remap_snapshot_header* header = &writer->header;
+    unsigned                      index_size;
+
+    if (writer->have_last)
+        emit_last(writer);
+    write_buffer(writer);
+    if (writer->status != REMAP_SNAPSHOT_OK)
+        return writer->status;
+
+    /* Slots past the last run, and the end of the last slot */
+    while (writer->next_slot <= header->fanout_count)
+        writer->index[writer->next_slot++] = header->run_count;
+
+    index_size = (header->fanout_count + 1) * sizeof(ulong64_t);
+    header->index_offset = writer->offset;
+    header->index_checksum = crc32_update(0, writer->index, index_size);
+    if (writer->io.write_fn(writer->io.context, writer->offset, 
+                            writer->index, index_size) != 0)
+        return writer->status = REMAP_SNAPSHOT_IO_ERROR;
+
+    header->checksum = header_checksum(header);
+    if (writer->io.write_fn(writer->io.context, 0, header, sizeof(*header)) != 0)
+        return writer->status = REMAP_SNAPSHOT_IO_ERROR;
+    return REMAP_SNAPSHOT_OK;
+}
+
+int remap_snapshot_save(disk_remap_t remap, 
+                        const struct remap_snapshot_io* io,
+                        ulong64_t disk_blocks,
+                        void* (*alloc_fn)(unsigned size), 
+                        void (*free_fn)(void* mem))
+{
+    struct remap_snapshot_writer* writer;
+    struct disk_remap_run*        runs;
+    ulong64_t                     next_block = 0;
+    unsigned                      count, i;
+    int                           status = REMAP_SNAPSHOT_OK;
+
+    writer = remap_snapshot_writer_create(io, disk_blocks, alloc_fn, free_fn);
+    runs = (struct disk_remap_run*)alloc_fn(SAVE_RUNS * sizeof(*runs));
+    if (writer == NULL || runs == NULL) {
+        status = REMAP_SNAPSHOT_NO_MEMORY;
+        goto out;
+    }
+
+    while (status == REMAP_SNAPSHOT_OK &&
+           (count = disk_tracker_export_sorted_runs(remap, &next_block, runs, SAVE_RUNS)) > 0) {
+        for (i = 0; i < count && status == REMAP_SNAPSHOT_OK; i++)
+            status = remap_snapshot_writer_add(writer, &runs[i]);
+    }
+    if (status == REMAP_SNAPSHOT_OK)
+        status = remap_snapshot_writer_finish(writer);
+
+out:
+    if (runs != NULL)
+        free_fn(runs);
+    remap_snapshot_writer_destroy(writer);
+    return status;
+}
+
+int remap_snapshot_open(struct remap_snapshot* snapshot, 
+                        const void* data, 
+                        ulong64_t size,
+                        int verify_runs)
+{
+    const struct remap_snapshot_header* header = (const struct remap_snapshot_header*)data;
+    struct remap_snapshot_header        copy;
+    ulong64_t                           runs_size, index_size, i;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    if (data == NULL || size < sizeof(*header))
+        return REMAP_SNAPSHOT_CORRUPT;
+
+    copy = *header;
+    if (copy.magic != SNAPSHOT_MAGIC || copy.version != REMAP_SNAPSHOT_VERSION ||
+        copy.header_size != sizeof(*header) || 
+        copy.run_size != sizeof(struct remap_snapshot_run) ||
+        header_checksum(&copy) != copy.checksum)
+        return REMAP_SNAPSHOT_CORRUPT;
+
+    /* Sizes are checked before they are multiplied */
+    if (copy.fanout_count == 0 || copy.fanout_count > REMAP_SNAPSHOT_MAX_FANOUT ||
+        copy.run_count > size / sizeof(struct remap_snapshot_run))
+        return REMAP_SNAPSHOT_CORRUPT;
+    runs_size = copy.run_count * sizeof(struct remap_snapshot_run);
+    index_size = ((ulong64_t)copy.fanout_count + 1) * sizeof(ulong64_t);
+    if (copy.index_offset != sizeof(*header) + runs_size || 
+        copy.index_offset + index_size > size)
+        return REMAP_SNAPSHOT_CORRUPT;
+
+    snapshot->header = header;
+    snapshot->runs = (const struct remap_snapshot_run*)(header + 1);
+    snapshot->index = (const ulong64_t*)((const unsigned char*)data + copy.index_offset);
+    snapshot->run_count = copy.run_count;
+
+    /* Lookups trust the index, it must stay within the runs */
+    if (crc32_update(0, snapshot->index, (unsigned)index_size) != copy.index_checksum)
+        goto corrupt;
+    for (i = 0; i <= copy.fanout_count; i++) {
+        if (snapshot->index[i] > copy.run_count || 
+            (i > 0 && snapshot->index[i] < snapshot->index[i - 1]))
+            goto corrupt;
+    }
+    if (snapshot->index[copy.fanout_count] != copy.run_count)
+        goto corrupt;
+
+    if (verify_runs) {
+        uint32_t  crc = 0;
+        ulong64_t done;
+
+        /* crc32_update takes unsigned sizes */
+        for (done = 0; done < runs_size; ) {
+            unsigned piece = runs_size - done > 0x40000000 ? 
+                             0x40000000 : (unsigned)(runs_size - done);
+            crc = crc32_update(crc, (const unsigned char*)snapshot->runs + done, piece);
+            done += piece;
+        }
+        if (crc != copy.runs_checksum)
+            goto corrupt;
+        for (i = 1; i < copy.run_count; i++) {
+            if (snapshot->runs[i].source_block < run_end(&snapshot->runs[i - 1]))
+                goto corrupt;
+        }
+    }
+    return REMAP_SNAPSHOT_OK;
+
+corrupt:
+    memset(snapshot, 0, sizeof(*snapshot));
+    return REMAP_SNAPSHOT_CORRUPT;
+}
+
+ulong64_t remap_snapshot_find(const struct remap_snapshot* snapshot, ulong64_t source_block)
+{
+    const struct remap_snapshot_header* header = snapshot->header;
+    ulong64_t                           slot, low, high;
+
+    if (snapshot->run_count == 0)
+        return 0;
+
+    slot = source_block >> header->fanout_shift;
+    if (slot >= header->fanout_count)
+        slot = header->fanout_count - 1;
+    low = snapshot->index[slot];
+    /* Run the next slot starts with may begin in this one */
+    high = slot + 1 < header->fanout_count ? snapshot->index[slot + 1] + 1 : snapshot->run_count;
+    if (high > snapshot->run_count)
+        high = snapshot->run_count;
+
+    /* First run in [low, high) ending past the block */
+    while (low < high) {
+        ulong64_t middle = low + (high - low) / 2;
+
+        if (run_end(&snapshot->runs[middle]) <= source_block)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+int remap_snapshot_lookup(const struct remap_snapshot* snapshot, 
+                          ulong64_t source_block,
+                          struct disk_remap_run* run)
+{
+    const struct remap_snapshot_run* found;
+    ulong64_t                        number = remap_snapshot_find(snapshot, source_block);
+    ulong64_t                        offset;
+
+    if (number == snapshot->run_count)
+        return 0;
+    found = &snapshot->runs[number];
+    if (found->source_block > source_block)
+        return 0;
+
+    offset = source_block - found->source_block;
+    run->source_block = source_block;
+    run->target_block = found->target_block + offset;
+    run->length_in_blocks = found->length_in_blocks - (ulong32_t)offset;
+    return 1;
+}
+
+int remap_snapshot_restore(const struct remap_snapshot* snapshot, disk_remap_t remap)
+{
+    struct disk_remap_run run;
+    ulong64_t             i;
+    int                   status;
+
+    for (i = 0; i < snapshot->run_count; i++) {
+        run.source_block = snapshot->runs[i].source_block;
+        run.target_block = snapshot->runs[i].target_block;
+        run.length_in_blocks = snapshot->runs[i].length_in_blocks;
+        status = disk_tracker_restore_run(remap, &run);
+        if (status != DISK_TRACKER_OK)
+            return status == DISK_TRACKER_NO_MEMORY ? 
+                   REMAP_SNAPSHOT_NO_MEMORY : REMAP_SNAPSHOT_INV_ARGUMENT;
+    }
+    return REMAP_SNAPSHOT_OK;
+}
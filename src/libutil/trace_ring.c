@@ -0,0 +1,159 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Per-CPU rings of fixed size trace records
+*/
+#include "libcrt/baselib.h"
+#include "libutil/trace_ring.h"
+
+#define CACHE_LINE  (64)
+
+/* Indexes run freely and wrap, ring position is index & mask */
+struct ring_cpu
+{
+    /* Written by the writer only */
+    volatile ulong32_t head;
+    volatile ulong32_t lost;
+    char               writer_padding[CACHE_LINE - 2 * sizeof(ulong32_t)];
+
+    /* Written by the reader only */
+    volatile ulong32_t tail;
+    ulong32_t          lost_reported;
+    char               reader_padding[CACHE_LINE - 2 * sizeof(ulong32_t)];
+};
+
+struct trace_ring
+{
+    struct ring_cpu* cpus;
+    unsigned char*   records;
+    unsigned         cpu_count;
+    unsigned         capacity;         /* Records per CPU */
+    unsigned         record_size;
+    unsigned         next_cpu;         /* Drained first next time */
+
+    void* (*alloc_fn)(unsigned size); 
+    void  (*free_fn) (void* mem);
+};
+
+static unsigned char* record_at(struct trace_ring* ring, unsigned cpu, ulong32_t index)
+{
+    return ring->records + 
+           ((size_t)cpu * ring->capacity + (index & (ring->capacity - 1))) * 
+           ring->record_size;
+}
+
+struct trace_ring* trace_ring_create(unsigned cpu_count,
+                                     unsigned records_per_cpu,
+                                     unsigned record_size,
+                                     void* (*alloc_fn)(unsigned size), 
+                                     void (*free_fn)(void* mem))
+{
+    struct trace_ring* ring;
+    unsigned           capacity = 1;
+
+    if (cpu_count == 0 || records_per_cpu == 0 || record_size == 0)
+        return NULL;
+    while (capacity < records_per_cpu)
+        capacity <<= 1;
+
+    ring = (struct trace_ring*)alloc_fn(sizeof(*ring));
+    if (ring == NULL)
+        return NULL;
+    memset(ring, 0, sizeof(*ring));
+    ring->cpu_count = cpu_count;
+    ring->capacity = capacity;
+    ring->record_size = record_size;
+    ring->alloc_fn = alloc_fn;
+    ring->free_fn = free_fn;
+
+    ring->cpus = (struct ring_cpu*)alloc_fn(cpu_count * sizeof(struct ring_cpu));
+    ring->records = (unsigned char*)alloc_fn(cpu_count * capacity * record_size);
+    if (ring->cpus == NULL || ring->records == NULL) {
+        trace_ring_destroy(ring);
+        return NULL;
+    }
+    memset(ring->cpus, 0, cpu_count * sizeof(struct ring_cpu));
+    return ring;
+}
+
+void trace_ring_destroy(struct trace_ring* ring)
+{
+    if (ring->cpus != NULL)
+        ring->free_fn(ring->cpus);
+    if (ring->records != NULL)
+        ring->free_fn(ring->records);
+    ring->free_fn(ring);
+}
+
+void trace_ring_write(struct trace_ring* ring, unsigned cpu, const void* record)
+{
+    struct ring_cpu* ring_cpu;
+    ulong32_t        head;
+
+    cpu %= ring->cpu_count;
+    ring_cpu = &ring->cpus[cpu];
+    head = ring_cpu->head;
+    if (head - ring_cpu->tail >= ring->capacity) {
+        ring_cpu->lost++;
+        return;
+    }
+
+    memcpy(record_at(ring, cpu, head), record, ring->record_size);
+    /* Record is complete before the reader sees it */
+    difi_write_barrier();
+    ring_cpu->head = head + 1;
+}
+
+unsigned trace_ring_drain(struct trace_ring* ring, 
+                          void* buffer, 
+                          unsigned max_records,
+                          ulong32_t* lost)
+{
+    unsigned char* out = (unsigned char*)buffer;
+    unsigned       count = 0;
+    unsigned       i;
+
+    *lost = 0;
+    for (i = 0; i < ring->cpu_count; i++) {
+        unsigned         cpu = (ring->next_cpu + i) % ring->cpu_count;
+        struct ring_cpu* ring_cpu = &ring->cpus[cpu];
+        ulong32_t        head = ring_cpu->head;
+        ulong32_t        tail = ring_cpu->tail;
+        ulong32_t        lost_now = ring_cpu->lost;
+
+        *lost += lost_now - ring_cpu->lost_reported;
+        ring_cpu->lost_reported = lost_now;
+
+        /* Records up to head are complete */
+        difi_read_barrier();
+        while (tail != head && count < max_records) {
+            memcpy(out, record_at(ring, cpu, tail), ring->record_size);
+            out += ring->record_size;
+            tail++;
+            count++;
+        }
+        /* Slots are copied out before the writer may reuse them */
+        difi_memory_barrier();
+        ring_cpu->tail = tail;
+    }
+    ring->next_cpu = (ring->next_cpu + 1) % ring->cpu_count;
+    return count;
+}
@@ -0,0 +1,152 @@
+/*
+  Copyright (c) 2010-2013 Alex Snyatkov
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Transfer plan builder. Turns remapped extents into requests the lower
+  disk can take as they are
+*/
+#include "libcrt/baselib.h"
+#include "libutil/transfer_plan.h"
+
+/* Longest piece starting at disk_block the limits allow */
+static ulong32_t piece_length(const struct transfer_limits* limits, 
+                              ulong32_t max_blocks, 
+                              ulong64_t disk_block, 
+                              ulong32_t remaining)
+{
+    ulong32_t length = max_blocks;
+
+    if (length == 0 || remaining <= length)
+        return remaining;
+
+    /* Cut so that the next piece starts aligned */
+    if (limits->align_blocks > 1 && max_blocks >= limits->align_blocks)
+        length -= (ulong32_t)(disk_block & (limits->align_blocks - 1));
+    return length;
+}
+
+/* 
+   Walk the plan, storing up to max_transfers transfers. Returns the total 
+   number of transfers
+*/
+static ulong32_t make_plan(const struct disk_extent_remap* remap, 
+                           const struct transfer_limits* limits,
+                           struct transfer* transfers,
+                           ulong32_t max_transfers)
+{
+    ulong32_t max_blocks = limits->max_blocks;
+    ulong32_t buffer_block = 0;
+    ulong32_t count = 0;
+    ulong32_t i = 0;
+
+    /* Aligned cuts need the limit to be a multiple of alignment */
+    if (limits->align_blocks > 1 && max_blocks >= limits->align_blocks)
+        max_blocks &= ~(limits->align_blocks - 1);
+
+    while (i < remap->number_of_extents) {
+        ulong64_t disk_block = remap->remapped_extents[i].start_block;
+        ulong32_t remaining = remap->remapped_extents[i].length_in_blocks;
+
+        /* Merge runs adjacent on the disk, they are adjacent in the buffer */
+        for (i++; i < remap->number_of_extents; i++) {
+            const struct disk_extent* next = &remap->remapped_extents[i];
+
+            if (next->start_block != disk_block + remaining)
+                break;
+            remaining += next->length_in_blocks;
+        }
+
+        while (remaining > 0) {
+            ulong32_t length = piece_length(limits, max_blocks, disk_block, remaining);
+
+            if (count < max_transfers) {
+                transfers[count].disk_block = disk_block;
+                transfers[count].buffer_block = buffer_block;
+                transfers[count].length_in_blocks = length;
+            }
+            count++;
+            disk_block += length;
+            buffer_block += length;
+            remaining -= length;
+        }
+    }
+    return count;
+}
+
+static void sift_down(struct transfer* transfers, ulong32_t root, ulong32_t count)
+{
+    struct transfer t = transfers[root];
+
+    for (;;) {
+        ulong32_t child = root * 2 + 1;
+
+        if (child >= count)
+            break;
+        if (child + 1 < count && 
+            transfers[child + 1].disk_block > transfers[child].disk_block)
+            child++;
+        if (transfers[child].disk_block <= t.disk_block)
+            break;
+        transfers[root] = transfers[child];
+        root = child;
+    }
+    transfers[root] = t;
+}
+
+/* Heap sort by disk block: no recursion and no extra memory */
+static void sort_by_disk_block(struct transfer* transfers, ulong32_t count)
+{
+    ulong32_t i;
+
+    for (i = count / 2; i > 0; i--)
+        sift_down(transfers, i - 1, count);
+    for (i = count; i > 1; i--) {
+        struct transfer t = transfers[0];
+        transfers[0] = transfers[i - 1];
+        transfers[i - 1] = t;
+        sift_down(transfers, 0, i - 1);
+    }
+}
+
+ulong32_t transfer_plan_size(const struct disk_extent_remap* remap, 
+                             const struct transfer_limits* limits)
+{
+    return make_plan(remap, limits, NULL, 0);
+}
+
+int transfer_plan_build(const struct disk_extent_remap* remap, 
+                        const struct transfer_limits* limits,
+                        int flags,
+                        struct transfer* transfers,
+                        ulong32_t max_transfers,
+                        ulong32_t* count)
+{
+    if (remap == NULL || limits == NULL || count == NULL || 
+        (transfers == NULL && max_transfers > 0))
+        return TRANSFER_PLAN_INV_ARGUMENT;
+
+    *count = make_plan(remap, limits, transfers, max_transfers);
+    if (*count > max_transfers)
+        return TRANSFER_PLAN_BUFFER_TOO_SMALL;
+
+    if (flags & TRANSFER_PLAN_SORTED)
+        sort_by_disk_block(transfers, *count);
+    return TRANSFER_PLAN_OK;
+}
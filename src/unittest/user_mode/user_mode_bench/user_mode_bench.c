@@ -0,0 +1,427 @@
+/*
+  Hash table microbenchmark: chained hashtable (as used by the first disk
+  tracker, key and value allocated per entry) against the flat u64_map and
+  the group-probing swiss_map. Also times building transfer plans for 
+  fragmented requests and remaps and lock-free reads by 1-64 threads with 
+  one and many tracker shards.
+
+  Usage: user_mode_bench [entries ...]     default is 1000000 10000000
+  100M entries need several gigabytes for the chained table.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#endif
+
+#include "libcrt/baselib.h"
+#include "libcrt/hashtable.h"
+#include "libcrt/u64_map.h"
+#include "libcrt/swiss_map.h"
+#include "libutil/disk_tracker.h"
+#include "libutil/transfer_plan.h"
+
+static double now_ns()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1e9 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
+
+static void* bench_alloc(unsigned size)
+{
+    return malloc(size);
+}
+
+static void bench_free(void* p)
+{
+    free(p);
+}
+
+static unsigned int block_hash(void* k)
+{
+    return good_hash_func((unsigned char*)k, sizeof(ulong64_t), 0);
+}
+
+static int block_equal(void* a, void* b)
+{
+    return *(ulong64_t*)a == *(ulong64_t*)b;
+}
+
+/* Block numbers of 4k clusters in random order, deterministic between runs */
+static ulong64_t* make_keys(unsigned count, ulong64_t first)
+{
+    ulong64_t* keys = (ulong64_t*)malloc(count * sizeof(*keys));
+    ulong64_t  seed = 0x9E3779B97F4A7C15ULL;
+    unsigned   i;
+
+    if (keys == NULL)
+        return NULL;
+    for (i = 0; i < count; i++)
+        keys[i] = (first + i) * 8;
+    for (i = count - 1; i > 0; i--) {
+        unsigned  j;
+        ulong64_t t;
+
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        j = (unsigned)(seed % (i + 1));
+        t = keys[i];
+        keys[i] = keys[j];
+        keys[j] = t;
+    }
+    return keys;
+}
+
+static void report(const char* table, const char* op, unsigned count, double start)
+{
+    printf("  %-10s %-8s %8.1f ns/op\n", table, op, (now_ns() - start) / count);
+}
+
+static void bench_hashtable(const ulong64_t* keys, const ulong64_t* misses, unsigned count)
+{
+    struct hashtable* h = create_hashtable(1000, block_hash, block_equal, 
+                                           bench_alloc, bench_free);
+    double            start;
+    unsigned          i, found = 0;
+
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        ulong64_t* k = (ulong64_t*)malloc(sizeof(*k));
+        ulong64_t* v = (ulong64_t*)malloc(sizeof(*v));
+        *k = keys[i];
+        *v = keys[i] + 1;
+        if (!hashtable_insert(h, k, v)) {
+            printf("hashtable: out of memory at %u entries\n", i);
+            return;
+        }
+    }
+    report("hashtable", "insert", count, start);
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        found += hashtable_search(h, (void*)&keys[i]) != NULL;
+    report("hashtable", "hit", count, start);
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        found += hashtable_search(h, (void*)&misses[i]) != NULL;
+    report("hashtable", "miss", count, start);
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        free(hashtable_remove(h, (void*)&keys[i]));
+    report("hashtable", "remove", count, start);
+
+    if (found != count)
+        printf("hashtable: found %u of %u\n", found, count);
+    hashtable_destroy(h, 1);
+}
+
+static void bench_u64_map(const ulong64_t* keys, const ulong64_t* misses, unsigned count)
+{
+    struct u64_map* map = u64_map_create(0, bench_alloc, bench_free);
+    double          start;
+    ulong64_t       value;
+    unsigned        i, found = 0;
+
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        if (!u64_map_insert(map, keys[i], keys[i] + 1)) {
+            printf("u64_map: out of memory at %u entries\n", i);
+            return;
+        }
+    }
+    report("u64_map", "insert", count, start);
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        found += u64_map_search(map, keys[i], &value);
+    report("u64_map", "hit", count, start);
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        found += u64_map_search(map, misses[i], &value);
+    report("u64_map", "miss", count, start);
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        u64_map_remove(map, keys[i]);
+    report("u64_map", "remove", count, start);
+
+    if (found != count)
+        printf("u64_map: found %u of %u\n", found, count);
+    u64_map_destroy(map);
+}
+
+static void bench_swiss_map(const ulong64_t* keys, const ulong64_t* misses, unsigned count)
+{
+    struct swiss_map* map = swiss_map_create(0, bench_alloc, bench_free);
+    double            start;
+    ulong64_t         value;
+    unsigned          i, found = 0;
+
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        if (!swiss_map_insert(map, keys[i], keys[i] + 1)) {
+            printf("swiss_map: out of memory at %u entries\n", i);
+            return;
+        }
+    }
+    report("swiss_map", "insert", count, start);
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        found += swiss_map_search(map, keys[i], &value);
+    report("swiss_map", "hit", count, start);
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        found += swiss_map_search(map, misses[i], &value);
+    report("swiss_map", "miss", count, start);
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        swiss_map_remove(map, keys[i]);
+    report("swiss_map", "remove", count, start);
+
+    if (found != count)
+        printf("swiss_map: found %u of %u\n", found, count);
+    swiss_map_destroy(map);
+}
+
+/* 
+   1Mb request remapped into runs of 1-8 blocks scattered over the storage,
+   every other run continues the previous one on the disk
+*/
+static void bench_transfer_plan(unsigned count)
+{
+#define PLAN_REQUEST_BLOCKS 2048
+
+    struct disk_extent_remap* remap = (struct disk_extent_remap*)
+        malloc(DISK_EXTENT_REMAP_SIZE(PLAN_REQUEST_BLOCKS));
+    struct transfer*          plan = (struct transfer*)
+        malloc(PLAN_REQUEST_BLOCKS * sizeof(*plan));
+    struct transfer_limits    limits = {256, 8};
+    ulong64_t                 seed = 0x9E3779B97F4A7C15ULL;
+    ulong32_t                 blocks = 0, n = 0, planned = 0;
+    double                    start;
+    unsigned                  i;
+
+    if (remap == NULL || plan == NULL) {
+        printf("transfer plan: out of memory\n");
+        free(remap);
+        free(plan);
+        return;
+    }
+    while (blocks < PLAN_REQUEST_BLOCKS) {
+        ulong32_t length;
+
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        length = (ulong32_t)(seed % 8) + 1;
+        if (length > PLAN_REQUEST_BLOCKS - blocks)
+            length = PLAN_REQUEST_BLOCKS - blocks;
+        if (n > 0 && (n & 1))
+            remap->remapped_extents[n].start_block = 
+                remap->remapped_extents[n - 1].start_block + 
+                remap->remapped_extents[n - 1].length_in_blocks;
+        else
+            remap->remapped_extents[n].start_block = (seed >> 8) % 100000000;
+        remap->remapped_extents[n].length_in_blocks = length;
+        blocks += length;
+        n++;
+    }
+    remap->number_of_extents = n;
+
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        ulong32_t transfers;
+
+        transfer_plan_build(remap, &limits, TRANSFER_PLAN_SORTED, 
+                            plan, PLAN_REQUEST_BLOCKS, &transfers);
+        planned += transfers;
+    }
+    printf("  transfer plan, %lu runs -> %lu transfers: %8.1f ns/plan\n", 
+           (unsigned long)n, (unsigned long)(planned / count), 
+           (now_ns() - start) / count);
+
+    free(remap);
+    free(plan);
+}
+
+#define TRACKER_THREADS_MAX     64
+#define TRACKER_OPS_PER_THREAD  20000
+#define TRACKER_DISK_BLOCKS     (1ULL << 28)    /* 128Gb */
+#define TRACKER_STORAGE_BLOCKS  (1UL << 24)     /* 8Gb, enough for all writes */
+
+struct tracker_thread
+{
+    disk_remap_t tracker;
+    ulong64_t    seed;
+    int          read_only;
+    unsigned     failed;
+};
+
+/* 
+   4k writes at random places, each followed by a read of the same range. 
+   Read only threads repeat the same sequence of ranges with reads only
+*/
+#ifdef _WIN32
+static DWORD WINAPI tracker_thread_fn(void* param)
+#else
+static void* tracker_thread_fn(void* param)
+#endif
+{
+    struct tracker_thread* t = (struct tracker_thread*)param;
+    struct {
+        struct disk_extent_remap remap;
+        struct disk_extent       more[7];
+    } buffer;
+    unsigned i;
+
+    for (i = 0; i < TRACKER_OPS_PER_THREAD; i++) {
+        struct disk_extent extent;
+
+        t->seed ^= t->seed << 13;
+        t->seed ^= t->seed >> 7;
+        t->seed ^= t->seed << 17;
+        extent.start_block = (t->seed % (TRACKER_DISK_BLOCKS / 8)) * 8;
+        extent.length_in_blocks = 8;
+        if (!t->read_only &&
+            disk_tracker_remap_to_buffer(t->tracker, &extent, &buffer.remap, 8) != 
+            DISK_TRACKER_OK)
+            t->failed++;
+        if (disk_tracker_find_remap_to_buffer(t->tracker, &extent, &buffer.remap, 8) != 
+            DISK_TRACKER_OK || buffer.remap.num_remapped != 8)
+            t->failed++;
+    }
+    return 0;
+}
+
+static void run_tracker_threads(struct tracker_thread* threads, unsigned count)
+{
+#ifdef _WIN32
+    HANDLE   handles[TRACKER_THREADS_MAX];
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+        handles[i] = CreateThread(NULL, 0, tracker_thread_fn, &threads[i], 0, NULL);
+    WaitForMultipleObjects(count, handles, TRUE, INFINITE);
+    for (i = 0; i < count; i++)
+        CloseHandle(handles[i]);
+#else
+    pthread_t handles[TRACKER_THREADS_MAX];
+    unsigned  i;
+
+    for (i = 0; i < count; i++)
+        pthread_create(&handles[i], NULL, tracker_thread_fn, &threads[i]);
+    for (i = 0; i < count; i++)
+        pthread_join(handles[i], NULL);
+#endif
+}
+
+static double time_tracker_threads(struct tracker_thread* threads, unsigned count,
+                                   disk_remap_t tracker, int read_only)
+{
+    double   start;
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        threads[i].tracker = tracker;
+        threads[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        threads[i].read_only = read_only;
+        threads[i].failed = 0;
+    }
+    start = now_ns();
+    run_tracker_threads(threads, count);
+    return now_ns() - start;
+}
+
+static void bench_tracker_threads(unsigned shards)
+{
+    struct tracker_thread threads[TRACKER_THREADS_MAX];
+    unsigned              count;
+
+    printf("tracker, %u shard(s):\n", shards);
+    for (count = 1; count <= TRACKER_THREADS_MAX; count *= 2) {
+        struct remap_storage* storage = (struct remap_storage*)malloc(sizeof(*storage));
+        disk_remap_t          tracker;
+        unsigned              i, failed = 0;
+        double                write_ns, read_ns;
+
+        memset(storage, 0, sizeof(*storage));
+        storage->number_of_extents = 1;
+        storage->number_of_blocks = TRACKER_STORAGE_BLOCKS;
+        storage->extents[0].start_block = TRACKER_DISK_BLOCKS;
+        storage->extents[0].length_in_blocks = TRACKER_STORAGE_BLOCKS;
+        tracker = disk_tracker_init_sharded(bench_alloc, bench_free, storage, shards);
+        if (tracker == NULL) {
+            printf("can't create tracker\n");
+            free(storage);
+            return;
+        }
+
+        write_ns = time_tracker_threads(threads, count, tracker, 0);
+        for (i = 0; i < count; i++)
+            failed += threads[i].failed;
+        read_ns = time_tracker_threads(threads, count, tracker, 1);
+        for (i = 0; i < count; i++)
+            failed += threads[i].failed;
+        printf("  %2u threads %8.2f M remaps/s %8.2f M reads/s%s\n", count, 
+               2.0 * count * TRACKER_OPS_PER_THREAD * 1e3 / write_ns,
+               1.0 * count * TRACKER_OPS_PER_THREAD * 1e3 / read_ns,
+               failed ? " (failures)" : "");
+
+        disk_tracker_destroy(&tracker);
+        free(storage);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    static const unsigned default_counts[] = { 1000000, 10000000 };
+    int                   runs = argc > 1 ? argc - 1 : 2;
+    int                   r;
+
+    for (r = 0; r < runs; r++) {
+        unsigned   count = argc > 1 ? (unsigned)strtoul(argv[r + 1], NULL, 10) 
+                                    : default_counts[r];
+        ulong64_t* keys = make_keys(count, 0);
+        ulong64_t* misses = make_keys(count, count);
+
+        if (count == 0 || keys == NULL || misses == NULL) {
+            printf("can't run with %u entries\n", count);
+            free(keys);
+            free(misses);
+            return 1;
+        }
+
+        printf("%u entries:\n", count);
+        bench_hashtable(keys, misses, count);
+        bench_u64_map(keys, misses, count);
+        bench_swiss_map(keys, misses, count);
+        bench_transfer_plan(count / 100 > 0 ? count / 100 : 1);
+
+        free(keys);
+        free(misses);
+    }
+
+    bench_tracker_threads(1);
+    bench_tracker_threads(DISK_TRACKER_MAX_SHARDS);
+    return 0;
+}
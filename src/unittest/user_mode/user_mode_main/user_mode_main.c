@@ -4,7 +4,34 @@
 
 #include "cutest/CuTest.h"
 #include "libcrt/baselib.h"
+#include "libcrt/crc32.h"
+#include "libcrt/hashtable.h"
+#include "libcrt/u64_map.h"
+#include "libcrt/swiss_map.h"
 #include "libutil/disk_tracker.h"
+#include "libutil/extent_map.h"
+#include "libutil/free_space.h"
+#include "libutil/histogram.h"
+#include "libutil/merge_engine.h"
+#include "libutil/epoch.h"
+#include "libutil/object_pool.h"
+#include "libutil/remap_journal.h"
+#include "libutil/remap_snapshot.h"
+#include "libutil/trace_ring.h"
+#include "libutil/transfer_plan.h"
+
+/* Allocations left before test_alloc fails, negative if it never does */
+static int test_alloc_budget = -1;
+
+/* Libraries take allocators of unsigned sizes */
+static void* test_alloc(unsigned size)
+{
+    if (test_alloc_budget == 0)
+        return NULL;
+    if (test_alloc_budget > 0)
+        test_alloc_budget--;
+    return malloc(size);
+}
 
 struct remap_storage* create_storage()
 {
@@ -50,7 +77,7 @@ void test_disk_tracker(CuTest* tc)
     unsigned remaps_count;
     struct disk_extent_remap** remaps;
 
-    tracker = disk_tracker_init(malloc, free, storage); 
+    tracker = disk_tracker_init(test_alloc, free, storage); 
     CuAssertTrue(tc, tracker != NULL);
 
     // Check that returned storage info is correct
@@ -210,6 +237,1730 @@ void test_disk_tracker(CuTest* tc)
     disk_tracker_destroy(&tracker);
 }
 
+void test_disk_tracker_contiguous(CuTest* tc)
+{
+    disk_remap_t tracker = NULL;
+    struct remap_storage* storage = create_storage();
+    struct disk_extent extent;
+    struct disk_extent_remap* result = NULL;
+    int status;
+
+    tracker = disk_tracker_init(test_alloc, free, storage); 
+    CuAssertTrue(tc, tracker != NULL);
+    status = disk_tracker_set_alloc_policy(tracker, DISK_TRACKER_ALLOC_CONTIGUOUS);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+
+    // 0:5 fits the first storage extent 10:10
+    extent.start_block = 0;
+    extent.length_in_blocks = 5;
+    status = disk_tracker_remap(tracker, &extent, &result);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+    CuAssertIntEquals(tc, 1, result->number_of_extents);
+    CuAssertLongLongEquals(tc, 10, result->remapped_extents[0].start_block);
+    disk_tracker_free_remap(tracker, result);
+
+    // 20:6 does not fit the 5 blocks left, must go to 100 as a single run
+    extent.start_block = 20;
+    extent.length_in_blocks = 6;
+    status = disk_tracker_remap(tracker, &extent, &result);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+    CuAssertIntEquals(tc, 1, result->number_of_extents);
+    CuAssertLongLongEquals(tc, 100, result->remapped_extents[0].start_block);
+    disk_tracker_free_remap(tracker, result);
+
+    // Nothing can hold 7 blocks continuously (5 + 4 left), fall back to split
+    extent.start_block = 40;
+    extent.length_in_blocks = 7;
+    status = disk_tracker_remap(tracker, &extent, &result);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+    CuAssertIntEquals(tc, 2, result->number_of_extents);
+    CuAssertLongLongEquals(tc, 15, result->remapped_extents[0].start_block);
+    CuAssertIntEquals(tc, 5, result->remapped_extents[0].length_in_blocks);
+    CuAssertLongLongEquals(tc, 106, result->remapped_extents[1].start_block);
+    CuAssertIntEquals(tc, 2, result->remapped_extents[1].length_in_blocks);
+    disk_tracker_free_remap(tracker, result);
+
+    // 24:4 overlaps 20:6, only two new blocks are taken from the 108:2 leftover
+    extent.start_block = 24;
+    extent.length_in_blocks = 4;
+    status = disk_tracker_remap(tracker, &extent, &result);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+    CuAssertIntEquals(tc, 2, result->number_of_extents);
+    CuAssertIntEquals(tc, 4, result->num_remapped);
+    CuAssertLongLongEquals(tc, 104, result->remapped_extents[0].start_block);
+    CuAssertLongLongEquals(tc, 108, result->remapped_extents[1].start_block);
+    CuAssertIntEquals(tc, 2, result->remapped_extents[1].length_in_blocks);
+    disk_tracker_free_remap(tracker, result);
+
+    extent.start_block = 50;
+    extent.length_in_blocks = 1;
+    status = disk_tracker_remap(tracker, &extent, &result);
+    CuAssertIntEquals(tc, DISK_TRACKER_NO_STORAGE, status);
+
+    disk_tracker_destroy(&tracker);
+}
+
+void test_disk_tracker_no_memory(CuTest* tc)
+{
+    disk_remap_t              tracker;
+    struct disk_extent        extent = {0, 15};
+    struct disk_extent_remap* remap = malloc(DISK_EXTENT_REMAP_SIZE(4));
+    unsigned                  total, free_blocks, remapped;
+
+    // 0:15 takes 10:10 and 100:5, the map node of the second run can't be had
+    tracker = disk_tracker_init(test_alloc, free, create_storage());
+    CuAssertPtrNotNull(tc, tracker);
+    test_alloc_budget = 1;
+    CuAssertIntEquals(tc, DISK_TRACKER_NO_MEMORY, 
+                      disk_tracker_remap_to_buffer(tracker, &extent, remap, 4));
+    test_alloc_budget = -1;
+
+    // The first run stays, targets of the second are free again
+    disk_tracker_get_hash_size(tracker, &remapped);
+    CuAssertIntEquals(tc, 10, remapped);
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 10, free_blocks);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, 
+                      disk_tracker_find_remap_to_buffer(tracker, &extent, remap, 4));
+    CuAssertIntEquals(tc, 2, remap->number_of_extents);
+    CuAssertLongLongEquals(tc, 10, remap->remapped_extents[0].start_block);
+    CuAssertLongLongEquals(tc, 10, remap->remapped_extents[1].start_block);
+
+    // Again, now it is mapped to the blocks given back
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, 
+                      disk_tracker_remap_to_buffer(tracker, &extent, remap, 4));
+    CuAssertLongLongEquals(tc, 100, remap->remapped_extents[1].start_block);
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 5, free_blocks);
+    disk_tracker_destroy(&tracker);
+
+    // A single run reserved by the contiguous policy goes back whole
+    tracker = disk_tracker_init(test_alloc, free, create_storage());
+    CuAssertPtrNotNull(tc, tracker);
+    disk_tracker_set_alloc_policy(tracker, DISK_TRACKER_ALLOC_CONTIGUOUS);
+    extent.length_in_blocks = 5;
+    test_alloc_budget = 0;
+    CuAssertIntEquals(tc, DISK_TRACKER_NO_MEMORY, 
+                      disk_tracker_remap_to_buffer(tracker, &extent, remap, 4));
+    test_alloc_budget = -1;
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 20, free_blocks);
+    CuAssertTrue(tc, disk_tracker_range_is_clean(tracker, &extent));
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, 
+                      disk_tracker_remap_to_buffer(tracker, &extent, remap, 4));
+    CuAssertLongLongEquals(tc, 10, remap->remapped_extents[0].start_block);
+
+    free(remap);
+    disk_tracker_destroy(&tracker);
+}
+
+void test_disk_tracker_sharded(CuTest* tc)
+{
+    static const struct disk_extent writes[] = {
+        {0, 5}, {2046, 5}, {2 * 2048, 6}, {3 * 2048 + 10, 4}
+    };
+    disk_remap_t tracker = NULL;
+    struct remap_storage* storage = create_storage();
+    struct disk_extent extent;
+    struct disk_extent_remap* result = NULL;
+    struct disk_extent_remap** remaps = NULL;
+    unsigned count, total_blocks, free_blocks, i, j;
+    char used[20];
+    int status;
+
+    CuAssertTrue(tc, disk_tracker_init_sharded(test_alloc, free, storage, 0) == NULL);
+    tracker = disk_tracker_init_sharded(test_alloc, free, storage, 4); 
+    CuAssertTrue(tc, tracker != NULL);
+
+    // 2046:5 crosses into the next shard. Shards run dry and take blocks 
+    // from each other until all 20 are used
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < sizeof(writes) / sizeof(writes[0]); i++) {
+        extent = writes[i];
+        status = disk_tracker_remap(tracker, &extent, &result);
+        CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+        CuAssertIntEquals(tc, extent.length_in_blocks, result->num_remapped);
+        for (j = 0; j < result->number_of_extents; j++) {
+            struct disk_extent* e = &result->remapped_extents[j];
+            ulong64_t b;
+            for (b = e->start_block; b < e->start_block + e->length_in_blocks; b++) {
+                unsigned k = b < 100 ? (unsigned)(b - 10) : (unsigned)(b - 90);
+                CuAssertTrue(tc, (b >= 10 && b < 20) || (b >= 100 && b < 110));
+                CuAssertIntEquals(tc, 0, used[k]);
+                used[k] = 1;
+            }
+        }
+        disk_tracker_free_remap(tracker, result);
+    }
+
+    disk_tracker_get_storage_info(tracker, &total_blocks, &free_blocks);
+    CuAssertIntEquals(tc, 20, total_blocks);
+    CuAssertIntEquals(tc, 0, free_blocks);
+    disk_tracker_get_hash_size(tracker, &count);
+    CuAssertIntEquals(tc, 20, count);
+
+    extent.start_block = 5 * 2048;
+    extent.length_in_blocks = 1;
+    status = disk_tracker_remap(tracker, &extent, &result);
+    CuAssertIntEquals(tc, DISK_TRACKER_NO_STORAGE, status);
+
+    // Runs of all shards come back in source order
+    status = disk_tracker_get_all_remaps(tracker, &count, &remaps);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+    CuAssertIntEquals(tc, 4, count);
+    for (i = 0; i < count; i++) {
+        CuAssertLongLongEquals(tc, writes[i].start_block, remaps[i]->source_extent.start_block);
+        CuAssertIntEquals(tc, writes[i].length_in_blocks, remaps[i]->source_extent.length_in_blocks);
+        disk_tracker_free_remap(tracker, remaps[i]);
+    }
+    free(remaps);
+
+    disk_tracker_reset(tracker);
+    disk_tracker_get_storage_info(tracker, &total_blocks, &free_blocks);
+    CuAssertIntEquals(tc, 20, free_blocks);
+
+    disk_tracker_destroy(&tracker);
+}
+
+void test_disk_tracker_remap_to_buffer(CuTest* tc)
+{
+    disk_remap_t tracker = NULL;
+    struct remap_storage* storage = create_storage();
+    struct disk_extent extent;
+    struct {
+        struct disk_extent_remap remap;
+        struct disk_extent       more[3];
+    } buffer;
+    struct disk_extent* extents = buffer.remap.remapped_extents;    /* Runs on into more */
+    int status;
+
+    tracker = disk_tracker_init(test_alloc, free, storage); 
+    CuAssertTrue(tc, tracker != NULL);
+
+    // 15 blocks take the whole first storage extent and a half of the second
+    extent.start_block = 0;
+    extent.length_in_blocks = 15;
+    status = disk_tracker_remap_to_buffer(tracker, &extent, &buffer.remap, 4);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+    CuAssertIntEquals(tc, 2, buffer.remap.number_of_extents);
+    CuAssertIntEquals(tc, 15, buffer.remap.num_remapped);
+    CuAssertLongLongEquals(tc, 10, extents[0].start_block);
+    CuAssertLongLongEquals(tc, 100, extents[1].start_block);
+
+    // Read around it gives 3 extents, one slot is not enough
+    extent.start_block = 0;
+    extent.length_in_blocks = 20;
+    status = disk_tracker_find_remap_to_buffer(tracker, &extent, &buffer.remap, 1);
+    CuAssertIntEquals(tc, DISK_TRACKER_BUFFER_TOO_SMALL, status);
+    CuAssertIntEquals(tc, 3, buffer.remap.number_of_extents);
+    CuAssertLongLongEquals(tc, 10, extents[0].start_block);
+
+    status = disk_tracker_find_remap_to_buffer(tracker, &extent, &buffer.remap, 4);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+    CuAssertIntEquals(tc, 3, buffer.remap.number_of_extents);
+    CuAssertLongLongEquals(tc, 15, extents[2].start_block);
+    CuAssertIntEquals(tc, 5, extents[2].length_in_blocks);
+
+    disk_tracker_destroy(&tracker);
+}
+
+void test_disk_tracker_cursor(CuTest* tc)
+{
+    disk_remap_t                tracker;
+    struct remap_storage*       storage = create_storage_for_reset();
+    struct disk_tracker_cursor* cursor;
+    struct disk_extent          extent;
+    struct disk_extent_remap**  remaps = NULL;
+    struct disk_extent_remap*   result;
+    struct disk_remap_run       runs[3];
+    ulong64_t                   last_end = 0;
+    unsigned                    count, blocks = 0, pages = 0, i;
+
+    storage->number_of_blocks = 1000;
+    storage->extents[0].start_block = 100000;
+    storage->extents[0].length_in_blocks = 1000;
+    tracker = disk_tracker_init_sharded(test_alloc, free, storage, 4);
+    CuAssertPtrNotNull(tc, tracker);
+
+    // Nothing to walk
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_get_all_remaps(tracker, &count, &remaps));
+    CuAssertIntEquals(tc, 0, count);
+    CuAssertTrue(tc, remaps == NULL);
+    cursor = disk_tracker_cursor_open(tracker, 0);
+    CuAssertPtrNotNull(tc, cursor);
+    CuAssertIntEquals(tc, 0, disk_tracker_cursor_next(cursor, runs, 3));
+    disk_tracker_cursor_close(cursor);
+
+    // 40 extents in all shards, remapped out of order
+    for (i = 0; i < 40; i++) {
+        extent.start_block = (ulong64_t)(i * 17 % 40) * 1000;
+        extent.length_in_blocks = 10;
+        CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_remap(tracker, &extent, &result));
+        disk_tracker_free_remap(tracker, result);
+    }
+
+    // Pages come in source order, the next page starts where one ends
+    cursor = disk_tracker_cursor_open(tracker, 0);
+    while ((count = disk_tracker_cursor_next(cursor, runs, 3)) != 0) {
+        for (i = 0; i < count; i++) {
+            CuAssertTrue(tc, blocks == 0 || runs[i].source_block >= last_end);
+            last_end = runs[i].source_block + runs[i].length_in_blocks;
+            blocks += runs[i].length_in_blocks;
+        }
+        CuAssertLongLongEquals(tc, last_end, disk_tracker_cursor_position(cursor));
+        pages++;
+    }
+    disk_tracker_cursor_close(cursor);
+    CuAssertIntEquals(tc, 400, blocks);
+    CuAssertLongLongEquals(tc, 39010, last_end);
+    CuAssertTrue(tc, pages >= 14);
+
+    // Starting inside a run gives its tail
+    cursor = disk_tracker_cursor_open(tracker, 2005);
+    CuAssertIntEquals(tc, 1, disk_tracker_cursor_next(cursor, runs, 1));
+    CuAssertLongLongEquals(tc, 2005, runs[0].source_block);
+    CuAssertIntEquals(tc, 5, runs[0].length_in_blocks);
+    disk_tracker_cursor_close(cursor);
+
+    disk_tracker_destroy(&tracker);
+}
+
+void test_disk_tracker_unmap(CuTest* tc)
+{
+    disk_remap_t              tracker;
+    struct remap_storage*     storage = create_storage_for_reset();
+    struct disk_extent        extent = {4000, 100};
+    struct disk_extent        target;
+    struct disk_extent_remap* remap = malloc(DISK_EXTENT_REMAP_SIZE(8));
+    struct disk_remap_run     run;
+    unsigned                  total, free_blocks, remapped;
+    ulong32_t                 unmapped;
+
+    // 4000:100 crosses from chunk 1 to chunk 2, so two shards hold it
+    storage->number_of_blocks = 1000;
+    storage->extents[0].start_block = 100000;
+    storage->extents[0].length_in_blocks = 1000;
+    tracker = disk_tracker_init_sharded(test_alloc, free, storage, 2);
+    CuAssertPtrNotNull(tc, tracker);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_remap_to_buffer(tracker, &extent, remap, 8));
+    CuAssertIntEquals(tc, 1, remap->number_of_extents);
+    run.source_block = 4000;
+    run.target_block = remap->remapped_extents[0].start_block;
+    run.length_in_blocks = 100;
+
+    // Middle of the run goes, the rest stays mapped
+    run.source_block += 40;
+    run.target_block += 40;
+    run.length_in_blocks = 20;
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_unmap_run(tracker, &run, 0, &unmapped));
+    CuAssertIntEquals(tc, 20, unmapped);
+    disk_tracker_get_hash_size(tracker, &remapped);
+    CuAssertIntEquals(tc, 80, remapped);
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 920, free_blocks);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_find_remap_to_buffer(tracker, &extent, remap, 8));
+    CuAssertIntEquals(tc, 3, remap->number_of_extents);
+    CuAssertIntEquals(tc, 80, remap->num_remapped);
+    CuAssertLongLongEquals(tc, 4040, remap->remapped_extents[1].start_block);
+
+    // Again: nothing is mapped there now. Wrong targets are skipped as well
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_unmap_run(tracker, &run, 0, &unmapped));
+    CuAssertIntEquals(tc, 0, unmapped);
+    run.source_block = 4000;
+    run.target_block = 0;
+    run.length_in_blocks = 100;
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_unmap_run(tracker, &run, 0, &unmapped));
+    CuAssertIntEquals(tc, 0, unmapped);
+
+    // Kept targets are not free until released
+    run.target_block = remap->remapped_extents[0].start_block;
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_unmap_run(tracker, &run, 1, &unmapped));
+    CuAssertIntEquals(tc, 80, unmapped);
+    disk_tracker_get_hash_size(tracker, &remapped);
+    CuAssertIntEquals(tc, 0, remapped);
+    CuAssertTrue(tc, disk_tracker_range_is_clean(tracker, &extent));
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 920, free_blocks);
+    target.start_block = run.target_block;
+    target.length_in_blocks = 40;
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_release_storage(tracker, &target));
+    target.start_block += 60;
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_release_storage(tracker, &target));
+    CuAssertIntEquals(tc, DISK_TRACKER_INV_ARGUMENT, disk_tracker_release_storage(tracker, &target));
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 1000, free_blocks);
+
+    // Freed storage is used again
+    extent.length_in_blocks = 1000;
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_remap_to_buffer(tracker, &extent, remap, 8));
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 0, free_blocks);
+
+    free(remap);
+    disk_tracker_destroy(&tracker);
+}
+
+void test_disk_tracker_reserve(CuTest* tc)
+{
+    disk_remap_t              tracker;
+    struct remap_storage*     storage = create_storage_for_reset();
+    struct disk_extent        reserved = {1, 4};
+    struct disk_extent        extent = {500, 12};
+    struct disk_extent_remap* remap = malloc(DISK_EXTENT_REMAP_SIZE(8));
+    unsigned                  total, free_blocks;
+
+    tracker = disk_tracker_init_sharded(test_alloc, free, storage, 2);
+    CuAssertPtrNotNull(tc, tracker);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_reserve_storage(tracker, &reserved));
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 8, total);
+    CuAssertIntEquals(tc, 8, free_blocks);
+
+    // A reset keeps the blocks out of use, they can't be reserved twice
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_reset(tracker));
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 8, free_blocks);
+    CuAssertIntEquals(tc, DISK_TRACKER_INV_ARGUMENT, disk_tracker_reserve_storage(tracker, &reserved));
+
+    // Only an extent as it was reserved goes back, then it can be reserved again
+    reserved.length_in_blocks = 2;
+    CuAssertIntEquals(tc, DISK_TRACKER_INV_ARGUMENT, disk_tracker_unreserve_storage(tracker, &reserved));
+    reserved.length_in_blocks = 4;
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_unreserve_storage(tracker, &reserved));
+    CuAssertIntEquals(tc, DISK_TRACKER_INV_ARGUMENT, disk_tracker_unreserve_storage(tracker, &reserved));
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 12, total);
+    CuAssertIntEquals(tc, 12, free_blocks);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_reserve_storage(tracker, &reserved));
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_unreserve_storage(tracker, &reserved));
+
+    // Remaps use the blocks given back, a reset does not take them again
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_remap_to_buffer(tracker, &extent, remap, 8));
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 0, free_blocks);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_reset(tracker));
+    disk_tracker_get_storage_info(tracker, &total, &free_blocks);
+    CuAssertIntEquals(tc, 12, free_blocks);
+
+    free(remap);
+    disk_tracker_destroy(&tracker);
+}
+
+void test_extent_map_merge(CuTest* tc)
+{
+    struct extent_map*    map = extent_map_create(test_alloc, free);
+    struct extent_map_run run;
+    struct extent_map_iter iter;
+
+    CuAssertPtrNotNull(tc, map);
+
+    // 10:5 -> 100, then 20:5 -> 110: not adjacent, two runs
+    run.source_block = 10; run.target_block = 100; run.length_in_blocks = 5;
+    CuAssertIntEquals(tc, EXTENT_MAP_OK, extent_map_insert(map, &run));
+    run.source_block = 20; run.target_block = 110; run.length_in_blocks = 5;
+    CuAssertIntEquals(tc, EXTENT_MAP_OK, extent_map_insert(map, &run));
+    CuAssertIntEquals(tc, 2, extent_map_count(map));
+
+    // 15:5 -> 105 fills the hole, all three must collapse into one run
+    run.source_block = 15; run.target_block = 105; run.length_in_blocks = 5;
+    CuAssertIntEquals(tc, EXTENT_MAP_OK, extent_map_insert(map, &run));
+    CuAssertIntEquals(tc, 1, extent_map_count(map));
+    CuAssertTrue(tc, extent_map_lookup(map, 24, &run));
+    CuAssertLongLongEquals(tc, 10, run.source_block);
+    CuAssertLongLongEquals(tc, 100, run.target_block);
+    CuAssertIntEquals(tc, 15, run.length_in_blocks);
+
+    // 5:5 -> 0 is adjacent by source only, must stay separate
+    run.source_block = 5; run.target_block = 0; run.length_in_blocks = 5;
+    CuAssertIntEquals(tc, EXTENT_MAP_OK, extent_map_insert(map, &run));
+    CuAssertIntEquals(tc, 2, extent_map_count(map));
+    CuAssertTrue(tc, !extent_map_lookup(map, 25, &run));
+    CuAssertTrue(tc, !extent_map_lookup(map, 4, &run));
+
+    extent_map_iter_seek(map, &iter, 7);
+    CuAssertTrue(tc, extent_map_iter_next(&iter, &run));
+    CuAssertLongLongEquals(tc, 5, run.source_block);
+    CuAssertTrue(tc, extent_map_iter_next(&iter, &run));
+    CuAssertLongLongEquals(tc, 10, run.source_block);
+    CuAssertTrue(tc, !extent_map_iter_next(&iter, &run));
+
+    // Removing 12:3 splits 10:15 -> 100 in two
+    CuAssertIntEquals(tc, EXTENT_MAP_OK, extent_map_remove(map, 12, 3));
+    CuAssertIntEquals(tc, 3, extent_map_count(map));
+    CuAssertTrue(tc, !extent_map_lookup(map, 13, &run));
+    CuAssertTrue(tc, extent_map_lookup(map, 11, &run));
+    CuAssertIntEquals(tc, 2, run.length_in_blocks);
+    CuAssertTrue(tc, extent_map_lookup(map, 15, &run));
+    CuAssertLongLongEquals(tc, 15, run.source_block);
+    CuAssertLongLongEquals(tc, 105, run.target_block);
+    CuAssertIntEquals(tc, 10, run.length_in_blocks);
+
+    // Front of 5:5 -> 0 goes, then everything from 9 on
+    CuAssertIntEquals(tc, EXTENT_MAP_OK, extent_map_remove(map, 0, 8));
+    CuAssertTrue(tc, extent_map_lookup(map, 9, &run));
+    CuAssertLongLongEquals(tc, 8, run.source_block);
+    CuAssertLongLongEquals(tc, 3, run.target_block);
+    CuAssertIntEquals(tc, EXTENT_MAP_OK, extent_map_remove(map, 9, 100));
+    CuAssertIntEquals(tc, 1, extent_map_count(map));
+    CuAssertTrue(tc, extent_map_lookup(map, 8, &run));
+    CuAssertIntEquals(tc, 1, run.length_in_blocks);
+
+    extent_map_destroy(map);
+}
+
+void test_extent_map_random(CuTest* tc)
+{
+#define NUM_RUNS 2000
+    
+    struct extent_map*    map = extent_map_create(test_alloc, free);
+    struct extent_map_run run;
+    struct extent_map_iter iter;
+    int*                  order = (int*)malloc(NUM_RUNS * sizeof(int));
+    int                   i, count;
+    ulong64_t             prev_end;
+
+    // Every other 8-block slot is mapped, targets are scattered so runs never merge
+    for (i = 0; i < NUM_RUNS; i++)
+        order[i] = i;
+    for (i = NUM_RUNS - 1; i > 0; i--) {
+        int j = rand() % (i + 1), t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (i = 0; i < NUM_RUNS; i++) {
+        run.source_block = (ulong64_t)order[i] * 16;
+        run.target_block = (ulong64_t)order[i] * 1000;
+        run.length_in_blocks = 8;
+        CuAssertIntEquals(tc, EXTENT_MAP_OK, extent_map_insert(map, &run));
+    }
+    CuAssertIntEquals(tc, NUM_RUNS, extent_map_count(map));
+
+    for (i = 0; i < NUM_RUNS; i++) {
+        CuAssertTrue(tc, extent_map_lookup(map, (ulong64_t)i * 16 + 7, &run));
+        CuAssertLongLongEquals(tc, (ulong64_t)i * 1000, run.target_block);
+        CuAssertTrue(tc, !extent_map_lookup(map, (ulong64_t)i * 16 + 8, &run));
+    }
+
+    // In-order walk from the middle of a run
+    count = 0;
+    prev_end = 0;
+    extent_map_iter_seek(map, &iter, 16 * 10 + 3);
+    while (extent_map_iter_next(&iter, &run)) {
+        CuAssert(tc, "Runs must be sorted", run.source_block >= prev_end);
+        prev_end = run.source_block + run.length_in_blocks;
+        count++;
+    }
+    CuAssertIntEquals(tc, NUM_RUNS - 10, count);
+
+    free(order);
+    extent_map_destroy(map);
+}
+
+void test_free_space(CuTest* tc)
+{
+    struct free_space* space = free_space_create(test_alloc, free);
+    ulong64_t          start;
+
+    CuAssertPtrNotNull(tc, space);
+
+    // [10..20) [30..34) [50..70), then 20:5 glues onto the first one
+    CuAssertIntEquals(tc, FREE_SPACE_OK, free_space_add(space, 50, 20));
+    CuAssertIntEquals(tc, FREE_SPACE_OK, free_space_add(space, 10, 10));
+    CuAssertIntEquals(tc, FREE_SPACE_OK, free_space_add(space, 30, 4));
+    CuAssertIntEquals(tc, FREE_SPACE_OK, free_space_add(space, 20, 5));
+    CuAssertIntEquals(tc, FREE_SPACE_OVERLAP, free_space_add(space, 33, 2));
+    CuAssertIntEquals(tc, 3, free_space_count(space));
+    CuAssertLongLongEquals(tc, 39, free_space_blocks(space));
+
+    // Lowest extent which holds all 16 blocks is 50:20
+    CuAssertIntEquals(tc, 16, free_space_alloc(space, 16, FREE_SPACE_FIT, &start));
+    CuAssertLongLongEquals(tc, 50, start);
+    CuAssertIntEquals(tc, 0, free_space_alloc(space, 16, FREE_SPACE_FIT, &start));
+
+    // Largest is 10:15 now, lowest is the same
+    CuAssertIntEquals(tc, 15, free_space_alloc(space, 100, FREE_SPACE_LARGEST, &start));
+    CuAssertLongLongEquals(tc, 10, start);
+    CuAssertIntEquals(tc, 3, free_space_alloc(space, 3, FREE_SPACE_LOWEST, &start));
+    CuAssertLongLongEquals(tc, 30, start);
+    CuAssertIntEquals(tc, 2, free_space_count(space));
+
+    // 33:1 and 66:4 are left, releasing 34:32 joins everything
+    CuAssertIntEquals(tc, FREE_SPACE_OK, free_space_add(space, 34, 32));
+    CuAssertIntEquals(tc, 1, free_space_count(space));
+    CuAssertIntEquals(tc, 37, free_space_alloc(space, 100, FREE_SPACE_LOWEST, &start));
+    CuAssertLongLongEquals(tc, 33, start);
+    CuAssertIntEquals(tc, 0, free_space_count(space));
+    CuAssertLongLongEquals(tc, 0, free_space_blocks(space));
+
+    free_space_destroy(space);
+}
+
+void test_free_space_random(CuTest* tc)
+{
+#define NUM_FREE_EXTENTS 1000
+
+    struct free_space* space = free_space_create(test_alloc, free);
+    ulong64_t          start, total = 0;
+    ulong32_t          length;
+    int                i;
+
+    // Extent i has i % 7 + 1 blocks followed by a 1 block gap
+    for (i = 0; i < NUM_FREE_EXTENTS; i++) {
+        int j = (i * 617) % NUM_FREE_EXTENTS;
+        CuAssertIntEquals(tc, FREE_SPACE_OK, 
+                          free_space_add(space, (ulong64_t)j * 8, j % 7 + 1));
+        total += j % 7 + 1;
+    }
+    CuAssertIntEquals(tc, NUM_FREE_EXTENTS, free_space_count(space));
+
+    // First fit for 7 blocks is extent 6, then 13 and so on
+    for (i = 6; i < NUM_FREE_EXTENTS; i += 7) {
+        CuAssertIntEquals(tc, 7, free_space_alloc(space, 7, FREE_SPACE_FIT, &start));
+        CuAssertLongLongEquals(tc, (ulong64_t)i * 8, start);
+        total -= 7;
+    }
+    CuAssertIntEquals(tc, 0, free_space_alloc(space, 7, FREE_SPACE_FIT, &start));
+    CuAssertLongLongEquals(tc, total, free_space_blocks(space));
+
+    // Everything else is still reachable piece by piece
+    while ((length = free_space_alloc(space, 5, FREE_SPACE_LARGEST, &start)) > 0)
+        total -= length;
+    CuAssertLongLongEquals(tc, 0, total);
+    CuAssertIntEquals(tc, 0, free_space_count(space));
+
+    free_space_destroy(space);
+}
+
+void test_free_space_take(CuTest* tc)
+{
+    struct free_space* space = free_space_create(test_alloc, free);
+    ulong64_t          start;
+
+    CuAssertPtrNotNull(tc, space);
+    CuAssertIntEquals(tc, FREE_SPACE_OK, free_space_add(space, 100, 100));
+
+    // Middle, front and back of 100:100, then blocks which are taken already
+    CuAssertIntEquals(tc, FREE_SPACE_OK, free_space_take(space, 150, 10));
+    CuAssertIntEquals(tc, FREE_SPACE_OK, free_space_take(space, 100, 5));
+    CuAssertIntEquals(tc, FREE_SPACE_OK, free_space_take(space, 190, 10));
+    CuAssertIntEquals(tc, FREE_SPACE_NOT_FREE, free_space_take(space, 145, 10));
+    CuAssertIntEquals(tc, FREE_SPACE_NOT_FREE, free_space_take(space, 50, 1));
+    CuAssertIntEquals(tc, FREE_SPACE_NOT_FREE, free_space_take(space, 200, 1));
+    CuAssertIntEquals(tc, 2, free_space_count(space));
+    CuAssertLongLongEquals(tc, 75, free_space_blocks(space));
+
+    // 105:45 and 160:30 are left
+    CuAssertIntEquals(tc, 45, free_space_alloc(space, 100, FREE_SPACE_LOWEST, &start));
+    CuAssertLongLongEquals(tc, 105, start);
+    CuAssertIntEquals(tc, FREE_SPACE_OK, free_space_take(space, 160, 30));
+    CuAssertIntEquals(tc, 0, free_space_count(space));
+    CuAssertLongLongEquals(tc, 0, free_space_blocks(space));
+
+    free_space_destroy(space);
+}
+
+void test_disk_tracker_large_extent(CuTest* tc)
+{
+    disk_remap_t tracker = NULL;
+    struct remap_storage* storage = create_storage_for_reset();
+    struct disk_extent extent;
+    struct disk_extent* block_extent;
+    struct disk_extent_remap* result = NULL;
+    unsigned remapped;
+    int status;
+
+    storage->number_of_blocks = 4096;
+    storage->extents[0].start_block = 10000;
+    storage->extents[0].length_in_blocks = 4096;
+
+    tracker = disk_tracker_init(test_alloc, free, storage); 
+    CuAssertTrue(tc, tracker != NULL);
+
+    // 1Mb write must end up as single run
+    extent.start_block = 2048;
+    extent.length_in_blocks = 2048;
+    status = disk_tracker_remap(tracker, &extent, &result);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+    CuAssertIntEquals(tc, 1, result->number_of_extents);
+    CuAssertIntEquals(tc, 2048, result->num_remapped);
+    CuAssertLongLongEquals(tc, 10000, result->remapped_extents[0].start_block);
+    disk_tracker_free_remap(tracker, result);
+
+    status = disk_tracker_get_hash_size(tracker, &remapped);
+    CuAssertIntEquals(tc, DISK_TRACKER_OK, status);
+    CuAssertIntEquals(tc, 2048, remapped);
+
+    block_extent = disk_tracker_find_remap_for_block(tracker, 2050);
+    CuAssertPtrNotNull(tc, block_extent);
+    CuAssertLongLongEquals(tc, 10002, block_extent->start_block);
+    CuAssertIntEquals(tc, 2046, block_extent->length_in_blocks);
+    disk_tracker_free_extent(tracker, block_extent);
+    CuAssertTrue(tc, disk_tracker_find_remap_for_block(tracker, 2047) == NULL);
+
+    // Chunk 1 (blocks 2048..4095) is dirty, its neighbours are not
+    extent.start_block = 0;
+    extent.length_in_blocks = 2048;
+    CuAssertTrue(tc, disk_tracker_range_is_clean(tracker, &extent));
+    extent.start_block = 4095;
+    extent.length_in_blocks = 2;
+    CuAssertTrue(tc, !disk_tracker_range_is_clean(tracker, &extent));
+    extent.start_block = 4096;
+    extent.length_in_blocks = 8;
+    CuAssertTrue(tc, disk_tracker_range_is_clean(tracker, &extent));
+
+    disk_tracker_destroy(&tracker);
+}
+
+struct pooled_object
+{
+    int  constructed;
+    char payload[13];
+};
+
+static int pool_constructs_left;
+static int pool_destructed;
+
+static int construct_pooled(void* object, void* context)
+{
+    if (pool_constructs_left-- == 0)
+        return -1;
+    ((struct pooled_object*)object)->constructed = *(int*)context;
+    return 0;
+}
+
+static void destruct_pooled(void* object, void* context)
+{
+    (void)context;
+    if (((struct pooled_object*)object)->constructed)
+        pool_destructed++;
+}
+
+void test_object_pool(CuTest* tc)
+{
+    struct object_pool*   pool;
+    struct pooled_object* objects[4];
+    struct pooled_object  outside;
+    int                   marker = 1, i;
+
+    // Third object fails to construct, the first two must be destructed
+    pool_constructs_left = 2;
+    pool_destructed = 0;
+    pool = object_pool_create(sizeof(struct pooled_object), 4, construct_pooled, 
+                              destruct_pooled, &marker, test_alloc, free);
+    CuAssertTrue(tc, pool == NULL);
+    CuAssertIntEquals(tc, 2, pool_destructed);
+
+    pool_constructs_left = 4;
+    pool_destructed = 0;
+    pool = object_pool_create(sizeof(struct pooled_object), 4, construct_pooled, 
+                              destruct_pooled, &marker, test_alloc, free);
+    CuAssertPtrNotNull(tc, pool);
+
+    for (i = 0; i < 4; i++) {
+        objects[i] = (struct pooled_object*)object_pool_get(pool);
+        CuAssertPtrNotNull(tc, objects[i]);
+        CuAssertIntEquals(tc, 1, objects[i]->constructed);
+        CuAssertTrue(tc, object_pool_owns(pool, objects[i]));
+    }
+    CuAssertTrue(tc, objects[0] != objects[3]);
+    CuAssertTrue(tc, object_pool_get(pool) == NULL);
+    CuAssertTrue(tc, !object_pool_owns(pool, &outside));
+
+    // Objects are recycled, not reconstructed
+    object_pool_put(pool, objects[2]);
+    CuAssertIntEquals(tc, 1, object_pool_free_count(pool));
+    CuAssertTrue(tc, object_pool_get(pool) == objects[2]);
+
+    for (i = 0; i < 4; i++)
+        object_pool_put(pool, objects[i]);
+    object_pool_destroy(pool);
+    CuAssertIntEquals(tc, 4, pool_destructed);
+}
+
+static int epoch_destroyed;
+
+static void destroy_counted(void* object)
+{
+    epoch_destroyed++;
+    free(object);
+}
+
+void test_epoch(CuTest* tc)
+{
+    struct epoch* epoch = epoch_create(test_alloc, free);
+    unsigned      token;
+    int           i;
+
+    CuAssertPtrNotNull(tc, epoch);
+    epoch_destroyed = 0;
+
+    // Reader active when the object was retired keeps it alive
+    token = epoch_enter(epoch);
+    epoch_retire(epoch, malloc(16), destroy_counted);
+    epoch_reclaim(epoch);
+    CuAssertIntEquals(tc, 0, epoch_destroyed);
+    epoch_leave(epoch, token);
+    epoch_reclaim(epoch);
+    CuAssertIntEquals(tc, 1, epoch_destroyed);
+
+    // Same for a reader of the other parity
+    token = epoch_enter(epoch);
+    epoch_retire(epoch, malloc(16), destroy_counted);
+    epoch_reclaim(epoch);
+    epoch_reclaim(epoch);
+    CuAssertIntEquals(tc, 1, epoch_destroyed);
+    epoch_leave(epoch, token);
+    epoch_reclaim(epoch);
+    CuAssertIntEquals(tc, 2, epoch_destroyed);
+
+    // Many retired objects without reclaim calls do not overflow
+    for (i = 0; i < 1000; i++)
+        epoch_retire(epoch, malloc(16), destroy_counted);
+    CuAssertTrue(tc, epoch_destroyed > 2);
+    epoch_reclaim(epoch);
+    epoch_reclaim(epoch);
+    CuAssertIntEquals(tc, 1002, epoch_destroyed);
+
+    // A reader which stays does not block retire, the objects wait for it
+    token = epoch_enter(epoch);
+    for (i = 0; i < 1000; i++)
+        epoch_retire(epoch, malloc(16), destroy_counted);
+    epoch_reclaim(epoch);
+    CuAssertIntEquals(tc, 1002, epoch_destroyed);
+    epoch_leave(epoch, token);
+    epoch_reclaim(epoch);
+    epoch_reclaim(epoch);
+    CuAssertIntEquals(tc, 2002, epoch_destroyed);
+
+    token = epoch_enter(epoch);
+    for (i = 0; i < 1000; i++)
+        epoch_retire(epoch, malloc(16), destroy_counted);
+    epoch_leave(epoch, token);
+    epoch_destroy(epoch);
+    CuAssertIntEquals(tc, 3002, epoch_destroyed);
+}
+
+void test_histogram(CuTest* tc)
+{
+    struct histogram* hist = calloc(1, sizeof(*hist));
+    unsigned          i;
+
+    // Values below 16 are exact, larger ones within 1/8
+    CuAssertIntEquals(tc, 5, histogram_bucket(5));
+    CuAssertIntEquals(tc, 15, histogram_bucket(15));
+    CuAssertIntEquals(tc, 16, histogram_bucket(16));
+    CuAssertIntEquals(tc, 16, histogram_bucket(17));
+    CuAssertIntEquals(tc, 17, histogram_bucket(18));
+    CuAssertIntEquals(tc, HISTOGRAM_BUCKETS - 1, histogram_bucket(1ULL << 40));
+    for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        CuAssertIntEquals(tc, i, histogram_bucket(histogram_bucket_low(i)));
+        CuAssertIntEquals(tc, i, histogram_bucket(histogram_bucket_high(i)));
+        CuAssertTrue(tc, histogram_bucket_high(i) + 1 == histogram_bucket_low(i + 1));
+    }
+
+    CuAssertTrue(tc, histogram_percentile(hist, 5000) == 0);
+    for (i = 1; i <= 1000; i++)
+        histogram_record(hist, i);
+    CuAssertTrue(tc, histogram_count(hist) == 1000);
+    CuAssertTrue(tc, histogram_percentile(hist, 5000) >= 500 &&
+                     histogram_percentile(hist, 5000) < 500 + 500 / 8);
+    CuAssertTrue(tc, histogram_percentile(hist, 9990) >= 999);
+    CuAssertTrue(tc, histogram_percentile(hist, 10000) == 1023);
+    CuAssertTrue(tc, histogram_percentile(hist, 0) == 1);
+
+    histogram_add(hist, hist);
+    CuAssertTrue(tc, histogram_count(hist) == 2000);
+    free(hist);
+}
+
+void test_trace_ring(CuTest* tc)
+{
+    struct trace_ring* ring = trace_ring_create(2, 3, sizeof(unsigned), test_alloc, free);
+    unsigned           out[16];
+    unsigned           i, count;
+    ulong32_t          lost;
+
+    CuAssertPtrNotNull(tc, ring);
+
+    // 3 is rounded up to 4 records per CPU, the rest is lost
+    for (i = 0; i < 6; i++)
+        trace_ring_write(ring, 1, &i);
+    i = 100;
+    trace_ring_write(ring, 2, &i);      // Same as CPU 0
+    count = trace_ring_drain(ring, out, 16, &lost);
+    CuAssertIntEquals(tc, 5, count);
+    CuAssertIntEquals(tc, 2, lost);
+    CuAssertIntEquals(tc, 100, out[0]);
+    for (i = 0; i < 4; i++)
+        CuAssertIntEquals(tc, i, out[i + 1]);
+
+    // Drained slots are reused, partial drains keep the rest
+    for (i = 10; i < 13; i++)
+        trace_ring_write(ring, 1, &i);
+    count = trace_ring_drain(ring, out, 2, &lost);
+    CuAssertIntEquals(tc, 2, count);
+    CuAssertIntEquals(tc, 0, lost);
+    CuAssertIntEquals(tc, 10, out[0]);
+    count = trace_ring_drain(ring, out, 16, &lost);
+    CuAssertIntEquals(tc, 1, count);
+    CuAssertIntEquals(tc, 12, out[0]);
+    CuAssertIntEquals(tc, 0, trace_ring_drain(ring, out, 16, &lost));
+
+    trace_ring_destroy(ring);
+}
+
+/* Journal area in memory, writes can be made to fail */
+struct journal_test_area
+{
+    unsigned char* data;
+    int            fail_writes;
+    unsigned       writes;
+    unsigned       writes_at_barrier;  /* Made before the last barrier */
+};
+
+static int journal_test_read(void* context, ulong64_t offset, void* buffer, unsigned size)
+{
+    memcpy(buffer, ((struct journal_test_area*)context)->data + offset, size);
+    return 0;
+}
+
+static int journal_test_write(void* context, ulong64_t offset, const void* buffer, unsigned size)
+{
+    struct journal_test_area* area = (struct journal_test_area*)context;
+
+    if (area->fail_writes)
+        return -1;
+    memcpy(area->data + offset, buffer, size);
+    area->writes++;
+    return 0;
+}
+
+static int journal_test_barrier(void* context)
+{
+    struct journal_test_area* area = (struct journal_test_area*)context;
+
+    area->writes_at_barrier = area->writes;
+    return 0;
+}
+
+/* Tracker with its journal, what the driver keeps */
+struct journal_test_tracker
+{
+    disk_remap_t               tracker;
+    struct remap_journal*      journal;
+    struct disk_tracker_export position;
+};
+
+static unsigned journal_test_export(void* context, int restart,
+                                    struct remap_journal_entry* entries, unsigned max)
+{
+    struct journal_test_tracker* t = (struct journal_test_tracker*)context;
+    struct disk_remap_run        runs[16];
+    unsigned                     count, i;
+
+    if (restart)
+        memset(&t->position, 0, sizeof(t->position));
+    count = disk_tracker_export_runs(t->tracker, &t->position, runs, max < 16 ? max : 16);
+    for (i = 0; i < count; i++) {
+        entries[i].source_block = runs[i].source_block;
+        entries[i].target_block = runs[i].target_block;
+        entries[i].length_in_blocks = runs[i].length_in_blocks;
+        entries[i].op = REMAP_JOURNAL_MAP;
+    }
+    return count;
+}
+
+static void journal_test_hook(void* context, const struct disk_remap_run* run)
+{
+    struct journal_test_tracker* t = (struct journal_test_tracker*)context;
+    struct remap_journal_entry   entry;
+    ulong64_t                    ticket;
+
+    entry.source_block = run->source_block;
+    entry.target_block = run->target_block;
+    entry.length_in_blocks = run->length_in_blocks;
+    entry.op = REMAP_JOURNAL_MAP;
+    remap_journal_append(t->journal, &entry, &ticket);
+}
+
+static int journal_test_apply(void* context, const struct remap_journal_entry* entry)
+{
+    struct journal_test_tracker* t = (struct journal_test_tracker*)context;
+    struct disk_remap_run        run;
+
+    ulong32_t                    unmapped;
+
+    run.source_block = entry->source_block;
+    run.target_block = entry->target_block;
+    run.length_in_blocks = entry->length_in_blocks;
+    if (entry->op == REMAP_JOURNAL_UNMAP)
+        return disk_tracker_unmap_run(t->tracker, &run, 0, &unmapped);
+    return disk_tracker_restore_run(t->tracker, &run);
+}
+
+#define JOURNAL_TEST_DISK_BLOCKS    (1 << 16)
+#define JOURNAL_TEST_AREA_BLOCKS    (2 * REMAP_JOURNAL_MIN_BLOCKS)
+
+static void journal_test_open(CuTest* tc, 
+                              struct journal_test_tracker* t, 
+                              struct journal_test_area* area,
+                              unsigned batch_entries)
+{
+    struct remap_journal_io io = {
+        NULL, journal_test_read, journal_test_write, NULL, journal_test_barrier
+    };
+    struct remap_storage*   storage = create_storage_for_reset();
+
+    storage->number_of_blocks = JOURNAL_TEST_DISK_BLOCKS;
+    storage->extents[0].start_block = 1 << 20;
+    storage->extents[0].length_in_blocks = JOURNAL_TEST_DISK_BLOCKS;
+
+    memset(t, 0, sizeof(*t));
+    io.context = area;
+    t->tracker = disk_tracker_init_sharded(test_alloc, free, storage, 4);
+    t->journal = remap_journal_create(&io, JOURNAL_TEST_AREA_BLOCKS, batch_entries, 
+                                      journal_test_export, t, test_alloc, free);
+    CuAssertPtrNotNull(tc, t->tracker);
+    CuAssertPtrNotNull(tc, t->journal);
+}
+
+static void journal_test_close(struct journal_test_tracker* t)
+{
+    remap_journal_destroy(t->journal);
+    disk_tracker_destroy(&t->tracker);
+}
+
+/* Both trackers translate the whole disk the same way */
+static int journal_test_same(struct journal_test_tracker* a, struct journal_test_tracker* b)
+{
+    struct disk_extent        disk = {0, JOURNAL_TEST_DISK_BLOCKS};
+    struct disk_extent_remap* ra = malloc(DISK_EXTENT_REMAP_SIZE(JOURNAL_TEST_DISK_BLOCKS));
+    struct disk_extent_remap* rb = malloc(DISK_EXTENT_REMAP_SIZE(JOURNAL_TEST_DISK_BLOCKS));
+    unsigned                  total_a, free_a, total_b, free_b;
+    int                       same;
+
+    disk_tracker_find_remap_to_buffer(a->tracker, &disk, ra, JOURNAL_TEST_DISK_BLOCKS);
+    disk_tracker_find_remap_to_buffer(b->tracker, &disk, rb, JOURNAL_TEST_DISK_BLOCKS);
+    disk_tracker_get_storage_info(a->tracker, &total_a, &free_a);
+    disk_tracker_get_storage_info(b->tracker, &total_b, &free_b);
+    same = ra->number_of_extents == rb->number_of_extents && 
+           ra->num_remapped == rb->num_remapped &&
+           free_a == free_b && 
+           memcmp(ra->remapped_extents, rb->remapped_extents, 
+                  ra->number_of_extents * sizeof(struct disk_extent)) == 0;
+    free(ra);
+    free(rb);
+    return same;
+}
+
+static void journal_test_writes(CuTest* tc, 
+                                struct journal_test_tracker* t, 
+                                unsigned count, 
+                                unsigned* seed)
+{
+    struct disk_extent_remap* result = malloc(DISK_EXTENT_REMAP_SIZE(64));
+    struct disk_extent        extent;
+    unsigned                  i;
+
+    for (i = 0; i < count; i++) {
+        *seed = *seed * 1103515245 + 12345;
+        extent.start_block = (*seed >> 8) % (JOURNAL_TEST_DISK_BLOCKS - 64);
+        extent.length_in_blocks = 1 + (*seed >> 4) % 16;
+        CuAssertIntEquals(tc, DISK_TRACKER_OK, 
+                          disk_tracker_remap_to_buffer(t->tracker, &extent, result, 64));
+    }
+    free(result);
+}
+
+/* Unmap the first count runs and log it, targets are freed once it is durable */
+static void journal_test_unmap(CuTest* tc, struct journal_test_tracker* t, unsigned count)
+{
+    struct disk_remap_run*     runs = malloc(count * sizeof(*runs));
+    struct remap_journal_entry entry;
+    struct disk_extent         target;
+    ulong64_t                  next_block = 0, ticket = 0;
+    ulong32_t                  unmapped;
+    unsigned                   i;
+
+    count = disk_tracker_export_sorted_runs(t->tracker, &next_block, runs, count);
+    for (i = 0; i < count; i++) {
+        CuAssertIntEquals(tc, DISK_TRACKER_OK, 
+                          disk_tracker_unmap_run(t->tracker, &runs[i], 1, &unmapped));
+        CuAssertIntEquals(tc, (int)runs[i].length_in_blocks, (int)unmapped);
+        entry.source_block = runs[i].source_block;
+        entry.target_block = runs[i].target_block;
+        entry.length_in_blocks = (uint32_t)runs[i].length_in_blocks;
+        entry.op = REMAP_JOURNAL_UNMAP;
+        remap_journal_append(t->journal, &entry, &ticket);
+    }
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, remap_journal_commit(t->journal, ticket));
+    for (i = 0; i < count; i++) {
+        target.start_block = runs[i].target_block;
+        target.length_in_blocks = runs[i].length_in_blocks;
+        CuAssertIntEquals(tc, DISK_TRACKER_OK, disk_tracker_release_storage(t->tracker, &target));
+    }
+    free(runs);
+}
+
+void test_remap_journal(CuTest* tc)
+{
+    struct journal_test_area    area;
+    struct journal_test_tracker live, restored, torn_replay;
+    struct remap_journal_info   info;
+    struct remap_journal_entry  entry = {5, 1 << 20, 1, REMAP_JOURNAL_MAP};
+    ulong64_t                   first, ticket, torn_block;
+    unsigned                    seed = 1, i;
+    unsigned char*              torn;
+
+    area.data = calloc(JOURNAL_TEST_AREA_BLOCKS, REMAP_JOURNAL_BLOCK_SIZE);
+    area.fail_writes = 0;
+    area.writes = 0;
+    area.writes_at_barrier = 0;
+
+    // Nothing to replay in a blank area
+    journal_test_open(tc, &live, &area, 256);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_CORRUPT, 
+                      remap_journal_replay(live.journal, journal_test_apply, &live));
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, remap_journal_format(live.journal));
+    disk_tracker_set_run_hook(live.tracker, journal_test_hook, &live);
+
+    // Group commit: one batch for three appends, the later tickets are durable with it
+    journal_test_writes(tc, &live, 3, &seed);
+    ticket = remap_journal_last_ticket(live.journal);
+    CuAssertTrue(tc, ticket >= 3);
+    first = ticket - 2;
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, remap_journal_commit(live.journal, first));
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, remap_journal_commit(live.journal, ticket));
+    remap_journal_get_info(live.journal, &info);
+    CuAssertLongLongEquals(tc, 1, info.batches);
+    CuAssertLongLongEquals(tc, ticket, info.entries);
+
+    // Data of the changes goes before the batch and before the header of a checkpoint
+    CuAssertIntEquals(tc, area.writes - 1, area.writes_at_barrier);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, remap_journal_checkpoint(live.journal));
+    CuAssertIntEquals(tc, area.writes - 1, area.writes_at_barrier);
+
+    // Many batches fill the half, the log goes on after a checkpoint in the other one
+    for (i = 0; i < 2000 && info.checkpoints < 3; i++) {
+        journal_test_writes(tc, &live, 10, &seed);
+        CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                          remap_journal_commit(live.journal, remap_journal_last_ticket(live.journal)));
+        remap_journal_get_info(live.journal, &info);
+    }
+    CuAssertTrue(tc, info.checkpoints == 3 && info.generation >= 3);
+
+    journal_test_open(tc, &restored, &area, 256);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                      remap_journal_replay(restored.journal, journal_test_apply, &restored));
+    CuAssertTrue(tc, journal_test_same(&live, &restored));
+    journal_test_close(&restored);
+
+    // A torn batch is dropped, the ones before it stay
+    journal_test_open(tc, &restored, &area, 256);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                      remap_journal_replay(restored.journal, journal_test_apply, &restored));
+    remap_journal_get_info(live.journal, &info);
+    torn_block = info.used_blocks;
+    journal_test_writes(tc, &live, 10, &seed);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                      remap_journal_commit(live.journal, remap_journal_last_ticket(live.journal)));
+    remap_journal_get_info(live.journal, &info);
+    CuAssertTrue(tc, info.used_blocks > torn_block);
+
+    // Generation 1 went to the first half
+    torn = area.data + ((info.generation % 2 ? 0 : info.half_blocks) + torn_block) * 
+                       REMAP_JOURNAL_BLOCK_SIZE + 100;
+    *torn ^= 0xFF;
+    journal_test_open(tc, &torn_replay, &area, 256);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                      remap_journal_replay(torn_replay.journal, journal_test_apply, &torn_replay));
+    CuAssertTrue(tc, journal_test_same(&restored, &torn_replay));
+    CuAssertTrue(tc, !journal_test_same(&live, &torn_replay));
+    *torn ^= 0xFF;
+    journal_test_close(&torn_replay);
+    journal_test_close(&restored);
+
+    // Failed write loses the batch in memory, the next commit checkpoints
+    area.fail_writes = 1;
+    journal_test_writes(tc, &live, 5, &seed);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_IO_ERROR, 
+                      remap_journal_commit(live.journal, remap_journal_last_ticket(live.journal)));
+    area.fail_writes = 0;
+    remap_journal_get_info(live.journal, &info);
+    first = info.checkpoints;
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                      remap_journal_commit(live.journal, remap_journal_last_ticket(live.journal)));
+    remap_journal_get_info(live.journal, &info);
+    CuAssertLongLongEquals(tc, first + 1, info.checkpoints);
+
+    journal_test_open(tc, &restored, &area, 256);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                      remap_journal_replay(restored.journal, journal_test_apply, &restored));
+    CuAssertTrue(tc, journal_test_same(&live, &restored));
+
+    journal_test_close(&restored);
+
+    // Unmaps replay, their targets are taken by later remaps
+    journal_test_unmap(tc, &live, 20);
+    journal_test_writes(tc, &live, 50, &seed);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                      remap_journal_commit(live.journal, remap_journal_last_ticket(live.journal)));
+    journal_test_open(tc, &restored, &area, 256);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                      remap_journal_replay(restored.journal, journal_test_apply, &restored));
+    CuAssertTrue(tc, journal_test_same(&live, &restored));
+
+    // Replayed runs conflicting with existing ones are refused
+    CuAssertIntEquals(tc, 0, journal_test_apply(&restored, &entry) == 0 && 
+                             disk_tracker_find_remap_for_block(restored.tracker, 5) == NULL);
+    journal_test_close(&restored);
+    journal_test_close(&live);
+
+    // Full batch drops entries, the commit takes a checkpoint instead
+    journal_test_open(tc, &live, &area, 4);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, remap_journal_format(live.journal));
+    disk_tracker_set_run_hook(live.tracker, journal_test_hook, &live);
+    journal_test_writes(tc, &live, 20, &seed);
+    remap_journal_get_info(live.journal, &info);
+    CuAssertTrue(tc, info.overflows > 0);
+    first = info.checkpoints;
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                      remap_journal_commit(live.journal, remap_journal_last_ticket(live.journal)));
+    remap_journal_get_info(live.journal, &info);
+    CuAssertLongLongEquals(tc, first + 1, info.checkpoints);
+    journal_test_open(tc, &restored, &area, 4);
+    CuAssertIntEquals(tc, REMAP_JOURNAL_OK, 
+                      remap_journal_replay(restored.journal, journal_test_apply, &restored));
+    CuAssertTrue(tc, journal_test_same(&live, &restored));
+    journal_test_close(&restored);
+    journal_test_close(&live);
+
+    free(area.data);
+}
+
+/* Snapshot file in memory */
+struct snapshot_test_file
+{
+    unsigned char* data;
+    ulong64_t      size;
+};
+
+static int snapshot_test_write(void* context, ulong64_t offset, const void* buffer, unsigned size)
+{
+    struct snapshot_test_file* file = (struct snapshot_test_file*)context;
+
+    if (offset + size > file->size) {
+        unsigned char* data = realloc(file->data, (size_t)(offset + size));
+        if (data == NULL)
+            return -1;
+        file->data = data;
+        file->size = offset + size;
+    }
+    memcpy(file->data + offset, buffer, size);
+    return 0;
+}
+
+static void snapshot_test_save(CuTest* tc, 
+                               disk_remap_t tracker, 
+                               ulong64_t disk_blocks,
+                               struct snapshot_test_file* file, 
+                               struct remap_snapshot* snapshot)
+{
+    struct remap_snapshot_io io = {NULL, snapshot_test_write};
+
+    io.context = file;
+    free(file->data);
+    memset(file, 0, sizeof(*file));
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_OK, 
+                      remap_snapshot_save(tracker, &io, disk_blocks, test_alloc, free));
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_OK, 
+                      remap_snapshot_open(snapshot, file->data, file->size, 1));
+}
+
+/* Every block translates the way the tracker does */
+static void snapshot_test_check(CuTest* tc, 
+                                disk_remap_t tracker, 
+                                struct remap_snapshot* snapshot)
+{
+    struct disk_remap_run run;
+    struct disk_extent*   extent;
+    unsigned              remapped;
+    ulong64_t             b;
+
+    for (b = 0; b < JOURNAL_TEST_DISK_BLOCKS; b++) {
+        extent = disk_tracker_find_remap_for_block(tracker, b);
+        CuAssertIntEquals(tc, extent != NULL, remap_snapshot_lookup(snapshot, b, &run));
+        if (extent != NULL) {
+            CuAssertLongLongEquals(tc, extent->start_block, run.target_block);
+            CuAssertTrue(tc, run.length_in_blocks >= extent->length_in_blocks);
+            disk_tracker_free_extent(tracker, extent);
+        }
+    }
+    disk_tracker_get_hash_size(tracker, &remapped);
+    CuAssertLongLongEquals(tc, remapped, snapshot->header->remapped_blocks);
+}
+
+void test_remap_snapshot(CuTest* tc)
+{
+    struct journal_test_area     area;
+    struct journal_test_tracker  live, restored;
+    struct snapshot_test_file    file = {NULL, 0};
+    struct remap_snapshot        snapshot;
+    struct remap_snapshot_io     io = {NULL, snapshot_test_write};
+    struct remap_snapshot_writer* writer;
+    struct disk_remap_run        run = {100, 5000, 10};
+    unsigned                     seed = 7;
+
+    // Trackers of the journal test, their journals stay unused
+    area.data = calloc(JOURNAL_TEST_AREA_BLOCKS, REMAP_JOURNAL_BLOCK_SIZE);
+    area.fail_writes = 0;
+    journal_test_open(tc, &live, &area, 256);
+
+    // Empty map
+    snapshot_test_save(tc, live.tracker, JOURNAL_TEST_DISK_BLOCKS, &file, &snapshot);
+    CuAssertLongLongEquals(tc, 0, snapshot.run_count);
+    CuAssertLongLongEquals(tc, 0, remap_snapshot_find(&snapshot, 5));
+    CuAssertIntEquals(tc, 0, remap_snapshot_lookup(&snapshot, 5, &run));
+
+    // Runs of all shards come sorted, the index finds each block
+    journal_test_writes(tc, &live, 3000, &seed);
+    snapshot_test_save(tc, live.tracker, JOURNAL_TEST_DISK_BLOCKS, &file, &snapshot);
+    CuAssertTrue(tc, snapshot.header->fanout_count == REMAP_SNAPSHOT_MAX_FANOUT);
+    snapshot_test_check(tc, live.tracker, &snapshot);
+
+    // Index too coarse for the disk: the last slot takes the rest
+    snapshot_test_save(tc, live.tracker, 1000, &file, &snapshot);
+    CuAssertTrue(tc, snapshot.header->fanout_count < REMAP_SNAPSHOT_MAX_FANOUT);
+    snapshot_test_check(tc, live.tracker, &snapshot);
+
+    // Restored tracker is the same
+    journal_test_open(tc, &restored, &area, 256);
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_OK, remap_snapshot_restore(&snapshot, restored.tracker));
+    CuAssertTrue(tc, journal_test_same(&live, &restored));
+    journal_test_close(&restored);
+
+    // Damage is found: runs only when verified, header and index always
+    file.data[sizeof(struct remap_snapshot_header) + 3] ^= 0xFF;
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_OK, 
+                      remap_snapshot_open(&snapshot, file.data, file.size, 0));
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_CORRUPT, 
+                      remap_snapshot_open(&snapshot, file.data, file.size, 1));
+    file.data[sizeof(struct remap_snapshot_header) + 3] ^= 0xFF;
+    file.data[file.size - 1] ^= 0xFF;
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_CORRUPT, 
+                      remap_snapshot_open(&snapshot, file.data, file.size, 0));
+    file.data[file.size - 1] ^= 0xFF;
+    file.data[20] ^= 0xFF;
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_CORRUPT, 
+                      remap_snapshot_open(&snapshot, file.data, file.size, 0));
+    file.data[20] ^= 0xFF;
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_CORRUPT, 
+                      remap_snapshot_open(&snapshot, file.data, file.size - 8, 0));
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_OK, 
+                      remap_snapshot_open(&snapshot, file.data, file.size, 1));
+
+    // Writer merges continuous runs and refuses overlapping ones
+    free(file.data);
+    memset(&file, 0, sizeof(file));
+    io.context = &file;
+    writer = remap_snapshot_writer_create(&io, 1 << 20, test_alloc, free);
+    CuAssertPtrNotNull(tc, writer);
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_OK, remap_snapshot_writer_add(writer, &run));
+    run.source_block += 10;
+    run.target_block += 10;
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_OK, remap_snapshot_writer_add(writer, &run));
+    run.source_block = 105;
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_INV_ARGUMENT, remap_snapshot_writer_add(writer, &run));
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_OK, remap_snapshot_writer_finish(writer));
+    remap_snapshot_writer_destroy(writer);
+    CuAssertIntEquals(tc, REMAP_SNAPSHOT_OK, 
+                      remap_snapshot_open(&snapshot, file.data, file.size, 1));
+    CuAssertLongLongEquals(tc, 1, snapshot.run_count);
+    CuAssertIntEquals(tc, 1, remap_snapshot_lookup(&snapshot, 119, &run));
+    CuAssertLongLongEquals(tc, 5019, run.target_block);
+    CuAssertIntEquals(tc, 1, (int)run.length_in_blocks);
+    CuAssertIntEquals(tc, 0, remap_snapshot_lookup(&snapshot, 120, &run));
+
+    journal_test_close(&live);
+    free(file.data);
+    free(area.data);
+}
+
+/* Disk and storage in one buffer, every block tagged with its source block and version */
+#define MERGE_TEST_DISK_BLOCKS      (8192)
+#define MERGE_TEST_BLOCKS           (2 * MERGE_TEST_DISK_BLOCKS)
+#define MERGE_TEST_BLOCK_SIZE       (512)
+
+struct merge_test_io
+{
+    unsigned char*         disk;
+    struct merge_engine*   engine;
+    struct merge_request*  pending[64];
+    unsigned               pending_count;
+    unsigned               max_in_flight;
+    unsigned               fail_after;      /* Requests before the first error, 0 never */
+    unsigned               submitted;
+    ulong64_t              last_write;
+    ulong64_t              last_read;
+    ulong64_t              read_window;
+    int                    writes_ascend;
+    int                    reads_ascend;
+    int                    flushed;
+};
+
+struct merge_test_source
+{
+    disk_remap_t tracker;
+    ulong64_t    next_block;
+};
+
+static void merge_test_tag(unsigned char* disk, ulong64_t block, ulong64_t source, ulong64_t version)
+{
+    ulong64_t* tag = (ulong64_t*)(disk + block * MERGE_TEST_BLOCK_SIZE);
+
+    tag[0] = source;
+    tag[1] = version;
+}
+
+static int merge_test_submit(void* context, struct merge_request* request)
+{
+    struct merge_test_io* io = (struct merge_test_io*)context;
+    struct merge_progress progress;
+
+    io->pending[io->pending_count++] = request;
+    if (io->pending_count > io->max_in_flight)
+        io->max_in_flight = io->pending_count;
+
+    if (request->op == MERGE_OP_WRITE) {
+        if (request->block < io->last_write)
+            io->writes_ascend = 0;
+        io->last_write = request->block + request->length_in_blocks;
+    } else {
+        // Reads of one window go up the storage
+        merge_engine_get_progress(io->engine, &progress);
+        if (progress.windows != io->read_window)
+            io->last_read = 0;
+        if (request->block < io->last_read)
+            io->reads_ascend = 0;
+        io->read_window = progress.windows;
+        io->last_read = request->block;
+    }
+    return 0;
+}
+
+/* Requests are done newest first, so completions come out of order */
+static void merge_test_wait(void* context)
+{
+    struct merge_test_io* io = (struct merge_test_io*)context;
+
+    while (io->pending_count > 0) {
+        struct merge_request* request = io->pending[--io->pending_count];
+        unsigned char*        block = io->disk + request->block * MERGE_TEST_BLOCK_SIZE;
+        size_t                size = (size_t)request->length_in_blocks * MERGE_TEST_BLOCK_SIZE;
+        int                   status = 0;
+
+        if (io->fail_after != 0 && ++io->submitted >= io->fail_after)
+            status = -1;
+        else if (request->op == MERGE_OP_READ)
+            memcpy(request->buffer, block, size);
+        else
+            memcpy(block, request->buffer, size);
+        merge_engine_complete(io->engine, request, status);
+    }
+}
+
+static int merge_test_flush(void* context)
+{
+    ((struct merge_test_io*)context)->flushed = 1;
+    return 0;
+}
+
+static unsigned merge_test_runs(void* context, struct disk_remap_run* runs, unsigned max)
+{
+    struct merge_test_source* source = (struct merge_test_source*)context;
+
+    return disk_tracker_export_sorted_runs(source->tracker, &source->next_block, runs, max);
+}
+
+/* Merge everything remapped by count random writes, version is the write number */
+static int merge_test_run(CuTest* tc, 
+                          const struct merge_params* params, 
+                          unsigned count, 
+                          unsigned fail_after,
+                          unsigned* seed)
+{
+    struct merge_io           io = {NULL, merge_test_submit, merge_test_wait, merge_test_flush};
+    struct merge_test_io      test_io;
+    struct merge_test_source  source;
+    struct merge_progress     progress;
+    struct remap_storage*     storage = create_storage_for_reset();
+    struct disk_extent_remap* result = malloc(DISK_EXTENT_REMAP_SIZE(64));
+    ulong64_t*                version = calloc(MERGE_TEST_DISK_BLOCKS, sizeof(ulong64_t));
+    struct disk_extent        extent;
+    unsigned                  remapped, i, j, k;
+    ulong64_t                 b, target;
+    int                       status;
+
+    memset(&test_io, 0, sizeof(test_io));
+    test_io.disk = malloc((size_t)MERGE_TEST_BLOCKS * MERGE_TEST_BLOCK_SIZE);
+    test_io.fail_after = fail_after;
+    test_io.writes_ascend = 1;
+    test_io.reads_ascend = 1;
+    test_io.read_window = (ulong64_t)-1;
+    for (b = 0; b < MERGE_TEST_BLOCKS; b++)
+        merge_test_tag(test_io.disk, b, b, 0);
+
+    storage->number_of_blocks = MERGE_TEST_DISK_BLOCKS;
+    storage->extents[0].start_block = MERGE_TEST_DISK_BLOCKS;
+    storage->extents[0].length_in_blocks = MERGE_TEST_DISK_BLOCKS;
+    source.tracker = disk_tracker_init_sharded(test_alloc, free, storage, 4);
+    source.next_block = 0;
+    CuAssertPtrNotNull(tc, source.tracker);
+
+    // Writes land in the storage, shards interleave their targets
+    for (i = 1; i <= count; i++) {
+        *seed = *seed * 1103515245 + 12345;
+        extent.start_block = (*seed >> 8) % (MERGE_TEST_DISK_BLOCKS - 64);
+        extent.length_in_blocks = 1 + (*seed >> 4) % 16;
+        CuAssertIntEquals(tc, DISK_TRACKER_OK, 
+                          disk_tracker_remap_to_buffer(source.tracker, &extent, result, 64));
+        b = extent.start_block;
+        for (j = 0; j < result->number_of_extents; j++) {
+            target = result->remapped_extents[j].start_block;
+            for (k = 0; k < result->remapped_extents[j].length_in_blocks; k++, b++) {
+                merge_test_tag(test_io.disk, target + k, b, i);
+                version[b] = i;
+            }
+        }
+    }
+    disk_tracker_get_hash_size(source.tracker, &remapped);
+
+    io.context = &test_io;
+    test_io.engine = merge_engine_create(params, &io, merge_test_runs, &source, 
+                                         remapped, test_alloc, free);
+    CuAssertPtrNotNull(tc, test_io.engine);
+    status = merge_engine_run(test_io.engine);
+    merge_engine_get_progress(test_io.engine, &progress);
+
+    CuAssertIntEquals(tc, 0, test_io.pending_count);
+    CuAssertTrue(tc, progress.done);
+    CuAssertIntEquals(tc, status, progress.status);
+    CuAssertTrue(tc, test_io.max_in_flight <= 
+                     (params != NULL ? params->queue_depth : MERGE_DEFAULT_QUEUE_DEPTH));
+    CuAssertTrue(tc, test_io.writes_ascend);
+    CuAssertTrue(tc, test_io.reads_ascend);
+    if (status == MERGE_ENGINE_OK) {
+        CuAssertTrue(tc, test_io.flushed);
+        CuAssertLongLongEquals(tc, remapped, progress.blocks_read);
+        CuAssertLongLongEquals(tc, remapped, progress.blocks_written);
+        CuAssertTrue(tc, progress.writes <= progress.reads);
+        for (b = 0; b < MERGE_TEST_DISK_BLOCKS; b++) {
+            ulong64_t* tag = (ulong64_t*)(test_io.disk + b * MERGE_TEST_BLOCK_SIZE);
+            CuAssertLongLongEquals(tc, b, tag[0]);
+            CuAssertLongLongEquals(tc, version[b], tag[1]);
+        }
+    } else {
+        CuAssertTrue(tc, !test_io.flushed);
+    }
+
+    merge_engine_destroy(test_io.engine);
+    disk_tracker_destroy(&source.tracker);
+    free(test_io.disk);
+    free(version);
+    free(result);
+    return status;
+}
+
+void test_merge_engine(CuTest* tc)
+{
+    struct merge_params small = {3, 16, 4};
+    struct merge_params bad = {8, 0, 4};
+    struct merge_io     io = {NULL, merge_test_submit, merge_test_wait, NULL};
+    unsigned            seed = 11;
+
+    CuAssertTrue(tc, merge_engine_create(&bad, &io, merge_test_runs, NULL, 0, test_alloc, free) == NULL);
+
+    // Nothing remapped, defaults
+    CuAssertIntEquals(tc, MERGE_ENGINE_OK, merge_test_run(tc, NULL, 0, 0, &seed));
+    CuAssertIntEquals(tc, MERGE_ENGINE_OK, merge_test_run(tc, NULL, 500, 0, &seed));
+
+    // Many windows, transfers split at 16 blocks
+    CuAssertIntEquals(tc, MERGE_ENGINE_OK, merge_test_run(tc, &small, 500, 0, &seed));
+
+    // Failed request stops the merge, nothing hangs
+    CuAssertIntEquals(tc, MERGE_ENGINE_IO_ERROR, merge_test_run(tc, &small, 500, 40, &seed));
+}
+
+void test_transfer_plan(CuTest* tc)
+{
+    static const struct disk_extent runs[] = {
+        {100, 4}, {104, 4}, {50, 20}, {10, 3}
+    };
+    struct disk_extent_remap* remap = malloc(DISK_EXTENT_REMAP_SIZE(4));
+    struct transfer_limits    limits = {0, 0};
+    struct transfer           plan[8];
+    ulong32_t                 count, i;
+
+    remap->number_of_extents = 4;
+    memcpy(remap->remapped_extents, runs, sizeof(runs));
+
+    // Adjacent runs are merged
+    CuAssertIntEquals(tc, 3, transfer_plan_size(remap, &limits));
+    CuAssertIntEquals(tc, TRANSFER_PLAN_OK, 
+                      transfer_plan_build(remap, &limits, 0, plan, 8, &count));
+    CuAssertIntEquals(tc, 3, count);
+    CuAssertTrue(tc, plan[0].disk_block == 100);
+    CuAssertIntEquals(tc, 8, plan[0].length_in_blocks);
+    CuAssertIntEquals(tc, 8, plan[1].buffer_block);
+    CuAssertIntEquals(tc, 28, plan[2].buffer_block);
+
+    // 50-69 is cut to 50-55, 56-63 and 64-69
+    limits.max_blocks = 8;
+    limits.align_blocks = 4;
+    CuAssertIntEquals(tc, TRANSFER_PLAN_BUFFER_TOO_SMALL, 
+                      transfer_plan_build(remap, &limits, 0, plan, 2, &count));
+    CuAssertIntEquals(tc, 5, count);
+    CuAssertIntEquals(tc, TRANSFER_PLAN_OK, 
+                      transfer_plan_build(remap, &limits, TRANSFER_PLAN_SORTED, 
+                                          plan, 8, &count));
+    CuAssertIntEquals(tc, 5, count);
+    for (i = 1; i < count; i++)
+        CuAssertTrue(tc, plan[i - 1].disk_block < plan[i].disk_block);
+    CuAssertTrue(tc, plan[0].disk_block == 10);
+    CuAssertIntEquals(tc, 28, plan[0].buffer_block);
+    CuAssertTrue(tc, plan[1].disk_block == 50);
+    CuAssertIntEquals(tc, 6, plan[1].length_in_blocks);
+    CuAssertIntEquals(tc, 8, plan[1].buffer_block);
+    CuAssertTrue(tc, plan[2].disk_block == 56);
+    CuAssertIntEquals(tc, 8, plan[2].length_in_blocks);
+    CuAssertIntEquals(tc, 14, plan[2].buffer_block);
+    CuAssertTrue(tc, plan[3].disk_block == 64);
+    CuAssertIntEquals(tc, 6, plan[3].length_in_blocks);
+    CuAssertTrue(tc, plan[4].disk_block == 100);
+
+    free(remap);
+}
+
+void test_crc32(CuTest* tc)
+{
+    static const char check[] = "123456789";
+    uint32_t          crc;
+
+    // Check value of CRC-32/ISO-HDLC, continuing gives the same result
+    CuAssertTrue(tc, crc32_update(0, check, 9) == 0xCBF43926);
+    crc = crc32_update(0, check, 4);
+    CuAssertTrue(tc, crc32_update(crc, check + 4, 5) == 0xCBF43926);
+    CuAssertTrue(tc, crc32_update(0, check, 0) == 0);
+}
+
+void test_u64_map(CuTest* tc)
+{
+#define NUM_KEYS 100000
+
+    struct u64_map* map = u64_map_create(0, test_alloc, free);
+    ulong64_t       i, value;
+
+    CuAssertPtrNotNull(tc, map);
+
+    // Sequential block numbers, as the disk tracker uses them
+    for (i = 0; i < NUM_KEYS; i++)
+        CuAssertTrue(tc, u64_map_insert(map, i << 11, i));
+    CuAssertIntEquals(tc, NUM_KEYS, u64_map_count(map));
+    CuAssertTrue(tc, !u64_map_insert(map, U64_MAP_EMPTY_KEY, 0));
+
+    // Replace keeps the count
+    CuAssertTrue(tc, u64_map_insert(map, 5 << 11, 55));
+    CuAssertIntEquals(tc, NUM_KEYS, u64_map_count(map));
+    CuAssertTrue(tc, u64_map_search(map, 5 << 11, &value));
+    CuAssertLongLongEquals(tc, 55, value);
+
+    // Remove every odd key, even ones must stay reachable
+    for (i = 1; i < NUM_KEYS; i += 2)
+        CuAssertTrue(tc, u64_map_remove(map, i << 11));
+    CuAssertTrue(tc, !u64_map_remove(map, 1 << 11));
+    CuAssertIntEquals(tc, NUM_KEYS / 2, u64_map_count(map));
+    for (i = 0; i < NUM_KEYS; i++) {
+        int found = u64_map_search(map, i << 11, &value);
+        CuAssertIntEquals(tc, (i & 1) == 0, found);
+        if (found && i != 5)
+            CuAssertLongLongEquals(tc, i, value);
+    }
+
+    u64_map_destroy(map);
+}
+
+void test_swiss_map(CuTest* tc)
+{
+    struct swiss_map* map = swiss_map_create(0, test_alloc, free);
+    ulong64_t         i, value;
+    int               round;
+
+    CuAssertPtrNotNull(tc, map);
+
+    for (i = 0; i < NUM_KEYS; i++)
+        CuAssertTrue(tc, swiss_map_insert(map, i * 8, i));
+    CuAssertIntEquals(tc, NUM_KEYS, swiss_map_count(map));
+    CuAssertTrue(tc, swiss_map_insert(map, 8, 100));
+    CuAssertIntEquals(tc, NUM_KEYS, swiss_map_count(map));
+    CuAssertTrue(tc, swiss_map_search(map, 8, &value));
+    CuAssertLongLongEquals(tc, 100, value);
+
+    // Churn leaves deleted slots behind, table must sweep them and stay correct
+    for (round = 0; round < 4; round++) {
+        for (i = 0; i < NUM_KEYS; i += 2)
+            CuAssertTrue(tc, swiss_map_remove(map, i * 8));
+        CuAssertTrue(tc, !swiss_map_remove(map, 0));
+        CuAssertIntEquals(tc, NUM_KEYS / 2, swiss_map_count(map));
+        for (i = 0; i < NUM_KEYS; i += 2)
+            CuAssertTrue(tc, swiss_map_insert(map, i * 8, i));
+    }
+    for (i = 0; i < NUM_KEYS; i++) {
+        CuAssertTrue(tc, swiss_map_search(map, i * 8, &value));
+        CuAssertTrue(tc, !swiss_map_search(map, i * 8 + 1, &value));
+    }
+
+    swiss_map_destroy(map);
+}
+
+static unsigned int test_key_hash(void* k)
+{
+    return good_hash_func((unsigned char*)k, sizeof(ulong64_t), 0);
+}
+
+static int test_key_equal(void* a, void* b)
+{
+    return *(ulong64_t*)a == *(ulong64_t*)b;
+}
+
+void test_hashtable_incremental_resize(CuTest* tc)
+{
+#define NUM_ENTRIES 200000
+
+    struct hashtable* h = create_hashtable(16, test_key_hash, test_key_equal, test_alloc, free);
+    ulong64_t         i, probe;
+    ulong64_t*        k;
+
+    CuAssertPtrNotNull(tc, h);
+
+    // Table goes through many resizes, entries must stay visible in between
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        k = (ulong64_t*)malloc(sizeof(*k));
+        *k = i;
+        CuAssertTrue(tc, hashtable_insert(h, k, k));
+        probe = i / 2;
+        CuAssertTrue(tc, hashtable_search(h, &probe) != NULL);
+    }
+    CuAssertIntEquals(tc, NUM_ENTRIES, hashtable_count(h));
+
+    for (i = 0; i < NUM_ENTRIES; i += 2)
+        CuAssertTrue(tc, hashtable_remove(h, &i) != NULL);
+    CuAssertIntEquals(tc, NUM_ENTRIES / 2, hashtable_count(h));
+    for (i = 0; i < NUM_ENTRIES; i++)
+        CuAssertIntEquals(tc, (int)(i & 1), hashtable_search(h, &i) != NULL);
+
+    hashtable_destroy(h, 0);
+}
+
 void test_quick_sort_simple(CuTest* tc)
 {
     ulong64_t arr[] = {4, 10, 0, 1, 12};
@@ -253,11 +2004,37 @@ CuSuite* get_test_suite()
     SUITE_ADD_TEST(suite, test_quick_sort_simple);
     SUITE_ADD_TEST(suite, test_quick_sort_big_array);
     SUITE_ADD_TEST(suite, test_disk_tracker);
+    SUITE_ADD_TEST(suite, test_disk_tracker_large_extent);
+    SUITE_ADD_TEST(suite, test_disk_tracker_contiguous);
+    SUITE_ADD_TEST(suite, test_disk_tracker_no_memory);
+    SUITE_ADD_TEST(suite, test_disk_tracker_sharded);
+    SUITE_ADD_TEST(suite, test_disk_tracker_remap_to_buffer);
+    SUITE_ADD_TEST(suite, test_disk_tracker_unmap);
+    SUITE_ADD_TEST(suite, test_disk_tracker_cursor);
+    SUITE_ADD_TEST(suite, test_disk_tracker_reserve);
+    SUITE_ADD_TEST(suite, test_extent_map_merge);
+    SUITE_ADD_TEST(suite, test_extent_map_random);
+    SUITE_ADD_TEST(suite, test_free_space);
+    SUITE_ADD_TEST(suite, test_free_space_random);
+    SUITE_ADD_TEST(suite, test_free_space_take);
+    SUITE_ADD_TEST(suite, test_object_pool);
+    SUITE_ADD_TEST(suite, test_epoch);
+    SUITE_ADD_TEST(suite, test_histogram);
+    SUITE_ADD_TEST(suite, test_trace_ring);
+    SUITE_ADD_TEST(suite, test_remap_journal);
+    SUITE_ADD_TEST(suite, test_remap_snapshot);
+    SUITE_ADD_TEST(suite, test_merge_engine);
+    SUITE_ADD_TEST(suite, test_transfer_plan);
+    SUITE_ADD_TEST(suite, test_crc32);
+    SUITE_ADD_TEST(suite, test_u64_map);
+    SUITE_ADD_TEST(suite, test_swiss_map);
+    SUITE_ADD_TEST(suite, test_hashtable_incremental_resize);
 
     return suite;
 }
 
-void run_all_cunit_tests()
+/* Returns the number of failed tests */
+int run_all_cunit_tests()
 {
     CuString* output = CuStringNew();
     CuSuite* test_suite = CuSuiteNew();
@@ -267,11 +2044,10 @@ void run_all_cunit_tests()
     CuSuiteSummary(test_suite, output);
     CuSuiteDetails(test_suite, output);
     printf("%s\n", output->buffer);
+    return test_suite->failCount;
 }
 
 int __cdecl main()
 {
-    run_all_cunit_tests();
-
-    return 1;
+    return run_all_cunit_tests() != 0;
 }
@@ -0,0 +1,559 @@
+/*
+  Replays a captured I/O trace against the disk tracker: writes are 
+  remapped, reads look their remaps up. Reports calls per second, call
+  latency percentiles, peak tracker memory, remapped blocks and extents
+  per result, so tracker changes can be compared on real access patterns.
+
+  Usage: user_mode_replay [options] trace_file
+    --csv             Text trace, "op,block,length" per line, op is R or W.
+                      Default if the name ends with .csv
+    --binary          Records saved by difi-cli --save-trace
+    --storage-gb N    Remap storage size, default 64
+    --shards N        Tracker shards, default 1
+    --contiguous      Keep each request in one storage run if possible
+    --to-buffer       Use the _to_buffer calls instead of allocated results
+    --repeat N        Replay the trace N times, default 1
+    --snapshot FILE   Save the remaps to a snapshot file afterwards, then map
+                      it back and look the traced blocks up in it
+
+  Blocks and lengths are in 512 byte sectors.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "libcrt/baselib.h"
+#include "libutil/disk_tracker.h"
+#include "libutil/histogram.h"
+#include "libutil/remap_snapshot.h"
+
+#define SECTORS_PER_GB      (2 * 1024 * 1024)
+#define BINARY_RECORD_SIZE  (32)    /* struct ioctl_difi_trace_record */
+#define BUFFER_EXTENTS      (64)
+
+struct trace_op
+{
+    ulong64_t start_block;
+    ulong32_t length_in_blocks;
+    int       write;
+};
+
+struct trace
+{
+    struct trace_op* ops;
+    unsigned         count;
+    unsigned         capacity;
+    ulong64_t        end_block;     /* Past the last block touched */
+};
+
+struct op_stats
+{
+    struct histogram latency;       /* Nanoseconds per call */
+    double           busy_ns;       /* Spent in the calls */
+    ulong64_t        calls;
+    ulong64_t        failed;
+    ulong64_t        extents;       /* In successful results */
+    ulong64_t        hits;
+};
+
+struct options
+{
+    int         csv;
+    unsigned    storage_gb;
+    unsigned    shards;
+    int         contiguous;
+    int         to_buffer;
+    unsigned    repeat;
+    const char* file_name;
+    const char* snapshot_name;
+};
+
+static double now_ns()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1e9 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
+
+/* Tracker memory is counted, every block remembers its size */
+struct alloc_header
+{
+    size_t size;
+    size_t padding;         /* Keeps the block 16 byte aligned */
+};
+
+static size_t memory_used;
+static size_t memory_peak;
+
+static void* counting_alloc(unsigned size)
+{
+    struct alloc_header* header = (struct alloc_header*)malloc(sizeof(*header) + size);
+
+    if (header == NULL)
+        return NULL;
+    header->size = size;
+    memory_used += size;
+    if (memory_used > memory_peak)
+        memory_peak = memory_used;
+    return header + 1;
+}
+
+static void counting_free(void* p)
+{
+    struct alloc_header* header = (struct alloc_header*)p - 1;
+
+    memory_used -= header->size;
+    free(header);
+}
+
+static int add_op(struct trace* trace, int write, ulong64_t start, ulong32_t length)
+{
+    if (length == 0)
+        return 1;
+    if (trace->count == trace->capacity) {
+        unsigned         capacity = trace->capacity ? trace->capacity * 2 : 4096;
+        struct trace_op* ops = (struct trace_op*)realloc(trace->ops, 
+                                                         capacity * sizeof(*ops));
+        if (ops == NULL)
+            return 0;
+        trace->ops = ops;
+        trace->capacity = capacity;
+    }
+    trace->ops[trace->count].start_block = start;
+    trace->ops[trace->count].length_in_blocks = length;
+    trace->ops[trace->count].write = write;
+    trace->count++;
+    if (start + length > trace->end_block)
+        trace->end_block = start + length;
+    return 1;
+}
+
+static int parse_op(const char* op, int* write)
+{
+    if (strcmp(op, "W") == 0 || strcmp(op, "w") == 0 || strcmp(op, "write") == 0) {
+        *write = 1;
+        return 1;
+    }
+    if (strcmp(op, "R") == 0 || strcmp(op, "r") == 0 || strcmp(op, "read") == 0) {
+        *write = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Lines that do not parse, like a header or comments, are skipped */
+static int load_csv(FILE* f, struct trace* trace)
+{
+    char line[256];
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char               op[16];
+        unsigned long long start;
+        unsigned long      length;
+        int                write;
+
+        if (sscanf(line, " %15[^, ] , %llu , %lu", op, &start, &length) != 3 ||
+            !parse_op(op, &write))
+            continue;
+        if (!add_op(trace, write, start, (ulong32_t)length))
+            return 0;
+    }
+    return 1;
+}
+
+static ulong64_t get_le(const unsigned char* p, unsigned bytes)
+{
+    ulong64_t value = 0;
+
+    while (bytes-- > 0)
+        value = (value << 8) | p[bytes];
+    return value;
+}
+
+/* Little endian struct ioctl_difi_trace_record, one after another */
+static int load_binary(FILE* f, struct trace* trace)
+{
+    unsigned char record[BINARY_RECORD_SIZE];
+
+    while (fread(record, sizeof(record), 1, f) == 1) {
+        ulong64_t start = get_le(record + 8, 8);
+        ulong32_t length = (ulong32_t)get_le(record + 16, 4);
+        int       write = record[26] == 1;
+
+        if (!add_op(trace, write, start, length))
+            return 0;
+    }
+    return 1;
+}
+
+static struct remap_storage* make_storage(ulong64_t first_block, unsigned gb)
+{
+    struct remap_storage* storage = (struct remap_storage*)malloc(
+        sizeof(*storage) + (gb - 1) * sizeof(struct disk_extent));
+    unsigned              i;
+
+    if (storage == NULL)
+        return NULL;
+    memset(storage, 0, sizeof(*storage));
+    /* 1Gb pieces, like a storage file on a fragmented volume */
+    storage->number_of_extents = gb;
+    storage->number_of_blocks = gb * SECTORS_PER_GB;
+    for (i = 0; i < gb; i++) {
+        storage->extents[i].start_block = first_block + (ulong64_t)i * 2 * SECTORS_PER_GB;
+        storage->extents[i].length_in_blocks = SECTORS_PER_GB;
+    }
+    return storage;
+}
+
+static void replay_op(disk_remap_t tracker, const struct options* opt,
+                      const struct trace_op* op, struct op_stats* stats)
+{
+    struct {
+        struct disk_extent_remap remap;
+        struct disk_extent       more[BUFFER_EXTENTS - 1];
+    } buffer;
+    struct disk_extent_remap* result = NULL;
+    struct disk_extent        extent;
+    double                    start, elapsed;
+    int                       status;
+
+    extent.start_block = op->start_block;
+    extent.length_in_blocks = op->length_in_blocks;
+
+    start = now_ns();
+    if (opt->to_buffer) {
+        result = &buffer.remap;
+        if (op->write)
+            status = disk_tracker_remap_to_buffer(tracker, &extent, result, BUFFER_EXTENTS);
+        else
+            status = disk_tracker_find_remap_to_buffer(tracker, &extent, result, BUFFER_EXTENTS);
+    } else {
+        if (op->write)
+            status = disk_tracker_remap(tracker, &extent, &result);
+        else
+            status = disk_tracker_find_remap(tracker, &extent, &result);
+    }
+    elapsed = now_ns() - start;
+    histogram_record(&stats->latency, (ulong64_t)elapsed);
+    stats->busy_ns += elapsed;
+
+    stats->calls++;
+    if (status != DISK_TRACKER_OK) {
+        stats->failed++;
+        return;
+    }
+    stats->extents += result->number_of_extents;
+    stats->hits += result->num_remapped;
+    if (!opt->to_buffer)
+        disk_tracker_free_remap(tracker, result);
+}
+
+static void report(const char* name, const struct op_stats* stats)
+{
+    ulong64_t ok = stats->calls - stats->failed;
+
+    if (stats->calls == 0) {
+        printf("  %-6s no calls\n", name);
+        return;
+    }
+    printf("  %-6s %10llu calls %10.0f calls/s  p50 %6llu ns  p99 %6llu ns  "
+           "p99.9 %7llu ns  %5.2f extents/result  %llu hits  %llu failed\n",
+           name, stats->calls, stats->calls * 1e9 / stats->busy_ns,
+           histogram_percentile(&stats->latency, 5000),
+           histogram_percentile(&stats->latency, 9900),
+           histogram_percentile(&stats->latency, 9990),
+           ok ? (double)stats->extents / ok : 0.0,
+           stats->hits, stats->failed);
+}
+
+static int snapshot_write(void* context, ulong64_t offset, const void* buffer, unsigned size)
+{
+    FILE* f = (FILE*)context;
+
+#ifdef _WIN32
+    if (_fseeki64(f, (__int64)offset, SEEK_SET) != 0)
+#else
+    if (fseeko(f, (off_t)offset, SEEK_SET) != 0)
+#endif
+        return -1;
+    return fwrite(buffer, 1, size, f) == size ? 0 : -1;
+}
+
+/* Whole file mapped read only */
+struct mapped_file
+{
+    const void* data;
+    ulong64_t   size;
+#ifdef _WIN32
+    HANDLE      file;
+    HANDLE      mapping;
+#endif
+};
+
+static int map_file(const char* name, struct mapped_file* mapped)
+{
+#ifdef _WIN32
+    LARGE_INTEGER size;
+
+    mapped->data = NULL;
+    mapped->mapping = NULL;
+    mapped->file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, 
+                               OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(mapped->file, &size))
+        return 0;
+    mapped->size = (ulong64_t)size.QuadPart;
+    mapped->mapping = CreateFileMapping(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapped->mapping != NULL)
+        mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+    return mapped->data != NULL;
+#else
+    struct stat st;
+    int         fd = open(name, O_RDONLY);
+    void*       data;
+
+    mapped->data = NULL;
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    mapped->size = (ulong64_t)st.st_size;
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+    mapped->data = data;
+    return 1;
+#endif
+}
+
+static void unmap_file(struct mapped_file* mapped)
+{
+#ifdef _WIN32
+    if (mapped->data != NULL)
+        UnmapViewOfFile(mapped->data);
+    if (mapped->mapping != NULL)
+        CloseHandle(mapped->mapping);
+    if (mapped->file != INVALID_HANDLE_VALUE)
+        CloseHandle(mapped->file);
+#else
+    if (mapped->data != NULL)
+        munmap((void*)mapped->data, (size_t)mapped->size);
+#endif
+}
+
+/* 
+   Save the tracker, map the file back and look up the first block of 
+   every traced request in both, counting disagreements
+*/
+static int check_snapshot(disk_remap_t tracker, const struct options* opt, 
+                          const struct trace* trace)
+{
+    struct remap_snapshot_io io = {NULL, snapshot_write};
+    struct remap_snapshot    snapshot;
+    struct mapped_file       mapped;
+    struct disk_remap_run    run;
+    struct disk_extent*      extent;
+    FILE*                    f;
+    double                   start, save_s, open_s, lookup_s;
+    unsigned                 i, found = 0, mismatches = 0;
+    int                      status;
+
+    f = fopen(opt->snapshot_name, "wb");
+    if (f == NULL) {
+        printf("can't create %s\n", opt->snapshot_name);
+        return 0;
+    }
+    io.context = f;
+    start = now_ns();
+    status = remap_snapshot_save(tracker, &io, trace->end_block, counting_alloc, counting_free);
+    if (fclose(f) != 0 && status == REMAP_SNAPSHOT_OK)
+        status = REMAP_SNAPSHOT_IO_ERROR;
+    save_s = (now_ns() - start) / 1e9;
+    if (status != REMAP_SNAPSHOT_OK) {
+        printf("can't save snapshot: %d\n", status);
+        return 0;
+    }
+
+    if (!map_file(opt->snapshot_name, &mapped)) {
+        printf("can't map %s\n", opt->snapshot_name);
+        unmap_file(&mapped);
+        return 0;
+    }
+    start = now_ns();
+    status = remap_snapshot_open(&snapshot, mapped.data, mapped.size, 1);
+    open_s = (now_ns() - start) / 1e9;
+    if (status != REMAP_SNAPSHOT_OK) {
+        printf("can't open snapshot: %d\n", status);
+        unmap_file(&mapped);
+        return 0;
+    }
+
+    start = now_ns();
+    for (i = 0; i < trace->count; i++)
+        found += remap_snapshot_lookup(&snapshot, trace->ops[i].start_block, &run);
+    lookup_s = (now_ns() - start) / 1e9;
+
+    for (i = 0; i < trace->count; i++) {
+        int hit = remap_snapshot_lookup(&snapshot, trace->ops[i].start_block, &run);
+
+        extent = disk_tracker_find_remap_for_block(tracker, trace->ops[i].start_block);
+        if (hit != (extent != NULL) || (hit && extent->start_block != run.target_block))
+            mismatches++;
+        if (extent != NULL)
+            disk_tracker_free_extent(tracker, extent);
+    }
+
+    printf("  snapshot %llu runs, %.1f Mb: saved in %.3f s (%.0f Mb/s), "
+           "verified in %.3f s (%.0f Mb/s)\n",
+           snapshot.run_count, mapped.size / (1024.0 * 1024.0),
+           save_s, mapped.size / (1024.0 * 1024.0) / save_s,
+           open_s, mapped.size / (1024.0 * 1024.0) / open_s);
+    printf("  snapshot lookups %10.0f/s, %u remapped, %u disagree with the tracker\n",
+           trace->count / lookup_s, found, mismatches);
+    unmap_file(&mapped);
+    return mismatches == 0;
+}
+
+static void usage()
+{
+    printf("Usage: user_mode_replay [--csv | --binary] [--storage-gb N] [--shards N]\n"
+           "                        [--contiguous] [--to-buffer] [--repeat N]\n"
+           "                        [--snapshot FILE] trace_file\n");
+}
+
+static int parse_options(int argc, char** argv, struct options* opt)
+{
+    int i, format_set = 0;
+
+    memset(opt, 0, sizeof(*opt));
+    opt->storage_gb = 64;
+    opt->shards = 1;
+    opt->repeat = 1;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0) {
+            opt->csv = 1;
+            format_set = 1;
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            opt->csv = 0;
+            format_set = 1;
+        } else if (strcmp(argv[i], "--contiguous") == 0) {
+            opt->contiguous = 1;
+        } else if (strcmp(argv[i], "--to-buffer") == 0) {
+            opt->to_buffer = 1;
+        } else if (i + 1 < argc && strcmp(argv[i], "--storage-gb") == 0) {
+            opt->storage_gb = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && strcmp(argv[i], "--shards") == 0) {
+            opt->shards = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && strcmp(argv[i], "--repeat") == 0) {
+            opt->repeat = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && strcmp(argv[i], "--snapshot") == 0) {
+            opt->snapshot_name = argv[++i];
+        } else if (argv[i][0] != '-' && opt->file_name == NULL) {
+            opt->file_name = argv[i];
+        } else {
+            return 0;
+        }
+    }
+    if (opt->file_name == NULL || opt->repeat == 0 || 
+        opt->storage_gb == 0 || opt->storage_gb > 2047 ||
+        opt->shards == 0 || opt->shards > DISK_TRACKER_MAX_SHARDS)
+        return 0;
+    if (!format_set) {
+        size_t len = strlen(opt->file_name);
+        opt->csv = len > 4 && strcmp(opt->file_name + len - 4, ".csv") == 0;
+    }
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    struct options        opt;
+    struct trace          trace;
+    struct remap_storage* storage;
+    struct op_stats*      stats;
+    disk_remap_t          tracker;
+    FILE*                 f;
+    unsigned              r, i, remapped = 0;
+    double                start, seconds;
+    int                   loaded, result = 0;
+
+    if (!parse_options(argc, argv, &opt)) {
+        usage();
+        return 1;
+    }
+
+    memset(&trace, 0, sizeof(trace));
+    f = fopen(opt.file_name, opt.csv ? "r" : "rb");
+    if (f == NULL) {
+        printf("can't open %s\n", opt.file_name);
+        return 1;
+    }
+    loaded = opt.csv ? load_csv(f, &trace) : load_binary(f, &trace);
+    fclose(f);
+    if (!loaded || trace.count == 0) {
+        printf("no requests in %s\n", opt.file_name);
+        free(trace.ops);
+        return 1;
+    }
+
+    /* Storage lies beyond the traced blocks, as on a disk of that size */
+    storage = make_storage(trace.end_block, opt.storage_gb);
+    stats = (struct op_stats*)calloc(2, sizeof(*stats));
+    tracker = storage != NULL ? 
+              disk_tracker_init_sharded(counting_alloc, counting_free, storage, opt.shards) : 
+              NULL;
+    if (stats == NULL || tracker == NULL) {
+        printf("can't create tracker\n");
+        free(storage);
+        free(stats);
+        free(trace.ops);
+        return 1;
+    }
+    if (opt.contiguous)
+        disk_tracker_set_alloc_policy(tracker, DISK_TRACKER_ALLOC_CONTIGUOUS);
+
+    start = now_ns();
+    for (r = 0; r < opt.repeat; r++) {
+        for (i = 0; i < trace.count; i++)
+            replay_op(tracker, &opt, &trace.ops[i], &stats[trace.ops[i].write]);
+    }
+    seconds = (now_ns() - start) / 1e9;
+    disk_tracker_get_hash_size(tracker, &remapped);
+
+    printf("%s: %u requests x %u, %u shard(s), %u Gb storage%s%s\n", 
+           opt.file_name, trace.count, opt.repeat, opt.shards, opt.storage_gb,
+           opt.contiguous ? ", contiguous" : "", opt.to_buffer ? ", to buffer" : "");
+    printf("  total  %10.0f calls/s, %.3f s\n", 
+           (double)(stats[0].calls + stats[1].calls) / seconds, seconds);
+    report("read", &stats[0]);
+    report("write", &stats[1]);
+    printf("  remapped blocks %u, peak tracker memory %.1f Mb\n", 
+           remapped, memory_peak / (1024.0 * 1024.0));
+    if (opt.snapshot_name != NULL && !check_snapshot(tracker, &opt, &trace))
+        result = 1;
+
+    disk_tracker_destroy(&tracker);
+    free(storage);
+    free(stats);
+    free(trace.ops);
+    return result;
+}
@@ -0,0 +1,399 @@
+/*
+  Benchmark suite: drives disk_tracker, hashtable, quick_sort_ulong64 and
+  good_hash_func with synthetic workloads (sequential, uniform, zipf, 
+  strided) and prints one JSON object per measurement, so results can be
+  collected and compared between builds.
+
+  Usage: user_mode_suite [options]
+    --bench NAME          Only disk_tracker, hashtable, sort or hash
+    --pattern NAME        Only sequential, uniform, zipf or strided
+    --ops N               Requests per tracker and hashtable run, default 200000
+    --sort N              Keys to sort, default 50000. Sorted input is the 
+                          worst case of quick_sort_ulong64, keep it modest
+    --min-kb N            Smallest request, default 4
+    --max-kb N            Largest request, default 64
+    --write-percent N     Writes among requests, default 70
+    --zipf-theta X        Skew of zipf, default 0.99
+    --stride-kb N         Gap of strided starts, default 1024
+    --disk-gb N           Disk size, default 64
+    --seed N
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "libcrt/baselib.h"
+#include "libcrt/hashtable.h"
+#include "libutil/disk_tracker.h"
+#include "libutil/histogram.h"
+#include "workload.h"
+
+#define BLOCKS_PER_KB       (2)
+#define BLOCKS_PER_GB       (2 * 1024 * 1024)
+#define STORAGE_MAX_BLOCKS  (0x7FFFFFFFUL)
+#define RESULT_EXTENTS      (64)
+
+struct suite_options
+{
+    struct workload_config workload;
+    unsigned               ops;
+    unsigned               sort_count;
+    const char*            bench;       /* NULL runs all */
+    int                    pattern_set;
+};
+
+static volatile ulong64_t sink;     /* Keeps results of timed loops alive */
+
+static double now_ns()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1e9 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
+
+static void* suite_alloc(unsigned size)
+{
+    return malloc(size);
+}
+
+static void suite_free(void* p)
+{
+    free(p);
+}
+
+/* Requests of the configured workload, NULL if it can't be made */
+static struct workload_op* make_ops(const struct workload_config* config, unsigned count)
+{
+    struct workload*    w = workload_create(config);
+    struct workload_op* ops = (struct workload_op*)malloc(count * sizeof(*ops));
+    unsigned            i;
+
+    if (w == NULL || ops == NULL) {
+        workload_destroy(w);
+        free(ops);
+        return NULL;
+    }
+    for (i = 0; i < count; i++)
+        workload_next(w, &ops[i]);
+    workload_destroy(w);
+    return ops;
+}
+
+static int bench_enabled(const struct suite_options* opt, const char* bench)
+{
+    return opt->bench == NULL || strcmp(opt->bench, bench) == 0;
+}
+
+static void print_head(const char* bench, const struct workload_config* config, 
+                       const char* operation, unsigned count)
+{
+    printf("{\"bench\":\"%s\",\"pattern\":\"%s\",\"op\":\"%s\",\"count\":%u",
+           bench, workload_pattern_name(config->pattern), operation, count);
+}
+
+static void bench_disk_tracker(const struct suite_options* opt, 
+                               const struct workload_op* ops)
+{
+    const struct workload_config* config = &opt->workload;
+    struct {
+        struct disk_extent_remap remap;
+        struct disk_extent       more[RESULT_EXTENTS - 1];
+    } buffer;
+    struct histogram*     latency[2];
+    struct remap_storage* storage;
+    disk_remap_t          tracker;
+    ulong64_t             need = (ulong64_t)opt->ops * config->max_blocks;
+    ulong64_t             extents[2] = {0, 0}, calls[2] = {0, 0}, failed[2] = {0, 0};
+    double                busy[2] = {0, 0};
+    unsigned              i, n, storage_extents, remapped = 0;
+
+    /* Room for every write, in 1Gb extents beyond the disk */
+    if (need > STORAGE_MAX_BLOCKS)
+        need = STORAGE_MAX_BLOCKS;
+    storage_extents = (unsigned)((need + BLOCKS_PER_GB - 1) / BLOCKS_PER_GB);
+    storage = (struct remap_storage*)calloc(1, sizeof(*storage) + 
+                                            storage_extents * sizeof(struct disk_extent));
+    latency[0] = (struct histogram*)calloc(1, sizeof(struct histogram));
+    latency[1] = (struct histogram*)calloc(1, sizeof(struct histogram));
+    if (storage == NULL || latency[0] == NULL || latency[1] == NULL)
+        goto out;
+    storage->number_of_extents = storage_extents;
+    storage->number_of_blocks = storage_extents * BLOCKS_PER_GB;
+    for (i = 0; i < storage_extents; i++) {
+        storage->extents[i].start_block = config->disk_blocks + (ulong64_t)i * BLOCKS_PER_GB;
+        storage->extents[i].length_in_blocks = BLOCKS_PER_GB;
+    }
+    tracker = disk_tracker_init(suite_alloc, suite_free, storage);
+    if (tracker == NULL)
+        goto out;
+
+    for (i = 0; i < opt->ops; i++) {
+        struct disk_extent extent;
+        double             start, elapsed;
+        int                w = ops[i].write, status;
+
+        extent.start_block = ops[i].start_block;
+        extent.length_in_blocks = ops[i].length_in_blocks;
+        start = now_ns();
+        if (w)
+            status = disk_tracker_remap_to_buffer(tracker, &extent, &buffer.remap, RESULT_EXTENTS);
+        else
+            status = disk_tracker_find_remap_to_buffer(tracker, &extent, &buffer.remap, RESULT_EXTENTS);
+        elapsed = now_ns() - start;
+
+        histogram_record(latency[w], (ulong64_t)elapsed);
+        busy[w] += elapsed;
+        calls[w]++;
+        /* Too many extents for the buffer still did the work */
+        if (status == DISK_TRACKER_OK || status == DISK_TRACKER_BUFFER_TOO_SMALL)
+            extents[w] += buffer.remap.number_of_extents;
+        else
+            failed[w]++;
+    }
+    disk_tracker_get_hash_size(tracker, &remapped);
+
+    for (n = 0; n < 2; n++) {
+        if (calls[n] == 0)
+            continue;
+        print_head("disk_tracker", config, n ? "remap" : "find_remap", (unsigned)calls[n]);
+        printf(",\"ns_per_op\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+               "\"extents_per_result\":%.3f,\"failed\":%llu,\"remapped_blocks\":%u}\n",
+               busy[n] / calls[n],
+               histogram_percentile(latency[n], 5000),
+               histogram_percentile(latency[n], 9900),
+               histogram_percentile(latency[n], 9990),
+               (double)extents[n] / calls[n], failed[n], remapped);
+    }
+    disk_tracker_destroy(&tracker);
+out:
+    free(storage);
+    free(latency[0]);
+    free(latency[1]);
+}
+
+static unsigned int block_hash(void* k)
+{
+    return good_hash_func((unsigned char*)k, sizeof(ulong64_t), 0);
+}
+
+static int block_equal(void* a, void* b)
+{
+    return *(ulong64_t*)a == *(ulong64_t*)b;
+}
+
+/* Request starts as keys, repeated starts of skewed patterns are inserted again */
+static void bench_hashtable(const struct suite_options* opt, 
+                            const struct workload_op* ops)
+{
+    struct hashtable* h = create_hashtable(1000, block_hash, block_equal, 
+                                           suite_alloc, suite_free);
+    double            start;
+    unsigned          i, found = 0;
+
+    if (h == NULL)
+        return;
+    start = now_ns();
+    for (i = 0; i < opt->ops; i++) {
+        ulong64_t* k = (ulong64_t*)malloc(sizeof(*k));
+        ulong64_t* v = (ulong64_t*)malloc(sizeof(*v));
+
+        *k = ops[i].start_block;
+        *v = i;
+        if (k == NULL || v == NULL || !hashtable_insert(h, k, v)) {
+            free(k);
+            free(v);
+            break;
+        }
+    }
+    print_head("hashtable", &opt->workload, "insert", i);
+    printf(",\"ns_per_op\":%.1f}\n", (now_ns() - start) / (i ? i : 1));
+
+    start = now_ns();
+    for (i = 0; i < opt->ops; i++)
+        found += hashtable_search(h, (void*)&ops[i].start_block) != NULL;
+    print_head("hashtable", &opt->workload, "search", opt->ops);
+    printf(",\"ns_per_op\":%.1f,\"found\":%u,\"entries\":%u}\n", 
+           (now_ns() - start) / opt->ops, found, hashtable_count(h));
+
+    hashtable_destroy(h, 1);
+}
+
+static void bench_sort(const struct suite_options* opt, 
+                       const struct workload_op* ops)
+{
+    unsigned    count = opt->sort_count < opt->ops ? opt->sort_count : opt->ops;
+    ulong64_t*  keys = (ulong64_t*)malloc(count * sizeof(*keys));
+    ulong64_t** ptrs = (ulong64_t**)malloc(count * sizeof(*ptrs));
+    double      start;
+    unsigned    i;
+
+    if (keys == NULL || ptrs == NULL)
+        goto out;
+
+    for (i = 0; i < count; i++)
+        keys[i] = ops[i].start_block;
+    start = now_ns();
+    quick_sort_ulong64(keys, count);
+    print_head("sort", &opt->workload, "quick_sort_ulong64", count);
+    printf(",\"ns_per_op\":%.1f}\n", (now_ns() - start) / count);
+
+    for (i = 0; i < count; i++) {
+        keys[i] = ops[i].start_block;
+        ptrs[i] = &keys[i];
+    }
+    start = now_ns();
+    quick_sort_ulong64_ptr(ptrs, count);
+    print_head("sort", &opt->workload, "quick_sort_ulong64_ptr", count);
+    printf(",\"ns_per_op\":%.1f}\n", (now_ns() - start) / count);
+out:
+    free(keys);
+    free(ptrs);
+}
+
+static void bench_hash_keys(const struct suite_options* opt, 
+                            const struct workload_op* ops)
+{
+    ulong64_t sum = 0;
+    double    start = now_ns();
+    unsigned  i;
+
+    for (i = 0; i < opt->ops; i++)
+        sum += good_hash_func((unsigned char*)&ops[i].start_block, sizeof(ulong64_t), 0);
+    sink = sum;
+    print_head("hash", &opt->workload, "good_hash_func_8", opt->ops);
+    printf(",\"ns_per_op\":%.1f}\n", (now_ns() - start) / opt->ops);
+}
+
+/* Longer keys do not depend on the pattern */
+static void bench_hash_lengths(unsigned count)
+{
+    static const unsigned lengths[] = { 64, 512, 4096 };
+    unsigned char*        data = (unsigned char*)malloc(4096);
+    unsigned              l, i;
+
+    if (data == NULL)
+        return;
+    for (i = 0; i < 4096; i++)
+        data[i] = (unsigned char)(i * 131);
+    for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        unsigned  rounds = count / (lengths[l] / 64);
+        ulong64_t sum = 0;
+        double    start, elapsed;
+
+        start = now_ns();
+        for (i = 0; i < rounds; i++)
+            sum += good_hash_func(data, lengths[l], i);
+        elapsed = now_ns() - start;
+        sink = sum;
+        printf("{\"bench\":\"hash\",\"pattern\":\"none\",\"op\":\"good_hash_func_%u\","
+               "\"count\":%u,\"ns_per_op\":%.1f,\"mb_per_sec\":%.1f}\n",
+               lengths[l], rounds, elapsed / rounds, 
+               (double)lengths[l] * rounds * 1e3 / elapsed);
+    }
+    free(data);
+}
+
+static void run_pattern(const struct suite_options* opt)
+{
+    struct workload_op* ops = make_ops(&opt->workload, opt->ops);
+
+    if (ops == NULL) {
+        printf("can't make %s workload\n", workload_pattern_name(opt->workload.pattern));
+        return;
+    }
+    if (bench_enabled(opt, "disk_tracker"))
+        bench_disk_tracker(opt, ops);
+    if (bench_enabled(opt, "hashtable"))
+        bench_hashtable(opt, ops);
+    if (bench_enabled(opt, "sort"))
+        bench_sort(opt, ops);
+    if (bench_enabled(opt, "hash"))
+        bench_hash_keys(opt, ops);
+    free(ops);
+}
+
+static void usage()
+{
+    printf("Usage: user_mode_suite [--bench disk_tracker|hashtable|sort|hash]\n"
+           "         [--pattern sequential|uniform|zipf|strided] [--ops N] [--sort N]\n"
+           "         [--min-kb N] [--max-kb N] [--write-percent N] [--zipf-theta X]\n"
+           "         [--stride-kb N] [--disk-gb N] [--seed N]\n");
+}
+
+static int parse_options(int argc, char** argv, struct suite_options* opt)
+{
+    struct workload_config* w = &opt->workload;
+    int                     i;
+
+    memset(opt, 0, sizeof(*opt));
+    workload_default_config(w);
+    opt->ops = 200000;
+    opt->sort_count = 50000;
+    for (i = 1; i + 1 < argc; i += 2) {
+        const char* name = argv[i];
+        const char* value = argv[i + 1];
+
+        if (strcmp(name, "--bench") == 0) {
+            opt->bench = value;
+        } else if (strcmp(name, "--pattern") == 0) {
+            if (!workload_parse_pattern(value, &w->pattern))
+                return 0;
+            opt->pattern_set = 1;
+        } else if (strcmp(name, "--ops") == 0) {
+            opt->ops = (unsigned)strtoul(value, NULL, 10);
+        } else if (strcmp(name, "--sort") == 0) {
+            opt->sort_count = (unsigned)strtoul(value, NULL, 10);
+        } else if (strcmp(name, "--min-kb") == 0) {
+            w->min_blocks = (ulong32_t)strtoul(value, NULL, 10) * BLOCKS_PER_KB;
+        } else if (strcmp(name, "--max-kb") == 0) {
+            w->max_blocks = (ulong32_t)strtoul(value, NULL, 10) * BLOCKS_PER_KB;
+        } else if (strcmp(name, "--write-percent") == 0) {
+            w->write_percent = (unsigned)strtoul(value, NULL, 10);
+        } else if (strcmp(name, "--zipf-theta") == 0) {
+            w->zipf_theta = strtod(value, NULL);
+        } else if (strcmp(name, "--stride-kb") == 0) {
+            w->stride_blocks = (ulong32_t)strtoul(value, NULL, 10) * BLOCKS_PER_KB;
+        } else if (strcmp(name, "--disk-gb") == 0) {
+            w->disk_blocks = (ulong64_t)strtoul(value, NULL, 10) * BLOCKS_PER_GB;
+        } else if (strcmp(name, "--seed") == 0) {
+            w->seed = strtoull(value, NULL, 10);
+        } else {
+            return 0;
+        }
+    }
+    return i == argc && opt->ops > 0;
+}
+
+int main(int argc, char** argv)
+{
+    struct suite_options opt;
+    int                  p;
+
+    if (!parse_options(argc, argv, &opt)) {
+        usage();
+        return 1;
+    }
+
+    for (p = 0; p < WORKLOAD_PATTERNS; p++) {
+        if (opt.pattern_set && p != (int)opt.workload.pattern)
+            continue;
+        opt.workload.pattern = (enum workload_pattern)p;
+        run_pattern(&opt);
+    }
+    if (bench_enabled(&opt, "hash"))
+        bench_hash_lengths(opt.ops);
+    return 0;
+}
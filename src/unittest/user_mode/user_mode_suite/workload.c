@@ -0,0 +1,180 @@
+/*
+  Synthetic disk request streams for benchmarks
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "workload.h"
+
+/* Exact head of the zeta sum, the tail is integrated */
+#define ZETA_EXACT_TERMS (1000)
+
+struct workload
+{
+    struct workload_config config;
+    ulong64_t              slots;       /* Aligned request starts on the disk */
+    ulong64_t              rng;
+    ulong64_t              position;    /* Next sequential or strided slot */
+
+    /* Gray et al, "Quickly generating billion-record synthetic databases" */
+    double                 zipf_alpha;
+    double                 zipf_zetan;
+    double                 zipf_eta;
+};
+
+static const char* const pattern_names[WORKLOAD_PATTERNS] = {
+    "sequential", "uniform", "zipf", "strided"
+};
+
+/* xorshift64* */
+static ulong64_t next_random(struct workload* w)
+{
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_unit(struct workload* w)
+{
+    return (double)(next_random(w) >> 11) / 9007199254740992.0;    /* 2^53 */
+}
+
+/* Sum of i^-theta for i = 1..n */
+static double zeta(ulong64_t n, double theta)
+{
+    double   sum = 0;
+    ulong64_t i, exact = n < ZETA_EXACT_TERMS ? n : ZETA_EXACT_TERMS;
+
+    for (i = 1; i <= exact; i++)
+        sum += pow((double)i, -theta);
+    if (n > exact) {
+        sum += (pow(n + 0.5, 1 - theta) - pow(exact + 0.5, 1 - theta)) / 
+               (1 - theta);
+    }
+    return sum;
+}
+
+/* Rank 0 is the most popular */
+static ulong64_t next_zipf_rank(struct workload* w)
+{
+    double    u = next_unit(w);
+    double    uz = u * w->zipf_zetan;
+    ulong64_t rank;
+
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, w->config.zipf_theta))
+        return 1;
+    rank = (ulong64_t)(w->slots * pow(w->zipf_eta * u - w->zipf_eta + 1, w->zipf_alpha));
+    return rank < w->slots ? rank : w->slots - 1;
+}
+
+/* Hot ranks land all over the disk, not at its start */
+static ulong64_t scramble(ulong64_t rank, ulong64_t slots)
+{
+    rank ^= rank >> 33;
+    rank *= 0xFF51AFD7ED558CCDULL;
+    rank ^= rank >> 33;
+    return rank % slots;
+}
+
+void workload_default_config(struct workload_config* config)
+{
+    memset(config, 0, sizeof(*config));
+    config->pattern = WORKLOAD_UNIFORM;
+    config->disk_blocks = 64ULL * 2 * 1024 * 1024;     /* 64Gb */
+    config->align_blocks = 8;
+    config->min_blocks = 8;
+    config->max_blocks = 128;
+    config->write_percent = 70;
+    config->zipf_theta = 0.99;
+    config->stride_blocks = 2048;
+    config->seed = 0x9E3779B97F4A7C15ULL;
+}
+
+struct workload* workload_create(const struct workload_config* config)
+{
+    struct workload* w;
+
+    if (config->align_blocks == 0 || config->min_blocks == 0 ||
+        config->min_blocks > config->max_blocks ||
+        config->disk_blocks < (ulong64_t)config->max_blocks + config->align_blocks ||
+        config->write_percent > 100 || config->pattern >= WORKLOAD_PATTERNS ||
+        (config->pattern == WORKLOAD_ZIPF && 
+         (config->zipf_theta <= 0 || config->zipf_theta == 1.0)))
+        return NULL;
+
+    w = (struct workload*)calloc(1, sizeof(*w));
+    if (w == NULL)
+        return NULL;
+    w->config = *config;
+    w->rng = config->seed != 0 ? config->seed : 1;
+    /* Every start leaves room for the largest request */
+    w->slots = (config->disk_blocks - config->max_blocks) / config->align_blocks + 1;
+
+    if (config->pattern == WORKLOAD_ZIPF) {
+        double theta = config->zipf_theta;
+
+        w->zipf_alpha = 1.0 / (1.0 - theta);
+        w->zipf_zetan = zeta(w->slots, theta);
+        w->zipf_eta = (1 - pow(2.0 / w->slots, 1 - theta)) / 
+                      (1 - zeta(2, theta) / w->zipf_zetan);
+    }
+    return w;
+}
+
+void workload_destroy(struct workload* workload)
+{
+    free(workload);
+}
+
+void workload_next(struct workload* w, struct workload_op* op)
+{
+    const struct workload_config* c = &w->config;
+    ulong32_t                     sizes = (c->max_blocks - c->min_blocks) / c->align_blocks + 1;
+    ulong64_t                     slot;
+
+    op->length_in_blocks = c->min_blocks + 
+                           (ulong32_t)(next_random(w) % sizes) * c->align_blocks;
+    op->write = (unsigned)(next_random(w) % 100) < c->write_percent;
+
+    switch (c->pattern) {
+    case WORKLOAD_SEQUENTIAL:
+    case WORKLOAD_STRIDED:
+        /* Both wrap at the end of the disk */
+        w->position %= w->slots;
+        slot = w->position;
+        if (c->pattern == WORKLOAD_SEQUENTIAL)
+            w->position += (op->length_in_blocks + c->align_blocks - 1) / c->align_blocks;
+        else
+            w->position += (c->stride_blocks + c->align_blocks - 1) / c->align_blocks;
+        break;
+    case WORKLOAD_ZIPF:
+        slot = scramble(next_zipf_rank(w), w->slots);
+        break;
+    default:
+        slot = next_random(w) % w->slots;
+        break;
+    }
+    op->start_block = slot * c->align_blocks;
+}
+
+const char* workload_pattern_name(enum workload_pattern pattern)
+{
+    return pattern < WORKLOAD_PATTERNS ? pattern_names[pattern] : "unknown";
+}
+
+int workload_parse_pattern(const char* name, enum workload_pattern* pattern)
+{
+    int i;
+
+    for (i = 0; i < WORKLOAD_PATTERNS; i++) {
+        if (strcmp(name, pattern_names[i]) == 0) {
+            *pattern = (enum workload_pattern)i;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+  Synthetic disk request streams for benchmarks
+*/
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include "libcrt/types.h"
+
+enum workload_pattern
+{
+    WORKLOAD_SEQUENTIAL,    /* Each request follows the previous one */
+    WORKLOAD_UNIFORM,       /* Uniformly random starts */
+    WORKLOAD_ZIPF,          /* Few hot places get most requests, spread over the disk */
+    WORKLOAD_STRIDED,       /* Fixed gap between request starts */
+    WORKLOAD_PATTERNS
+};
+
+struct workload_config
+{
+    enum workload_pattern pattern;
+    ulong64_t disk_blocks;      /* Requests stay below this block */
+    ulong32_t align_blocks;     /* Starts and sizes are multiples of it, 8 is 4k */
+    ulong32_t min_blocks;       /* Request sizes are uniform in [min, max] */
+    ulong32_t max_blocks;
+    unsigned  write_percent;    /* Rest are reads */
+    double    zipf_theta;       /* Skew, 0.99 is the YCSB default, must not be 1 */
+    ulong32_t stride_blocks;    /* From one request start to the next */
+    ulong64_t seed;
+};
+
+struct workload_op
+{
+    ulong64_t start_block;
+    ulong32_t length_in_blocks;
+    int       write;
+};
+
+struct workload;
+
+void workload_default_config(struct workload_config* config);
+
+/* NULL if the config makes no sense */
+struct workload* workload_create(const struct workload_config* config);
+
+void workload_destroy(struct workload* workload);
+
+void workload_next(struct workload* workload, struct workload_op* op);
+
+const char* workload_pattern_name(enum workload_pattern pattern);
+
+/* Non-zero if name is one of workload_pattern_name */
+int workload_parse_pattern(const char* name, enum workload_pattern* pattern);
+
+#endif